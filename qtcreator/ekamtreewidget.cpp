@@ -17,8 +17,11 @@
 #include "ekamtreewidget.h"
 #include "ekamdashboardplugin.h"
 
+#include <QTimer>
 #include <QVBoxLayout>
 
+#include <algorithm>
+
 #include <coreplugin/editormanager/editormanager.h>
 #include <projectexplorer/taskhub.h>
 #include <utils/navigationtreeview.h>
@@ -56,91 +59,56 @@ struct StatePrioritiesInitializer {
 };
 static StatePrioritiesInitializer statePrioritiesInitializer;
 
-// =======================================================================================
-
-EkamTreeNode::EkamTreeNode(EkamTreeModel* tree)
-  : QObject(tree), tree(tree), isDirectory(true), parentNode(0), action(0), state(DEFAULT_STATE) {}
-EkamTreeNode::EkamTreeNode(EkamTreeNode* parent, const QString& name, bool isDirectory)
-  : QObject(parent), tree(parent->tree), isDirectory(isDirectory), name(name),
-    parentNode(parent), action(0), state(DEFAULT_STATE) {}
-EkamTreeNode::~EkamTreeNode() {}
-
-int EkamTreeNode::row() {
-  if (this == tree->root) {
-    return -1;
-  }
+static_assert(sizeof(ORDERED_STATES) / sizeof(ORDERED_STATES[0]) == STATE_PRIORITY_COUNT,
+              "STATE_PRIORITY_COUNT doesn't match ORDERED_STATES.");
 
-  int result = parentNode->childNodes.indexOf(this);
-  if (result == -1) {
-    qWarning() << "parentNode->childNodes doesn't contain this?";
-  }
-  return result;
+static int priorityOf(ekam::proto::TaskUpdate::State state) {
+  uint i = static_cast<uint>(state);
+  int result = i < (sizeof(STATE_PRIORITIES) / sizeof(STATE_PRIORITIES[0])) ?
+      STATE_PRIORITIES[i] : -1;
+  // Treat unknown states like the default.
+  return result < 0 ? 0 : result;
 }
 
-QModelIndex EkamTreeNode::index() {
-  if (this == tree->root) {
-    return QModelIndex();
-  }
-
-  int rowNum = row();
-  if (rowNum == -1) {
-    return QModelIndex();
+static ekam::proto::TaskUpdate::State stateFromCounts(const int* counts) {
+  for (int i = STATE_PRIORITY_COUNT - 1; i > 0; i--) {
+    if (counts[i] > 0) {
+      return ORDERED_STATES[i];
+    }
   }
-
-  return tree->createIndex(rowNum, 0, this);
+  return DEFAULT_STATE;
 }
 
-void EkamTreeNode::actionStateChanged(ekam::proto::TaskUpdate::State newState) {
-  stateChanged(newState);
-}
-
-void EkamTreeNode::actionRemoved() {
-  setAction(0);
-  if (parentNode != 0) {
-    parentNode->removeChild(this);
-  }
-//  QModelIndex myIndex = index();
-//  emit tree->dataChanged(myIndex, myIndex);
+static bool nameLess(const EkamTreeNode* a, const EkamTreeNode* b) {
+  return a->name < b->name;
 }
 
-void EkamTreeNode::createNode(const QString& noun, const QString& verb, ActionState* action) {
-  int slash = noun.indexOf(QLatin1Char('/'));
-
-  QString childName = (slash == -1) ? QString(QLatin1String("%1 (%2)")).arg(noun, verb) : noun.mid(0, slash);
-
-  QList<EkamTreeNode*>::iterator iter = childNodes.begin();
-  while (iter < childNodes.end() && (*iter)->name < childName) {
-    ++iter;
-  }
-
-  EkamTreeNode* selectedNode;
-  bool isNew = iter == childNodes.end() || (*iter)->name != childName;
+// =======================================================================================
 
-  if (isNew) {
-    QModelIndex i = index();
-    int r = iter - childNodes.begin();
-    tree->beginInsertRows(i, r, r);
-    selectedNode = new EkamTreeNode(this, childName, slash != -1);
-    childNodes.insert(iter, selectedNode);
-  } else {
-    selectedNode = *iter;
+EkamTreeNode::EkamTreeNode(EkamTreeNode* parent, const QString& name, bool isDirectory)
+  : parentNode(parent), name(name), isDirectory(isDirectory), populated(false), action(0),
+    state(DEFAULT_STATE) {
+  for (int i = 0; i < STATE_PRIORITY_COUNT; i++) {
+    counts[i] = 0;
   }
+}
+EkamTreeNode::~EkamTreeNode() {
+  qDeleteAll(children);
+}
 
-  if (slash == -1) {
-    selectedNode->setAction(action);
-  } else {
-    selectedNode->createNode(noun.right(noun.size() - slash - 1), verb, action);
+int EkamTreeNode::row() const {
+  if (parentNode == 0) {
+    return -1;
   }
 
-  if (isNew) {
-    tree->endInsertRows();
-  } else {
-    QModelIndex nodeIndex = selectedNode->index();
-    emit tree->dataChanged(nodeIndex, nodeIndex);
+  int result = parentNode->children.indexOf(const_cast<EkamTreeNode*>(this));
+  if (result == -1) {
+    qWarning() << "parentNode->children doesn't contain this?";
   }
+  return result;
 }
 
-QVariant EkamTreeNode::data(int role) {
+QVariant EkamTreeNode::data(int role) const {
   switch (role) {
     case Qt::DisplayRole:
     case Qt::EditRole:
@@ -152,7 +120,7 @@ QVariant EkamTreeNode::data(int role) {
       if (action == 0) {
         return QVariant();
       } else {
-        action->getPath();
+        return action->getPath();
       }
 
     case Qt::DecorationRole:
@@ -212,73 +180,25 @@ QVariant EkamTreeNode::data(int role) {
   return QVariant();
 }
 
-void EkamTreeNode::setAction(ActionState* newAction) {
-  if (action != 0) {
-    disconnect(action, SIGNAL(stateChanged(ekam::proto::TaskUpdate::State)),
-               this, SLOT(actionStateChanged(ekam::proto::TaskUpdate::State)));
-    disconnect(action, SIGNAL(removed()), this, SLOT(actionRemoved()));
-  }
-
-  action = newAction;
-  stateChanged(action == 0 ? DEFAULT_STATE : action->getState());
-
-  if (action != 0) {
-    connect(action, SIGNAL(stateChanged(ekam::proto::TaskUpdate::State)),
-            this, SLOT(actionStateChanged(ekam::proto::TaskUpdate::State)));
-    connect(action, SIGNAL(removed()), this, SLOT(actionRemoved()));
-  }
-}
-
-void EkamTreeNode::stateChanged(ekam::proto::TaskUpdate::State newState) {
-  if (state != newState) {
-    state = newState;
-    QModelIndex myIndex = index();
-    emit tree->dataChanged(myIndex, myIndex);
-    if (parentNode != 0) {
-      parentNode->childStateChanged();
-    }
-  }
-}
-
-void EkamTreeNode::childStateChanged() {
-  ekam::proto::TaskUpdate::State maxState = DEFAULT_STATE;
-  int maxStatePriority = STATE_PRIORITIES[static_cast<uint>(maxState)];
-
-  foreach (EkamTreeNode* child, childNodes) {
-    int childPriority = STATE_PRIORITIES[static_cast<uint>(child->state)];
-    if (childPriority > maxStatePriority) {
-      maxState = child->state;
-      maxStatePriority = childPriority;
-    }
-  }
-
-  stateChanged(maxState);
-}
-
-void EkamTreeNode::removeChild(EkamTreeNode* child) {
-  int r = child->row();
-  tree->beginRemoveRows(index(), r, r);
-  childNodes.erase(childNodes.begin() + r);
-  tree->endRemoveRows();
-  if (childNodes.empty() && parentNode != 0) {
-    parentNode->removeChild(this);
-  }
-}
-
 // =======================================================================================
 
 EkamTreeModel::EkamTreeModel(EkamDashboardPlugin* plugin, QObject* parent)
-  : QAbstractItemModel(parent), plugin(plugin), root(new EkamTreeNode(this)) {
+  : QAbstractItemModel(parent), plugin(plugin), root(new EkamTreeNode(0, QString(), true)),
+    updateScheduled(false) {
 //  qDebug() << "EkamTreeModel::EkamTreeModel(...)";
+  root->populated = true;
 
   connect(plugin, SIGNAL(newAction(ActionState*)), this, SLOT(newAction(ActionState*)));
 
   foreach (ActionState* action, plugin->allActions()) {
     newAction(action);
   }
+  applyUpdates();
 }
 
-EkamTreeModel::~EkamTreeModel() {}
+EkamTreeModel::~EkamTreeModel() {
+  delete root;
+}
 
 QModelIndex EkamTreeModel::index(int row, int column, const QModelIndex & parent) const {
 //  qDebug() << "EkamTreeModel::index(" << row << ", " << column << ", " << parent << ")";
@@ -306,7 +226,7 @@ QModelIndex EkamTreeModel::parent(const QModelIndex &index) const {
     qWarning() << "Called parent() on invisible root object?";
     return QModelIndex();
   } else {
-    return reinterpret_cast<EkamTreeNode*>(node->parent())->index();
+    return nodeToIndex(node->parentNode);
   }
 }
 
@@ -331,12 +251,342 @@ int EkamTreeModel::columnCount(const QModelIndex & parent) const {
 bool EkamTreeModel::hasChildren(const QModelIndex & parent) const {
 //  qDebug() << "EkamTreeModel::hasChildren(" << parent << ") = "
 //           << (indexToNode(parent)->childCount() > 0);
-  return indexToNode(parent)->childCount() > 0;
+  EkamTreeNode* node = indexToNode(parent);
+  return node->childCount() > 0 || !node->pending.empty();
+}
+
+bool EkamTreeModel::canFetchMore(const QModelIndex & parent) const {
+  EkamTreeNode* node = indexToNode(parent);
+  return node->isDirectory && !node->populated;
+}
+
+void EkamTreeModel::fetchMore(const QModelIndex & parent) {
+  EkamTreeNode* node = indexToNode(parent);
+  if (node->isDirectory && !node->populated) {
+    populate(node);
+  }
+}
+
+QModelIndex EkamTreeModel::nodeToIndex(EkamTreeNode* node) const {
+  if (node == root) {
+    return QModelIndex();
+  }
+
+  int rowNum = node->row();
+  if (rowNum == -1) {
+    return QModelIndex();
+  }
+
+  return createIndex(rowNum, 0, node);
 }
 
 void EkamTreeModel::newAction(ActionState* action) {
 //  qDebug() << "EkamTreeModel::newAction(" << action->getVerb() << ":" << action->getNoun() << ")";
-  root->createNode(action->getNoun(), action->getVerb(), action);
+
+  // An action that is hidden and then shown again is announced again, so make sure not to
+  // connect twice.
+  connect(action, SIGNAL(stateChanged(ekam::proto::TaskUpdate::State)),
+          this, SLOT(actionStateChanged()), Qt::UniqueConnection);
+  connect(action, SIGNAL(removed()), this, SLOT(actionRemoved()), Qt::UniqueConnection);
+
+  addedActions.insert(action);
+  scheduleUpdate();
+}
+
+void EkamTreeModel::actionStateChanged() {
+  ActionState* action = static_cast<ActionState*>(sender());
+
+  // Actions not yet added will pick up their current state when they are.
+  if (entries.contains(action)) {
+    changedActions.insert(action);
+    scheduleUpdate();
+  }
+}
+
+void EkamTreeModel::actionRemoved() {
+  // This may be emitted from the action's destructor, so `action` mustn't be dereferenced, now
+  // or later.
+  ActionState* action = static_cast<ActionState*>(sender());
+
+  addedActions.remove(action);
+  changedActions.remove(action);
+
+  QHash<ActionState*, Entry>::iterator iter = entries.find(action);
+  if (iter != entries.end()) {
+    // The node stays until applyUpdates(), but forget the action now in case the view asks for
+    // its tool tip or the user double-clicks it in the meantime.
+    if (!iter->node->isDirectory) {
+      iter->node->action = 0;
+    }
+    removedActions.insert(action);
+    scheduleUpdate();
+  }
+}
+
+void EkamTreeModel::scheduleUpdate() {
+  if (!updateScheduled) {
+    updateScheduled = true;
+    QTimer::singleShot(0, this, SLOT(applyUpdates()));
+  }
+}
+
+void EkamTreeModel::applyUpdates() {
+  updateScheduled = false;
+
+  if (!removedActions.empty() && removedActions.size() == entries.size()) {
+    // Everything is going away, e.g. because we lost the connection to Ekam.  Start over rather
+    // than removing rows one by one.
+    beginResetModel();
+    delete root;
+    root = new EkamTreeNode(0, QString(), true);
+    root->populated = true;
+    entries.clear();
+    dirtyNodes.clear();
+    endResetModel();
+  } else {
+    foreach (ActionState* action, removedActions) {
+      removeAction(action);
+    }
+  }
+  removedActions.clear();
+
+  foreach (ActionState* action, changedActions) {
+    QHash<ActionState*, Entry>::iterator iter = entries.find(action);
+    if (iter != entries.end()) {
+      ekam::proto::TaskUpdate::State oldState = iter->state;
+      ekam::proto::TaskUpdate::State newState = action->getState();
+      if (newState != oldState) {
+        iter->state = newState;
+        recount(iter->node, &oldState, &newState);
+      }
+    }
+  }
+  changedActions.clear();
+
+  if (!addedActions.empty()) {
+    // New nodes are collected per parent, then each parent gets one insertion per run of
+    // adjacent new rows.
+    QHash<EkamTreeNode*, QList<EkamTreeNode*> > newChildren;
+    foreach (ActionState* action, addedActions) {
+      if (!entries.contains(action)) {
+        addAction(action, &newChildren);
+      }
+    }
+    addedActions.clear();
+
+    for (QHash<EkamTreeNode*, QList<EkamTreeNode*> >::iterator iter = newChildren.begin();
+         iter != newChildren.end(); ++iter) {
+      insertChildren(iter.key(), iter.value());
+    }
+  }
+
+  foreach (EkamTreeNode* node, dirtyNodes) {
+    if (node != root) {
+      QModelIndex nodeIndex = nodeToIndex(node);
+      emit dataChanged(nodeIndex, nodeIndex);
+    }
+  }
+  dirtyNodes.clear();
+}
+
+void EkamTreeModel::addAction(ActionState* action,
+                              QHash<EkamTreeNode*, QList<EkamTreeNode*> >* newChildren) {
+  Entry& entry = entries[action];
+  entry.state = action->getState();
+
+  EkamTreeNode* dir = root;
+  QString rest = action->getNoun();
+
+  while (true) {
+    if (!dir->populated) {
+      // Nobody is looking inside this directory yet.
+      EkamTreeNode::Pending pending = { rest, action->getVerb(), action };
+      dir->pending.append(pending);
+      entry.node = dir;
+      recount(dir, 0, &entry.state);
+      return;
+    }
+
+    int slash = rest.indexOf(QLatin1Char('/'));
+    if (slash == -1) {
+      EkamTreeNode* leaf = new EkamTreeNode(
+          dir, QString(QLatin1String("%1 (%2)")).arg(rest, action->getVerb()), false);
+      leaf->action = action;
+      (*newChildren)[dir].append(leaf);
+      entry.node = leaf;
+      recount(leaf, 0, &entry.state);
+      return;
+    }
+
+    QString childName = rest.left(slash);
+    rest = rest.mid(slash + 1);
+
+    EkamTreeNode* child = 0;
+    QList<EkamTreeNode*>::iterator iter = std::lower_bound(
+        dir->children.begin(), dir->children.end(), childName,
+        [](const EkamTreeNode* node, const QString& name) { return node->name < name; });
+    for (; iter != dir->children.end() && (*iter)->name == childName; ++iter) {
+      if ((*iter)->isDirectory) {
+        child = *iter;
+        break;
+      }
+    }
+
+    if (child == 0) {
+      QList<EkamTreeNode*>& added = (*newChildren)[dir];
+      foreach (EkamTreeNode* node, added) {
+        if (node->isDirectory && node->name == childName) {
+          child = node;
+          break;
+        }
+      }
+      if (child == 0) {
+        // New directories start out unpopulated; the rest of the path goes in `pending`.
+        child = new EkamTreeNode(dir, childName, true);
+        added.append(child);
+      }
+    }
+
+    dir = child;
+  }
+}
+
+void EkamTreeModel::insertChildren(EkamTreeNode* parent, QList<EkamTreeNode*> newChildren) {
+  std::stable_sort(newChildren.begin(), newChildren.end(), nameLess);
+  QModelIndex parentIndex = nodeToIndex(parent);
+
+  int pos = 0;
+  int next = 0;
+  while (next < newChildren.size()) {
+    pos = std::upper_bound(parent->children.begin() + pos, parent->children.end(),
+                           newChildren[next], nameLess) - parent->children.begin();
+
+    // All the new children which sort before the existing child at `pos` are inserted together.
+    int end = next + 1;
+    while (end < newChildren.size() &&
+           (pos == parent->children.size() ||
+            newChildren[end]->name < parent->children[pos]->name)) {
+      ++end;
+    }
+
+    beginInsertRows(parentIndex, pos, pos + end - next - 1);
+    QList<EkamTreeNode*> merged = parent->children.mid(0, pos);
+    merged += newChildren.mid(next, end - next);
+    merged += parent->children.mid(pos);
+    parent->children.swap(merged);
+    endInsertRows();
+
+    pos += end - next;
+    next = end;
+  }
+}
+
+void EkamTreeModel::removeAction(ActionState* action) {
+  QHash<ActionState*, Entry>::iterator iter = entries.find(action);
+  if (iter == entries.end()) {
+    return;
+  }
+  Entry entry = *iter;
+  entries.erase(iter);
+
+  recount(entry.node, &entry.state, 0);
+
+  EkamTreeNode* node = entry.node;
+  if (node->isDirectory) {
+    for (int i = 0; i < node->pending.size(); i++) {
+      if (node->pending[i].action == action) {
+        node->pending.removeAt(i);
+        break;
+      }
+    }
+  }
+
+  // Remove the leaf, and any directories left empty.
+  while (node != root &&
+         (!node->isDirectory || (node->children.empty() && node->pending.empty()))) {
+    EkamTreeNode* parentNode = node->parentNode;
+    removeNode(node);
+    node = parentNode;
+  }
+}
+
+void EkamTreeModel::removeNode(EkamTreeNode* node) {
+  int r = node->row();
+  beginRemoveRows(nodeToIndex(node->parentNode), r, r);
+  node->parentNode->children.removeAt(r);
+  endRemoveRows();
+  dirtyNodes.remove(node);
+  delete node;
+}
+
+void EkamTreeModel::populate(EkamTreeNode* node) {
+  QList<EkamTreeNode*> newChildren;
+  QHash<QString, EkamTreeNode*> dirs;
+
+  foreach (const EkamTreeNode::Pending& pending, node->pending) {
+    Entry& entry = entries[pending.action];
+
+    int slash = pending.rest.indexOf(QLatin1Char('/'));
+    if (slash == -1) {
+      EkamTreeNode* leaf = new EkamTreeNode(
+          node, QString(QLatin1String("%1 (%2)")).arg(pending.rest, pending.verb), false);
+      // An action removed since the last applyUpdates() may already be gone.
+      leaf->action = removedActions.contains(pending.action) ? 0 : pending.action;
+      leaf->state = entry.state;
+      newChildren.append(leaf);
+      entry.node = leaf;
+    } else {
+      QString childName = pending.rest.left(slash);
+      EkamTreeNode*& dir = dirs[childName];
+      if (dir == 0) {
+        dir = new EkamTreeNode(node, childName, true);
+        newChildren.append(dir);
+      }
+      EkamTreeNode::Pending childPending = {
+        pending.rest.mid(slash + 1), pending.verb, pending.action
+      };
+      dir->pending.append(childPending);
+      ++dir->counts[priorityOf(entry.state)];
+      entry.node = dir;
+    }
+  }
+
+  foreach (EkamTreeNode* dir, dirs) {
+    dir->state = stateFromCounts(dir->counts);
+  }
+
+  std::stable_sort(newChildren.begin(), newChildren.end(), nameLess);
+  node->pending.clear();
+  node->populated = true;
+
+  if (!newChildren.empty()) {
+    beginInsertRows(nodeToIndex(node), 0, newChildren.size() - 1);
+    node->children.swap(newChildren);
+    endInsertRows();
+  }
+}
+
+void EkamTreeModel::recount(EkamTreeNode* node, const ekam::proto::TaskUpdate::State* oldState,
+                            const ekam::proto::TaskUpdate::State* newState) {
+  for (; node != 0; node = node->parentNode) {
+    ekam::proto::TaskUpdate::State nodeState;
+    if (node->isDirectory) {
+      if (oldState != 0) {
+        --node->counts[priorityOf(*oldState)];
+      }
+      if (newState != 0) {
+        ++node->counts[priorityOf(*newState)];
+      }
+      nodeState = stateFromCounts(node->counts);
+    } else {
+      nodeState = newState == 0 ? DEFAULT_STATE : *newState;
+    }
+
+    if (nodeState != node->state) {
+      node->state = nodeState;
+      dirtyNodes.insert(node);
+    }
+  }
 }
 
 // =======================================================================================
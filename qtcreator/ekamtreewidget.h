@@ -21,6 +21,8 @@
 
 #include <QWidget>
 #include <QAbstractItemModel>
+#include <QHash>
+#include <QSet>
 #include <QTreeView>
 
 #include <projectexplorer/task.h>
@@ -34,53 +36,63 @@ class EkamDashboardPlugin;
 class EkamTreeModel;
 class ActionState;
 
-class EkamTreeNode : public QObject {
-  Q_OBJECT
-public:
-  explicit EkamTreeNode(EkamTreeModel* tree);
-  EkamTreeNode(EkamTreeNode* parent, const QString& name, bool isDirectory);
-  virtual ~EkamTreeNode();
-
-  int row();
-  QModelIndex index();
+// Number of entries in ORDERED_STATES, i.e. the number of distinct state priorities.
+static const int STATE_PRIORITY_COUNT = 8;
 
-  void createNode(const QString& noun, const QString& verb, ActionState* action);
+// A row in the tree.  Nodes are plain structs owned by their parent; with tens of thousands of
+// actions, a QObject (and a pair of signal connections) per node is too expensive.
+//
+// A directory's children are created only once the view asks for them (fetchMore()), usually
+// because the user expanded it.  Until then the actions underneath it sit in `pending`.
+struct EkamTreeNode {
+  struct Pending {
+    // The action's noun, relative to this directory.
+    QString rest;
+    // Kept so that creating the leaf later needn't touch the action, which may be gone by then.
+    QString verb;
+    ActionState* action;
+  };
 
-  QVariant data(int role);
+  EkamTreeNode(EkamTreeNode* parent, const QString& name, bool isDirectory);
+  ~EkamTreeNode();
 
-  int childCount() {
-    return childNodes.size();
-  }
-  EkamTreeNode* getChild(int index) {
-    return childNodes.at(index);
-  }
+  EkamTreeNode* parentNode;
+  QString name;
+  bool isDirectory;
 
-  ActionState* getAction() {
-    return action;
-  }
+  // True once `children` has been created from `pending`.  Always false for leaves.
+  bool populated;
+  QList<EkamTreeNode*> children;
+  QList<Pending> pending;
 
-private slots:
-  void actionStateChanged(ekam::proto::TaskUpdate::State newState);
-  void actionRemoved();
+  // For leaves, the action shown.  Null for directories.
+  ActionState* action;
 
-private:
-  EkamTreeModel* tree;
+  // For leaves, the action's state.  For directories, the highest-priority state among all
+  // actions underneath, populated or not, as tallied in `counts` (indexed by state priority).
+  ekam::proto::TaskUpdate::State state;
+  int counts[STATE_PRIORITY_COUNT];
 
-  bool isDirectory;
-  QString name;
+  int row() const;
 
-  EkamTreeNode* parentNode;
-  QList<EkamTreeNode*> childNodes;
+  QVariant data(int role) const;
 
-  ActionState* action;
-  ekam::proto::TaskUpdate::State state;
+  int childCount() const {
+    return children.size();
+  }
+  EkamTreeNode* getChild(int index) const {
+    return children.at(index);
+  }
 
-  void setAction(ActionState* newAction);
-  void stateChanged(ekam::proto::TaskUpdate::State newState);
-  void childStateChanged();
-  void removeChild(EkamTreeNode* child);
+  ActionState* getAction() const {
+    return action;
+  }
 };
 
+// Updates from the plugin arrive one message at a time, and a build start can bring tens of
+// thousands of them at once.  Rather than touch the model for each, EkamTreeModel queues them
+// and applies them all at once on the next event loop iteration, so that the view sees a few
+// ranged row insertions instead of one per action.
 class EkamTreeModel : public QAbstractItemModel {
   Q_OBJECT
 public:
@@ -95,18 +107,56 @@ public:
   virtual int columnCount(const QModelIndex & parent = QModelIndex()) const;
   virtual bool hasChildren(const QModelIndex & parent = QModelIndex()) const;
 
+  virtual bool canFetchMore(const QModelIndex & parent) const;
+  virtual void fetchMore(const QModelIndex & parent);
+
   EkamTreeNode* indexToNode(const QModelIndex& index) const {
     return index.isValid() ? reinterpret_cast<EkamTreeNode*>(index.internalPointer()) : root;
   }
 
 private slots:
   void newAction(ActionState* action);
+  void actionStateChanged();
+  void actionRemoved();
+  void applyUpdates();
 
 private:
-  friend class EkamTreeNode;
+  // Where an action currently lives:  either its leaf node, or the unpopulated directory
+  // holding it in `pending`.  `state` is the state counted in the ancestors' `counts`, which
+  // lags the action's own state until the next applyUpdates().
+  struct Entry {
+    EkamTreeNode* node;
+    ekam::proto::TaskUpdate::State state;
+  };
 
   EkamDashboardPlugin* plugin;
   EkamTreeNode* root;
+  QHash<ActionState*, Entry> entries;
+
+  // Updates not yet applied.
+  QSet<ActionState*> addedActions;
+  QSet<ActionState*> removedActions;
+  QSet<ActionState*> changedActions;
+  bool updateScheduled;
+
+  // Nodes whose state changed during applyUpdates(); dataChanged() is emitted for each at the
+  // end.
+  QSet<EkamTreeNode*> dirtyNodes;
+
+  QModelIndex nodeToIndex(EkamTreeNode* node) const;
+  void scheduleUpdate();
+
+  void addAction(ActionState* action,
+                 QHash<EkamTreeNode*, QList<EkamTreeNode*> >* newChildren);
+  void insertChildren(EkamTreeNode* parent, QList<EkamTreeNode*> newChildren);
+  void removeAction(ActionState* action);
+  void removeNode(EkamTreeNode* node);
+  void populate(EkamTreeNode* node);
+
+  // Moves one action's worth of `counts` from oldState to newState (or only adds or only
+  // removes it, if the other is null) in `node` and every ancestor.
+  void recount(EkamTreeNode* node, const ekam::proto::TaskUpdate::State* oldState,
+               const ekam::proto::TaskUpdate::State* newState);
 };
 
 class EkamTreeWidget : public QWidget {
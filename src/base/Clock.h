@@ -0,0 +1,48 @@
+// Ekam Build System
+// Author: Kenton Varda (kenton@sandstorm.io)
+// Copyright (c) 2010-2015 Kenton Varda, Google Inc., and contributors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef KENTONSCODE_BASE_CLOCK_H_
+#define KENTONSCODE_BASE_CLOCK_H_
+
+#include <stdint.h>
+#include <time.h>
+
+namespace ekam {
+
+// Readings of the monotonic clock, for timing things.  They are unrelated to wall-clock time,
+// so only differences between them mean anything.
+
+inline uint64_t monotonicNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000u + ts.tv_nsec;
+}
+
+inline uint64_t monotonicMicros() {
+  return monotonicNanos() / 1000;
+}
+
+inline uint64_t monotonicMillis() {
+  return monotonicNanos() / 1000000;
+}
+
+inline double monotonicSeconds() {
+  return monotonicNanos() / 1e9;
+}
+
+}  // namespace ekam
+
+#endif  // KENTONSCODE_BASE_CLOCK_H_
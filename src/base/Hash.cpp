@@ -33,6 +33,16 @@ char HexDigit(unsigned int value) {
   }
 }
 
+int HexDigitValue(char c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  } else if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  } else {
+    return -1;
+  }
+}
+
 } // anonymous namespace
 
 Hash Hash::of(const std::string& data) {
@@ -56,6 +66,21 @@ std::string Hash::toString() const {
   return result;
 }
 
+bool Hash::fromString(const std::string& text, Hash* output) {
+  if (text.size() != sizeof(output->hash) * 2) {
+    return false;
+  }
+  for (unsigned int i = 0; i < sizeof(output->hash); i++) {
+    int high = HexDigitValue(text[i * 2]);
+    int low = HexDigitValue(text[i * 2 + 1]);
+    if (high < 0 || low < 0) {
+      return false;
+    }
+    output->hash[i] = (high << 4) | low;
+  }
+  return true;
+}
+
 Hash::Builder::Builder() {
   SHA256_Init(&context);
 }
@@ -46,6 +46,9 @@ public:
 
   std::string toString() const;
 
+  // Parses the output of toString().  Returns false if the input is malformed.
+  static bool fromString(const std::string& text, Hash* output);
+
   inline bool operator==(const Hash& other) const {
     return memcmp(hash, other.hash, sizeof(hash)) == 0;
   }
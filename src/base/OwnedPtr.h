@@ -18,6 +18,7 @@
 #define KENTONSCODE_BASE_OWNEDPTR_H_
 
 #include <stddef.h>
+#include <atomic>
 #include <type_traits>
 #include <vector>
 #include <deque>
@@ -25,6 +26,8 @@
 #include <unordered_map>
 #include <assert.h>
 
+#include "Pooled.h"
+
 #ifdef __CDT_PARSER__
 #define noexcept
 #define constexpr
@@ -108,6 +111,8 @@ private:
   friend class OwnedPtrDeque;
   template <typename U>
   friend class OwnedPtrQueue;
+  template <typename U>
+  friend class OwnedPtrList;
   template <typename Key, typename U, typename HashFunc, typename EqualsFunc>
   friend class OwnedPtrMap;
 };
@@ -142,22 +147,26 @@ private:
 };
 
 // TODO:  Hide this somewhere private?
-class Refcount {
+//
+// The counts are atomic, so SmartPtrs to the same object may be copied and destroyed on
+// different threads (e.g. DiskFile nodes, which SourceScanner's threads share with the event
+// loop).  Upgrading a WeakPtr is only safe on the thread which owns the last strong reference.
+class Refcount : public Pooled {
 public:
-  Refcount(): strong(1), weak(0) {}
+  // weak counts the WeakPtrs, plus one held collectively by the strong references, so that
+  // whichever count drops last frees the Refcount.
+  Refcount(): strong(1), weak(1) {}
   Refcount(const Refcount& other) = delete;
   Refcount& operator=(const Refcount& other) = delete;
 
   static void inc(Refcount* r) {
-    if (r != NULL) ++r->strong;
+    if (r != NULL) r->strong.fetch_add(1, std::memory_order_relaxed);
   }
   static bool dec(Refcount* r) {
     if (r == NULL) {
       return false;
-    } else if (--r->strong == 0) {
-      if (r->weak == 0) {
-        delete r;
-      }
+    } else if (r->strong.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      decWeak(r);
       return true;
     } else {
       return false;
@@ -165,16 +174,16 @@ public:
   }
 
   static void incWeak(Refcount* r) {
-    if (r != NULL) ++r->weak;
+    if (r != NULL) r->weak.fetch_add(1, std::memory_order_relaxed);
   }
   static void decWeak(Refcount* r) {
-    if (r != NULL && --r->weak == 0 && r->strong == 0) {
+    if (r != NULL && r->weak.fetch_sub(1, std::memory_order_acq_rel) == 1) {
       delete r;
     }
   }
 
   static bool release(Refcount* r) {
-    if (r != NULL && r->strong == 1) {
+    if (r != NULL && r->strong.load(std::memory_order_acquire) == 1) {
       dec(r);
       return true;
     } else {
@@ -183,12 +192,12 @@ public:
   }
 
   static bool isLive(Refcount* r) {
-    return r != NULL && r->strong > 0;
+    return r != NULL && r->strong.load(std::memory_order_acquire) > 0;
   }
 
 private:
-  int strong;
-  int weak;
+  std::atomic<int> strong;
+  std::atomic<int> weak;
 };
 
 template <typename T>
@@ -453,7 +462,7 @@ public:
 
   void set(int index, OwnedPtr<T> ptr) {
     deleteEnsuringCompleteType(vec[index]);
-    vec[index] = ptr->releaseRaw();
+    vec[index] = ptr.releaseRaw();
   }
 
   OwnedPtr<T> release(int index) {
@@ -608,6 +617,164 @@ private:
   std::queue<T*> q;
 };
 
+template <typename T>
+class OwnedPtrList;
+
+// Base class for objects which are stored in an OwnedPtrList.  The list pointers live in the
+// object itself, so an object can only be in one list at a time, but it can be removed from
+// that list in constant time.
+template <typename T>
+class OwnedPtrListNode {
+public:
+  OwnedPtrListNode(): prev(NULL), next(NULL), list(NULL) {}
+  OwnedPtrListNode(const OwnedPtrListNode&) = delete;
+  ~OwnedPtrListNode() {
+    assert(list == NULL);
+  }
+
+  OwnedPtrListNode& operator=(const OwnedPtrListNode&) = delete;
+
+private:
+  T* prev;
+  T* next;
+  OwnedPtrList<T>* list;
+
+  friend class OwnedPtrList<T>;
+};
+
+template <typename T>
+class OwnedPtrList {
+  typedef OwnedPtrListNode<T> Node;
+
+public:
+  OwnedPtrList(): head(NULL), tail(NULL), count(0) {}
+  OwnedPtrList(const OwnedPtrList&) = delete;
+  ~OwnedPtrList() {
+    clear();
+  }
+
+  OwnedPtrList& operator=(const OwnedPtrList&) = delete;
+
+  int size() const { return count; }
+  bool empty() const { return count == 0; }
+  T* front() const { return head; }
+  T* back() const { return tail; }
+
+  bool contains(T* ptr) const {
+    return node(ptr)->list == this;
+  }
+
+  void pushFront(OwnedPtr<T> ptr) {
+    T* value = ptr.releaseRaw();
+    Node* n = node(value);
+    assert(n->list == NULL);
+    n->list = this;
+    n->prev = NULL;
+    n->next = head;
+    if (head == NULL) {
+      tail = value;
+    } else {
+      node(head)->prev = value;
+    }
+    head = value;
+    ++count;
+  }
+
+  void pushBack(OwnedPtr<T> ptr) {
+    T* value = ptr.releaseRaw();
+    Node* n = node(value);
+    assert(n->list == NULL);
+    n->list = this;
+    n->prev = tail;
+    n->next = NULL;
+    if (tail == NULL) {
+      head = value;
+    } else {
+      node(tail)->next = value;
+    }
+    tail = value;
+    ++count;
+  }
+
+  OwnedPtr<T> popFront() {
+    return release(head);
+  }
+
+  OwnedPtr<T> popBack() {
+    return release(tail);
+  }
+
+  // Removes the given element, which must be in this list.
+  OwnedPtr<T> release(T* ptr) {
+    Node* n = node(ptr);
+    assert(n->list == this);
+    if (n->prev == NULL) {
+      head = n->next;
+    } else {
+      node(n->prev)->next = n->next;
+    }
+    if (n->next == NULL) {
+      tail = n->prev;
+    } else {
+      node(n->next)->prev = n->prev;
+    }
+    n->prev = NULL;
+    n->next = NULL;
+    n->list = NULL;
+    --count;
+    return OwnedPtr<T>(ptr);
+  }
+
+  // Removes and deletes the given element, if it is in this list.  Returns true if it was.
+  bool erase(T* ptr) {
+    if (contains(ptr)) {
+      release(ptr);
+      return true;
+    } else {
+      return false;
+    }
+  }
+
+  void clear() {
+    while (head != NULL) {
+      release(head);
+    }
+  }
+
+  // Iterates from front to back.  The current element may be released during iteration.
+  class Iterator {
+  public:
+    explicit Iterator(const OwnedPtrList& list): current(NULL), nextPtr(list.head) {}
+
+    bool next() {
+      current = nextPtr;
+      if (current == NULL) {
+        return false;
+      } else {
+        nextPtr = node(current)->next;
+        return true;
+      }
+    }
+
+    T* value() {
+      return current;
+    }
+
+  private:
+    T* current;
+    T* nextPtr;
+  };
+
+private:
+  T* head;
+  T* tail;
+  int count;
+
+  static Node* node(T* ptr) {
+    return static_cast<Node*>(ptr);
+  }
+};
+
 template <typename Key, typename T,
           typename HashFunc = std::hash<Key>,
           typename EqualsFunc = std::equal_to<Key> >
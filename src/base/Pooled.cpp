@@ -0,0 +1,86 @@
+// Ekam Build System
+// Author: Kenton Varda (kenton@sandstorm.io)
+// Copyright (c) 2010-2015 Kenton Varda, Google Inc., and contributors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "Pooled.h"
+
+#include <new>
+
+namespace ekam {
+
+namespace {
+
+const size_t GRANULE = 16;
+const size_t CLASS_COUNT = Pooled::MAX_SIZE / GRANULE;
+
+// Past this many free objects per size class, frees go back to the heap.
+const int MAX_FREE = 1024;
+
+struct FreeNode {
+  FreeNode* next;
+};
+
+struct FreeList {
+  FreeNode* head;
+  int count;
+};
+
+// Plain data, so that it's usable during static destruction.  (What's on the lists when a thread
+// exits is leaked.)
+thread_local FreeList freeLists[CLASS_COUNT];
+
+inline size_t sizeClass(size_t size) {
+  return (size - 1) / GRANULE;
+}
+
+}  // namespace
+
+void* Pooled::operator new(size_t size) {
+  if (size == 0 || size > MAX_SIZE) {
+    return ::operator new(size);
+  }
+
+  FreeList& list = freeLists[sizeClass(size)];
+  if (list.head == nullptr) {
+    // Allocate the whole size class, so that any object in the class fits when reused.
+    return ::operator new((sizeClass(size) + 1) * GRANULE);
+  }
+  FreeNode* node = list.head;
+  list.head = node->next;
+  --list.count;
+  return node;
+}
+
+void Pooled::operator delete(void* ptr, size_t size) {
+  if (ptr == nullptr) {
+    return;
+  }
+  if (size == 0 || size > MAX_SIZE) {
+    ::operator delete(ptr);
+    return;
+  }
+
+  FreeList& list = freeLists[sizeClass(size)];
+  if (list.count >= MAX_FREE) {
+    ::operator delete(ptr);
+    return;
+  }
+  FreeNode* node = reinterpret_cast<FreeNode*>(ptr);
+  node->next = list.head;
+  list.head = node;
+  ++list.count;
+}
+
+}  // namespace ekam
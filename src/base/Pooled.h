@@ -0,0 +1,41 @@
+// Ekam Build System
+// Author: Kenton Varda (kenton@sandstorm.io)
+// Copyright (c) 2010-2015 Kenton Varda, Google Inc., and contributors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef KENTONSCODE_BASE_POOLED_H_
+#define KENTONSCODE_BASE_POOLED_H_
+
+#include <stddef.h>
+
+namespace ekam {
+
+// Inherit from Pooled to allocate instances from per-thread free lists instead of the general
+// heap.  For small objects which are created and destroyed at a high rate, such as promise
+// states and the runnables behind each continuation.
+//
+// Objects may be freed on a different thread than the one which allocated them.  Objects
+// bigger than MAX_SIZE are allocated normally.  The lists are capped, so memory freed in a
+// burst is mostly returned to the heap.
+class Pooled {
+public:
+  static const size_t MAX_SIZE = 256;
+
+  static void* operator new(size_t size);
+  static void operator delete(void* ptr, size_t size);
+};
+
+}  // namespace ekam
+
+#endif  // KENTONSCODE_BASE_POOLED_H_
@@ -27,6 +27,8 @@
 
 #include "OwnedPtr.h"
 #include "Debug.h"
+#include "Pooled.h"
+#include "Trace.h"
 
 namespace ekam {
 
@@ -161,7 +163,7 @@ public:
 };
 
 template <typename Func>
-class LambdaRunnable: public Runnable {
+class LambdaRunnable: public Runnable, public Pooled {
 public:
   LambdaRunnable(Func&& func): func(std::move(func)) {}
   ~LambdaRunnable() {}
@@ -352,7 +354,7 @@ public:
 };
 
 template <typename T>
-class PromiseState {
+class PromiseState : public Pooled {
 public:
   PromiseState(): owner(nullptr), listener(nullptr), fulfilled(false), failed(false) {}
   virtual ~PromiseState() {}
@@ -424,7 +426,7 @@ public:
 };
 
 template <>
-class PromiseState<void> {
+class PromiseState<void> : public Pooled {
 public:
   PromiseState(): owner(nullptr), listener(nullptr), fulfilled(false), failed(false) {}
   virtual ~PromiseState() {}
@@ -636,7 +638,7 @@ public:
 
   ~DependentPromiseFulfiller() {
     if (pendingReadyLater != nullptr) {
-      DEBUG_INFO << "Promise canceled: " << this;
+      TRACE("promise canceled: %p", this);
     }
   }
 
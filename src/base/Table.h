@@ -19,6 +19,8 @@
 
 #include <unordered_map>
 #include <vector>
+#include <utility>
+#include <stdint.h>
 #include <stdlib.h>
 
 namespace ekam {
@@ -45,6 +47,216 @@ public:
   inline void swap(DummyMap& other) {}
 };
 
+// A hash multimap from Key to int using open addressing with linear probing, so that lookups
+// touch one contiguous array rather than chasing linked nodes.  All values for a key live in
+// the key's bucket, the first one inline.  Implements just the subset of the
+// std::unordered_multimap interface that Table uses.
+template <typename Key, typename Hasher, typename Eq>
+class FlatMultimap {
+private:
+  struct Bucket {
+    Key key;
+    bool used;         // If true, key is set.  Stays true after values are erased, so that
+                       // probe sequences passing through this bucket remain intact.
+    int count;         // Number of values.
+    int first;         // First value.
+    std::vector<int> more;  // Remaining values.
+
+    Bucket() : key(), used(false), count(0), first(0) {}
+
+    inline int& value(int i) { return i == 0 ? first : more[i - 1]; }
+    inline int value(int i) const { return i == 0 ? first : more[i - 1]; }
+  };
+
+public:
+  typedef std::pair<const Key, int> value_type;
+
+  FlatMultimap() : usedBuckets(0), entryCount(0), shift(64) {}
+
+  // Points at one value.  Dereferencing yields something with "first" and "second" members like
+  // a value_type.
+  class iterator {
+  public:
+    struct Reference {
+      const Key& first;
+      int& second;
+      Reference(const Key& first, int& second) : first(first), second(second) {}
+    };
+    class Arrow {
+    public:
+      Arrow(const Reference& ref) : ref(ref) {}
+      const Reference* operator->() const { return &ref; }
+    private:
+      Reference ref;
+    };
+
+    iterator() : map(NULL), bucket(0), pos(0), wholeMap(false) {}
+
+    inline Arrow operator->() const {
+      Bucket& b = map->buckets[bucket];
+      return Arrow(Reference(b.key, b.value(pos)));
+    }
+
+    iterator& operator++() {
+      ++pos;
+      if (wholeMap && pos >= map->buckets[bucket].count) {
+        pos = 0;
+        bucket = map->nextOccupied(bucket + 1);
+      }
+      return *this;
+    }
+
+    inline bool operator==(const iterator& other) const {
+      return bucket == other.bucket && pos == other.pos;
+    }
+    inline bool operator!=(const iterator& other) const {
+      return !(*this == other);
+    }
+
+  private:
+    FlatMultimap* map;
+    size_t bucket;
+    int pos;
+    bool wholeMap;  // If false, iteration covers only one key's values.
+
+    iterator(const FlatMultimap* map, size_t bucket, int pos, bool wholeMap)
+        : map(const_cast<FlatMultimap*>(map)), bucket(bucket), pos(pos), wholeMap(wholeMap) {}
+
+    friend class FlatMultimap;
+  };
+  typedef iterator const_iterator;
+
+  inline iterator begin() const { return iterator(this, nextOccupied(0), 0, true); }
+  inline iterator end() const { return iterator(this, buckets.size(), 0, true); }
+
+  inline size_t size() const { return entryCount; }
+
+  iterator find(const Key& key) const {
+    size_t b = lookup(key);
+    return b == buckets.size() ? end() : iterator(this, b, 0, false);
+  }
+
+  std::pair<iterator, iterator> equal_range(const Key& key) const {
+    size_t b = lookup(key);
+    if (b == buckets.size()) {
+      return std::make_pair(end(), end());
+    } else {
+      return std::make_pair(iterator(this, b, 0, false),
+                            iterator(this, b, buckets[b].count, false));
+    }
+  }
+
+  iterator insert(const value_type& value) {
+    if ((usedBuckets + 1) * 2 > buckets.size()) {
+      rehash();
+    }
+
+    size_t mask = buckets.size() - 1;
+    for (size_t b = slotFor(value.first); ; b = (b + 1) & mask) {
+      Bucket& bucket = buckets[b];
+      if (!bucket.used) {
+        bucket.key = value.first;
+        bucket.used = true;
+        ++usedBuckets;
+      } else if (!eq(bucket.key, value.first)) {
+        continue;
+      }
+
+      if (bucket.count == 0) {
+        bucket.first = value.second;
+      } else {
+        bucket.more.push_back(value.second);
+      }
+      ++entryCount;
+      return iterator(this, b, bucket.count++, false);
+    }
+  }
+
+  // Only supports erasing complete ranges returned by equal_range().
+  void erase(const iterator& first, const iterator& last) {
+    if (first != last) {
+      Bucket& bucket = buckets[first.bucket];
+      entryCount -= bucket.count;
+      bucket.count = 0;
+      std::vector<int>().swap(bucket.more);
+    }
+  }
+
+  void swap(FlatMultimap& other) {
+    buckets.swap(other.buckets);
+    std::swap(usedBuckets, other.usedBuckets);
+    std::swap(entryCount, other.entryCount);
+    std::swap(shift, other.shift);
+  }
+
+private:
+  std::vector<Bucket> buckets;
+  size_t usedBuckets;
+  size_t entryCount;
+  int shift;  // 64 - log2(buckets.size())
+  Hasher hasher;
+  Eq eq;
+
+  // Fibonacci hashing, so that hash functions with poor low bits (e.g. pointers) still spread.
+  inline size_t slotFor(const Key& key) const {
+    return (static_cast<uint64_t>(hasher(key)) * 11400714819323198485ull) >> shift;
+  }
+
+  size_t lookup(const Key& key) const {
+    if (buckets.empty()) return 0;
+
+    size_t mask = buckets.size() - 1;
+    for (size_t b = slotFor(key); buckets[b].used; b = (b + 1) & mask) {
+      if (eq(buckets[b].key, key)) {
+        return buckets[b].count == 0 ? buckets.size() : b;
+      }
+    }
+    return buckets.size();
+  }
+
+  size_t nextOccupied(size_t b) const {
+    while (b < buckets.size() && buckets[b].count == 0) {
+      ++b;
+    }
+    return b;
+  }
+
+  // Resizes to fit the current keys, dropping buckets whose values have all been erased.
+  void rehash() {
+    size_t liveKeys = 0;
+    for (size_t i = 0; i < buckets.size(); i++) {
+      if (buckets[i].count > 0) ++liveKeys;
+    }
+
+    int newShift = 61;  // 8 buckets
+    while ((size_t(1) << (64 - newShift)) < (liveKeys + 1) * 4) {
+      --newShift;
+    }
+
+    std::vector<Bucket> oldBuckets(size_t(1) << (64 - newShift));
+    oldBuckets.swap(buckets);
+    shift = newShift;
+    usedBuckets = liveKeys;
+
+    size_t mask = buckets.size() - 1;
+    for (size_t i = 0; i < oldBuckets.size(); i++) {
+      Bucket& old = oldBuckets[i];
+      if (old.count > 0) {
+        size_t b = slotFor(old.key);
+        while (buckets[b].used) {
+          b = (b + 1) & mask;
+        }
+        Bucket& bucket = buckets[b];
+        bucket.key = old.key;
+        bucket.used = true;
+        bucket.count = old.count;
+        bucket.first = old.first;
+        bucket.more.swap(old.more);
+      }
+    }
+  }
+};
+
 template <typename Choices, int index>
 struct ChooseType;
 template <typename Choices>
@@ -62,6 +274,14 @@ struct IndexedColumn {
   typedef std::unordered_multimap<T, int, Hasher, Eq> Index;
 };
 
+// Like IndexedColumn, but the index uses open addressing.  Faster for columns that are
+// searched often, at the cost of keeping erased keys' buckets until the index next grows.
+template <typename T, typename Hasher = std::hash<T>, typename Eq = std::equal_to<T> >
+struct FlatIndexedColumn {
+  typedef T Value;
+  typedef FlatMultimap<T, Hasher, Eq> Index;
+};
+
 template <typename T, typename Hasher = std::hash<T>, typename Eq = std::equal_to<T> >
 struct UniqueColumn {
   typedef T Value;
@@ -201,14 +421,17 @@ public:
 
   template <int columnNumber>
   const Row* find(const typename Column<columnNumber>::Value& value) const {
-    typename Column<columnNumber>::Index::const_iterator iter =
-        Column<columnNumber>::index(*this).find(value);
-    if (iter == Column<columnNumber>::index(*this).end()) {
-      return NULL;
-    } else {
+    // Rows erased via some other column are still in this column's index, so skip those.
+    typedef typename Column<columnNumber>::Index::const_iterator ColumnIterator;
+    std::pair<ColumnIterator, ColumnIterator> range =
+        Column<columnNumber>::index(*this).equal_range(value);
+    for (ColumnIterator iter = range.first; iter != range.second; ++iter) {
       const Row* row = &rows[iter->second];
-      return row->deleted ? NULL : row;
+      if (!row->deleted) {
+        return row;
+      }
     }
+    return NULL;
   }
 
   template <int columnNumber>
@@ -267,6 +490,13 @@ public:
     return rows.capacity();
   }
 
+  // Discard deleted rows now rather than waiting for them to accumulate.
+  void compact() {
+    if (deletedCount > 0) {
+      refresh();
+    }
+  }
+
   template <int columnNumber>
   int indexSize() {
     return Column<columnNumber>::index(this)->size();
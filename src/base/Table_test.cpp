@@ -15,6 +15,7 @@
 // limitations under the License.
 
 #include "Table.h"
+#include "Clock.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <set>
@@ -222,10 +223,133 @@ void testTable() {
   }
 }
 
+void testFlatTable() {
+  {
+    typedef Table<FlatIndexedColumn<std::string>, FlatIndexedColumn<int>, Column<char> > MyTable;
+    MyTable table;
+
+    table.add("foo", 1, 'f');
+    table.add("foo", 2, 'o');
+    table.add("bar", 1, 'b');
+    table.add("bar", 2, 'a');
+
+    {
+      std::map<int, char> values;
+      MyTable::SearchIterator<0> iter(table, "bar");
+
+      ASSERT(iter.next());
+      values[iter.cell<1>()] = iter.cell<2>();
+      ASSERT(iter.next());
+      values[iter.cell<1>()] = iter.cell<2>();
+      ASSERT(!iter.next());
+
+      ASSERT(values[1] == 'b');
+      ASSERT(values[2] == 'a');
+    }
+
+    ASSERT(table.find<0>("baz") == NULL);
+    ASSERT(!MyTable::SearchIterator<0>(table, "baz").next());
+    ASSERT(table.has<1>(2));
+
+    ASSERT(table.erase<0>("foo") == 2);
+    ASSERT(table.find<0>("foo") == NULL);
+    ASSERT(table.find<1>(1)->cell<0>() == "bar");
+
+    // Re-adding an erased key reuses its bucket.
+    table.add("foo", 3, 'x');
+    const MyTable::Row* row = table.find<0>("foo");
+    ASSERT(row != NULL);
+    ASSERT(row->cell<1>() == 3);
+
+    table.compact();
+    ASSERT(table.size() == 3);
+    ASSERT(table.capacity() == 3);
+    ASSERT(table.find<0>("foo")->cell<2>() == 'x');
+  }
+
+  {
+    // Enough keys to force the index to grow several times, with pointer-like keys whose low
+    // bits are all zero.
+    typedef Table<FlatIndexedColumn<long>, FlatIndexedColumn<int> > MyTable;
+    MyTable table;
+
+    for (int i = 0; i < 1000; i++) {
+      table.add(i * 16L, i % 10);
+    }
+    ASSERT(table.indexSize<0>() == 1000);
+    ASSERT(table.indexSize<1>() == 1000);
+
+    for (int i = 0; i < 1000; i += 2) {
+      ASSERT(table.erase<0>(i * 16L) == 1);
+    }
+    ASSERT(table.size() == 500);
+
+    for (int i = 0; i < 1000; i++) {
+      const MyTable::Row* row = table.find<0>(i * 16L);
+      if (i % 2 == 0) {
+        ASSERT(row == NULL);
+      } else {
+        ASSERT(row != NULL);
+        ASSERT(row->cell<1>() == i % 10);
+      }
+    }
+
+    int count = 0;
+    for (MyTable::SearchIterator<1> iter(table, 3); iter.next();) {
+      ASSERT(iter.cell<0>() % 32 == 16);
+      ++count;
+    }
+    ASSERT(count == 100);
+  }
+}
+
+// Not a correctness test, but having it here keeps it building.  Compares the index types on
+// the operation mix the Driver performs:  many adds, lookups of small groups, and erasure of
+// groups by a second column.
+template <typename ColumnType>
+void benchmarkTable(const char* name) {
+  typedef Table<ColumnType, ColumnType> MyTable;
+  static const long ROWS = 1000000;
+  static const long GROUP = 4;
+
+  double start = monotonicSeconds();
+  MyTable table;
+  for (long i = 0; i < ROWS; i++) {
+    // Column 0 is like DependencyTable::ACTION (a few rows per key) and column 1 like
+    // DependencyTable::TAG (keys spread across everything).
+    table.add((i / GROUP) * 64, (i * 7919) % (ROWS / 2));
+  }
+  double added = monotonicSeconds();
+
+  // Search in scattered order, as the Driver does with pointer keys.
+  long found = 0;
+  for (long i = 0; i < ROWS / GROUP; i++) {
+    long key = (i * 7919) % (ROWS / GROUP) * 64;
+    for (typename MyTable::template SearchIterator<0> iter(table, key); iter.next();) {
+      found += iter.template cell<1>() >= 0;
+    }
+  }
+  ASSERT(found == ROWS);
+  double searched = monotonicSeconds();
+
+  long erased = 0;
+  for (long i = 0; i < ROWS / 2; i += 2) {
+    erased += table.template erase<1>(i);
+  }
+  double erasedTime = monotonicSeconds();
+  ASSERT(table.size() == ROWS - erased);
+
+  fprintf(stdout, "%s: add %.3fs, search %.3fs, erase %.3fs\n", name,
+          added - start, searched - added, erasedTime - searched);
+}
+
 }  // namespace
 }  // namespace ekam
 
 int main(int argc, char* argv[]) {
   ekam::testTable();
+  ekam::testFlatTable();
+  ekam::benchmarkTable<ekam::IndexedColumn<long> >("IndexedColumn");
+  ekam::benchmarkTable<ekam::FlatIndexedColumn<long> >("FlatIndexedColumn");
   return 0;
 }
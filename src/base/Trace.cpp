@@ -0,0 +1,232 @@
+// Ekam Build System
+// Author: Kenton Varda (kenton@sandstorm.io)
+// Copyright (c) 2010-2015 Kenton Varda, Google Inc., and contributors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "Trace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <thread>
+#include <vector>
+
+namespace ekam {
+
+static_assert(sizeof(Trace::Record) == 128, "Trace records should be two cache lines.");
+
+thread_local Trace::Buffer* Trace::threadBuffer = nullptr;
+
+namespace {
+
+std::atomic<Trace::Buffer*> allBuffers(nullptr);
+std::atomic<uint32_t> threadCount(0);
+
+// Hands the thread's buffer back for reuse when the thread exits.  The events stay in it until
+// they are overwritten.
+struct BufferReleaser {
+  Trace::Buffer* buffer = nullptr;
+  ~BufferReleaser() {
+    if (buffer != nullptr) {
+      buffer->inUse.store(false, std::memory_order_release);
+    }
+  }
+};
+thread_local BufferReleaser bufferReleaser;
+
+void formatEvent(std::string* out, const Trace::Event& event) {
+  int arg = 0;
+  size_t pos = 0;
+  char buffer[32];
+
+  for (const char* p = event.format->format; *p != '\0'; p++) {
+    if (*p != '%') {
+      out->push_back(*p);
+      continue;
+    }
+    ++p;
+    if (*p == '%') {
+      out->push_back('%');
+      continue;
+    } else if (*p == '\0') {
+      break;
+    }
+
+    if (arg >= event.argCount) {
+      out->push_back('?');
+      continue;
+    }
+
+    Trace::ArgType type = event.types[arg++];
+    if (type == Trace::STRING) {
+      size_t size = static_cast<unsigned char>(event.data[pos++]);
+      out->append(event.data + pos, size);
+      pos += size;
+    } else {
+      uint64_t value;
+      memcpy(&value, event.data + pos, sizeof(value));
+      pos += sizeof(value);
+      if (type == Trace::POINTER) {
+        snprintf(buffer, sizeof(buffer), "%p", reinterpret_cast<void*>(value));
+      } else if (*p == 'x') {
+        snprintf(buffer, sizeof(buffer), "%llx", static_cast<unsigned long long>(value));
+      } else if (type == Trace::SIGNED) {
+        snprintf(buffer, sizeof(buffer), "%lld", static_cast<long long>(value));
+      } else {
+        snprintf(buffer, sizeof(buffer), "%llu", static_cast<unsigned long long>(value));
+      }
+      out->append(buffer);
+    }
+  }
+}
+
+int dumpPipe[2] = { -1, -1 };
+
+void handleDumpSignal(int) {
+  int savedErrno = errno;
+  char byte = 0;
+  if (write(dumpPipe[1], &byte, 1) < 0) {
+    // Nothing to be done in a signal handler.
+  }
+  errno = savedErrno;
+}
+
+void dumpLoop(std::string path) {
+  while (true) {
+    char byte;
+    ssize_t n = read(dumpPipe[0], &byte, 1);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return;
+
+    std::string text = Trace::dump();
+    FILE* file = fopen(path.c_str(), "we");
+    if (file == nullptr) {
+      DEBUG_ERROR << "Writing trace dump to " << path << " failed: " << strerror(errno);
+      continue;
+    }
+    fwrite(text.data(), 1, text.size(), file);
+    fclose(file);
+  }
+}
+
+}  // namespace
+
+Trace::Buffer* Trace::attachThread() {
+  Buffer* buffer = nullptr;
+
+  // Reuse the buffer of a thread which has exited, if any.
+  for (Buffer* b = allBuffers.load(std::memory_order_acquire); b != nullptr; b = b->next) {
+    bool expected = false;
+    if (b->inUse.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+      buffer = b;
+      break;
+    }
+  }
+
+  if (buffer == nullptr) {
+    buffer = new Buffer();
+    buffer->inUse.store(true, std::memory_order_relaxed);
+    buffer->next = allBuffers.load(std::memory_order_relaxed);
+    while (!allBuffers.compare_exchange_weak(buffer->next, buffer, std::memory_order_release)) {}
+  }
+
+  buffer->thread = threadCount.fetch_add(1, std::memory_order_relaxed);
+  threadBuffer = buffer;
+  bufferReleaser.buffer = buffer;
+  return buffer;
+}
+
+std::string Trace::dump() {
+  std::vector<Event> events;
+
+  for (Buffer* b = allBuffers.load(std::memory_order_acquire); b != nullptr; b = b->next) {
+    uint64_t head = b->head.load(std::memory_order_acquire);
+    uint64_t i = head > RECORD_COUNT ? head - RECORD_COUNT : 0;
+    for (; i < head; i++) {
+      Record& record = b->records[i % RECORD_COUNT];
+      uint64_t sequence = record.sequence.load(std::memory_order_acquire);
+      if (sequence != i + 1) continue;
+
+      // The owning thread may be overwriting the record as we copy it, in which case the
+      // sequence number will have changed and the copy is dropped.
+      Event event;
+      memcpy(&event, &record.event, sizeof(event));
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (record.sequence.load(std::memory_order_relaxed) != sequence) continue;
+
+      events.push_back(event);
+    }
+  }
+
+  std::stable_sort(events.begin(), events.end(), [](const Event& a, const Event& b) {
+    return a.time < b.time;
+  });
+
+  // Times are shown in seconds before the dump.
+  uint64_t now = monotonicNanos();
+  std::string out;
+  char buffer[64];
+  for (size_t i = 0; i < events.size(); i++) {
+    const Event& event = events[i];
+    double age = now > event.time ? (now - event.time) / 1e9 : 0;
+    snprintf(buffer, sizeof(buffer), "%12.6f t%-3u ", -age, event.thread);
+    out.append(buffer);
+    out.append(event.format->file);
+    snprintf(buffer, sizeof(buffer), ":%d: ", event.format->line);
+    out.append(buffer);
+    formatEvent(&out, event);
+    out.push_back('\n');
+  }
+  return out;
+}
+
+void Trace::dumpOnSignal(int signalNumber, const std::string& path) {
+  if (dumpPipe[0] == -1) {
+    if (pipe2(dumpPipe, O_CLOEXEC) < 0) {
+      DEBUG_ERROR << "pipe2: " << strerror(errno);
+      return;
+    }
+
+    // The thread mustn't take signals meant for others, e.g. the SIGCHLD which EventManagers
+    // block and read from a signalfd.
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    std::thread(dumpLoop, path).detach();
+    pthread_sigmask(SIG_SETMASK, &old, nullptr);
+  }
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = &handleDumpSignal;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  sigaction(signalNumber, &action, nullptr);
+}
+
+void Trace::echoLast() {
+  Buffer* buffer = currentBuffer();
+  uint64_t head = buffer->head.load(std::memory_order_relaxed);
+  if (head == 0) return;
+
+  const Event& event = buffer->records[(head - 1) % RECORD_COUNT].event;
+  std::string text;
+  formatEvent(&text, event);
+  DebugMessage(DebugMessage::INFO, event.format->file, event.format->line) << text;
+}
+
+}  // namespace ekam
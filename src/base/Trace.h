@@ -0,0 +1,211 @@
+// Ekam Build System
+// Author: Kenton Varda (kenton@sandstorm.io)
+// Copyright (c) 2010-2015 Kenton Varda, Google Inc., and contributors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef KENTONSCODE_BASE_TRACE_H_
+#define KENTONSCODE_BASE_TRACE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <type_traits>
+
+#include "Clock.h"
+#include "Debug.h"
+
+namespace ekam {
+
+// An event log for the hottest code paths, cheap enough to leave on all the time.  Formatting
+// and writing each message as DEBUG_INFO does would slow the build down several times over.
+//
+//   TRACE("exec: %s", command);
+//
+// Each thread records events into its own ring buffer of fixed-size slots, without locking and
+// without formatting:  a slot holds a pointer to the call site's format (a constant), a
+// timestamp, and the raw arguments.  Only when the buffers are dumped (see Trace::dump()) are
+// the most recent events of all threads formatted and merged in time order.
+//
+// Arguments may be integers, pointers, or strings (truncated to fit in the slot).  Each `%`
+// conversion in the format is replaced by the next argument, formatted according to its type,
+// except that `%x` prints an integer in hex.  With -v, events are also logged as DEBUG_INFO
+// would as they are recorded.
+struct TraceFormat {
+  const char* file;
+  int line;
+  const char* format;
+};
+
+class Trace {
+public:
+  enum ArgType : uint8_t {
+    SIGNED,
+    UNSIGNED,
+    POINTER,
+    STRING
+  };
+
+  static const int MAX_ARGS = 7;
+  static const size_t DATA_SIZE = 92;
+  static const size_t RECORD_COUNT = 2048;
+
+  struct Event {
+    const TraceFormat* format;
+    uint64_t time;  // CLOCK_MONOTONIC nanoseconds
+    uint32_t thread;
+    uint8_t argCount;
+    ArgType types[MAX_ARGS];
+    // Integers and pointers take 8 bytes; strings take a length byte and then their content.
+    char data[DATA_SIZE];
+  };
+
+  struct Record {
+    // 0 while the event is being written, and then the record's index in the buffer plus one.
+    // A reader on another thread keeps the event only if this is the same before and after
+    // copying it.
+    std::atomic<uint64_t> sequence;
+    Event event;
+  };
+
+  struct Buffer {
+    Buffer* next;  // in the list of all buffers, which never shrinks
+    std::atomic<bool> inUse;
+    uint32_t thread;
+    std::atomic<uint64_t> head;  // index of the next record to write
+    Record records[RECORD_COUNT];
+  };
+
+  // Returns the calling thread's buffer.
+  static Buffer* currentBuffer() {
+    Buffer* result = threadBuffer;
+    return result == nullptr ? attachThread() : result;
+  }
+
+  // Formats the recent events of all threads, oldest first, one per line.  May be called from
+  // any thread while others are tracing.
+  static std::string dump();
+
+  // Whenever the process receives the given signal, dumps to the file at `path` (from a
+  // background thread, so this works even if the thread which would otherwise do it is stuck).
+  static void dumpOnSignal(int signalNumber, const std::string& path);
+
+  // Logs the calling thread's last event as DEBUG_INFO.
+  static void echoLast();
+
+private:
+  static thread_local Buffer* threadBuffer;
+
+  static Buffer* attachThread();
+};
+
+// Writes one event into the calling thread's buffer; published when destroyed.
+class TraceWriter {
+public:
+  explicit TraceWriter(const TraceFormat* format)
+      : buffer(Trace::currentBuffer()),
+        index(buffer->head.load(std::memory_order_relaxed)),
+        record(&buffer->records[index % Trace::RECORD_COUNT]),
+        pos(0) {
+    record->sequence.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    Trace::Event& event = record->event;
+    event.format = format;
+    event.time = monotonicNanos();
+    event.thread = buffer->thread;
+    event.argCount = 0;
+  }
+  ~TraceWriter() {
+    record->sequence.store(index + 1, std::memory_order_release);
+    buffer->head.store(index + 1, std::memory_order_release);
+  }
+
+  void addWord(Trace::ArgType type, uint64_t value) {
+    if (begin(type, sizeof(value))) {
+      memcpy(record->event.data + pos, &value, sizeof(value));
+      pos += sizeof(value);
+    }
+  }
+
+  void addString(const char* data, size_t size) {
+    if (begin(Trace::STRING, 1)) {
+      size = std::min<size_t>(std::min<size_t>(size, Trace::DATA_SIZE - pos - 1), 255);
+      record->event.data[pos++] = static_cast<char>(size);
+      memcpy(record->event.data + pos, data, size);
+      pos += size;
+    }
+  }
+
+private:
+  Trace::Buffer* buffer;
+  uint64_t index;
+  Trace::Record* record;
+  size_t pos;
+
+  // Arguments that don't fit are dropped.
+  bool begin(Trace::ArgType type, size_t minSize) {
+    Trace::Event& event = record->event;
+    if (event.argCount == Trace::MAX_ARGS || pos + minSize > Trace::DATA_SIZE) {
+      return false;
+    }
+    event.types[event.argCount++] = type;
+    return true;
+  }
+};
+
+template <typename T>
+inline typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value>::type
+    addTraceArg(TraceWriter* writer, T value) {
+  writer->addWord(std::is_signed<T>::value ? Trace::SIGNED : Trace::UNSIGNED,
+                  static_cast<uint64_t>(value));
+}
+template <typename T>
+inline void addTraceArg(TraceWriter* writer, T* value) {
+  writer->addWord(Trace::POINTER, reinterpret_cast<uintptr_t>(value));
+}
+inline void addTraceArg(TraceWriter* writer, const char* value) {
+  writer->addString(value, strlen(value));
+}
+inline void addTraceArg(TraceWriter* writer, char* value) {
+  writer->addString(value, strlen(value));
+}
+inline void addTraceArg(TraceWriter* writer, const std::string& value) {
+  writer->addString(value.data(), value.size());
+}
+
+template <typename... Args>
+inline void trace(const TraceFormat* format, const Args&... args) {
+  {
+    TraceWriter writer(format);
+    int unused[] = { 0, (addTraceArg(&writer, args), 0)... };
+    (void)unused;
+  }
+  if (DebugMessage::shouldLog(DebugMessage::INFO, format->file, format->line)) {
+    Trace::echoLast();
+  }
+}
+
+#define TRACE(FORMAT, ...)                                                                     \
+  do {                                                                                         \
+    static constexpr ::ekam::TraceFormat EKAM_TRACE_FORMAT = { __FILE__, __LINE__, FORMAT };   \
+    ::ekam::trace(&EKAM_TRACE_FORMAT, ##__VA_ARGS__);                                          \
+  } while (false)
+
+}  // namespace ekam
+
+#endif  // KENTONSCODE_BASE_TRACE_H_
@@ -89,6 +89,15 @@ __FBSDID("$FreeBSD: src/lib/libmd/sha256c.c,v 1.2.10.1 2009/08/03 08:13:06 kensm
 
 #include <string.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_SHA2)
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
 #include "sha256.h"
 
 namespace ekam {
@@ -163,7 +172,7 @@ be32dec_vect(uint32_t *dst, const unsigned char *src, size_t len)
  * the 512-bit input block to produce a new state.
  */
 static void
-SHA256_Transform(uint32_t * state, const unsigned char block[64])
+SHA256_TransformPortable(uint32_t * state, const unsigned char block[64])
 {
 	uint32_t W[64];
 	uint32_t S[8];
@@ -249,6 +258,206 @@ SHA256_Transform(uint32_t * state, const unsigned char block[64])
 		state[i] += S[i];
 }
 
+static void
+SHA256_BlocksPortable(uint32_t * state, const unsigned char * data, size_t blocks)
+{
+
+	for (; blocks > 0; blocks--, data += 64)
+		SHA256_TransformPortable(state, data);
+}
+
+/*
+ * Hardware-accelerated block functions.  These are compiled only when the
+ * compiler can target the instructions, and used only if the CPU reports
+ * support for them at runtime.
+ */
+
+#if defined(__x86_64__) || defined(__i386__) || \
+    (defined(__aarch64__) && defined(__ARM_FEATURE_SHA2))
+
+static const uint32_t K[64] __attribute__((aligned(16))) = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+
+/* Intel SHA extensions. */
+__attribute__((target("sha,sse4.1")))
+static void
+SHA256_BlocksHardware(uint32_t * state, const unsigned char * data, size_t blocks)
+{
+	const __m128i MASK =
+	    _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+	__m128i STATE0, STATE1, ABEF_SAVE, CDGH_SAVE, MSG, TMP;
+	__m128i M[4];
+	int g;
+
+	/* The instructions want the state as ABEF and CDGH. */
+	TMP = _mm_loadu_si128((const __m128i *)&state[0]);
+	STATE1 = _mm_loadu_si128((const __m128i *)&state[4]);
+	TMP = _mm_shuffle_epi32(TMP, 0xB1);
+	STATE1 = _mm_shuffle_epi32(STATE1, 0x1B);
+	STATE0 = _mm_alignr_epi8(TMP, STATE1, 8);
+	STATE1 = _mm_blend_epi16(STATE1, TMP, 0xF0);
+
+	for (; blocks > 0; blocks--, data += 64) {
+		ABEF_SAVE = STATE0;
+		CDGH_SAVE = STATE1;
+
+		for (g = 0; g < 4; g++)
+			M[g] = _mm_shuffle_epi8(_mm_loadu_si128(
+			    (const __m128i *)(data + g * 16)), MASK);
+
+		/* Four rounds per group, expanding the schedule as we go. */
+#pragma GCC unroll 16
+		for (g = 0; g < 16; g++) {
+			MSG = _mm_add_epi32(M[g % 4],
+			    _mm_load_si128((const __m128i *)&K[g * 4]));
+			STATE1 = _mm_sha256rnds2_epu32(STATE1, STATE0, MSG);
+			if (g >= 3 && g <= 14) {
+				TMP = _mm_alignr_epi8(M[g % 4], M[(g + 3) % 4], 4);
+				M[(g + 1) % 4] = _mm_add_epi32(M[(g + 1) % 4], TMP);
+				M[(g + 1) % 4] =
+				    _mm_sha256msg2_epu32(M[(g + 1) % 4], M[g % 4]);
+			}
+			MSG = _mm_shuffle_epi32(MSG, 0x0E);
+			STATE0 = _mm_sha256rnds2_epu32(STATE0, STATE1, MSG);
+			if (g >= 1 && g <= 12)
+				M[(g + 3) % 4] =
+				    _mm_sha256msg1_epu32(M[(g + 3) % 4], M[g % 4]);
+		}
+
+		STATE0 = _mm_add_epi32(STATE0, ABEF_SAVE);
+		STATE1 = _mm_add_epi32(STATE1, CDGH_SAVE);
+	}
+
+	TMP = _mm_shuffle_epi32(STATE0, 0x1B);
+	STATE1 = _mm_shuffle_epi32(STATE1, 0xB1);
+	STATE0 = _mm_blend_epi16(TMP, STATE1, 0xF0);
+	STATE1 = _mm_alignr_epi8(STATE1, TMP, 8);
+	_mm_storeu_si128((__m128i *)&state[0], STATE0);
+	_mm_storeu_si128((__m128i *)&state[4], STATE1);
+}
+
+static int
+SHA256_HardwareDetect(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) ||
+	    !(ecx & bit_SSSE3) || !(ecx & bit_SSE4_1))
+		return 0;
+	if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+		return 0;
+	return (ebx & bit_SHA) != 0;
+}
+
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_SHA2)
+
+/* ARMv8 cryptography extensions. */
+static void
+SHA256_BlocksHardware(uint32_t * state, const unsigned char * data, size_t blocks)
+{
+	uint32x4_t STATE0, STATE1, ABCD_SAVE, EFGH_SAVE, MSG, TMP;
+	uint32x4_t M[4];
+	int g;
+
+	STATE0 = vld1q_u32(&state[0]);
+	STATE1 = vld1q_u32(&state[4]);
+
+	for (; blocks > 0; blocks--, data += 64) {
+		ABCD_SAVE = STATE0;
+		EFGH_SAVE = STATE1;
+
+		for (g = 0; g < 4; g++)
+			M[g] = vreinterpretq_u32_u8(vrev32q_u8(
+			    vld1q_u8(data + g * 16)));
+
+#pragma GCC unroll 16
+		for (g = 0; g < 16; g++) {
+			MSG = vaddq_u32(M[g % 4], vld1q_u32(&K[g * 4]));
+			if (g < 12)
+				M[g % 4] = vsha256su1q_u32(
+				    vsha256su0q_u32(M[g % 4], M[(g + 1) % 4]),
+				    M[(g + 2) % 4], M[(g + 3) % 4]);
+			TMP = STATE0;
+			STATE0 = vsha256hq_u32(STATE0, STATE1, MSG);
+			STATE1 = vsha256h2q_u32(STATE1, TMP, MSG);
+		}
+
+		STATE0 = vaddq_u32(STATE0, ABCD_SAVE);
+		STATE1 = vaddq_u32(STATE1, EFGH_SAVE);
+	}
+
+	vst1q_u32(&state[0], STATE0);
+	vst1q_u32(&state[4], STATE1);
+}
+
+static int
+SHA256_HardwareDetect(void)
+{
+
+	return (getauxval(AT_HWCAP) & HWCAP_SHA2) != 0;
+}
+
+#else
+
+#define SHA256_BlocksHardware SHA256_BlocksPortable
+
+static int
+SHA256_HardwareDetect(void)
+{
+
+	return 0;
+}
+
+#endif
+
+typedef void SHA256_BlocksFunc(uint32_t *, const unsigned char *, size_t);
+
+/* Chosen on first use, so that static initializers may hash. */
+static SHA256_BlocksFunc *&
+SHA256_Blocks(void)
+{
+	static SHA256_BlocksFunc *impl = SHA256_HardwareDetect() ?
+	    SHA256_BlocksHardware : SHA256_BlocksPortable;
+
+	return impl;
+}
+
+int
+SHA256_HardwareSupported(void)
+{
+	static const int supported = SHA256_HardwareDetect();
+
+	return supported;
+}
+
+void
+SHA256_UseHardware(int enable)
+{
+
+	SHA256_Blocks() = (enable && SHA256_HardwareSupported()) ?
+	    SHA256_BlocksHardware : SHA256_BlocksPortable;
+}
+
 static unsigned char PAD[64] = {
 	0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
 	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
@@ -325,15 +534,15 @@ SHA256_Update(SHA256_CTX * ctx, const void *in, size_t len)
 
 	/* Finish the current block */
 	memcpy(&ctx->buf[r], src, 64 - r);
-	SHA256_Transform(ctx->state, ctx->buf);
+	SHA256_Blocks()(ctx->state, ctx->buf, 1);
 	src += 64 - r;
 	len -= 64 - r;
 
 	/* Perform complete blocks */
-	while (len >= 64) {
-		SHA256_Transform(ctx->state, src);
-		src += 64;
-		len -= 64;
+	if (len >= 64) {
+		SHA256_Blocks()(ctx->state, src, len / 64);
+		src += len & ~(size_t)63;
+		len &= 63;
 	}
 
 	/* Copy left over data into buffer */
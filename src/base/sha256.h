@@ -34,6 +34,7 @@
 #define _SHA256_H_
 
 #include <sys/types.h>
+#include <stdint.h>
 
 namespace ekam {
 
@@ -51,6 +52,14 @@ char   *SHA256_File(const char *, char *);
 char   *SHA256_FileChunk(const char *, char *, off_t, off_t);
 char   *SHA256_Data(const void *, unsigned int, char *);
 
+/*
+ * Updates use the CPU's SHA-256 instructions (Intel SHA extensions or ARMv8
+ * crypto) when available.  SHA256_UseHardware(0) forces the portable code,
+ * e.g. for benchmarking.  Not thread-safe.
+ */
+int	SHA256_HardwareSupported(void);
+void	SHA256_UseHardware(int);
+
 }  // namespace ekam
 
 #endif /* !_SHA256_H_ */
@@ -0,0 +1,120 @@
+// Ekam Build System
+// Author: Kenton Varda (kenton@sandstorm.io)
+// Copyright (c) 2010-2015 Kenton Varda, Google Inc., and contributors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "sha256.h"
+#include "Clock.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+namespace ekam {
+namespace {
+
+#define ASSERT(EXPRESSION)                                                    \
+  if (!(EXPRESSION)) {                                                        \
+    fprintf(stderr, "%s:%d: FAILED: %s\n", __FILE__, __LINE__, #EXPRESSION);  \
+    exit(1);                                                                  \
+  }
+
+std::string hexDigest(const void* data, size_t size, size_t chunkSize) {
+  SHA256_CTX context;
+  SHA256_Init(&context);
+  const unsigned char* pos = reinterpret_cast<const unsigned char*>(data);
+  while (size > 0) {
+    size_t n = size < chunkSize ? size : chunkSize;
+    SHA256_Update(&context, pos, n);
+    pos += n;
+    size -= n;
+  }
+
+  unsigned char digest[32];
+  SHA256_Final(digest, &context);
+  char hex[65];
+  for (int i = 0; i < 32; i++) {
+    sprintf(hex + i * 2, "%02x", digest[i]);
+  }
+  return hex;
+}
+
+void testVectors(bool hardware) {
+  SHA256_UseHardware(hardware);
+
+  ASSERT(hexDigest("", 0, 64) ==
+         "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+  ASSERT(hexDigest("abc", 3, 64) ==
+         "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+
+  const char* twoBlocks = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+  ASSERT(hexDigest(twoBlocks, strlen(twoBlocks), 64) ==
+         "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1");
+
+  std::string million(1000000, 'a');
+  ASSERT(hexDigest(million.data(), million.size(), 1000000) ==
+         "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0");
+  ASSERT(hexDigest(million.data(), million.size(), 777) ==
+         "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0");
+}
+
+void testHardwareMatchesPortable() {
+  if (!SHA256_HardwareSupported()) {
+    printf("sha256: no hardware support; skipping comparison\n");
+    return;
+  }
+
+  std::vector<unsigned char> data(10000);
+  srand(1234);
+  for (size_t i = 0; i < data.size(); i++) {
+    data[i] = rand();
+  }
+
+  for (size_t size = 0; size < data.size(); size += 97) {
+    for (size_t chunkSize = 1; chunkSize < 300; chunkSize = chunkSize * 3 + 1) {
+      SHA256_UseHardware(false);
+      std::string expected = hexDigest(&data[0], size, chunkSize);
+      SHA256_UseHardware(true);
+      ASSERT(hexDigest(&data[0], size, chunkSize) == expected);
+    }
+  }
+}
+
+void benchmark(bool hardware, const char* name) {
+  static const size_t SIZE = 64 << 20;
+  std::vector<unsigned char> data(SIZE, 'x');
+
+  SHA256_UseHardware(hardware);
+  double start = monotonicSeconds();
+  hexDigest(&data[0], data.size(), 65536);
+  double time = monotonicSeconds() - start;
+
+  printf("sha256 %-8s: %7.1f MB/s\n", name, SIZE / time / (1 << 20));
+}
+
+}  // namespace
+}  // namespace ekam
+
+int main(int argc, char* argv[]) {
+  ekam::testVectors(false);
+  ekam::testVectors(true);
+  ekam::testHardwareMatchesPortable();
+  ekam::benchmark(false, "portable");
+  if (ekam::SHA256_HardwareSupported()) {
+    ekam::benchmark(true, "hardware");
+  }
+  ekam::SHA256_UseHardware(true);
+  return 0;
+}
@@ -16,12 +16,39 @@
 
 #include "Action.h"
 
+#include <fcntl.h>
+
+#include "os/ByteStream.h"
+
 namespace ekam {
 
 BuildContext::~BuildContext() noexcept(false) {}
 Action::~Action() {}
+
+Hash Action::ekamIdentity() {
+  static const Hash result = []() {
+    Hash::Builder hasher;
+    try {
+      ByteStream exe("/proc/self/exe", O_RDONLY);
+      char buffer[65536];
+      size_t n;
+      while ((n = exe.read(buffer, sizeof(buffer))) > 0) {
+        hasher.add(buffer, n);
+      }
+    } catch (const std::exception&) {
+      // Can't identify ourselves, so cached results of built-in actions can't be told apart
+      // across Ekam versions.  Not worth failing over.
+    }
+    return hasher.build();
+  }();
+  return result;
+}
 ActionFactory::~ActionFactory() {}
 
+bool ActionFactory::tryTagInline(const Tag& id, File* file, std::vector<Tag>* tags) {
+  return false;
+}
+
 const int BuildContext::INSTALL_LOCATION_COUNT;
 const char* const BuildContext::INSTALL_LOCATION_NAMES[INSTALL_LOCATION_COUNT] = {
   "bin", "lib", "node_modules"
@@ -19,9 +19,11 @@
 
 #include <string>
 #include <vector>
+#include <stdint.h>
 #include <sys/types.h>
 
 #include "base/OwnedPtr.h"
+#include "base/Hash.h"
 #include "os/File.h"
 #include "Tag.h"
 #include "os/EventManager.h"
@@ -45,6 +47,10 @@ public:
   virtual File* findProvider(Tag id) = 0;
   virtual File* findInput(const std::string& path) = 0;
 
+  // Finds the providers of "canonical:<dir>/<name>" for each directory <dir> containing the
+  // given file, outermost first.  Records dependencies just as findProvider() would.
+  virtual std::vector<File*> findModifiers(File* file, const std::string& name) = 0;
+
   enum InstallLocation {
     BIN,
     LIB,
@@ -62,6 +68,26 @@ public:
 
   virtual void addActionType(OwnedPtr<ActionFactory> factory) = 0;
 
+  // How long a previous run of an action with this action's verb, triggered by the given file,
+  // took, in seconds.  Negative if unknown.
+  virtual double getHistoricalDuration(const std::string& canonicalName) = 0;
+
+  // Record the given duration for this run in place of the measured one.  Useful for actions
+  // which hand their work off to other actions, such as a sharded test.
+  virtual void recordDuration(double seconds) = 0;
+
+  // CPU seconds which each process the action starts may use before being killed, or zero for
+  // no limit.  Pass it to Subprocess::setCpuTimeLimit().
+  virtual double getCpuTimeLimit() = 0;
+
+  // Don't remember this run's results in the action cache, so that the action will actually
+  // run again next time.  For flaky or non-hermetic tests.
+  virtual void uncacheable() = 0;
+
+  // If the Driver placed the action on a remote worker (see Resources::remotable), the command
+  // to prefix the command line of each process it starts with.  Otherwise empty.
+  virtual std::string getRemoteLauncher() = 0;
+
   virtual void passed() = 0;
   virtual void failed() = 0;
 };
@@ -70,8 +96,32 @@ class Action {
 public:
   virtual ~Action();
 
+  // Resources the action is expected to consume while running.  The Driver will not start an
+  // action unless enough are available (except when nothing else is running).
+  struct Resources {
+    double cpus;      // Counted against the limit on concurrent actions (-j).
+    uint64_t memory;  // Bytes; zero if negligible.
+
+    // The action only starts self-contained processes, which don't talk to the interceptor, so
+    // it may run them on a remote worker when local CPUs are busy.
+    bool remotable;
+
+    Resources(): cpus(1), memory(0), remotable(false) {}
+  };
+
   virtual bool isSilent() { return false; }
+  virtual Resources getResources() { return Resources(); }
   virtual std::string getVerb() = 0;
+
+  // Identifies whatever determines the action's results other than its trigger file and the
+  // inputs it looks up -- e.g. the script implementing it.  Part of the action's cache key, so a
+  // change invalidates cached results.  The default identifies the Ekam binary, which implements
+  // built-in actions.
+  virtual Hash getIdentity() { return ekamIdentity(); }
+
+  // Hash of the running Ekam binary.
+  static Hash ekamIdentity();
+
   virtual Promise<void> start(EventManager* eventManager, BuildContext* context) = 0;
 };
 
@@ -81,6 +131,11 @@ public:
 
   virtual void enumerateTriggerTags(std::back_insert_iterator<std::vector<Tag> > iter) = 0;
   virtual OwnedPtr<Action> tryMakeAction(const Tag& id, File* file) = 0;
+
+  // For triggers whose only effect would be to tag the file with tags computed from its name:
+  // adds those tags to *tags and returns true, in which case the Driver applies them to the
+  // triggering file immediately and does not call tryMakeAction().  The default returns false.
+  virtual bool tryTagInline(const Tag& id, File* file, std::vector<Tag>* tags);
 };
 
 }  // namespace ekam
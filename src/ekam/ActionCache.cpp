@@ -0,0 +1,410 @@
+// Ekam Build System
+// Author: Kenton Varda (kenton@sandstorm.io)
+// Copyright (c) 2010-2015 Kenton Varda, Google Inc., and contributors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "ActionCache.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+
+#include "base/Debug.h"
+#include "os/DiskFile.h"
+#include "os/TextFile.h"
+
+extern char** environ;
+
+namespace ekam {
+
+// The log is a sequence of records of the form:
+//
+//   action <key> <srcHash> passed|done
+//   dep <tag> <contentHash>|-
+//   output <contentHash> <path>
+//   tag <tag>                        (applies to the preceding output)
+//   install <location> <name>        (applies to the preceding output)
+//   end
+//
+// or:
+//
+//   forget <key>
+//
+// Records which are not terminated by "end" (e.g. because Ekam was killed mid-write) are
+// ignored.
+
+namespace {
+
+// Environment variables which affect how built-in actions and the standard rules build things.
+// Only these go into cache keys; the rest of the environment -- locale, terminal, CI job IDs and
+// the like -- differs between terminals and machines without changing any output.  Variables
+// that only matter to one rule are declared by that rule instead (see the "environment" plugin
+// command), and become part of its identity.
+const char* const BUILD_VARIABLES[] = {
+  "CC", "CFLAGS", "CROSS_TARGETS", "CXX", "CXXFLAGS", "LDFLAGS", "LIBS", "LINKFLAGS", "NM",
+  "NMFLAGS", "PATH",
+};
+// Cross-compiling looks up e.g. CXXFLAGS_aarch64_linux_gnu before falling back to CXXFLAGS.
+const char* const BUILD_VARIABLE_PREFIXES[] = {
+  "CC_", "CFLAGS_", "CXX_", "CXXFLAGS_", "LDFLAGS_", "LIBS_", "LINKFLAGS_",
+};
+
+bool isBuildVariable(const char* entry) {
+  const char* eq = strchr(entry, '=');
+  std::string name(entry, eq == nullptr ? strlen(entry) : eq - entry);
+  for (const char* variable : BUILD_VARIABLES) {
+    if (name == variable) return true;
+  }
+  for (const char* prefix : BUILD_VARIABLE_PREFIXES) {
+    if (name.compare(0, strlen(prefix), prefix) == 0) return true;
+  }
+  return false;
+}
+
+// Returns the path of the program the shell would run for the given command name, or the empty
+// string if there is none.
+std::string findTool(const std::string& name) {
+  std::vector<std::string> candidates;
+  if (name.find('/') != std::string::npos) {
+    candidates.push_back(name);
+  } else {
+    const char* path = getenv("PATH");
+    std::string dirs = path == nullptr ? "/usr/bin:/bin" : path;
+    std::string::size_type pos = 0;
+    while (pos <= dirs.size()) {
+      std::string::size_type end = std::min(dirs.find(':', pos), dirs.size());
+      std::string dir(dirs, pos, end - pos);
+      candidates.push_back((dir.empty() ? "." : dir) + "/" + name);
+      pos = end + 1;
+    }
+  }
+
+  for (const std::string& candidate : candidates) {
+    struct stat stats;
+    if (access(candidate.c_str(), X_OK) == 0 && stat(candidate.c_str(), &stats) == 0 &&
+        S_ISREG(stats.st_mode)) {
+      char* real = realpath(candidate.c_str(), nullptr);
+      std::string result = real == nullptr ? candidate : real;
+      free(real);
+      return result;
+    }
+  }
+  return std::string();
+}
+
+// Describes the given program by path, size and modification time.  Like ccache, we trust the
+// file's metadata rather than hashing what might be a hundred-megabyte binary on every startup.
+std::string describeTool(const std::string& path) {
+  struct stat stats;
+  if (path.empty() || stat(path.c_str(), &stats) != 0) {
+    return "missing";
+  }
+  return path + " " + std::to_string(stats.st_size) + " " + std::to_string(stats.st_mtime);
+}
+
+// Returns the first word of the given variable, or the default if it is unset or empty.  Enough
+// for the usual "ccache g++" style of compiler setting to find the program that runs first.
+std::string commandNamed(const char* variable, const char* defaultValue) {
+  const char* value = getenv(variable);
+  std::string result = value == nullptr ? "" : value;
+  std::string::size_type start = result.find_first_not_of(' ');
+  if (start == std::string::npos) {
+    return defaultValue;
+  }
+  return result.substr(start, result.find(' ', start) - start);
+}
+
+// Returns true if the path is relative and has no empty, "." or ".." components, so that it can
+// only name something inside the directory it is relative to.
+bool isCanonicalRelativePath(const std::string& path) {
+  if (path.empty() || path[0] == '/') {
+    return false;
+  }
+  std::string::size_type pos = 0;
+  while (pos <= path.size()) {
+    std::string::size_type end = std::min(path.find('/', pos), path.size());
+    std::string::size_type length = end - pos;
+    if (length == 0 || (length == 1 && path[pos] == '.') ||
+        (length == 2 && path[pos] == '.' && path[pos + 1] == '.')) {
+      return false;
+    }
+    pos = end + 1;
+  }
+  return true;
+}
+
+}  // namespace
+
+ActionCache::ActionCache(File* file, ArtifactStore* remote)
+    : file(file->clone()), remote(remote), environmentHash(hashEnvironment()) {
+  if (remote != nullptr) {
+    toolchainHash = hashToolchain();
+  }
+
+  if (this->file->exists()) {
+    parse(this->file->readAll(), &entries);
+  }
+
+  // Compact the log by rewriting it with only the live entries.
+  std::string content;
+  for (EntryMap::Iterator iter(entries); iter.next();) {
+    write(iter.key(), iter.value(), &content);
+  }
+  writeBestEffort(this->file.get(), content, "action cache");
+
+  OwnedPtr<File::DiskRef> diskRef = this->file->getOnDisk(File::UPDATE);
+  log = newOwned<ByteStream>(diskRef->path(), O_WRONLY | O_APPEND | O_CREAT);
+}
+
+ActionCache::~ActionCache() {}
+
+Hash ActionCache::hashEnvironment() {
+  // Sorted, so that the order in which variables were set doesn't matter.
+  std::vector<std::string> entries;
+  for (char** entry = environ; *entry != nullptr; ++entry) {
+    if (isBuildVariable(*entry)) {
+      entries.push_back(*entry);
+    }
+  }
+  std::sort(entries.begin(), entries.end());
+
+  entries.push_back(describeTool(findTool(commandNamed("CXX", "c++"))));
+  entries.push_back(describeTool(findTool(commandNamed("CC", "cc"))));
+
+  Hash::Builder hasher;
+  for (const std::string& entry : entries) {
+    hasher.add(entry).add(std::string(1, '\0'));
+  }
+  return hasher.build();
+}
+
+Hash ActionCache::hashToolchain() {
+  // Matching metadata is good evidence that a compiler is unchanged on one machine, but not that
+  // two machines have the same one, so the shared store goes by content.
+  Hash::Builder hasher;
+  const char* const variables[][2] = { { "CXX", "c++" }, { "CC", "cc" } };
+  for (const auto& variable : variables) {
+    std::string path = findTool(commandNamed(variable[0], variable[1]));
+    if (path.empty()) {
+      hasher.add("missing");
+      continue;
+    }
+    try {
+      hasher.add(DiskFile(path, nullptr).contentHash().toString());
+    } catch (const std::exception& e) {
+      DEBUG_ERROR << "Can't read compiler to identify it: " << e.what();
+      hasher.add(describeTool(path));
+    }
+  }
+  return hasher.build();
+}
+
+Hash ActionCache::makeKey(const std::string& verb, const Hash& identity,
+                          const std::string& srcPath) {
+  return Hash::Builder().add(verb).add(std::string(1, '\0'))
+      .add(identity.toString()).add(environmentHash.toString())
+      .add(srcPath).build();
+}
+
+const ActionCache::Entry* ActionCache::find(const Hash& key) {
+  return entries.get(key);
+}
+
+void ActionCache::put(const Hash& key, OwnedPtr<Entry> entry) {
+  std::string text;
+  write(key, entry.get(), &text);
+  entries.add(key, entry.release());
+  append(text);
+}
+
+void ActionCache::erase(const Hash& key) {
+  if (entries.erase(key)) {
+    append("forget " + key.toString() + "\n");
+  }
+}
+
+Hash ActionCache::remoteKey(const Hash& key, const Hash& srcHash) {
+  return Hash::Builder().add(key.toString()).add(toolchainHash.toString())
+      .add(srcHash.toString()).build();
+}
+
+OwnedPtr<ActionCache::Entry> ActionCache::findRemote(const Hash& key, const Hash& srcHash) {
+  std::string record;
+  if (remote == nullptr || !remote->getRecord(remoteKey(key, srcHash), &record)) {
+    return nullptr;
+  }
+
+  EntryMap parsed;
+  parse(record, &parsed);
+  OwnedPtr<Entry> result;
+  if (!parsed.release(key, &result) || result->srcHash != srcHash) {
+    return nullptr;
+  }
+
+  // The store is shared, so don't trust it to only name files under tmp/.  Our own records
+  // never contain anything else.
+  for (const Output& output : result->outputs) {
+    if (!isCanonicalRelativePath(output.path)) {
+      DEBUG_ERROR << "Ignoring shared cache record with bad output path: " << output.path;
+      return nullptr;
+    }
+  }
+  for (const Installation& installation : result->installations) {
+    if (!isCanonicalRelativePath(installation.name)) {
+      DEBUG_ERROR << "Ignoring shared cache record with bad install name: " << installation.name;
+      return nullptr;
+    }
+  }
+  return result.release();
+}
+
+bool ActionCache::fetchRemote(const Hash& contentHash, File* output) {
+  return remote != nullptr && remote->getBlob(contentHash, output);
+}
+
+void ActionCache::publish(const Hash& key, const Entry& entry,
+                          const std::vector<File*>& outputFiles) {
+  if (remote == nullptr) {
+    return;
+  }
+
+  // Upload outputs before the record so that nobody sees a record whose outputs are missing.
+  for (size_t i = 0; i < entry.outputs.size(); i++) {
+    if (outputFiles[i] != nullptr && !remote->hasBlob(entry.outputs[i].contentHash)) {
+      remote->putBlob(entry.outputs[i].contentHash, outputFiles[i]);
+    }
+  }
+
+  std::string record;
+  write(key, &entry, &record);
+  remote->putRecord(remoteKey(key, entry.srcHash), record);
+}
+
+void ActionCache::append(const std::string& text) {
+  // Cache writes are best-effort.  Losing them only costs us a rebuild next time.
+  try {
+    log->writeAll(text.data(), text.size());
+  } catch (const std::exception& e) {
+    DEBUG_ERROR << "Writing action cache failed: " << e.what();
+  }
+}
+
+void ActionCache::write(const Hash& key, const Entry* entry, std::string* output) {
+  output->append("action ");
+  output->append(key.toString());
+  output->push_back(' ');
+  output->append(entry->srcHash.toString());
+  output->append(entry->passed ? " passed\n" : " done\n");
+
+  for (size_t i = 0; i < entry->dependencies.size(); i++) {
+    const Dependency& dep = entry->dependencies[i];
+    output->append("dep ");
+    output->append(dep.tag.toString());
+    output->append(dep.found ? " " + dep.contentHash.toString() + "\n" : " -\n");
+  }
+
+  for (size_t i = 0; i < entry->outputs.size(); i++) {
+    const Output& out = entry->outputs[i];
+    output->append("output ");
+    output->append(out.contentHash.toString());
+    output->push_back(' ');
+    output->append(out.path);
+    output->push_back('\n');
+    for (size_t j = 0; j < out.tags.size(); j++) {
+      output->append("tag ");
+      output->append(out.tags[j].toString());
+      output->push_back('\n');
+    }
+    for (size_t j = 0; j < entry->installations.size(); j++) {
+      const Installation& installation = entry->installations[j];
+      if (installation.output == (int)i) {
+        output->append("install ");
+        output->append(toString(installation.location));
+        output->push_back(' ');
+        output->append(installation.name);
+        output->push_back('\n');
+      }
+    }
+  }
+
+  output->append("end\n");
+}
+
+void ActionCache::parse(const std::string& content, EntryMap* entries) {
+  OwnedPtr<Entry> current;
+  Hash currentKey;
+  bool corrupt = false;
+
+  forEachLine(content, [&](std::string& line) {
+    std::string command = splitToken(&line);
+
+    if (command == "action") {
+      std::string keyText = splitToken(&line);
+      std::string hashText = splitToken(&line);
+      current = newOwned<Entry>();
+      corrupt = !Hash::fromString(keyText, &currentKey) ||
+                !Hash::fromString(hashText, &current->srcHash);
+      current->passed = line == "passed";
+    } else if (command == "forget") {
+      Hash key;
+      if (Hash::fromString(line, &key)) {
+        entries->erase(key);
+      }
+    } else if (current == nullptr) {
+      // Garbage outside a record.  Skip it.
+    } else if (command == "dep") {
+      std::string tagText = splitToken(&line);
+      Dependency dep;
+      corrupt = corrupt || !Tag::fromString(tagText, &dep.tag);
+      dep.found = line != "-";
+      if (dep.found) {
+        corrupt = corrupt || !Hash::fromString(line, &dep.contentHash);
+      }
+      current->dependencies.push_back(dep);
+    } else if (command == "output") {
+      std::string hashText = splitToken(&line);
+      Output out;
+      corrupt = corrupt || !Hash::fromString(hashText, &out.contentHash) || line.empty();
+      out.path = line;
+      current->outputs.push_back(out);
+    } else if (command == "tag") {
+      Tag tag;
+      if (current->outputs.empty() || !Tag::fromString(line, &tag)) {
+        corrupt = true;
+      } else {
+        current->outputs.back().tags.push_back(tag);
+      }
+    } else if (command == "install") {
+      std::string locationText = splitToken(&line);
+      Installation installation;
+      installation.output = current->outputs.size() - 1;
+      installation.location = atoi(locationText.c_str());
+      installation.name = line;
+      corrupt = corrupt || current->outputs.empty() || installation.name.empty();
+      current->installations.push_back(installation);
+    } else if (command == "end") {
+      if (!corrupt) {
+        entries->add(currentKey, current.release());
+      }
+      current.clear();
+    } else {
+      corrupt = true;
+    }
+  });
+}
+
+}  // namespace ekam
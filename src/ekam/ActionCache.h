@@ -0,0 +1,117 @@
+// Ekam Build System
+// Author: Kenton Varda (kenton@sandstorm.io)
+// Copyright (c) 2010-2015 Kenton Varda, Google Inc., and contributors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef KENTONSCODE_EKAM_ACTIONCACHE_H_
+#define KENTONSCODE_EKAM_ACTIONCACHE_H_
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include "base/OwnedPtr.h"
+#include "base/Hash.h"
+#include "os/File.h"
+#include "os/ByteStream.h"
+#include "Tag.h"
+#include "ArtifactStore.h"
+
+namespace ekam {
+
+// Remembers the results of successful actions across Ekam runs, so that an action whose trigger
+// file and dependencies are unchanged since the last run can be replayed instead of re-run.
+//
+// The cache is stored as an append-only text log.  When the same action is recorded more than
+// once, the last record wins.  The log is compacted each time it is loaded.
+//
+// If a remote ArtifactStore is given, records and outputs are also published there, and records
+// missing locally are looked up there.
+class ActionCache {
+public:
+  ActionCache(File* file, ArtifactStore* remote = nullptr);
+  ~ActionCache();
+
+  struct Dependency {
+    Tag tag;
+    bool found;
+    Hash contentHash;  // Only meaningful if found.
+  };
+
+  struct Output {
+    std::string path;  // On-disk path.
+    Hash contentHash;
+    std::vector<Tag> tags;
+  };
+
+  struct Installation {
+    int output;  // Index into outputs.
+    int location;
+    std::string name;
+  };
+
+  struct Entry {
+    Hash srcHash;
+    bool passed;
+    std::vector<Dependency> dependencies;
+    std::vector<Output> outputs;
+    std::vector<Installation> installations;
+  };
+
+  // Computes the key under which an action with the given verb and identity (see
+  // Action::getIdentity()) triggered by the given file is cached.  srcPath should be the on-disk
+  // path, since canonical names are not unique between source and output directories.  The key
+  // also covers the environment variables that affect builds (e.g. CXXFLAGS) and the compilers
+  // they name, which actions inherit but don't report as dependencies.
+  Hash makeKey(const std::string& verb, const Hash& identity, const std::string& srcPath);
+
+  // Returns null if there is no entry.
+  const Entry* find(const Hash& key);
+
+  void put(const Hash& key, OwnedPtr<Entry> entry);
+  void erase(const Hash& key);
+
+  // Looks up an entry for the given action and trigger file content in the remote store.
+  // Returns null if there is no remote store or it has no such entry.
+  OwnedPtr<Entry> findRemote(const Hash& key, const Hash& srcHash);
+
+  // Fetches an output file from the remote store.  Returns false on failure.
+  bool fetchRemote(const Hash& contentHash, File* output);
+
+  // Uploads an entry to the remote store.  outputFiles parallels entry.outputs; outputs
+  // corresponding to null files (e.g. source files, which every client has anyway) are not
+  // uploaded.
+  void publish(const Hash& key, const Entry& entry, const std::vector<File*>& outputFiles);
+
+private:
+  typedef OwnedPtrMap<Hash, Entry, Hash::StlHashFunc> EntryMap;
+
+  OwnedPtr<File> file;
+  ArtifactStore* remote;
+  Hash environmentHash;
+  Hash toolchainHash;  // Only computed if there's a remote store.
+  OwnedPtr<ByteStream> log;
+  EntryMap entries;
+
+  static Hash hashEnvironment();
+  static Hash hashToolchain();
+  Hash remoteKey(const Hash& key, const Hash& srcHash);
+  static void parse(const std::string& content, EntryMap* output);
+  static void write(const Hash& key, const Entry* entry, std::string* output);
+  void append(const std::string& text);
+};
+
+}  // namespace ekam
+
+#endif  // KENTONSCODE_EKAM_ACTIONCACHE_H_
@@ -0,0 +1,338 @@
+// Ekam Build System
+// Author: Kenton Varda (kenton@sandstorm.io)
+// Copyright (c) 2010-2015 Kenton Varda, Google Inc., and contributors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "ActionCache.h"
+#include "ArtifactStore.h"
+#include "Driver.h"
+#include "ExtractTypeActionFactory.h"
+#include "SimpleDashboard.h"
+#include "os/DiskFile.h"
+#include "os/EpollEventManager.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+namespace ekam {
+namespace {
+
+#define ASSERT(EXPRESSION)                                                    \
+  if (!(EXPRESSION)) {                                                        \
+    fprintf(stderr, "%s:%d: FAILED: %s\n", __FILE__, __LINE__, #EXPRESSION);  \
+    exit(1);                                                                  \
+  }
+
+// Publishes an entry with one output at the given path and installation name, then returns
+// whether a second client sharing the store would accept it.
+bool acceptsRecord(ArtifactStore* store, const std::string& dir, const std::string& outputPath,
+                   const std::string& installName) {
+  DiskFile publisherFile(dir + "/publisher-cache", nullptr);
+  ActionCache publisher(&publisherFile, store);
+  Hash key = publisher.makeKey("compile", Hash::of("rule"), "src/foo.cpp");
+
+  ActionCache::Entry entry;
+  entry.srcHash = Hash::of("int main() {}");
+  entry.passed = false;
+  ActionCache::Output output;
+  output.contentHash = Hash::of("object code");
+  output.path = outputPath;
+  entry.outputs.push_back(output);
+  ActionCache::Installation installation = { 0, 0, installName };
+  entry.installations.push_back(installation);
+  publisher.publish(key, entry, std::vector<File*>(1, nullptr));
+
+  DiskFile consumerFile(dir + "/consumer-cache", nullptr);
+  ActionCache consumer(&consumerFile, store);
+  return consumer.findRemote(key, entry.srcHash) != nullptr;
+}
+
+void testRejectsHostileOutputPaths() {
+  char dirTemplate[] = "/tmp/ekam-action-cache-test.XXXXXX";
+  ASSERT(mkdtemp(dirTemplate) != nullptr);
+  std::string dir = dirTemplate;
+  DirectoryArtifactStore store(dir + "/store");
+
+  ASSERT(acceptsRecord(&store, dir, "tmp/foo.o", "foo"));
+  ASSERT(acceptsRecord(&store, dir, "tmp/sub/foo.o", "sub/foo"));
+
+  ASSERT(!acceptsRecord(&store, dir, "tmp/../src/foo.cpp", "foo"));
+  ASSERT(!acceptsRecord(&store, dir, "tmp/./foo.o", "foo"));
+  ASSERT(!acceptsRecord(&store, dir, "tmp//foo.o", "foo"));
+  ASSERT(!acceptsRecord(&store, dir, "tmp/foo/", "foo"));
+  ASSERT(!acceptsRecord(&store, dir, "..", "foo"));
+  ASSERT(!acceptsRecord(&store, dir, "/etc/passwd", "foo"));
+  ASSERT(!acceptsRecord(&store, dir, "tmp/foo.o", "../foo"));
+  ASSERT(!acceptsRecord(&store, dir, "tmp/foo.o", "/usr/bin/foo"));
+
+  std::string command = "rm -rf " + dir;
+  ASSERT(system(command.c_str()) == 0);
+}
+
+// -------------------------------------------------------------------------------------------
+// Record and replay through the Driver.
+
+// Runs of CopyAction, across Drivers.
+int copyRuns = 0;
+
+// Copies foo.in to foo.out, after looking up dep.h so that the Driver records a dependency.  If
+// the input says "uncacheable", says so, like a rule which read something the Driver can't track.
+class CopyAction : public Action {
+public:
+  CopyAction(File* file) : file(file->clone()) {}
+  ~CopyAction() {}
+
+  // implements Action -------------------------------------------------------------------
+  std::string getVerb() { return "copy"; }
+
+  Promise<void> start(EventManager* eventManager, BuildContext* context) {
+    ++copyRuns;
+    if (context->findProvider(Tag::fromFile("dep.h")) == nullptr) {
+      context->failed();
+      return newFulfilledPromise();
+    }
+
+    std::string content = file->readAll();
+    if (content == "uncacheable") {
+      context->uncacheable();
+    }
+    OwnedPtr<File> output = context->newOutput("foo.out");
+    output->writeAll(content);
+    context->provide(output.get(), std::vector<Tag>());
+    return newFulfilledPromise();
+  }
+
+private:
+  OwnedPtr<File> file;
+};
+
+class CopyActionFactory : public ActionFactory {
+public:
+  CopyActionFactory() {}
+  ~CopyActionFactory() {}
+
+  // implements ActionFactory ------------------------------------------------------------
+  void enumerateTriggerTags(std::back_insert_iterator<std::vector<Tag> > iter) {
+    *iter++ = Tag::fromName("filetype:.in");
+  }
+  OwnedPtr<Action> tryMakeAction(const Tag& id, File* file) {
+    return newOwned<CopyAction>(file);
+  }
+};
+
+// Builds src into tmp the way a new run of Ekam would:  with a fresh Driver, and the action cache
+// loaded from tmp/.ekam-action-cache.  Returns the number of times the action actually ran, as
+// opposed to being replayed.  Call in the test's directory.
+int build() {
+  int before = copyRuns;
+
+  DiskFile src("src", nullptr);
+  DiskFile tmp("tmp", nullptr);
+  DiskFile bin("bin", nullptr);
+  DiskFile lib("lib", nullptr);
+  DiskFile nodeModules("node_modules", nullptr);
+  File* installDirs[BuildContext::INSTALL_LOCATION_COUNT];
+  installDirs[BuildContext::BIN] = &bin;
+  installDirs[BuildContext::LIB] = &lib;
+  installDirs[BuildContext::NODE_MODULES] = &nodeModules;
+
+  FILE* devNull = fopen("/dev/null", "w");
+  {
+    SimpleDashboard dashboard(devNull);
+    EpollEventManager eventManager;
+    ActionCache cache(tmp.relative(".ekam-action-cache").get());
+    ExtractTypeActionFactory extractTypeActionFactory;
+    CopyActionFactory copyActionFactory;
+    Driver driver(&eventManager, &dashboard, &tmp, installDirs, 1, nullptr, &cache);
+    driver.addActionFactory(&extractTypeActionFactory);
+    driver.addActionFactory(&copyActionFactory);
+    driver.addSourceFile(src.relative("dep.h").get());
+    driver.addSourceFile(src.relative("foo.in").get());
+    eventManager.loop();
+    ASSERT(driver.getStats().failedActions == 0);
+  }
+  fclose(devNull);
+
+  return copyRuns - before;
+}
+
+void writeFile(const std::string& path, const std::string& content) {
+  DiskFile(path, nullptr).writeAll(content);
+}
+
+std::string readFile(const std::string& path) {
+  return DiskFile(path, nullptr).readAll();
+}
+
+void testReplay() {
+  char dirTemplate[] = "/tmp/ekam-action-cache-test.XXXXXX";
+  ASSERT(mkdtemp(dirTemplate) != nullptr);
+  std::string dir = dirTemplate;
+  char* oldCwd = getcwd(nullptr, 0);
+  ASSERT(chdir(dir.c_str()) == 0);
+  DiskFile("src", nullptr).createDirectory();
+  DiskFile("tmp", nullptr).createDirectory();
+  unsetenv("CXXFLAGS");
+
+  writeFile("src/dep.h", "dep 1");
+  writeFile("src/foo.in", "foo 1");
+
+  // The first run records; the next replays, restoring the output's tags without running.
+  ASSERT(build() == 1);
+  ASSERT(readFile("tmp/foo.out") == "foo 1");
+  ASSERT(build() == 0);
+
+  // Miss:  the trigger file changed.
+  writeFile("src/foo.in", "foo 2");
+  ASSERT(build() == 1);
+  ASSERT(readFile("tmp/foo.out") == "foo 2");
+  ASSERT(build() == 0);
+
+  // A dependency's content hash no longer matches.
+  writeFile("src/dep.h", "dep 2");
+  ASSERT(build() == 1);
+  ASSERT(build() == 0);
+
+  // A build variable changed, which selects a different entry.  The old one is still there for
+  // when it changes back.
+  setenv("CXXFLAGS", "-O2", 1);
+  ASSERT(build() == 1);
+  ASSERT(build() == 0);
+  unsetenv("CXXFLAGS");
+  ASSERT(build() == 0);
+
+  // An output went missing, or was modified.
+  ASSERT(unlink("tmp/foo.out") == 0);
+  ASSERT(build() == 1);
+  ASSERT(readFile("tmp/foo.out") == "foo 2");
+  writeFile("tmp/foo.out", "tampered");
+  ASSERT(build() == 1);
+  ASSERT(readFile("tmp/foo.out") == "foo 2");
+
+  // A run which called uncacheable() forgets what the last cacheable run recorded, so going
+  // back to that input runs the action again.
+  writeFile("src/foo.in", "uncacheable");
+  ASSERT(build() == 1);
+  ASSERT(readFile("tmp/.ekam-action-cache").find("forget ") != std::string::npos);
+  ASSERT(build() == 1);
+  writeFile("src/foo.in", "foo 2");
+  ASSERT(build() == 1);
+  ASSERT(build() == 0);
+
+  ASSERT(chdir(oldCwd) == 0);
+  free(oldCwd);
+  std::string command = "rm -rf " + dir;
+  ASSERT(system(command.c_str()) == 0);
+}
+
+// -------------------------------------------------------------------------------------------
+// The log itself.
+
+OwnedPtr<ActionCache::Entry> makeEntry(const std::string& source) {
+  OwnedPtr<ActionCache::Entry> entry = newOwned<ActionCache::Entry>();
+  entry->srcHash = Hash::of(source);
+  entry->passed = true;
+
+  ActionCache::Dependency found = { Tag::fromFile("dep.h"), true, Hash::of("dep") };
+  ActionCache::Dependency missing = { Tag::fromName("c++symbol:foo"), false, Hash() };
+  entry->dependencies.push_back(found);
+  entry->dependencies.push_back(missing);
+
+  ActionCache::Output output;
+  output.path = "tmp/" + source + ".o";
+  output.contentHash = Hash::of("object code for " + source);
+  output.tags.push_back(Tag::fromName("c++symbol:" + source));
+  entry->outputs.push_back(output);
+  ActionCache::Installation installation = { 0, BuildContext::BIN, source };
+  entry->installations.push_back(installation);
+  return entry;
+}
+
+void testReload() {
+  char dirTemplate[] = "/tmp/ekam-action-cache-test.XXXXXX";
+  ASSERT(mkdtemp(dirTemplate) != nullptr);
+  std::string dir = dirTemplate;
+  DiskFile file(dir + "/cache", nullptr);
+
+  Hash kept;
+  Hash forgotten;
+  {
+    ActionCache cache(&file);
+    kept = cache.makeKey("compile", Hash::of("rule"), "src/kept.cpp");
+    forgotten = cache.makeKey("compile", Hash::of("rule"), "src/forgotten.cpp");
+    ASSERT(cache.find(kept) == nullptr);
+
+    cache.put(kept, makeEntry("stale"));
+    cache.put(kept, makeEntry("kept"));  // the last record wins
+    cache.put(forgotten, makeEntry("forgotten"));
+    cache.erase(forgotten);
+    ASSERT(cache.find(forgotten) == nullptr);
+  }
+  ASSERT(file.readAll().find("forget " + forgotten.toString()) != std::string::npos);
+
+  {
+    ActionCache cache(&file);
+    ASSERT(cache.find(forgotten) == nullptr);
+
+    const ActionCache::Entry* entry = cache.find(kept);
+    ASSERT(entry != nullptr);
+    ASSERT(entry->srcHash == Hash::of("kept"));
+    ASSERT(entry->passed);
+    ASSERT(entry->dependencies.size() == 2);
+    ASSERT(entry->dependencies[0].tag == Tag::fromFile("dep.h"));
+    ASSERT(entry->dependencies[0].found);
+    ASSERT(entry->dependencies[0].contentHash == Hash::of("dep"));
+    ASSERT(entry->dependencies[1].tag == Tag::fromName("c++symbol:foo"));
+    ASSERT(!entry->dependencies[1].found);
+    ASSERT(entry->outputs.size() == 1);
+    ASSERT(entry->outputs[0].path == "tmp/kept.o");
+    ASSERT(entry->outputs[0].contentHash == Hash::of("object code for kept"));
+    ASSERT(entry->outputs[0].tags.size() == 1);
+    ASSERT(entry->outputs[0].tags[0] == Tag::fromName("c++symbol:kept"));
+    ASSERT(entry->installations.size() == 1);
+    ASSERT(entry->installations[0].output == 0);
+    ASSERT(entry->installations[0].location == BuildContext::BIN);
+    ASSERT(entry->installations[0].name == "kept");
+  }
+
+  // Loading compacted the log down to the live entry.
+  std::string content = file.readAll();
+  ASSERT(content.find("forget ") == std::string::npos);
+  ASSERT(content.find(Hash::of("stale").toString()) == std::string::npos);
+  ASSERT(content.find(Hash::of("kept").toString()) != std::string::npos);
+
+  // A record cut off by a crash is ignored, without losing the ones before it.
+  file.writeAll(content + "action " + forgotten.toString() + " " +
+                Hash::of("torn").toString() + " passed\n");
+  {
+    ActionCache cache(&file);
+    ASSERT(cache.find(kept) != nullptr);
+    ASSERT(cache.find(forgotten) == nullptr);
+  }
+
+  std::string command = "rm -rf " + dir;
+  ASSERT(system(command.c_str()) == 0);
+}
+
+}  // namespace
+}  // namespace ekam
+
+int main(int argc, char* argv[]) {
+  ekam::testRejectsHostileOutputPaths();
+  ekam::testReplay();
+  ekam::testReload();
+  return 0;
+}
@@ -0,0 +1,142 @@
+// Ekam Build System
+// Author: Kenton Varda (kenton@sandstorm.io)
+// Copyright (c) 2010-2015 Kenton Varda, Google Inc., and contributors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "ActionGraph.h"
+
+#include "os/TextFile.h"
+
+namespace ekam {
+
+// File format is a line per action, followed by a line per output and per input:
+//
+//   action <verb> <noun>
+//   output <canonical name>
+//   input <verb> <noun>
+
+ActionGraph::ActionGraph(File* file) : file(file->clone()), dirty(false) {
+  Record* current = nullptr;
+  forEachLineOf(this->file.get(), [&](std::string& line) {
+    if (line.find_first_of(' ') == std::string::npos) return;
+    std::string kind = splitToken(&line);
+
+    if (kind == "action") {
+      current = &records[line];
+      current->outputs.clear();
+      current->inputs.clear();
+    } else if (current == nullptr) {
+      return;
+    } else if (kind == "output") {
+      current->outputs.push_back(line);
+    } else if (kind == "input") {
+      current->inputs.push_back(line);
+    }
+  });
+}
+
+ActionGraph::~ActionGraph() {}
+
+void ActionGraph::setEdges(const std::string& action, std::vector<std::string>&& outputs,
+                           std::vector<std::string>&& inputs) {
+  Record& record = records[action];
+  if (record.outputs != outputs || record.inputs != inputs) {
+    record.outputs = std::move(outputs);
+    record.inputs = std::move(inputs);
+    dirty = true;
+  }
+}
+
+bool ActionGraph::findClosure(const std::string& output,
+                              std::unordered_set<std::string>* actions) {
+  std::vector<std::string> unexpanded;
+  for (std::unordered_map<std::string, Record>::iterator iter = records.begin();
+       iter != records.end(); ++iter) {
+    const std::vector<std::string>& outputs = iter->second.outputs;
+    for (size_t i = 0; i < outputs.size(); i++) {
+      if (outputs[i] == output) {
+        unexpanded.push_back(iter->first);
+        break;
+      }
+    }
+  }
+
+  if (unexpanded.empty()) {
+    return false;
+  }
+
+  expand(&unexpanded, actions);
+  return true;
+}
+
+void ActionGraph::findTriggeredClosure(const std::string& trigger,
+                                       std::unordered_set<std::string>* actions) {
+  std::vector<std::string> unexpanded;
+  for (std::unordered_map<std::string, Record>::iterator iter = records.begin();
+       iter != records.end(); ++iter) {
+    // Actions are named "<verb> <noun>", where the noun is the trigger.
+    const std::string& action = iter->first;
+    std::string::size_type space = action.find_first_of(' ');
+    if (space != std::string::npos && action.compare(space + 1, std::string::npos, trigger) == 0) {
+      unexpanded.push_back(action);
+    }
+  }
+
+  expand(&unexpanded, actions);
+}
+
+void ActionGraph::expand(std::vector<std::string>* unexpanded,
+                         std::unordered_set<std::string>* actions) {
+  while (!unexpanded->empty()) {
+    std::string action = unexpanded->back();
+    unexpanded->pop_back();
+    if (!actions->insert(action).second) {
+      continue;
+    }
+
+    std::unordered_map<std::string, Record>::iterator iter = records.find(action);
+    if (iter != records.end()) {
+      unexpanded->insert(unexpanded->end(),
+                         iter->second.inputs.begin(), iter->second.inputs.end());
+    }
+  }
+}
+
+void ActionGraph::save() {
+  if (!dirty) return;
+
+  std::string content;
+  for (std::unordered_map<std::string, Record>::iterator iter = records.begin();
+       iter != records.end(); ++iter) {
+    content.append("action ");
+    content.append(iter->first);
+    content.push_back('\n');
+    for (size_t i = 0; i < iter->second.outputs.size(); i++) {
+      content.append("output ");
+      content.append(iter->second.outputs[i]);
+      content.push_back('\n');
+    }
+    for (size_t i = 0; i < iter->second.inputs.size(); i++) {
+      content.append("input ");
+      content.append(iter->second.inputs[i]);
+      content.push_back('\n');
+    }
+  }
+
+  if (writeBestEffort(file.get(), content, "action graph")) {
+    dirty = false;
+  }
+}
+
+}  // namespace ekam
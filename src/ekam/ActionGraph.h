@@ -0,0 +1,71 @@
+// Ekam Build System
+// Author: Kenton Varda (kenton@sandstorm.io)
+// Copyright (c) 2010-2015 Kenton Varda, Google Inc., and contributors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef KENTONSCODE_EKAM_ACTIONGRAPH_H_
+#define KENTONSCODE_EKAM_ACTIONGRAPH_H_
+
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "base/OwnedPtr.h"
+#include "os/File.h"
+
+namespace ekam {
+
+// Remembers, across runs, which files each action produced and which actions it used the
+// outputs (or rules) of.  The Driver uses this to build a single file without building
+// everything else:  only the actions which produced the file last time, and those they
+// transitively depended on, need to run.
+//
+// Actions are identified as in ActionHistory, files by canonical name.
+class ActionGraph {
+public:
+  ActionGraph(File* file);
+  ~ActionGraph();
+
+  // Replaces what is known about the action.
+  void setEdges(const std::string& action, std::vector<std::string>&& outputs,
+                std::vector<std::string>&& inputs);
+
+  // Adds to *actions every action needed to produce the file, according to the last run.
+  // Returns false if no action is known to produce it.
+  bool findClosure(const std::string& output, std::unordered_set<std::string>* actions);
+
+  // Adds to *actions every action triggered by the file with the given canonical name, and
+  // every action those needed, according to the last run.
+  void findTriggeredClosure(const std::string& trigger, std::unordered_set<std::string>* actions);
+
+  // Write to disk, if anything changed.
+  void save();
+
+private:
+  struct Record {
+    std::vector<std::string> outputs;  // canonical names
+    std::vector<std::string> inputs;   // actions
+  };
+
+  OwnedPtr<File> file;
+  std::unordered_map<std::string, Record> records;
+  bool dirty;
+
+  void expand(std::vector<std::string>* unexpanded, std::unordered_set<std::string>* actions);
+};
+
+}  // namespace ekam
+
+#endif  // KENTONSCODE_EKAM_ACTIONGRAPH_H_
@@ -0,0 +1,93 @@
+// Ekam Build System
+// Author: Kenton Varda (kenton@sandstorm.io)
+// Copyright (c) 2010-2015 Kenton Varda, Google Inc., and contributors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "ActionHistory.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "os/TextFile.h"
+
+namespace ekam {
+
+// File format is one line per action:
+//
+//   <duration> <criticalPath> <verb> <noun>
+
+ActionHistory::ActionHistory(File* file) : file(file->clone()), dirty(false) {
+  forEachLineOf(this->file.get(), [this](const std::string& line) {
+    const char* start = line.c_str();
+    char* end;
+    Record record;
+    record.duration = strtod(start, &end);
+    if (*end != ' ') return;
+    record.criticalPath = strtod(end + 1, &end);
+    if (*end != ' ') return;
+    records[std::string(end + 1)] = record;
+  });
+}
+
+ActionHistory::~ActionHistory() {}
+
+double ActionHistory::getDuration(const std::string& action) {
+  std::unordered_map<std::string, Record>::iterator iter = records.find(action);
+  return iter == records.end() ? -1 : iter->second.duration;
+}
+
+void ActionHistory::setDuration(const std::string& action, double seconds) {
+  std::unordered_map<std::string, Record>::iterator iter = records.find(action);
+  if (iter == records.end()) {
+    Record record = { seconds, seconds };
+    records[action] = record;
+  } else {
+    iter->second.duration = seconds;
+  }
+  dirty = true;
+}
+
+double ActionHistory::getCriticalPath(const std::string& action) {
+  std::unordered_map<std::string, Record>::iterator iter = records.find(action);
+  return iter == records.end() ? 0 : iter->second.criticalPath;
+}
+
+void ActionHistory::setCriticalPath(const std::string& action, double seconds) {
+  std::unordered_map<std::string, Record>::iterator iter = records.find(action);
+  if (iter != records.end() && iter->second.criticalPath != seconds) {
+    iter->second.criticalPath = seconds;
+    dirty = true;
+  }
+}
+
+void ActionHistory::save() {
+  if (!dirty) return;
+
+  std::string content;
+  char buffer[64];
+  for (std::unordered_map<std::string, Record>::iterator iter = records.begin();
+       iter != records.end(); ++iter) {
+    snprintf(buffer, sizeof(buffer), "%.3f %.3f ",
+             iter->second.duration, iter->second.criticalPath);
+    content.append(buffer);
+    content.append(iter->first);
+    content.push_back('\n');
+  }
+
+  if (writeBestEffort(file.get(), content, "action history")) {
+    dirty = false;
+  }
+}
+
+}  // namespace ekam
@@ -0,0 +1,63 @@
+// Ekam Build System
+// Author: Kenton Varda (kenton@sandstorm.io)
+// Copyright (c) 2010-2015 Kenton Varda, Google Inc., and contributors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef KENTONSCODE_EKAM_ACTIONHISTORY_H_
+#define KENTONSCODE_EKAM_ACTIONHISTORY_H_
+
+#include <string>
+#include <unordered_map>
+
+#include "base/OwnedPtr.h"
+#include "os/File.h"
+
+namespace ekam {
+
+// Remembers how long each action took in previous runs, and how long the longest chain of
+// actions depending on it took.  The Driver uses the latter to start actions on the critical
+// path first.
+//
+// Actions are identified by verb and noun, e.g. "compile foo/bar.cpp".  Times are in seconds.
+class ActionHistory {
+public:
+  ActionHistory(File* file);
+  ~ActionHistory();
+
+  // Returns a negative number if unknown.
+  double getDuration(const std::string& action);
+  void setDuration(const std::string& action, double seconds);
+
+  // The duration of the action plus the longest chain of actions that depended on it.  Returns
+  // zero if unknown.
+  double getCriticalPath(const std::string& action);
+  void setCriticalPath(const std::string& action, double seconds);
+
+  // Write to disk, if anything changed.
+  void save();
+
+private:
+  struct Record {
+    double duration;
+    double criticalPath;
+  };
+
+  OwnedPtr<File> file;
+  std::unordered_map<std::string, Record> records;
+  bool dirty;
+};
+
+}  // namespace ekam
+
+#endif  // KENTONSCODE_EKAM_ACTIONHISTORY_H_
@@ -16,6 +16,7 @@
 
 #include "ActionUtil.h"
 #include <string.h>
+#include <algorithm>
 
 namespace ekam {
 
@@ -48,33 +49,102 @@ Promise<void> Logger::run(EventManager* eventManager) {
 
 // =======================================================================================
 
-LineReader::LineReader(ByteStream* stream) : stream(stream) {}
+LineReader::LineReader(ByteStream* stream)
+    : stream(stream), framesEnabled(false), atEof(false), skipping(0), buffer(65536),
+      begin(0), end(0), scanned(0) {}
 LineReader::~LineReader() {}
 
-Promise<OwnedPtr<std::string>> LineReader::readLine(EventManager* eventManager) {
-  std::string::size_type endpos = leftover.find_first_of('\n');
-  if (endpos != std::string::npos) {
-    auto result = newOwned<std::string>(leftover, 0, endpos);
-    leftover.erase(0, endpos + 1);
-    return newFulfilledPromise(result.release());
+bool LineReader::next(Record* record) {
+  if (skipping > 0) {
+    size_t amount = std::min(skipping, end - begin);
+    skipping -= amount;
+    begin += amount;
+    scanned = begin;
   }
 
-  return eventManager->when(stream->readAsync(eventManager, buffer, sizeof(buffer)))(
-    [=](size_t size) -> Promise<OwnedPtr<std::string>> {
-      if (size == 0) {
-        if (leftover.empty()) {
-          // No more data.
-          return newFulfilledPromise(OwnedPtr<std::string>(nullptr));
-        } else {
-          // Still have a line of text that had no trailing newline.
-          auto line = newOwned<std::string>(std::move(leftover));
-          leftover.clear();
-          return newFulfilledPromise(line.release());
-        }
+  if (begin == end) {
+    return false;
+  }
+
+  const char* data = &buffer[begin];
+  size_t available = end - begin;
+  record->malformed = false;
+
+  if (framesEnabled && data[0] == '\0') {
+    if (available >= FRAME_HEADER_SIZE) {
+      const unsigned char* header = reinterpret_cast<const unsigned char*>(data);
+      size_t payloadSize = header[1] | (header[2] << 8) | (header[3] << 16) |
+                           (static_cast<size_t>(header[4]) << 24);
+      if (payloadSize > MAX_FRAME_SIZE) {
+        // Hand out just the header and throw the payload away as it arrives, rather than
+        // buffering it.
+        record->data = data;
+        record->size = FRAME_HEADER_SIZE;
+        record->malformed = true;
+        begin += FRAME_HEADER_SIZE;
+        scanned = begin;
+        skipping = payloadSize;
+        return true;
       }
+      size_t size = FRAME_HEADER_SIZE + payloadSize;
+      if (available >= size) {
+        record->data = data;
+        record->size = size;
+        begin += size;
+        scanned = begin;
+        return true;
+      }
+    }
+  } else {
+    const char* eol = static_cast<const char*>(memchr(&buffer[scanned], '\n', end - scanned));
+    if (eol != nullptr) {
+      record->data = data;
+      record->size = eol - data;
+      begin += record->size + 1;
+      scanned = begin;
+      return true;
+    }
+    scanned = end;
+  }
 
-      leftover.append(buffer, size);
-      return readLine(eventManager);
+  if (atEof) {
+    // Still have a record that was cut off.  A partial line is still a line, but a partial
+    // frame is useless.
+    record->data = data;
+    record->size = available;
+    record->malformed = framesEnabled && data[0] == '\0';
+    begin = end;
+    scanned = end;
+    return true;
+  }
+  return false;
+}
+
+Promise<bool> LineReader::readMore(EventManager* eventManager) {
+  if (atEof) {
+    return newFulfilledPromise(begin != end);
+  }
+
+  // Move what's left of a partial record to the front, so the buffer only grows when a single
+  // record doesn't fit.
+  if (begin > 0) {
+    memmove(&buffer[0], &buffer[begin], end - begin);
+    end -= begin;
+    scanned -= begin;
+    begin = 0;
+  }
+  if (end == buffer.size()) {
+    buffer.resize(buffer.size() * 2);
+  }
+
+  return eventManager->when(stream->readAsync(eventManager, &buffer[end], buffer.size() - end))(
+    [this](size_t size) -> bool {
+      if (size == 0) {
+        atEof = true;
+        return begin != end;
+      }
+      end += size;
+      return true;
     });
 }
 
@@ -18,6 +18,7 @@
 #define KENTONSCODE_EKAM_ACTIONUTIL_H_
 
 #include <string>
+#include <vector>
 
 #include "os/ByteStream.h"
 #include "Action.h"
@@ -39,17 +40,56 @@ private:
   char buffer[4096];
 };
 
+// Splits a stream into lines, reading into one reusable buffer.  Everything that arrives in one
+// read is handed out without further copying or waiting, so a rule that prints thousands of
+// lines at once costs one promise rather than one per line.
 class LineReader {
 public:
   LineReader(ByteStream* stream);
   ~LineReader();
 
-  Promise<OwnedPtr<std::string>> readLine(EventManager* eventManager);
+  struct Record {
+    const char* data;
+    size_t size;  // not including the newline
+
+    // Set for a frame that can't be used:  one whose header announces more than
+    // MAX_FRAME_SIZE bytes (the record is then just the header, and the payload is skipped
+    // unread), or one cut off by the end of the stream.
+    bool malformed;
+  };
+
+  // Takes the next complete line (or frame) already buffered, without waiting, and returns
+  // true, or returns false if there isn't one.  The record points into the buffer, so is only
+  // valid until readMore() is called.  At the end of the stream, a last line with no trailing
+  // newline is returned too.
+  bool next(Record* record);
+
+  // Waits for more of the stream.  Fulfills with false at the end of the stream, once there is
+  // nothing left for next() to return.
+  Promise<bool> readMore(EventManager* eventManager);
+
+  // After calling this, next() also recognizes binary frames mixed in with the lines.  A frame
+  // is a NUL byte followed by a 32-bit little-endian payload length and the payload.  next()
+  // returns the whole frame, including the five header bytes, so callers can tell frames from
+  // lines by the leading NUL, which never starts a line of text.
+  void enableFrames() { framesEnabled = true; }
+
+  static const size_t FRAME_HEADER_SIZE = 5;
+
+  // Largest frame payload accepted.  The buffer never grows past what this needs, whatever a
+  // misbehaving rule writes.
+  static const size_t MAX_FRAME_SIZE = 1 << 20;
 
 private:
   ByteStream* stream;
-  std::string leftover;
-  char buffer[4096];
+  bool framesEnabled;
+  bool atEof;
+  size_t skipping;  // payload bytes of an oversized frame still to be discarded
+
+  std::vector<char> buffer;  // grows to fit the largest frame
+  size_t begin;    // start of the data not yet returned by next()
+  size_t end;      // end of the data read
+  size_t scanned;  // [begin, scanned) is known to contain no newline
 };
 
 }  // namespace ekam
@@ -0,0 +1,151 @@
+// Ekam Build System
+// Author: Kenton Varda (kenton@sandstorm.io)
+// Copyright (c) 2010-2015 Kenton Varda, Google Inc., and contributors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "ArtifactStore.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "base/Debug.h"
+#include "os/ByteStream.h"
+#include "os/OsHandle.h"
+
+namespace ekam {
+
+namespace {
+
+std::string tempPathFor(const std::string& path) {
+  return path + ".tmp." + toString(getpid());
+}
+
+// Copies a file, preserving its permission bits, such that the destination appears atomically.
+void copyFile(const std::string& from, const std::string& to) {
+  std::string temp = tempPathFor(to);
+
+  try {
+    ByteStream input(from, O_RDONLY);
+    struct stat stats;
+    input.stat(&stats);
+
+    ByteStream output(temp, O_WRONLY | O_CREAT | O_TRUNC, stats.st_mode & 0777);
+    char buffer[8192];
+    while (true) {
+      size_t n = input.read(buffer, sizeof(buffer));
+      if (n == 0) break;
+      output.writeAll(buffer, n);
+    }
+  } catch (...) {
+    unlink(temp.c_str());
+    throw;
+  }
+
+  WRAP_SYSCALL(rename, temp.c_str(), to.c_str());
+}
+
+void ensureDirectory(const std::string& path) {
+  if (mkdir(path.c_str(), 0777) < 0 && errno != EEXIST) {
+    throw OsError(path, "mkdir", errno);
+  }
+}
+
+}  // namespace
+
+ArtifactStore::~ArtifactStore() {}
+
+DirectoryArtifactStore::DirectoryArtifactStore(const std::string& path) : path(path) {
+  try {
+    ensureDirectory(path);
+    ensureDirectory(path + "/actions");
+    ensureDirectory(path + "/blobs");
+  } catch (const std::exception& e) {
+    DEBUG_ERROR << "Couldn't initialize shared cache: " << e.what();
+  }
+}
+
+DirectoryArtifactStore::~DirectoryArtifactStore() {}
+
+std::string DirectoryArtifactStore::recordPath(const Hash& key) {
+  return path + "/actions/" + key.toString();
+}
+
+std::string DirectoryArtifactStore::blobPath(const Hash& contentHash) {
+  return path + "/blobs/" + contentHash.toString();
+}
+
+bool DirectoryArtifactStore::getRecord(const Hash& key, std::string* output) {
+  std::string recordFile = recordPath(key);
+  if (access(recordFile.c_str(), R_OK) < 0) {
+    return false;
+  }
+
+  try {
+    ByteStream input(recordFile, O_RDONLY);
+    output->clear();
+    char buffer[8192];
+    while (true) {
+      size_t n = input.read(buffer, sizeof(buffer));
+      if (n == 0) break;
+      output->append(buffer, n);
+    }
+    return true;
+  } catch (const std::exception& e) {
+    DEBUG_INFO << "Reading shared cache record failed: " << e.what();
+    return false;
+  }
+}
+
+void DirectoryArtifactStore::putRecord(const Hash& key, const std::string& record) {
+  std::string recordFile = recordPath(key);
+  std::string temp = tempPathFor(recordFile);
+  try {
+    {
+      ByteStream output(temp, O_WRONLY | O_CREAT | O_TRUNC);
+      output.writeAll(record.data(), record.size());
+    }
+    WRAP_SYSCALL(rename, temp.c_str(), recordFile.c_str());
+  } catch (const std::exception& e) {
+    unlink(temp.c_str());
+    DEBUG_INFO << "Writing shared cache record failed: " << e.what();
+  }
+}
+
+bool DirectoryArtifactStore::hasBlob(const Hash& contentHash) {
+  return access(blobPath(contentHash).c_str(), R_OK) == 0;
+}
+
+bool DirectoryArtifactStore::getBlob(const Hash& contentHash, File* output) {
+  try {
+    OwnedPtr<File::DiskRef> diskRef = output->getOnDisk(File::WRITE);
+    copyFile(blobPath(contentHash), diskRef->path());
+    return true;
+  } catch (const std::exception& e) {
+    DEBUG_INFO << "Fetching from shared cache failed: " << e.what();
+    return false;
+  }
+}
+
+void DirectoryArtifactStore::putBlob(const Hash& contentHash, File* input) {
+  try {
+    OwnedPtr<File::DiskRef> diskRef = input->getOnDisk(File::READ);
+    copyFile(diskRef->path(), blobPath(contentHash));
+  } catch (const std::exception& e) {
+    DEBUG_INFO << "Uploading to shared cache failed: " << e.what();
+  }
+}
+
+}  // namespace ekam
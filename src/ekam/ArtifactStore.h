@@ -0,0 +1,71 @@
+// Ekam Build System
+// Author: Kenton Varda (kenton@sandstorm.io)
+// Copyright (c) 2010-2015 Kenton Varda, Google Inc., and contributors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef KENTONSCODE_EKAM_ARTIFACTSTORE_H_
+#define KENTONSCODE_EKAM_ARTIFACTSTORE_H_
+
+#include <string>
+
+#include "base/OwnedPtr.h"
+#include "base/Hash.h"
+#include "os/File.h"
+
+namespace ekam {
+
+// A content-addressed store shared between machines, backing the local ActionCache.  Action
+// records are stored under a key derived from the action, the content of the compilers used, and
+// its trigger file's hash; output files are stored by content hash.
+//
+// Stores are allowed to lose data at any time.  All methods should report failure by returning
+// false (or doing nothing) rather than throwing, since a failure only costs a rebuild.
+class ArtifactStore {
+public:
+  virtual ~ArtifactStore();
+
+  virtual bool getRecord(const Hash& key, std::string* output) = 0;
+  virtual void putRecord(const Hash& key, const std::string& record) = 0;
+
+  virtual bool hasBlob(const Hash& contentHash) = 0;
+  virtual bool getBlob(const Hash& contentHash, File* output) = 0;
+  virtual void putBlob(const Hash& contentHash, File* input) = 0;
+};
+
+// Stores artifacts in a directory, which is presumably on a shared filesystem.  All writes
+// are done by writing a temporary file and renaming it into place, so that concurrent readers
+// never see partial files.
+class DirectoryArtifactStore : public ArtifactStore {
+public:
+  DirectoryArtifactStore(const std::string& path);
+  ~DirectoryArtifactStore();
+
+  // implements ArtifactStore ------------------------------------------------------------
+  bool getRecord(const Hash& key, std::string* output);
+  void putRecord(const Hash& key, const std::string& record);
+
+  bool hasBlob(const Hash& contentHash);
+  bool getBlob(const Hash& contentHash, File* output);
+  void putBlob(const Hash& contentHash, File* input);
+
+private:
+  std::string path;
+
+  std::string recordPath(const Hash& key);
+  std::string blobPath(const Hash& contentHash);
+};
+
+}  // namespace ekam
+
+#endif  // KENTONSCODE_EKAM_ARTIFACTSTORE_H_
@@ -0,0 +1,271 @@
+// Ekam Build System
+// Author: Kenton Varda (kenton@sandstorm.io)
+// Copyright (c) 2010-2015 Kenton Varda, Google Inc., and contributors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "BuildServer.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "base/Debug.h"
+#include "base/Trace.h"
+#include "os/OsHandle.h"
+#include "SimpleDashboard.h"
+
+namespace ekam {
+
+class BuildServer::Client : public Driver::BuildWaiter {
+public:
+  Client(BuildServer* server, OwnedPtr<ByteStream> stream)
+      : server(server), stream(stream.release()), output(nullptr), waiting(false),
+        closeWhenWritten(false), disconnected(false) {
+    readRequest();
+  }
+  ~Client() {
+    // Anything still buffered in `output` has nowhere to go.
+    disconnected = true;
+    if (waiting) {
+      server->driver->cancelWait(this);
+    }
+    connector.clear();
+    dashboard.clear();
+    if (output != nullptr) {
+      fclose(output);
+    }
+  }
+
+  // implements BuildWaiter --------------------------------------------------------------
+  void buildDone(bool hasFailures) {
+    waiting = false;
+    connector.clear();
+    fputs(hasFailures ? "fail\n" : "pass\n", output);
+    fflush(output);
+    closeWhenWritten = true;
+    writePending();
+  }
+
+private:
+  BuildServer* server;
+  OwnedPtr<ByteStream> stream;
+  char buffer[1024];
+  std::string request;
+  Promise<void> readOp;
+
+  FILE* output;
+  OwnedPtr<SimpleDashboard> dashboard;
+  OwnedPtr<MuxDashboard::Connector> connector;
+  bool waiting;
+  Promise<void> closeOp;
+
+  // Output the client hasn't accepted yet.  The socket is non-blocking, so that a client which
+  // stops reading can't stall the event loop; one which falls more than MAX_PENDING behind is
+  // disconnected instead.
+  static const size_t MAX_PENDING = 1 << 20;
+  std::string pending;
+  OwnedPtr<EventManager::IoWatcher> writeWatcher;
+  Promise<void> writeOp;
+  bool closeWhenWritten;
+  bool disconnected;
+
+  void readRequest() {
+    readOp = server->eventManager->when(
+        stream->readAsync(server->eventManager, buffer, sizeof(buffer)))(
+      [this](size_t size) {
+        if (size == 0) {
+          close();
+          return;
+        }
+        request.append(buffer, size);
+        std::string::size_type eol = request.find_first_of('\n');
+        if (eol == std::string::npos) {
+          readRequest();
+        } else {
+          request.erase(eol);
+          handleRequest();
+        }
+      }, [this](MaybeException<size_t> error) {
+        close();
+      });
+  }
+
+  void handleRequest() {
+    std::string canonicalName;
+    if (request == "trace") {
+      startOutput();
+      pending = Trace::dump();
+      closeWhenWritten = true;
+      writePending();
+      return;
+    } else if (request.compare(0, 6, "build ") == 0) {
+      canonicalName = request.substr(6);
+    } else if (request != "build") {
+      DEBUG_ERROR << "Bad request from ekam client: " << request;
+      close();
+      return;
+    }
+
+    startOutput();
+    cookie_io_functions_t functions = { nullptr, &Client::writeOutput, nullptr, nullptr };
+    output = fopencookie(this, "w", functions);
+    if (output == nullptr) {
+      throw OsError("fopencookie", errno);
+    }
+    dashboard = newOwned<SimpleDashboard>(output);
+    connector = newOwned<MuxDashboard::Connector>(&server->mux, dashboard.get());
+    waiting = true;
+    server->driver->waitForBuild(canonicalName, this);
+  }
+
+  void startOutput() {
+    int fd = stream->getHandle()->get();
+    WRAP_SYSCALL(fcntl, fd, F_SETFL, O_NONBLOCK);
+    stream->releaseWatcher();
+    writeWatcher = server->eventManager->watchFd(fd);
+  }
+
+  // Called by `output`, possibly while the dashboard is in the middle of an update, so this must
+  // not disconnect the dashboard itself; close() defers that to the destructor.
+  static ssize_t writeOutput(void* cookie, const char* data, size_t size) {
+    Client* self = reinterpret_cast<Client*>(cookie);
+    if (self->disconnected) {
+      return size;
+    }
+    if (self->pending.size() + size > MAX_PENDING) {
+      DEBUG_INFO << "Disconnecting ekam client which stopped reading its output.";
+      self->disconnect();
+      return size;
+    }
+
+    bool wasEmpty = self->pending.empty();
+    self->pending.append(data, size);
+    if (wasEmpty) {
+      self->writePending();
+    }
+    return size;
+  }
+
+  void writePending() {
+    while (!pending.empty() && !disconnected) {
+      ssize_t n = ::write(stream->getHandle()->get(), pending.data(), pending.size());
+      if (n >= 0) {
+        pending.erase(0, n);
+      } else if (errno == EAGAIN) {
+        writeOp = server->eventManager->when(writeWatcher->onWritable())(
+          [this](Void) {
+            writeOp.release();
+            writePending();
+          });
+        return;
+      } else if (errno != EINTR) {
+        DEBUG_INFO << "Writing to ekam client: " << strerror(errno);
+        disconnect();
+        return;
+      }
+    }
+
+    if (closeWhenWritten && !disconnected) {
+      close();
+    }
+  }
+
+  void disconnect() {
+    disconnected = true;
+    pending.clear();
+    close();
+  }
+
+  void close() {
+    BuildServer* server = this->server;
+    Client* self = this;
+    closeOp = server->eventManager->when()(
+      [server, self]() {
+        server->clients.erase(self);
+      });
+  }
+};
+
+BuildServer::BuildServer(EventManager* eventManager, const std::string& socketPath,
+                         OwnedPtr<Dashboard> baseDashboard)
+    : eventManager(eventManager), driver(nullptr), base(baseDashboard.release()),
+      baseConnector(newOwned<MuxDashboard::Connector>(&mux, base.get())),
+      socket(eventManager, "unix:" + socketPath) {
+  acceptOp = doAccept();
+}
+
+BuildServer::~BuildServer() {
+  // Clients may be waiting on the Driver.
+  clients.clear();
+}
+
+void BuildServer::setDriver(Driver* driver) {
+  this->driver = driver;
+}
+
+Promise<void> BuildServer::doAccept() {
+  return eventManager->when(socket.accept())(
+    [this](OwnedPtr<ByteStream> stream) {
+      auto client = newOwned<Client>(this, stream.release());
+      auto key = client.get();  // cannot inline due to undefined evaluation order
+      clients.add(key, client.release());
+      return doAccept();
+    });
+}
+
+OwnedPtr<Dashboard::Task> BuildServer::beginTask(
+    const std::string& verb, const std::string& noun, Silence silence) {
+  return mux.beginTask(verb, noun, silence);
+}
+
+void BuildServer::setFocusListener(FocusListener* listener) {
+  base->setFocusListener(listener);
+}
+
+bool BuildServer::request(const std::string& socketPath, const std::string& canonicalName,
+                          bool* passed) {
+  OwnedPtr<ByteStream> stream;
+  try {
+    stream = connectSocket("unix:" + socketPath);
+  } catch (const OsError& e) {
+    DEBUG_INFO << "No build server: " << e.what();
+    return false;
+  }
+
+  std::string request = canonicalName.empty() ? "build\n" : "build " + canonicalName + "\n";
+  stream->writeAll(request.data(), request.size());
+
+  // Hold back the last line, which is the status.
+  std::string pending;
+  char buffer[4096];
+  while (true) {
+    size_t size = stream->read(buffer, sizeof(buffer));
+    if (size == 0) break;
+    pending.append(buffer, size);
+
+    std::string::size_type lastLine = pending.find_last_of('\n', pending.size() - 2);
+    if (pending.size() >= 2 && lastLine != std::string::npos) {
+      fwrite(pending.data(), 1, lastLine + 1, stdout);
+      pending.erase(0, lastLine + 1);
+    }
+  }
+  fflush(stdout);
+
+  *passed = pending == "pass\n";
+  return true;
+}
+
+}  // namespace ekam
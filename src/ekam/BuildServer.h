@@ -0,0 +1,80 @@
+// Ekam Build System
+// Author: Kenton Varda (kenton@sandstorm.io)
+// Copyright (c) 2010-2015 Kenton Varda, Google Inc., and contributors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef KENTONSCODE_EKAM_BUILDSERVER_H_
+#define KENTONSCODE_EKAM_BUILDSERVER_H_
+
+#include <string>
+
+#include "base/OwnedPtr.h"
+#include "os/EventManager.h"
+#include "os/Socket.h"
+#include "Dashboard.h"
+#include "MuxDashboard.h"
+#include "Driver.h"
+
+namespace ekam {
+
+// Lets other `ekam` invocations in the same directory get their results from a continuous
+// build which is already running, rather than scanning and building from scratch themselves.
+//
+// Wraps the build's dashboard, and listens on a unix socket.  Each client sends one line:
+//
+//   build [<file>]
+//
+// and is sent the build's output, as SimpleDashboard would print it, until the build is done
+// (see Driver::waitForBuild()), followed by a last line of "pass" or "fail".  Then the server
+// closes the connection.  A client which stops reading is disconnected once a megabyte of output
+// is waiting for it, rather than holding up the build.
+//
+// Sending "trace" instead gets a dump of Ekam's recent trace events (see base/Trace.h).
+class BuildServer : public Dashboard {
+public:
+  BuildServer(EventManager* eventManager, const std::string& socketPath,
+              OwnedPtr<Dashboard> baseDashboard);
+  ~BuildServer();
+
+  // Must be called before any client connects.
+  void setDriver(Driver* driver);
+
+  // Client side:  sends a request to the server listening at the path, copies its output to
+  // stdout, and sets *passed from the last line.  Returns false, having written nothing, if no
+  // server is listening.
+  static bool request(const std::string& socketPath, const std::string& canonicalName,
+                      bool* passed);
+
+  // implements Dashboard ----------------------------------------------------------------
+  OwnedPtr<Task> beginTask(const std::string& verb, const std::string& noun, Silence silence);
+  void setFocusListener(FocusListener* listener);
+
+private:
+  class Client;
+
+  EventManager* eventManager;
+  Driver* driver;
+  OwnedPtr<Dashboard> base;
+  MuxDashboard mux;
+  OwnedPtr<MuxDashboard::Connector> baseConnector;
+  ServerSocket socket;
+  Promise<void> acceptOp;
+  OwnedPtrMap<Client*, Client> clients;
+
+  Promise<void> doAccept();
+};
+
+}  // namespace ekam
+
+#endif  // KENTONSCODE_EKAM_BUILDSERVER_H_
@@ -0,0 +1,145 @@
+// Ekam Build System
+// Author: Kenton Varda (kenton@sandstorm.io)
+// Copyright (c) 2010-2015 Kenton Varda, Google Inc., and contributors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "BuildTrace.h"
+
+#include <fcntl.h>
+#include <algorithm>
+#include <stdio.h>
+
+#include "base/Clock.h"
+
+namespace ekam {
+
+namespace {
+
+// Flush once this much has accumulated.
+const size_t BUFFER_SIZE = 64 << 10;
+
+}  // namespace
+
+const int BuildTrace::DRIVER_LANE;
+
+BuildTrace::BuildTrace(const std::string& path)
+    : out(newOwned<ByteStream>(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)),
+      origin(monotonicMicros()), eventCount(0), namedLanes(0) {
+  buffer = "[\n";
+  nameLane(DRIVER_LANE, "driver");
+}
+
+BuildTrace::~BuildTrace() {
+  buffer.append("\n]\n");
+  flush();
+}
+
+uint64_t BuildTrace::now() {
+  return monotonicMicros() - origin;
+}
+
+int BuildTrace::acquireLane() {
+  size_t i = 0;
+  while (i < lanesInUse.size() && lanesInUse[i]) {
+    ++i;
+  }
+  if (i == lanesInUse.size()) {
+    lanesInUse.push_back(true);
+  } else {
+    lanesInUse[i] = true;
+  }
+
+  int lane = i + 1;
+  if (lane > namedLanes) {
+    char name[32];
+    snprintf(name, sizeof(name), "action %d", lane);
+    nameLane(lane, name);
+  }
+  return lane;
+}
+
+void BuildTrace::releaseLane(int lane) {
+  lanesInUse[lane - 1] = false;
+}
+
+void BuildTrace::addSlice(const std::string& name, const char* category, int lane,
+                          uint64_t start, uint64_t end, const std::string& args) {
+  char numbers[96];
+  snprintf(numbers, sizeof(numbers), "\"pid\": 1, \"tid\": %d, \"ts\": %llu, \"dur\": %llu",
+           lane, (unsigned long long)start, (unsigned long long)(end - start));
+
+  startEvent();
+  buffer.append("{\"ph\": \"X\", \"name\": \"");
+  buffer.append(escape(name));
+  buffer.append("\", \"cat\": \"");
+  buffer.append(category);
+  buffer.append("\", ");
+  buffer.append(numbers);
+  if (!args.empty()) {
+    buffer.append(", \"args\": {");
+    buffer.append(args);
+    buffer.push_back('}');
+  }
+  buffer.push_back('}');
+
+  if (buffer.size() >= BUFFER_SIZE) {
+    flush();
+  }
+
+  Total& total = lane == DRIVER_LANE ? totals[name.substr(0, name.find_first_of(':'))]
+                                     : totals[category];
+  total.micros += end - start;
+  ++total.count;
+}
+
+void BuildTrace::flush() {
+  out->writeAll(buffer.data(), buffer.size());
+  buffer.clear();
+}
+
+std::string BuildTrace::escape(const std::string& text) {
+  std::string result;
+  result.reserve(text.size());
+  for (std::string::const_iterator iter = text.begin(); iter != text.end(); ++iter) {
+    unsigned char c = *iter;
+    if (c == '"' || c == '\\') {
+      result.push_back('\\');
+      result.push_back(c);
+    } else if (c < 0x20) {
+      char escaped[8];
+      snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+      result.append(escaped);
+    } else {
+      result.push_back(c);
+    }
+  }
+  return result;
+}
+
+void BuildTrace::startEvent() {
+  buffer.append(eventCount++ == 0 ? "  " : ",\n  ");
+}
+
+void BuildTrace::nameLane(int lane, const std::string& name) {
+  char prefix[64];
+  snprintf(prefix, sizeof(prefix), "{\"ph\": \"M\", \"pid\": 1, \"tid\": %d, ", lane);
+  startEvent();
+  buffer.append(prefix);
+  buffer.append("\"name\": \"thread_name\", \"args\": {\"name\": \"");
+  buffer.append(escape(name));
+  buffer.append("\"}}");
+  namedLanes = std::max(namedLanes, lane);
+}
+
+}  // namespace ekam
@@ -0,0 +1,102 @@
+// Ekam Build System
+// Author: Kenton Varda (kenton@sandstorm.io)
+// Copyright (c) 2010-2015 Kenton Varda, Google Inc., and contributors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef KENTONSCODE_EKAM_BUILDTRACE_H_
+#define KENTONSCODE_EKAM_BUILDTRACE_H_
+
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "base/OwnedPtr.h"
+#include "os/ByteStream.h"
+
+namespace ekam {
+
+// Records a timeline of the build in Chrome's trace event format, for viewing with
+// chrome://tracing or https://ui.perfetto.dev.  Each running action occupies a numbered lane;
+// work done by the Driver itself is on lane 0.
+//
+// Events are written as they happen.  The closing bracket is only written on destruction, but
+// the viewers accept the file without it, so a continuous build's trace can be opened at any
+// time after flush().
+class BuildTrace {
+public:
+  BuildTrace(const std::string& path);
+  ~BuildTrace();
+
+  // Microseconds since the trace began.
+  uint64_t now();
+
+  // Lanes for actions.  The lowest free one is handed out, keeping the timeline compact.
+  int acquireLane();
+  void releaseLane(int lane);
+
+  static const int DRIVER_LANE = 0;
+
+  // Records a slice.  args, if non-empty, is the body of a JSON object, e.g. "\"count\": 3".
+  void addSlice(const std::string& name, const char* category, int lane,
+                uint64_t start, uint64_t end, const std::string& args = std::string());
+
+  // Write out buffered events.
+  void flush();
+
+  struct Total {
+    uint64_t micros;
+    uint64_t count;
+  };
+
+  // The slices recorded so far, summed by kind:  the category for actions, and for the Driver's
+  // own work, the name up to any ':' (e.g. "returned").  A Driver slice nested in another counts
+  // toward both.
+  const std::map<std::string, Total>& getTotals() { return totals; }
+
+  // Records a slice on the driver lane spanning the Scope's lifetime.  trace may be null.
+  class Scope {
+  public:
+    Scope(BuildTrace* trace, const char* name)
+        : trace(trace), name(name), start(trace == nullptr ? 0 : trace->now()) {}
+    ~Scope() {
+      if (trace != nullptr) trace->addSlice(name, "driver", DRIVER_LANE, start, trace->now());
+    }
+
+  private:
+    BuildTrace* trace;
+    const char* name;
+    uint64_t start;
+  };
+
+  static std::string escape(const std::string& text);
+
+private:
+  OwnedPtr<ByteStream> out;
+  std::string buffer;
+  uint64_t origin;  // CLOCK_MONOTONIC, in microseconds
+  uint64_t eventCount;
+
+  std::map<std::string, Total> totals;
+
+  std::vector<bool> lanesInUse;  // by lane, starting from 1
+  int namedLanes;
+
+  void startEvent();
+  void nameLane(int lane, const std::string& name);
+};
+
+}  // namespace ekam
+
+#endif  // KENTONSCODE_EKAM_BUILDTRACE_H_
@@ -18,13 +18,25 @@
 
 #include <sys/ioctl.h>
 #include <termios.h>
+#include <signal.h>
 #include <string.h>
 #include <ctype.h>
 
+#include "base/Clock.h"
 #include "base/Debug.h"
 
 namespace ekam {
 
+namespace {
+
+volatile sig_atomic_t windowResized = 0;
+
+void handleWindowResize(int) {
+  windowResized = 1;
+}
+
+}  // namespace
+
 class ConsoleDashboard::LogFormatter {
 public:
   LogFormatter(const std::string& text)
@@ -202,10 +214,9 @@ ConsoleDashboard::TaskImpl::TaskImpl(ConsoleDashboard* dashboard,
                                      Silence silence)
     : dashboard(dashboard), state(PENDING), silence(silence), verb(verb), noun(noun) {}
 ConsoleDashboard::TaskImpl::~TaskImpl() {
-  if (state == RUNNING) {
-    dashboard->clearRunning();
+  if (state == RUNNING && silence != SILENT) {
     removeFromRunning();
-    dashboard->drawRunning();
+    dashboard->changed();
   }
 }
 
@@ -222,8 +233,6 @@ void ConsoleDashboard::TaskImpl::setState(TaskState state) {
 
   this->state = state;
 
-  dashboard->clearRunning();
-
   switch (state) {
     case PENDING:
       // Don't display.
@@ -245,7 +254,7 @@ void ConsoleDashboard::TaskImpl::setState(TaskState state) {
       break;
   }
 
-  dashboard->drawRunning();
+  dashboard->changed();
 }
 
 void ConsoleDashboard::TaskImpl::addOutput(const std::string& text) {
@@ -265,22 +274,30 @@ void ConsoleDashboard::TaskImpl::removeFromRunning() {
 void ConsoleDashboard::TaskImpl::writeFinalLog(Color verbColor, const char* icon) {
   // Silent tasks should not be written to the log, unless they had error messages.
   if (silence != SILENT || !outputText.empty()) {
-    fprintf(dashboard->out, "%s%s %s:%s %s\n",
-            ANSI_COLOR_CODES[verbColor], icon, verb.c_str(), ANSI_CLEAR_COLOR, noun.c_str());
+    std::string& out = dashboard->pendingOutput;
+    out.append(ANSI_COLOR_CODES[verbColor]);
+    out.append(icon);
+    out.push_back(' ');
+    out.append(verb);
+    out.push_back(':');
+    out.append(ANSI_CLEAR_COLOR);
+    out.push_back(' ');
+    out.append(noun);
+    out.push_back('\n');
 
     // Write any output we have buffered.
     if (!outputText.empty()) {
       LogFormatter formatter(outputText);
-      struct winsize windowSize;
-      ioctl(dashboard->fd, TIOCGWINSZ, &windowSize);
+      dashboard->updateWindowSize();
 
       for (int i = 0; i < dashboard->maxDisplayedLogLines && !formatter.atEnd(); i++) {
-        std::string line = formatter.getLine(4, windowSize.ws_col);
-        fprintf(dashboard->out, "    %s\n", line.c_str());
+        out.append("    ");
+        out.append(formatter.getLine(4, dashboard->windowSize.ws_col));
+        out.push_back('\n');
       }
 
       if (!formatter.atEnd()) {
-        fprintf(dashboard->out, "    ...(log truncated; use -l to increase log limit)...\n");
+        out.append("    ...(log truncated; use -l to increase log limit)...\n");
       }
 
       outputText.clear();
@@ -322,16 +339,75 @@ const ConsoleDashboard::Color ConsoleDashboard::PASSED_COLOR = BRIGHT_GREEN;
 const ConsoleDashboard::Color ConsoleDashboard::FAILED_COLOR = BRIGHT_RED;
 const ConsoleDashboard::Color ConsoleDashboard::RUNNING_COLOR = BRIGHT_FUCHSIA;
 
-ConsoleDashboard::ConsoleDashboard(FILE* output, int maxDisplayedLogLines)
+const int ConsoleDashboard::REDRAWS_PER_SECOND;
+
+ConsoleDashboard::ConsoleDashboard(FILE* output, int maxDisplayedLogLines,
+                                   EventManager* eventManager)
     : fd(fileno(output)), out(output), maxDisplayedLogLines(maxDisplayedLogLines),
-      runningTasksLineCount(0), lastDebugMessageCount(DebugMessage::getMessageCount()) {}
-ConsoleDashboard::~ConsoleDashboard() {}
+      runningTasksLineCount(0), lastDebugMessageCount(DebugMessage::getMessageCount()),
+      eventManager(eventManager), lastRedrawTime(0) {
+  windowResized = 1;
+  updateWindowSize();
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = &handleWindowResize;
+  action.sa_flags = SA_RESTART;
+  sigaction(SIGWINCH, &action, NULL);
+}
+
+ConsoleDashboard::~ConsoleDashboard() {
+  if (redrawOp != nullptr) {
+    redrawOp.release();
+    redraw();
+  }
+  signal(SIGWINCH, SIG_DFL);
+}
 
 OwnedPtr<Dashboard::Task> ConsoleDashboard::beginTask(
     const std::string& verb, const std::string& noun, Silence silence) {
   return newOwned<TaskImpl>(this, verb, noun, silence);
 }
 
+void ConsoleDashboard::changed() {
+  if (eventManager == nullptr) {
+    redraw();
+    return;
+  }
+
+  if (redrawOp != nullptr) {
+    // Already scheduled.
+    return;
+  }
+
+  double wait = lastRedrawTime + 1.0 / REDRAWS_PER_SECOND - monotonicSeconds();
+  if (wait <= 0) {
+    redraw();
+    return;
+  }
+
+  redrawOp = eventManager->when(eventManager->onTimeout(static_cast<uint64_t>(wait * 1000) + 1))(
+    [this](Void) {
+      redrawOp.release();
+      redraw();
+    });
+}
+
+void ConsoleDashboard::redraw() {
+  clearRunning();
+  fputs(pendingOutput.c_str(), out);
+  pendingOutput.clear();
+  drawRunning();
+  lastRedrawTime = monotonicSeconds();
+}
+
+void ConsoleDashboard::updateWindowSize() {
+  if (windowResized) {
+    windowResized = 0;
+    ioctl(fd, TIOCGWINSZ, &windowSize);
+  }
+}
+
 void ConsoleDashboard::clearRunning() {
   if (lastDebugMessageCount != DebugMessage::getMessageCount()) {
     // Some debug messages were printed.  We don't want to clobber them.  So we can't clear.
@@ -345,8 +421,7 @@ void ConsoleDashboard::clearRunning() {
 }
 
 void ConsoleDashboard::drawRunning() {
-  struct winsize windowSize;
-  ioctl(fd, TIOCGWINSZ, &windowSize);
+  updateWindowSize();
 
   // Leave a few lines for completed tasks.
   int spaceForTasks = windowSize.ws_row - 4;
@@ -18,14 +18,19 @@
 #define KENTONSCODE_EKAM_CONSOLEDASHBOARD_H_
 
 #include <vector>
+#include <string>
 #include <stdio.h>
+#include <sys/ioctl.h>
 #include "Dashboard.h"
+#include "os/EventManager.h"
 
 namespace ekam {
 
 class ConsoleDashboard : public Dashboard {
 public:
-  ConsoleDashboard(FILE* output, int maxDisplayedLogLines);
+  // With an EventManager, the display is redrawn at most REDRAWS_PER_SECOND times a second.
+  // Without one, it is redrawn on every change.
+  ConsoleDashboard(FILE* output, int maxDisplayedLogLines, EventManager* eventManager = nullptr);
   ~ConsoleDashboard();
 
   // implements Dashboard ----------------------------------------------------------------
@@ -43,6 +48,17 @@ private:
   int runningTasksLineCount;
   int lastDebugMessageCount;
 
+  // Finished tasks' logs, written above the running tasks at the next redraw.
+  std::string pendingOutput;
+
+  // Updated on SIGWINCH.
+  struct winsize windowSize;
+
+  static const int REDRAWS_PER_SECOND = 10;
+  EventManager* eventManager;  // possibly null
+  Promise<void> redrawOp;
+  double lastRedrawTime;
+
   enum Color {
     BLACK,
     RED,
@@ -74,6 +90,11 @@ private:
 
   void clearRunning();
   void drawRunning();
+
+  // Something changed; redraw now or soon.
+  void changed();
+  void redraw();
+  void updateWindowSize();
 };
 
 }  // namespace ekam
@@ -16,8 +16,12 @@
 
 #include "CppActionFactory.h"
 
+#include <unordered_map>
 #include <unordered_set>
 #include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/stat.h>
 
 #include "base/Debug.h"
 #include "os/ByteStream.h"
@@ -46,8 +50,108 @@ bool isTestName(const std::string& name) {
   }
 }
 
+// Non-host architectures listed in CROSS_TARGETS.
+std::vector<std::string> getCrossTargets() {
+  std::vector<std::string> result;
+  const char* targets = getenv("CROSS_TARGETS");
+  if (targets != NULL) {
+    while (const char* spacepos = strchr(targets, ' ')) {
+      result.push_back(std::string(targets, spacepos));
+      targets = spacepos + 1;
+    }
+    result.push_back(targets);
+  }
+  return result;
+}
+
+// Looks up e.g. LIBS_aarch64_linux_gnu for the given target, falling back to LIBS.
+const char* getTargetEnv(const std::string& name, const std::string& target) {
+  if (!target.empty()) {
+    std::string targetName = name + "_" + target;
+    for (char& c: targetName) {
+      if (c == '-') c = '_';
+    }
+    const char* result = getenv(targetName.c_str());
+    if (result != nullptr) {
+      return result;
+    }
+  }
+  return getenv(name.c_str());
+}
+
+void addWords(Subprocess* subprocess, const char* words) {
+  if (words != NULL) {
+    while (const char* spacepos = strchr(words, ' ')) {
+      subprocess->addArgument(std::string(words, spacepos));
+      words = spacepos + 1;
+    }
+    subprocess->addArgument(words);
+  }
+}
+
 }  // namespace
 
+// Remembers the symbol tags parsed out of each deps file, so that the many links which share an
+// object don't each re-read and re-split its deps file.  Tags are interned, so an entry is just
+// an array of small ids.  Entries are keyed by path and validated by stat(), so a link only reads
+// the deps files which changed since the last link that used them.
+class LinkDepsCache {
+public:
+  LinkDepsCache() {}
+  ~LinkDepsCache() {}
+
+  // Returns null if the deps file doesn't exist.
+  const std::vector<Tag>* getSymbols(File* depsFile) {
+    std::string path = depsFile->getOnDisk(File::READ)->path();
+
+    // Taken before reading, so that a change made while reading is noticed next time.
+    struct stat stats;
+    if (stat(path.c_str(), &stats) < 0 || !S_ISREG(stats.st_mode)) {
+      return nullptr;
+    }
+
+    Entry& entry = entries[path];
+    if (!entry.isCurrent(stats)) {
+      std::string content = depsFile->readAll();
+      entry.symbols.clear();
+
+      // One buffer for every name, rather than a new string per symbol.
+      static const char PREFIX[] = "c++symbol:";
+      std::string name(PREFIX);
+      const char* pos = content.data();
+      const char* end = pos + content.size();
+      while (pos < end) {
+        const char* eol = static_cast<const char*>(memchr(pos, '\n', end - pos));
+        if (eol == nullptr) break;
+        name.resize(sizeof(PREFIX) - 1);
+        name.append(pos, eol - pos);
+        entry.symbols.push_back(Tag::fromName(name));
+        pos = eol + 1;
+      }
+      entry.stats = stats;
+    }
+    return &entry.symbols;
+  }
+
+private:
+  struct Entry {
+    struct stat stats;  // st_ino is zero until the entry is filled
+    std::vector<Tag> symbols;
+
+    Entry() { memset(&stats, 0, sizeof(stats)); }
+
+    bool isCurrent(const struct stat& now) const {
+      return stats.st_ino != 0 && now.st_dev == stats.st_dev && now.st_ino == stats.st_ino &&
+          now.st_size == stats.st_size &&
+          now.st_mtim.tv_sec == stats.st_mtim.tv_sec &&
+          now.st_mtim.tv_nsec == stats.st_mtim.tv_nsec &&
+          now.st_ctim.tv_sec == stats.st_ctim.tv_sec &&
+          now.st_ctim.tv_nsec == stats.st_ctim.tv_nsec;
+    }
+  };
+  std::unordered_map<std::string, Entry> entries;
+};
+
 class LinkAction : public Action {
 public:
   enum Mode {
@@ -57,17 +161,18 @@ public:
     NODEJS
   };
 
-  LinkAction(File* file, Mode mode);
+  LinkAction(File* file, Mode mode, LinkDepsCache* depsCache);
   ~LinkAction();
 
   // implements Action -------------------------------------------------------------------
+  Resources getResources();
   std::string getVerb();
   Promise<void> start(EventManager* eventManager, BuildContext* context);
 
 private:
   class DepsSet {
   public:
-    DepsSet() {}
+    DepsSet(LinkDepsCache* depsCache) : depsCache(depsCache) {}
     ~DepsSet() {}
 
     void addObject(BuildContext* context, File* objectFile);
@@ -76,7 +181,12 @@ private:
     }
 
   private:
+    LinkDepsCache* depsCache;
     OwnedPtrMap<File*, File, File::HashFunc, File::EqualFunc> deps;
+
+    // Symbols already looked up.  Most objects share many undefined symbols, and looking one up
+    // again would give the same answer.
+    std::unordered_set<Tag, Tag::HashFunc> resolved;
   };
 
   static const Tag GTEST_MAIN;
@@ -85,6 +195,7 @@ private:
 
   OwnedPtr<File> file;
   Mode mode;
+  LinkDepsCache* depsCache;
 
   Promise<void> startTarget(EventManager* eventManager, BuildContext* context,
                             const std::string& base, OwnedPtrVector<File>& flatDeps,
@@ -95,10 +206,18 @@ const Tag LinkAction::GTEST_MAIN = Tag::fromName("gtest:main");
 const Tag LinkAction::KJTEST_MAIN = Tag::fromName("kjtest:main");
 const Tag LinkAction::TEST_EXECUTABLE = Tag::fromName("test:executable");
 
-LinkAction::LinkAction(File* file, Mode mode) : file(file->clone()), mode(mode) {}
+LinkAction::LinkAction(File* file, Mode mode, LinkDepsCache* depsCache)
+    : file(file->clone()), mode(mode), depsCache(depsCache) {}
 
 LinkAction::~LinkAction() {}
 
+Action::Resources LinkAction::getResources() {
+  Resources result;
+  result.cpus += getCrossTargets().size();
+  result.remotable = true;
+  return result;
+}
+
 std::string LinkAction::getVerb() {
   return "link";
 }
@@ -113,22 +232,17 @@ void LinkAction::DepsSet::addObject(BuildContext* context, File* objectFile) {
   deps.add(rawptr, ptr.release());
 
   OwnedPtr<File> depsFile = getDepsFile(objectFile);
-  if (depsFile->exists()) {
-    std::string data = depsFile->readAll();
-
-    std::string::size_type prevPos = 0;
-    std::string::size_type pos = data.find_first_of('\n');
-
-    while (pos != std::string::npos) {
-      std::string symbolName(data, prevPos, pos - prevPos);
+  const std::vector<Tag>* symbols = depsCache->getSymbols(depsFile.get());
+  if (symbols != nullptr) {
+    for (size_t i = 0; i < symbols->size(); i++) {
+      if (!resolved.insert((*symbols)[i]).second) {
+        continue;
+      }
 
-      File* file = context->findProvider(Tag::fromName("c++symbol:" + symbolName));
+      File* file = context->findProvider((*symbols)[i]);
       if (file != NULL) {
         addObject(context, file);
       }
-
-      prevPos = pos + 1;
-      pos = data.find_first_of('\n', prevPos);
     }
   }
 }
@@ -136,7 +250,7 @@ void LinkAction::DepsSet::addObject(BuildContext* context, File* objectFile) {
 // ---------------------------------------------------------------------------------------
 
 Promise<void> LinkAction::start(EventManager* eventManager, BuildContext* context) {
-  DepsSet deps;
+  DepsSet deps(depsCache);
 
   if (mode == GTEST) {
     File* gtestMain = context->findProvider(GTEST_MAIN);
@@ -172,28 +286,19 @@ Promise<void> LinkAction::start(EventManager* eventManager, BuildContext* contex
 
   auto promise = startTarget(eventManager, context, base, flatDeps, "");
 
-  const char* targets = getenv("CROSS_TARGETS");
-  if (targets != NULL) {
-    auto addTarget = [&](std::string target) {
-      OwnedPtrVector<File> targetDeps;
-      for (int i = 0; i < flatDeps.size(); i++) {
-        std::string name, ext;
-        splitExtension(flatDeps.get(i)->basename(), &name, &ext);
-        targetDeps.add(flatDeps.get(i)->parent()->relative(name + '.' + target + ext));
-      }
-
-      promise = eventManager->when(std::move(promise))(
-          [this, target = std::move(target), targetDeps = std::move(targetDeps),
-           eventManager, context, base](Void) mutable {
-        return startTarget(eventManager, context, base, targetDeps, target);
-      });
-    };
-
-    while (const char* spacepos = strchr(targets, ' ')) {
-      addTarget(std::string(targets, spacepos));
-      targets = spacepos + 1;
+  // Links for each target are independent, so run them concurrently.  getResources() has
+  // already claimed a CPU for each.
+  for (const std::string& target: getCrossTargets()) {
+    OwnedPtrVector<File> targetDeps;
+    for (int i = 0; i < flatDeps.size(); i++) {
+      std::string name, ext;
+      splitExtension(flatDeps.get(i)->basename(), &name, &ext);
+      targetDeps.add(flatDeps.get(i)->parent()->relative(name + '.' + target + ext));
     }
-    addTarget(targets);
+
+    promise = eventManager->when(promise,
+        startTarget(eventManager, context, base, targetDeps, target))(
+        [](Void, Void) {});
   }
 
   return promise;
@@ -206,6 +311,10 @@ Promise<void> LinkAction::startTarget(
   const char* cxx = getenv("CXX");
 
   auto subprocess = newOwned<Subprocess>();
+  std::string launcher = context->getRemoteLauncher();
+  if (!launcher.empty()) {
+    addWords(subprocess.get(), launcher.c_str());
+  }
 
   std::string compiler = cxx == NULL ? "c++" : cxx;
 
@@ -229,6 +338,9 @@ Promise<void> LinkAction::startTarget(
     subprocess->addArgument("-static");
   }
 
+  // E.g. "-fuse-ld=mold -Wl,--threads" to use a faster, multi-threaded linker.
+  addWords(subprocess.get(), getTargetEnv("LINKFLAGS", target));
+
   subprocess->addArgument("-o");
 
   auto executableFile = context->newOutput(target.empty() ? base : (base + "." + target));
@@ -244,33 +356,19 @@ Promise<void> LinkAction::startTarget(
     subprocess->addArgument(flatDeps.get(i), File::READ);
   }
 
-  const char* libs = nullptr;
-  if (!target.empty()) {
-    // Look for arch-specific libs.
-    std::string targetLibsName = "LIBS_" + target;
-    for (char& c: targetLibsName) {
-      if (c == '-') c = '_';
-    }
-    libs = getenv(targetLibsName.c_str());
-  }
-
-  if (libs == nullptr) {
-    libs = getenv("LIBS");
-  }
+  const char* libs = getTargetEnv("LIBS", target);
 
-  if (libs != NULL) {
-    while (const char* spacepos = strchr(libs, ' ')) {
-      subprocess->addArgument(std::string(libs, spacepos));
-      libs = spacepos + 1;
-    }
-    subprocess->addArgument(libs);
-  }
+  addWords(subprocess.get(), libs);
 
   auto logStream = subprocess->captureStdoutAndStderr();
+  subprocess->setCpuTimeLimit(context->getCpuTimeLimit());
 
   auto subprocessWaitOp = eventManager->when(subprocess->start(eventManager))(
     [context](ProcessExitCode exitCode) {
       if (exitCode.wasSignaled() || exitCode.getExitCode() != 0) {
+        if (exitCode.wasSignaled() && exitCode.getSignalNumber() == SIGXCPU) {
+          context->log("killed after exceeding CPU time limit\n");
+        }
         context->failed();
       }
     });
@@ -293,7 +391,7 @@ const Tag CppActionFactory::GTEST_TEST = Tag::fromName("gtest:test");
 const Tag CppActionFactory::KJTEST_TEST = Tag::fromName("kjtest:test");
 const Tag CppActionFactory::NODEJS_MODULE = Tag::fromName("nodejs:module");
 
-CppActionFactory::CppActionFactory() {}
+CppActionFactory::CppActionFactory() : depsCache(newOwned<LinkDepsCache>()) {}
 CppActionFactory::~CppActionFactory() {}
 
 void CppActionFactory::enumerateTriggerTags(
@@ -310,17 +408,17 @@ OwnedPtr<Action> CppActionFactory::tryMakeAction(const Tag& id, File* file) {
   OwnedPtr<Action> result;
   for (unsigned int i = 0; i < (sizeof(MAIN_SYMBOLS) / sizeof(MAIN_SYMBOLS[0])); i++) {
     if (id == MAIN_SYMBOLS[i]) {
-      return newOwned<LinkAction>(file, LinkAction::NORMAL);
+      return newOwned<LinkAction>(file, LinkAction::NORMAL, depsCache.get());
     }
   }
   if (id == GTEST_TEST) {
-    return newOwned<LinkAction>(file, LinkAction::GTEST);
+    return newOwned<LinkAction>(file, LinkAction::GTEST, depsCache.get());
   }
   if (id == KJTEST_TEST) {
-    return newOwned<LinkAction>(file, LinkAction::KJTEST);
+    return newOwned<LinkAction>(file, LinkAction::KJTEST, depsCache.get());
   }
   if (id == NODEJS_MODULE) {
-    return newOwned<LinkAction>(file, LinkAction::NODEJS);
+    return newOwned<LinkAction>(file, LinkAction::NODEJS, depsCache.get());
   }
   return nullptr;
 }
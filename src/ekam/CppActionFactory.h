@@ -23,6 +23,8 @@
 
 namespace ekam {
 
+class LinkDepsCache;
+
 class CppActionFactory: public ActionFactory {
 public:
   CppActionFactory();
@@ -33,6 +35,8 @@ public:
   OwnedPtr<Action> tryMakeAction(const Tag& id, File* file);
 
 private:
+  OwnedPtr<LinkDepsCache> depsCache;
+
   static const Tag MAIN_SYMBOLS[];
   static const Tag GTEST_TEST;
   static const Tag KJTEST_TEST;
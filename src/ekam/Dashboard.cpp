@@ -20,5 +20,8 @@ namespace ekam {
 
 Dashboard::~Dashboard() {}
 Dashboard::Task::~Task() {}
+Dashboard::FocusListener::~FocusListener() {}
+
+void Dashboard::setFocusListener(FocusListener* listener) {}
 
 }
@@ -18,6 +18,7 @@
 #define KENTONSCODE_EKAM_DASHBOARD_H_
 
 #include <string>
+#include <vector>
 #include "base/OwnedPtr.h"
 
 namespace ekam {
@@ -50,6 +51,18 @@ public:
 
   virtual OwnedPtr<Task> beginTask(const std::string& verb, const std::string& noun,
                                    Silence silence) = 0;
+
+  // Told which source files users are working on, e.g. have open in an editor.
+  class FocusListener {
+  public:
+    virtual ~FocusListener();
+
+    // Replaces the previous focus.  Names are canonical.
+    virtual void setFocus(const std::vector<std::string>& canonicalNames) = 0;
+  };
+
+  // Only dashboards which hear from clients report focus.  The default ignores the listener.
+  virtual void setFocusListener(FocusListener* listener);
 };
 
 class EventManager;
@@ -16,20 +16,37 @@
 
 #include "Driver.h"
 
+#include <algorithm>
 #include <queue>
 #include <memory>
 #include <stdexcept>
 #include <errno.h>
+#include <fcntl.h>
 #include <string.h>
 #include <stdio.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 
+#include "base/Clock.h"
 #include "base/Debug.h"
 #include "os/EventGroup.h"
+#include "os/ByteStream.h"
 
 namespace ekam {
 
 namespace {
 
+// Added to the priorities (critical path lengths, in seconds) of focused actions (see
+// Driver::setFocus()), previously failed actions and those triggered by changed sources
+// respectively, so that each class goes ahead of the next, and all of them ahead of any
+// critical path.
+const double FOCUS_PRIORITY = 1e12;
+const double FAILED_PRIORITY = 1e9;
+const double CHANGED_PRIORITY = 1e6;
+
 int fileDepth(const std::string& name) {
   int result = 0;
   for (unsigned int i = 0; i < name.size(); i++) {
@@ -40,22 +57,62 @@ int fileDepth(const std::string& name) {
   return result;
 }
 
-int commonPrefixLength(const std::string& srcName, const std::string& bestMatchName) {
-  std::string::size_type n = std::min(srcName.size(), bestMatchName.size());
+// Looks up the verb's timeout, falling back to the default under the empty verb.
+double findTimeout(const std::unordered_map<std::string, double>& timeouts,
+                   const std::string& verb) {
+  std::unordered_map<std::string, double>::const_iterator iter = timeouts.find(verb);
+  if (iter == timeouts.end()) {
+    iter = timeouts.find(std::string());
+  }
+  return iter == timeouts.end() ? 0 : iter->second;
+}
+
+std::string directoryOf(const std::string& name) {
+  std::string::size_type pos = name.find_last_of('/');
+  return pos == std::string::npos ? std::string() : name.substr(0, pos + 1);
+}
+
+// Length of the longest common prefix of the two names which ends at a directory boundary.
+// directory must be empty or end with '/'.
+int commonDirectoryPrefixLength(const std::string& directory, const std::string& name) {
+  std::string::size_type n = std::min(directory.size(), name.size());
+  int result = 0;
   for (unsigned int i = 0; i < n; i++) {
-    if (srcName[i] != bestMatchName[i]) {
-      return i;
+    if (directory[i] != name[i]) {
+      break;
+    } else if (directory[i] == '/') {
+      result = i + 1;
     }
   }
-  return n;
+  return result;
 }
 
 }  // namespace
 
-class Driver::ActionDriver : public BuildContext, public EventGroup::ExceptionHandler {
+// Sets driver->resetCause for the Scope's lifetime.  Cheap enough to use whether or not there is
+// an explainer.
+class Driver::ExplainScope {
+public:
+  ExplainScope(Driver* driver, Provision* provision, const char* how,
+               ActionDriver* parent = nullptr)
+      : driver(driver), saved(driver->resetCause) {
+    driver->resetCause.provision = provision;
+    driver->resetCause.how = how;
+    driver->resetCause.parent = parent;
+  }
+  ~ExplainScope() {
+    driver->resetCause = saved;
+  }
+
+private:
+  Driver* driver;
+  ResetCause saved;
+};
+
+class Driver::ActionDriver : public BuildContext, public EventGroup::ExceptionHandler,
+                             public OwnedPtrListNode<ActionDriver> {
 public:
-  ActionDriver(Driver* driver, OwnedPtr<Action> action,
-               File* srcfile, Hash srcHash, OwnedPtr<Dashboard::Task> task);
+  ActionDriver(Driver* driver, OwnedPtr<Action> action, File* srcfile, Hash srcHash);
   ~ActionDriver();
 
   void start();
@@ -63,6 +120,7 @@ public:
   // implements BuildContext -------------------------------------------------------------
   File* findProvider(Tag id);
   File* findInput(const std::string& path);
+  std::vector<File*> findModifiers(File* file, const std::string& name);
 
   void provide(File* file, const std::vector<Tag>& tags);
   void install(File* file, InstallLocation location, const std::string& name);
@@ -72,6 +130,12 @@ public:
 
   void addActionType(OwnedPtr<ActionFactory> factory);
 
+  double getHistoricalDuration(const std::string& canonicalName);
+  void recordDuration(double seconds);
+  void uncacheable();
+  double getCpuTimeLimit();
+  std::string getRemoteLauncher();
+
   void passed();
   void failed();
 
@@ -84,7 +148,12 @@ private:
   Driver* driver;
   OwnedPtr<Action> action;
   OwnedPtr<File> srcfile;
+  std::string srcDirectory;  // Directory part of srcfile's canonical name.
   Hash srcHash;
+
+  // Created by getDashboardTask() once the action starts, so that actions reset before they
+  // ever run cost the dashboard nothing.  Silent actions get one only if there's something to
+  // show, i.e. output or a result other than DONE (see setDashboardState()).
   OwnedPtr<Dashboard::Task> dashboardTask;
 
   // TODO:  Get rid of "state".  Maybe replace with "status" or something, but don't try to
@@ -105,8 +174,22 @@ private:
   bool isRunning;
   Promise<void> runningAction;
 
+  // Fires if the action runs past its timeout.  Waits on driver->eventManager rather than
+  // eventGroup, since it must not keep the action from completing.
+  Promise<void> timeoutOp;
+
+  // Files created by newOutput(), while the action runs.
   OwnedPtrVector<File> outputs;
 
+  // Hashes of provisions' files made by driver->fileHasher once the action finished, parallel
+  // to provisions.  Used, and cleared, by returned().
+  std::vector<FileHasher::Result> outputHashes;
+
+  // Bytes of output passed to the dashboard during the current run.  Output past
+  // driver->logLimit goes to logSpill instead, so that chatty actions don't fill memory.
+  uint64_t logBytes = 0;
+  OwnedPtr<ByteStream> logSpill;
+
   struct Installation {
     File* file;
     InstallLocation location;
@@ -116,16 +199,93 @@ private:
 
   OwnedPtrVector<Provision> provisions;
   OwnedPtrVector<std::vector<Tag> > providedTags;
+  // Indexes into provisions and providedTags by file, while the action runs.
+  std::unordered_map<File*, int, File::HashFunc, File::EqualFunc> provisionIndex;
   OwnedPtrVector<ActionFactory> providedFactories;
 
+  // Provisions from before the last reset(), if any.  When we next complete, those we
+  // reproduce exactly are kept along with their dependents (early cutoff); the rest are reset.
+  OwnedPtr<StaleOutputs> stale;
+
+  // Key under which this action is stored in driver->actionCache.
+  Hash cacheKey;
+
+  // True if the current results were replayed from driver->actionCache rather than produced by
+  // actually running the action.
+  bool replayedFromCache = false;
+
+  // True if the cache entry named a dependency that isn't available (yet).  We don't run the
+  // action until the driver is otherwise idle, since the dependency will probably show up.
+  bool blockedOnCache = false;
+
+  // If true, the next start() will not consult the cache.
+  bool bypassCache = false;
+
+  // False if the current run called uncacheable().
+  bool cacheable = true;
+
+  // Scheduling priority; see Driver::prioritizedActions.
+  double priority = 0;
+  std::multimap<double, ActionDriver*>::iterator priorityPos;
+
+  // Position in Driver::resourceBlockedByPriority, if in resourceBlockedActions.
+  std::multimap<double, ActionDriver*>::iterator resourceBlockedPos;
+
+  // Resources claimed while running.  Captured at start time so that we release exactly what we
+  // claimed.
+  Action::Resources resources;
+
+  // Whether the current run was placed on a remote worker.
+  bool remote = false;
+
+  // When the action last started running, and how long it took, if it completed successfully.
+  double startTime = 0;
+  double duration = -1;
+
+  // Duration passed to recordDuration() during the current run, or negative.
+  double recordedDuration = -1;
+
+  // For driver->trace:  when the action was last queued or started, the lane it runs on, and
+  // counts over the current run (except resetCount, which is over the action's lifetime).
+  uint64_t traceQueuedTime = 0;
+  uint64_t traceStartTime = 0;
+  int traceLane = 0;
+  int findProviderCalls = 0;
+  uint64_t outputBytes = 0;
+  int resetCount = 0;
+
+  // For driver->explainer:  the source change whose cascade of resets last reached this action,
+  // valid if cascadeGeneration matches driver->explainGeneration.
+  std::string cascadeRoot;
+  uint64_t cascadeGeneration = 0;
+
   // True if returned() is currently on the stack.  Causes destructor to abort.  Used for
   // debugging.
   bool currentlyExecutingReturned = false;
 
+  enum ReplayResult {
+    REPLAY_MISSED,
+    REPLAY_BLOCKED,
+    REPLAY_SUCCEEDED
+  };
+
+  std::string historyKey();
   void ensureRunning();
+  bool tryReplayFromCache();
+  // Asks the kernel to start reading the inputs recorded in the action's stale cache entry.
+  void prefetchInputs();
+  ReplayResult replay(const ActionCache::Entry* entry);
+  void recordInCache();
   void queueDoneCallback();
+  void timedOut(double seconds);
+  void traceRun(const char* result);
   void returned();
   void reset();
+
+  Dashboard::Task* getDashboardTask();
+  void setDashboardState(Dashboard::TaskState state);
+  bool reuseStaleProvision(int index);
+  void discardStaleProvisions();
   Provision* choosePreferredProvider(const Tag& tag);
   File* provideInternal(File* file, const std::vector<Tag>& tags);
 
@@ -133,11 +293,10 @@ private:
 };
 
 Driver::ActionDriver::ActionDriver(Driver* driver, OwnedPtr<Action> action,
-                                   File* srcfile, Hash srcHash,
-                                   OwnedPtr<Dashboard::Task> task)
-    : driver(driver), action(action.release()), srcfile(srcfile->clone()), srcHash(srcHash),
-      dashboardTask(task.release()), state(PENDING), eventGroup(driver->eventManager, this),
-      isRunning(false) {}
+                                   File* srcfile, Hash srcHash)
+    : driver(driver), action(action.release()), srcfile(srcfile->clone()),
+      srcDirectory(directoryOf(srcfile->canonicalName())), srcHash(srcHash), state(PENDING),
+      eventGroup(driver->eventManager, this), isRunning(false) {}
 Driver::ActionDriver::~ActionDriver() {
   assert(!currentlyExecutingReturned);
 }
@@ -153,7 +312,41 @@ void Driver::ActionDriver::start() {
 
   state = RUNNING;
   isRunning = true;
-  dashboardTask->setState(Dashboard::RUNNING);
+  startTime = monotonicSeconds();
+  recordedDuration = -1;
+  cacheable = true;
+  logBytes = 0;
+  setDashboardState(Dashboard::RUNNING);
+
+  if (driver->trace != nullptr) {
+    traceStartTime = driver->trace->now();
+    traceLane = driver->trace->acquireLane();
+    findProviderCalls = 0;
+    outputBytes = 0;
+  }
+
+  if (driver->actionCache != nullptr) {
+    cacheKey = driver->actionCache->makeKey(action->getVerb(), action->getIdentity(),
+                                            srcfile->getOnDisk(File::READ)->path());
+    bool useCache = !bypassCache;
+    bypassCache = false;
+    if (useCache && tryReplayFromCache()) {
+      return;
+    }
+    if (driver->prefetch && !remote) {
+      prefetchInputs();
+    }
+  }
+
+  double timeout = findTimeout(driver->timeouts, action->getVerb());
+  if (timeout > 0) {
+    timeoutOp = driver->eventManager->when(
+        driver->eventManager->onTimeout(static_cast<uint64_t>(timeout * 1000)))(
+      [this, timeout](Void) {
+        timeoutOp.release();
+        timedOut(timeout);
+      });
+  }
 
   asyncCallbackOp = eventGroup.when()(
     [this]() {
@@ -162,8 +355,201 @@ void Driver::ActionDriver::start() {
     });
 }
 
+std::string Driver::ActionDriver::historyKey() {
+  return action->getVerb() + " " + srcfile->canonicalName();
+}
+
+bool Driver::ActionDriver::tryReplayFromCache() {
+  const ActionCache::Entry* entry = driver->actionCache->find(cacheKey);
+  if (entry != nullptr && entry->srcHash == srcHash && replay(entry) != REPLAY_MISSED) {
+    return true;
+  }
+
+  OwnedPtr<ActionCache::Entry> remoteEntry = driver->actionCache->findRemote(cacheKey, srcHash);
+  if (remoteEntry != nullptr && replay(remoteEntry.get()) != REPLAY_MISSED) {
+    // Remember it locally, too.
+    driver->actionCache->put(cacheKey, remoteEntry.release());
+    return true;
+  }
+
+  return false;
+}
+
+void Driver::ActionDriver::prefetchInputs() {
+  // The action will most likely read what it read last time, even though something changed.
+  const ActionCache::Entry* entry = driver->actionCache->find(cacheKey);
+  if (entry == nullptr) {
+    return;
+  }
+
+  for (size_t i = 0; i < entry->dependencies.size(); i++) {
+    const ActionCache::Dependency& dep = entry->dependencies[i];
+    if (!dep.found) continue;
+    Provision* provision = choosePreferredProvider(dep.tag);
+    if (provision == nullptr) continue;
+
+    // Only a hint, so errors are ignored.
+    int fd = open(provision->file->getOnDisk(File::READ)->path().c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+      posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+      close(fd);
+      ++driver->stats.inputsPrefetched;
+    }
+  }
+}
+
+Driver::ActionDriver::ReplayResult Driver::ActionDriver::replay(
+    const ActionCache::Entry* entry) {
+  // Files which the action could have legitimately provided without creating them.
+  std::unordered_map<std::string, File*> knownFiles;
+  knownFiles[srcfile->getOnDisk(File::READ)->path()] = srcfile.get();
+
+  // Check dependencies, recording them exactly as findProvider() would have so that we get
+  // reset if they change.
+  for (size_t i = 0; i < entry->dependencies.size(); i++) {
+    const ActionCache::Dependency& dep = entry->dependencies[i];
+    Provision* provision = choosePreferredProvider(dep.tag);
+    driver->dependencyTable.add(dep.tag, this, provision);
+
+    if (provision == nullptr) {
+      if (dep.found) {
+        // The dependency hasn't been built yet.  Running the action now would most likely fail
+        // for the same reason, so wait for it to show up.
+        blockedOnCache = true;
+        state = FAILED;
+        queueDoneCallback();
+        return REPLAY_BLOCKED;
+      }
+    } else if (!dep.found || provision->contentHash != dep.contentHash) {
+      driver->dependencyTable.erase<DependencyTable::ACTION>(this);
+      return REPLAY_MISSED;
+    } else {
+      knownFiles[provision->file->getOnDisk(File::READ)->path()] = provision->file.get();
+    }
+  }
+
+  // Check that all outputs are still intact, fetching missing ones from the remote store.
+  std::string tmpPrefix = driver->tmp->getOnDisk(File::READ)->path() + "/";
+  std::vector<File*> provided;
+  bool intact = true;
+  for (size_t i = 0; i < entry->outputs.size() && intact; i++) {
+    const ActionCache::Output& output = entry->outputs[i];
+    bool isTemporary = output.path.compare(0, tmpPrefix.size(), tmpPrefix) == 0;
+    OwnedPtr<File> file;
+    if (isTemporary) {
+      file = driver->tmp->relative(output.path.substr(tmpPrefix.size()));
+    } else {
+      std::unordered_map<std::string, File*>::iterator iter = knownFiles.find(output.path);
+      if (iter == knownFiles.end()) {
+        intact = false;
+        break;
+      }
+      file = iter->second->clone();
+    }
+
+    if (!file->exists() || file->contentHash() != output.contentHash) {
+      if (!isTemporary) {
+        intact = false;
+        break;
+      }
+      driver->createParentDirectory(file.get());
+      if (!driver->actionCache->fetchRemote(output.contentHash, file.get()) ||
+          file->contentHash() != output.contentHash) {
+        intact = false;
+        break;
+      }
+    }
+
+    provided.push_back(provideInternal(file.get(), output.tags));
+    if (isTemporary) {
+      outputs.add(file.release());
+    }
+  }
+
+  if (!intact) {
+    driver->dependencyTable.erase<DependencyTable::ACTION>(this);
+    provisions.clear();
+    providedTags.clear();
+    provisionIndex.clear();
+    outputs.clear();
+    return REPLAY_MISSED;
+  }
+
+  for (size_t i = 0; i < entry->installations.size(); i++) {
+    const ActionCache::Installation& installation = entry->installations[i];
+    Installation replayed = {
+      provided[installation.output], (InstallLocation)installation.location, installation.name
+    };
+    installations.push_back(replayed);
+  }
+
+  replayedFromCache = true;
+  state = entry->passed ? PASSED : DONE;
+  queueDoneCallback();
+  return REPLAY_SUCCEEDED;
+}
+
+void Driver::ActionDriver::recordInCache() {
+  if (!providedFactories.empty()) {
+    // We can't serialize action factories.
+    return;
+  }
+
+  OwnedPtr<ActionCache::Entry> entry = newOwned<ActionCache::Entry>();
+  entry->srcHash = srcHash;
+  entry->passed = state == PASSED;
+
+  for (DependencyTable::SearchIterator<DependencyTable::ACTION>
+       iter(driver->dependencyTable, this); iter.next();) {
+    Provision* provision = iter.cell<DependencyTable::PROVISION>();
+    ActionCache::Dependency dep;
+    dep.tag = iter.cell<DependencyTable::TAG>();
+    dep.found = provision != nullptr;
+    if (dep.found) {
+      dep.contentHash = provision->contentHash;
+    }
+    entry->dependencies.push_back(dep);
+  }
+
+  std::string tmpPrefix = driver->tmp->getOnDisk(File::READ)->path() + "/";
+  std::vector<File*> outputFiles;
+  for (int i = 0; i < provisions.size(); i++) {
+    ActionCache::Output output;
+    output.path = provisions.get(i)->file->getOnDisk(File::READ)->path();
+    output.contentHash = provisions.get(i)->contentHash;
+    output.tags = *providedTags.get(i);
+    entry->outputs.push_back(output);
+
+    // Only files we created are worth uploading.
+    bool isTemporary = output.path.compare(0, tmpPrefix.size(), tmpPrefix) == 0;
+    outputFiles.push_back(isTemporary ? provisions.get(i)->file.get() : nullptr);
+  }
+
+  for (size_t i = 0; i < installations.size(); i++) {
+    ActionCache::Installation installation;
+    installation.output = -1;
+    for (int j = 0; j < provisions.size(); j++) {
+      if (provisions.get(j)->file.get() == installations[i].file) {
+        installation.output = j;
+        break;
+      }
+    }
+    if (installation.output == -1) {
+      // Installed file was deleted before the action completed.
+      return;
+    }
+    installation.location = installations[i].location;
+    installation.name = installations[i].name;
+    entry->installations.push_back(installation);
+  }
+
+  driver->actionCache->publish(cacheKey, *entry, outputFiles);
+  driver->actionCache->put(cacheKey, entry.release());
+}
+
 File* Driver::ActionDriver::findProvider(Tag tag) {
   ensureRunning();
+  ++findProviderCalls;
 
   Provision* provision = choosePreferredProvider(tag);
 
@@ -181,6 +567,21 @@ File* Driver::ActionDriver::findInput(const std::string& path) {
   return findProvider(Tag::fromFile(path));
 }
 
+std::vector<File*> Driver::ActionDriver::findModifiers(File* file, const std::string& name) {
+  ensureRunning();
+
+  const ModifierChain& chain = driver->findModifierChain(file, name, srcDirectory);
+  std::vector<File*> result;
+  for (size_t i = 0; i < chain.tags.size(); i++) {
+    Provision* provision = chain.providers[i];
+    driver->dependencyTable.add(chain.tags[i], this, provision);
+    if (provision != NULL) {
+      result.push_back(provision->file.get());
+    }
+  }
+  return result;
+}
+
 void Driver::ActionDriver::provide(File* file, const std::vector<Tag>& tags) {
   provideInternal(file, tags);
 }
@@ -189,25 +590,22 @@ File* Driver::ActionDriver::provideInternal(File* file, const std::vector<Tag>&
   ensureRunning();
 
   // Find existing provision for this file, if any.
-  // TODO:  Convert provisions into a map?
-  Provision* provision = NULL;
-  for (int i = 0; i < provisions.size(); i++) {
-    if (provisions.get(i)->file->equals(file)) {
-      provision = provisions.get(i);
-      providedTags.get(i)->insert(providedTags.get(i)->end(), tags.begin(), tags.end());
-      break;
-    }
-  }
-
-  if (provision == NULL) {
-    auto ownedProvision = newOwned<Provision>();
-    provision = ownedProvision.get();
-    provision->creator = this;
-    provisions.add(ownedProvision.release());
-    providedTags.add(newOwned<std::vector<Tag>>(tags));
+  std::unordered_map<File*, int, File::HashFunc, File::EqualFunc>::iterator iter =
+      provisionIndex.find(file);
+  if (iter != provisionIndex.end()) {
+    std::vector<Tag>* existingTags = providedTags.get(iter->second);
+    existingTags->insert(existingTags->end(), tags.begin(), tags.end());
+    // Keep the existing File, since installations may point at it.
+    return provisions.get(iter->second)->file.get();
   }
 
+  auto ownedProvision = newOwned<Provision>();
+  Provision* provision = ownedProvision.get();
+  provision->creator = this;
   provision->file = file->clone();
+  provisionIndex[provision->file.get()] = provisions.size();
+  provisions.add(ownedProvision.release());
+  providedTags.add(newOwned<std::vector<Tag>>(tags));
   return provision->file.get();
 }
 
@@ -227,14 +625,44 @@ void Driver::ActionDriver::install(File* file, InstallLocation location, const s
 
 void Driver::ActionDriver::log(const std::string& text) {
   ensureRunning();
-  dashboardTask->addOutput(text);
+  outputBytes += text.size();
+
+  uint64_t limit = driver->logLimit;
+  if (limit == 0 || logBytes + text.size() <= limit) {
+    logBytes += text.size();
+    getDashboardTask()->addOutput(text);
+    return;
+  }
+
+  // Show up to the last complete line that fits.
+  size_t shown = logBytes < limit ? limit - logBytes : 0;
+  if (shown > 0) {
+    std::string::size_type eol = text.find_last_of('\n', shown - 1);
+    shown = eol == std::string::npos ? 0 : eol + 1;
+  }
+  logBytes += text.size();
+
+  try {
+    if (logSpill == nullptr) {
+      OwnedPtr<File> file = driver->tmp->relative(
+          srcfile->canonicalName() + "." + action->getVerb() + ".log");
+      driver->createParentDirectory(file.get());
+      std::string path = file->getOnDisk(File::WRITE)->path();
+      logSpill = newOwned<ByteStream>(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+      getDashboardTask()->addOutput(text.substr(0, shown) + (shown > 0 ? "" : "\n") +
+          "...(log truncated; remaining output is in " + path + ")...\n");
+    }
+    logSpill->writeAll(text.data() + shown, text.size() - shown);
+  } catch (const std::exception& e) {
+    DEBUG_ERROR << "Writing log for " << historyKey() << " failed: " << e.what();
+  }
 }
 
 OwnedPtr<File> Driver::ActionDriver::newOutput(const std::string& path) {
   ensureRunning();
   OwnedPtr<File> file = driver->tmp->relative(path);
 
-  recursivelyCreateDirectory(file->parent().get());
+  driver->createParentDirectory(file.get());
 
   OwnedPtr<File> result = file->clone();
 
@@ -261,6 +689,34 @@ void Driver::ActionDriver::noMoreEvents() {
   }
 }
 
+double Driver::ActionDriver::getHistoricalDuration(const std::string& canonicalName) {
+  ensureRunning();
+  if (driver->history == nullptr) {
+    return -1;
+  }
+  return driver->history->getDuration(action->getVerb() + " " + canonicalName);
+}
+
+void Driver::ActionDriver::recordDuration(double seconds) {
+  ensureRunning();
+  recordedDuration = seconds;
+}
+
+void Driver::ActionDriver::uncacheable() {
+  ensureRunning();
+  cacheable = false;
+}
+
+double Driver::ActionDriver::getCpuTimeLimit() {
+  ensureRunning();
+  return findTimeout(driver->cpuTimeouts, action->getVerb());
+}
+
+std::string Driver::ActionDriver::getRemoteLauncher() {
+  ensureRunning();
+  return remote ? driver->remoteLauncher : std::string();
+}
+
 void Driver::ActionDriver::passed() {
   ensureRunning();
 
@@ -298,6 +754,23 @@ void Driver::ActionDriver::ensureRunning() {
 }
 
 void Driver::ActionDriver::queueDoneCallback() {
+  if (state != FAILED && !replayedFromCache && driver->fileHasher != nullptr &&
+      !provisions.empty()) {
+    std::vector<File*> files;
+    for (int i = 0; i < provisions.size(); i++) {
+      files.push_back(provisions.get(i)->file.get());
+    }
+    asyncCallbackOp = driver->eventManager->when(driver->fileHasher->hash(files))(
+      [this](std::vector<FileHasher::Result> hashes) {
+        asyncCallbackOp.release();
+        outputHashes = std::move(hashes);
+        Driver* driver = this->driver;
+        returned();  // may delete this
+        driver->startSomeActions();
+      });
+    return;
+  }
+
   asyncCallbackOp = driver->eventManager->when()(
     [this]() {
       asyncCallbackOp.release();
@@ -307,9 +780,27 @@ void Driver::ActionDriver::queueDoneCallback() {
     });
 }
 
+void Driver::ActionDriver::timedOut(double seconds) {
+  if (state != RUNNING) {
+    // Finished just in time; the done callback is already queued.
+    return;
+  }
+
+  char buffer[64];
+  snprintf(buffer, sizeof(buffer), "timed out after %g seconds\n", seconds);
+  log(buffer);
+
+  // returned() cancels the action, killing its processes, and frees up its slot.
+  asyncCallbackOp.release();
+  state = FAILED;
+  Driver* driver = this->driver;
+  returned();  // may delete this
+  driver->startSomeActions();
+}
+
 void Driver::ActionDriver::threwException(const std::exception& e) {
   ensureRunning();
-  dashboardTask->addOutput(std::string("uncaught exception: ") + e.what() + "\n");
+  getDashboardTask()->addOutput(std::string("uncaught exception: ") + e.what() + "\n");
   asyncCallbackOp.release();
   state = FAILED;
   returned();
@@ -317,7 +808,7 @@ void Driver::ActionDriver::threwException(const std::exception& e) {
 
 void Driver::ActionDriver::threwUnknownException() {
   ensureRunning();
-  dashboardTask->addOutput("uncaught exception of unknown type\n");
+  getDashboardTask()->addOutput("uncaught exception of unknown type\n");
   asyncCallbackOp.release();
   state = FAILED;
   returned();
@@ -348,6 +839,20 @@ Deferred<Func> defer(Func&& func) {
 }
 
 
+void Driver::ActionDriver::traceRun(const char* result) {
+  BuildTrace* trace = driver->trace;
+  uint64_t end = trace->now();
+
+  char args[256];
+  snprintf(args, sizeof(args),
+      "\"result\": \"%s\", \"queued_us\": %llu, \"find_provider_calls\": %d, "
+      "\"output_bytes\": %llu, \"resets\": %d",
+      result, (unsigned long long)(traceStartTime - std::min(traceQueuedTime, traceStartTime)),
+      findProviderCalls, (unsigned long long)outputBytes, resetCount);
+  trace->addSlice(historyKey(), "action", traceLane, traceStartTime, end, args);
+  trace->releaseLane(traceLane);
+}
+
 void Driver::ActionDriver::returned() {
   ensureRunning();
 
@@ -356,49 +861,123 @@ void Driver::ActionDriver::returned() {
     currentlyExecutingReturned = false;
   });
 
+  // Everything from here on is the Driver's bookkeeping, traced separately from the run.
+  uint64_t traceReturnedTime = 0;
+  if (driver->trace != nullptr) {
+    traceRun(replayedFromCache ? "cached" : state == FAILED ? "failed" :
+             state == PASSED ? "passed" : "done");
+    traceReturnedTime = driver->trace->now();
+  }
+  auto traceReturned = defer([this, traceReturnedTime]() {
+    if (driver->trace != nullptr) {
+      driver->trace->addSlice("returned: " + historyKey(), "driver", BuildTrace::DRIVER_LANE,
+                              traceReturnedTime, driver->trace->now());
+    }
+  });
+
   // Cancel anything still running.
   runningAction.release();
+  timeoutOp.release();
   isRunning = false;
+  logSpill.clear();
 
   // Pull self out of driver->activeActions.
-  OwnedPtr<ActionDriver> self;
-  for (int i = 0; i < driver->activeActions.size(); i++) {
-    if (driver->activeActions.get(i) == this) {
-      self = driver->activeActions.releaseAndShift(i);
-      break;
-    }
-  }
-
-  driver->completedActionPtrs.add(this, self.release());
+  driver->completedActionPtrs.add(this, driver->releaseActiveAction(this));
 
   if (state == FAILED) {
+    // An action waiting for a cached dependency hasn't actually failed.  It will be retried
+    // once the driver is otherwise idle.
+    if (!blockedOnCache) {
+      driver->failedActions.insert(historyKey());
+      driver->reportFailure();
+    }
+
     // Failed, possibly due to missing dependencies.
+    discardStaleProvisions();
     provisions.clear();
     installations.clear();
     providedTags.clear();
+    provisionIndex.clear();
     providedFactories.clear();
     outputs.clear();
-    dashboardTask->setState(Dashboard::BLOCKED);
+    outputHashes.clear();
+    setDashboardState(Dashboard::BLOCKED);
   } else {
-    dashboardTask->setState(state == PASSED ? Dashboard::PASSED : Dashboard::DONE);
+    driver->failedActions.erase(historyKey());
+    setDashboardState(state == PASSED ? Dashboard::PASSED : Dashboard::DONE);
+
+    if (!replayedFromCache) {
+      duration = monotonicSeconds() - startTime;
+      if (driver->history != nullptr) {
+        driver->history->setDuration(historyKey(),
+            recordedDuration >= 0 ? recordedDuration : duration);
+      }
+    }
 
     // Remove outputs which were deleted before the action completed.  Some actions create
     // files and then delete them immediately.
+    // providedTags parallels provisions, so filter it the same way.  Likewise outputHashes,
+    // which may be short if provisions were added after hashing began.
     OwnedPtrVector<Provision> provisionsToFilter;
+    OwnedPtrVector<std::vector<Tag> > tagsToFilter;
+    std::vector<FileHasher::Result> hashesToFilter;
     provisions.swap(&provisionsToFilter);
+    providedTags.swap(&tagsToFilter);
+    outputHashes.swap(hashesToFilter);
     for (int i = 0; i < provisionsToFilter.size(); i++) {
       if (provisionsToFilter.get(i)->file->exists()) {
         provisions.add(provisionsToFilter.release(i));
+        providedTags.add(tagsToFilter.release(i));
+        if (static_cast<size_t>(i) < hashesToFilter.size()) {
+          outputHashes.push_back(hashesToFilter[i]);
+        }
+      }
+    }
+
+    std::vector<bool> reused;
+    for (int i = 0; i < provisions.size(); i++) {
+      Provision* provision = provisions.get(i);
+      if (static_cast<size_t>(i) < outputHashes.size() &&
+          outputHashes[i].isCurrent(provision->file.get())) {
+        provision->contentHash = outputHashes[i].hash;
+      } else {
+        // Not hashed yet, or rewritten since.
+        provision->contentHash = provision->file->contentHash();
+      }
+      reused.push_back(reuseStaleProvision(i));
+    }
+    outputHashes.clear();
+
+    // Where we rewrote a file with different content, whatever it triggered is replaced, but
+    // the replacements inherit the old outputs in case those come out the same.
+    if (stale != nullptr) {
+      for (int i = 0; i < stale->provisions.size(); i++) {
+        for (int j = 0; j < provisions.size(); j++) {
+          if (!reused[j] && stale->provisions.get(i)->file->equals(provisions.get(j)->file.get())) {
+            driver->orphanTriggeredOutputs(stale->provisions.get(i));
+            break;
+          }
+        }
       }
     }
+    discardStaleProvisions();
 
     // Register providers.  But, don't allow our own dependencies to depend on them.
-    std::unordered_set<ActionDriver*> deps;
-    driver->getTransitiveDependencies(this, &deps);
+    AncestorSet ancestors(driver, this);
     for (int i = 0; i < provisions.size(); i++) {
-      driver->registerProvider(provisions.get(i), *providedTags.get(i), deps);
+      driver->registerProvider(provisions.get(i), *providedTags.get(i), &ancestors, reused[i]);
+    }
+    driver->discardOrphanedOutputs();
+    if (driver->actionCache != nullptr && !replayedFromCache) {
+      if (cacheable) {
+        recordInCache();
+      } else {
+        driver->actionCache->erase(cacheKey);
+      }
     }
     providedTags.clear();  // Not needed anymore.
+    provisionIndex.clear();
+    outputs.clear();  // The provisions have their own copies.
 
     // Register factories.
     for (int i = 0; i < providedFactories.size(); i++) {
@@ -409,6 +988,10 @@ void Driver::ActionDriver::returned() {
     // Install files.
     for (size_t i = 0; i < installations.size(); i++) {
       File* installDir = driver->installDirs[installations[i].location];
+      if (driver->installer != nullptr) {
+        driver->queueInstall(installations[i].file, installDir, installations[i].name);
+        continue;
+      }
       OwnedPtr<File> target = installDir->relative(installations[i].name);
       if (target->exists()) {
         target->unlink();
@@ -422,7 +1005,36 @@ void Driver::ActionDriver::returned() {
       }
       target->link(installations[i].file);
     }
+    driver->startInstalls();
+  }
+}
+
+Dashboard::Task* Driver::ActionDriver::getDashboardTask() {
+  if (dashboardTask == nullptr) {
+    dashboardTask = driver->dashboard->beginTask(
+        action->getVerb(), srcfile->canonicalName(),
+        action->isSilent() ? Dashboard::SILENT : Dashboard::NORMAL);
+    if (isRunning) {
+      dashboardTask->setState(Dashboard::RUNNING);
+    }
+  }
+  return dashboardTask.get();
+}
+
+void Driver::ActionDriver::setDashboardState(Dashboard::TaskState state) {
+  if (dashboardTask == nullptr) {
+    // No dashboard shows a silent task which runs and finishes quietly, so don't tell them
+    // about it at all.
+    if (action->isSilent() && (state == Dashboard::RUNNING || state == Dashboard::DONE)) {
+      return;
+    }
+    if (state == Dashboard::RUNNING) {
+      // Created in that state.
+      getDashboardTask();
+      return;
+    }
   }
+  getDashboardTask()->setState(state);
 }
 
 void Driver::ActionDriver::reset() {
@@ -434,18 +1046,27 @@ void Driver::ActionDriver::reset() {
   }
 
   OwnedPtr<ActionDriver> self;
+  bool wasRunning = isRunning;
+  ++resetCount;
+  ++driver->stats.actionsReset;
+  if (driver->explainer != nullptr) {
+    driver->explainReset(this);
+  }
 
   if (isRunning) {
-    dashboardTask->setState(Dashboard::BLOCKED);
+    if (driver->trace != nullptr) {
+      traceRun("canceled");
+    }
+    // A silent action canceled before saying anything has nothing to show.
+    if (dashboardTask != nullptr) {
+      dashboardTask->setState(Dashboard::BLOCKED);
+    }
     runningAction.release();
+    timeoutOp.release();
     asyncCallbackOp.release();
+    logSpill.clear();
 
-    for (int i = 0; i < driver->activeActions.size(); i++) {
-      if (driver->activeActions.get(i) == this) {
-        self = driver->activeActions.releaseAndShift(i);
-        break;
-      }
-    }
+    self = driver->releaseActiveAction(this);
 
     isRunning = false;
   } else {
@@ -455,6 +1076,8 @@ void Driver::ActionDriver::reset() {
   }
 
   state = PENDING;
+  replayedFromCache = false;
+  blockedOnCache = false;
 
   // Put on back of queue (as opposed to front) so that actions which are frequently reset
   // don't get redundantly rebuilt too much.  We add the action to the queue before resetting
@@ -463,16 +1086,26 @@ void Driver::ActionDriver::reset() {
   //   action queue should really be a graph that remembers what depended on what the last
   //   time we ran them, and avoids re-running any action before re-running actions on which it
   //   depended last time.
-  driver->pendingActions.pushBack(self.release());
+  driver->queuePendingAction(self.release(), false);
 
-  // Reset dependents.
-  for (int i = 0; i < provisions.size(); i++) {
-    driver->resetDependentActions(provisions.get(i));
+  // Don't reset dependents yet:  if we reproduce our outputs exactly, they needn't rebuild.
+  // (If we were still running, our provisions were never registered.)
+  if (!wasRunning && !provisions.empty()) {
+    assert(stale == nullptr);
+    stale = newOwned<StaleOutputs>();
+    for (int i = 0; i < provisions.size(); i++) {
+      std::vector<Tag> tags;
+      driver->retireProvision(provisions.get(i), &tags);
+      std::sort(tags.begin(), tags.end());
+      stale->tags.push_back(tags);
+      stale->provisions.add(provisions.release(i));
+    }
   }
 
   // Actions created by any provided ActionFactories must be deleted.
   for (int i = 0; i < providedFactories.size(); i++) {
     ActionFactory* factory = providedFactories.get(i);
+    ExplainScope explainScope(driver, nullptr, "factory reset", this);
 
     std::vector<ActionDriver*> actionsToDelete;
     for (ActionTriggersTable::SearchIterator<ActionTriggersTable::FACTORY>
@@ -483,16 +1116,7 @@ void Driver::ActionDriver::reset() {
 
     for (size_t j = 0; j < actionsToDelete.size(); j++) {
       actionsToDelete[j]->reset();
-
-      // TODO:  Use better data structure for pendingActions.  For now we have to iterate
-      //   through the whole thing to find the action we're deleting.  We iterate from the back
-      //   since it's likely the action was just added there.
-      for (int k = driver->pendingActions.size() - 1; k >= 0; k--) {
-        if (driver->pendingActions.get(k) == actionsToDelete[j]) {
-          driver->pendingActions.releaseAndShift(k);
-          break;
-        }
-      }
+      driver->deletePendingAction(actionsToDelete[j]);
     }
 
     driver->actionTriggersTable.erase<ActionTriggersTable::FACTORY>(factory);
@@ -505,72 +1129,66 @@ void Driver::ActionDriver::reset() {
   provisions.clear();
   installations.clear();
   providedTags.clear();
+  provisionIndex.clear();
   providedFactories.clear();
   outputs.clear();
 }
 
-Driver::Provision* Driver::ActionDriver::choosePreferredProvider(const Tag& tag) {
-  TagTable::SearchIterator<TagTable::TAG> iter(driver->tagTable, tag);
-
-  if (!iter.next()) {
-    return NULL;
-  } else {
-    std::string srcName = srcfile->canonicalName();
-    Provision* bestMatch = iter.cell<TagTable::PROVISION>();
-
-    if (iter.next()) {
-      // There are multiple files with this tag.  We must choose which one we like best.
-      std::string bestMatchName = bestMatch->file->canonicalName();
-      int bestMatchDepth = fileDepth(bestMatchName);
-      int bestMatchCommonPrefix = commonPrefixLength(srcName, bestMatchName);
-
-      do {
-        Provision* candidate = iter.cell<TagTable::PROVISION>();
-        std::string candidateName = candidate->file->canonicalName();
-        int candidateDepth = fileDepth(candidateName);
-        int candidateCommonPrefix = commonPrefixLength(srcName, candidateName);
-        if (candidateCommonPrefix < bestMatchCommonPrefix) {
-          // Prefer provider that is closer in the directory tree.
-          continue;
-        } else if (candidateCommonPrefix == bestMatchCommonPrefix) {
-          if (candidateDepth > bestMatchDepth) {
-            // Prefer provider that is less deeply nested.
-            continue;
-          } else if (candidateDepth == bestMatchDepth) {
-            // Arbitrarily -- but consistently -- choose one.
-            int diff = bestMatchName.compare(candidateName);
-            if (diff < 0) {
-              // Prefer file that comes first alphabetically.
-              continue;
-            } else if (diff == 0) {
-              // TODO:  Is this really an error?  I think it is for the moment, but someday it
-              //   may not be, if multiple actions are allowed to produce outputs with the same
-              //   canonical names.
-              DEBUG_ERROR << "Two providers have same file name: " << bestMatchName;
-              continue;
-            }
-          }
-        }
+bool Driver::ActionDriver::reuseStaleProvision(int index) {
+  if (stale == nullptr) {
+    return false;
+  }
 
-        // If we get here, the candidate is better than the existing best match.
-        bestMatch = candidate;
-        bestMatchName.swap(candidateName);
-        bestMatchDepth = candidateDepth;
-        bestMatchCommonPrefix = candidateCommonPrefix;
-      } while(iter.next());
+  Provision* provision = provisions.get(index);
+  std::vector<Tag> tags = *providedTags.get(index);
+  driver->addInlineTags(provision->file.get(), &tags);  // retired along with the provided tags
+  std::sort(tags.begin(), tags.end());
+
+  for (int i = 0; i < stale->provisions.size(); i++) {
+    Provision* old = stale->provisions.get(i);
+    if (old->contentHash == provision->contentHash && stale->tags[i] == tags &&
+        old->file->equals(provision->file.get())) {
+      DEBUG_INFO << "Output unchanged: " << old->canonicalName;
+      OwnedPtr<Provision> reused = stale->provisions.releaseAndShift(i);
+      stale->tags.erase(stale->tags.begin() + i);
+      reused->creator = this;  // may have been adopted from a replaced action
+      reused->file = provision->file.release();  // installations point at this File
+      provisions.set(index, reused.release());
+      return true;
     }
+  }
+  return false;
+}
 
-    return bestMatch;
+void Driver::ActionDriver::discardStaleProvisions() {
+  // Resetting dependents can get back here through deletePendingAction(), so detach first.
+  OwnedPtr<StaleOutputs> old = stale.release();
+  if (old != nullptr) {
+    driver->discardStaleOutputs(old.get());
   }
 }
 
+Driver::Provision* Driver::ActionDriver::choosePreferredProvider(const Tag& tag) {
+  return driver->choosePreferredProvider(tag, srcDirectory);
+}
+
 // =======================================================================================
 
 Driver::Driver(EventManager* eventManager, Dashboard* dashboard, File* tmp,
                File* installDirs[BuildContext::INSTALL_LOCATION_COUNT], int maxConcurrentActions,
-               ActivityObserver* activityObserver)
+               ActivityObserver* activityObserver, ActionCache* actionCache,
+               ActionHistory* history)
     : eventManager(eventManager), dashboard(dashboard), tmp(tmp),
-      maxConcurrentActions(maxConcurrentActions), activityObserver(activityObserver) {
+      maxConcurrentActions(maxConcurrentActions), memoryBudget(0), logLimit(0), remoteSlots(0),
+      prefetch(false),
+      activeCpus(0), activeMemory(0), activeRemoteCpus(0), batchDepth(0), scanning(false),
+      activityObserver(activityObserver),
+      actionCache(actionCache), history(history), hashCache(nullptr), fileHasher(nullptr),
+      installer(nullptr), tmpDevice(0), tmpInode(0), installing(false), trace(nullptr),
+      explainer(nullptr), graph(nullptr), resetCause(), explainGeneration(1), stats(),
+      actionsSinceIdle(0), busySince(0), failedSinceIdle(false), resourcesReleased(false) {
+  stats.firstFailureSeconds = -1;
+
   if (!tmp->isDirectory()) {
     tmp->createDirectory();
   }
@@ -582,53 +1200,253 @@ Driver::Driver(EventManager* eventManager, Dashboard* dashboard, File* tmp,
 
 Driver::~Driver() {}
 
-void Driver::addActionFactory(ActionFactory* factory) {
-  std::vector<Tag> triggerTags;
-  factory->enumerateTriggerTags(std::back_inserter(triggerTags));
-  for (unsigned int i = 0; i < triggerTags.size(); i++) {
-    triggers.add(triggerTags[i], factory);
-  }
+void Driver::setMemoryBudget(uint64_t bytes) {
+  memoryBudget = bytes;
 }
 
-void Driver::addSourceFile(File* file) {
-  OwnedPtr<Provision> provision;
-  if (rootProvisions.release(file, &provision)) {
-    // Source file was modified.  Reset all actions dependent on the old version.
-    resetDependentActions(provision.get());
-  }
+void Driver::setLogLimit(uint64_t bytes) {
+  logLimit = bytes;
+}
 
-  // Apply default tag.
-  std::vector<Tag> tags;
-  tags.push_back(Tag::DEFAULT_TAG);
+void Driver::setFileHasher(FileHasher* hasher) {
+  fileHasher = hasher;
+}
 
-  provision = newOwned<Provision>();
-  provision->creator = nullptr;
-  provision->file = file->clone();
-  registerProvider(provision.get(), tags, std::unordered_set<ActionDriver*>());
-  File* key = provision->file.get();  // cannot inline due to undefined evaluation order
-  rootProvisions.add(key, provision.release());
+void Driver::setInstaller(Installer* installer) {
+  this->installer = installer;
+}
 
-  startSomeActions();
+void Driver::setPrefetch(bool prefetch) {
+  this->prefetch = prefetch;
 }
 
-void Driver::removeSourceFile(File* file) {
-  OwnedPtr<Provision> provision;
-  if (rootProvisions.release(file, &provision)) {
-    resetDependentActions(provision.get());
+void Driver::setRemoteLauncher(int slots, const std::string& launcher) {
+  remoteSlots = slots;
+  remoteLauncher = launcher;
+}
 
-    // In case some active actions were canceled.
-    startSomeActions();
-  } else {
-    DEBUG_ERROR << "Tried to remove source file that wasn't ever added: " << file->canonicalName();
+void Driver::setTimeout(const std::string& verb, double seconds) {
+  timeouts[verb] = seconds;
+}
+
+void Driver::setCpuTimeout(const std::string& verb, double seconds) {
+  cpuTimeouts[verb] = seconds;
+}
+
+void Driver::setHashCache(HashCache* cache) {
+  hashCache = cache;
+}
+
+void Driver::setTrace(BuildTrace* trace) {
+  this->trace = trace;
+}
+
+void Driver::setExplainer(ResetExplainer* explainer) {
+  this->explainer = explainer;
+}
+
+void Driver::setActionGraph(ActionGraph* graph) {
+  this->graph = graph;
+}
+
+bool Driver::setGoal(const std::string& canonicalName) {
+  goalActions.clear();
+  if (!graph->findClosure(canonicalName, &goalActions)) {
+    goal.clear();
+    return false;
+  }
+  goal = canonicalName;
+  return true;
+}
+
+void Driver::setFocus(const std::vector<std::string>& canonicalNames) {
+  focus.clear();
+  focus.insert(canonicalNames.begin(), canonicalNames.end());
+  focusActions.clear();
+  if (graph != nullptr) {
+    for (size_t i = 0; i < canonicalNames.size(); i++) {
+      graph->findTriggeredClosure(canonicalNames[i], &focusActions);
+    }
+  }
+
+  for (OwnedPtrList<ActionDriver>::Iterator iter(pendingActions); iter.next();) {
+    updatePriority(iter.value());
+  }
+  for (OwnedPtrList<ActionDriver>::Iterator iter(resourceBlockedActions); iter.next();) {
+    ActionDriver* action = iter.value();
+    resourceBlockedByPriority.erase(action->resourceBlockedPos);
+    action->resourceBlockedPos = resourceBlockedByPriority.insert(
+        std::make_pair(-computePriority(action), action));
+  }
+}
+
+const uint64_t Driver::Stats::REBUILD_BUCKET_BOUNDS[REBUILD_BUCKET_COUNT] = {
+  1, 10, 100, 1000, 10000
+};
+
+Driver::Stats Driver::getStats() {
+  Stats result = stats;
+  result.pendingActions = pendingActions.size() + resourceBlockedActions.size();
+  result.activeActions = activeActions.size();
+  result.completedActions = completedActionPtrs.size();
+  result.failedActions = 0;
+  for (OwnedPtrMap<ActionDriver*, ActionDriver>::Iterator iter(completedActionPtrs); iter.next();) {
+    if (iter.key()->state == ActionDriver::FAILED) {
+      ++result.failedActions;
+    }
+  }
+  result.tagTableSize = tagTable.size();
+  result.dependencyTableSize = dependencyTable.size();
+  return result;
+}
+
+void Driver::addActionFactory(ActionFactory* factory) {
+  std::vector<Tag> triggerTags;
+  factory->enumerateTriggerTags(std::back_inserter(triggerTags));
+  for (unsigned int i = 0; i < triggerTags.size(); i++) {
+    triggers.add(triggerTags[i], factory);
+  }
+}
+
+void Driver::addSourceFile(File* file) {
+  addSourceFile(file, file->contentHash());
+}
+
+void Driver::addSourceFile(File* file, const Hash& contentHash) {
+  Provision* existing = rootProvisions.get(file);
+  if (existing != nullptr && existing->contentHash == contentHash) {
+    // Touched but not changed.  Nothing depending on it needs to rebuild.
+    return;
+  }
+
+  OwnedPtr<Provision> provision;
+  if (rootProvisions.release(file, &provision)) {
+    // Source file was modified.  Reset all actions dependent on the old version.  The actions it
+    // triggered are replaced, but their outputs are handed down to the replacements.
+    orphanTriggeredOutputs(provision.get());
+    resetDependentActions(provision.get());
+  }
+
+  // Apply default tag.
+  std::vector<Tag> tags;
+  tags.push_back(Tag::DEFAULT_TAG);
+
+  if (!scanning) {
+    changedSources.insert(file->canonicalName());
+  }
+
+  provision = newOwned<Provision>();
+  provision->creator = nullptr;
+  provision->file = file->clone();
+  provision->contentHash = contentHash;
+  registerProvider(provision.get(), tags, nullptr, false);
+  File* key = provision->file.get();  // cannot inline due to undefined evaluation order
+  rootProvisions.add(key, provision.release());
+
+  discardOrphanedOutputs();
+
+  startSomeActions();
+}
+
+void Driver::removeSourceFile(File* file) {
+  OwnedPtr<Provision> provision;
+  if (rootProvisions.release(file, &provision)) {
+    resetDependentActions(provision.get());
+
+    // In case some active actions were canceled.
+    startSomeActions();
+  } else {
+    DEBUG_ERROR << "Tried to remove source file that wasn't ever added: " << file->canonicalName();
+  }
+}
+
+void Driver::beginBatch() {
+  ++batchDepth;
+}
+
+void Driver::setScanning(bool scanning) {
+  this->scanning = scanning;
+  if (!scanning) {
+    startSomeActions();
+  }
+}
+
+void Driver::endBatch() {
+  assert(batchDepth > 0);
+  if (--batchDepth == 0) {
+    startSomeActions();
   }
 }
 
 void Driver::startSomeActions() {
-  while (activeActions.size() < maxConcurrentActions && !pendingActions.empty()) {
+  if (batchDepth > 0) {
+    // Will be called again by endBatch().
+    return;
+  }
+
+  while (activeCpus < maxConcurrentActions || activeRemoteCpus < remoteSlots) {
+    bool localFull = activeCpus >= maxConcurrentActions;
+    bool remote = false;
+
+    // Prefer actions that were previously held back for lack of resources.  None of them fit
+    // last time we looked, so there's no point looking again until something releases resources.
+    ActionDriver* ready = nullptr;
+    if (resourcesReleased) {
+      for (std::multimap<double, ActionDriver*>::iterator iter =
+               resourceBlockedByPriority.begin();
+           iter != resourceBlockedByPriority.end(); ++iter) {
+        if (hasResourcesFor(iter->second, &remote)) {
+          ready = iter->second;
+          break;
+        }
+      }
+      if (ready == nullptr) {
+        resourcesReleased = false;
+      }
+    }
+
+    OwnedPtr<ActionDriver> actionDriver;
+    if (ready != nullptr) {
+      actionDriver = releaseResourceBlockedAction(ready);
+    } else if (localFull) {
+      // Only remote workers have room, so don't pull actions which can't use them off the
+      // queue.
+      for (ActionDriver* candidate : remotablePendingActions) {
+        if (hasResourcesFor(candidate, &remote)) {
+          ready = candidate;
+          break;
+        }
+      }
+      if (ready == nullptr) {
+        break;
+      }
+      actionDriver = releasePendingAction(ready);
+    } else if (pendingActions.empty()) {
+      break;
+    } else {
+      actionDriver = dequeuePendingAction();
+      if (!hasResourcesFor(actionDriver.get(), &remote)) {
+        blockOnResources(actionDriver.release());
+        continue;
+      }
+    }
+
     if (activityObserver != nullptr) activityObserver->startingAction();
-    OwnedPtr<ActionDriver> actionDriver = pendingActions.popFront();
     ActionDriver* ptr = actionDriver.get();
-    activeActions.add(actionDriver.release());
+    ptr->resources = ptr->action->getResources();
+    ptr->remote = remote;
+    if (remote) {
+      activeRemoteCpus += ptr->resources.cpus;
+    } else {
+      activeCpus += ptr->resources.cpus;
+      activeMemory += ptr->resources.memory;
+    }
+    activeActions.pushBack(actionDriver.release());
+    ++stats.actionsStarted;
+    if (actionsSinceIdle++ == 0) {
+      busySince = monotonicSeconds();
+      checkCreatedDirs();
+    }
     try {
       ptr->start();
     } catch (const std::exception& e) {
@@ -638,76 +1456,663 @@ void Driver::startSomeActions() {
     }
   }
 
-  if (activeActions.size() == 0) {
+  if (activeActions.size() == 0 && !scanning && !installing) {
+    if (retryCacheBlockedActions()) {
+      startSomeActions();
+      return;
+    }
+
+    if (!offGoalActions.empty() && !goalReached()) {
+      // The goal's actions ran out without producing it, so last run's graph is no guide.
+      DEBUG_INFO << "Goal " << goal << " not produced; building everything.";
+      abandonGoal();
+      startSomeActions();
+      return;
+    }
+
+    bool ranActions = actionsSinceIdle > 0;
+    if (actionsSinceIdle > 0) {
+      for (int i = 0; i < Stats::REBUILD_BUCKET_COUNT; i++) {
+        if (actionsSinceIdle <= Stats::REBUILD_BUCKET_BOUNDS[i]) {
+          ++stats.rebuildBuckets[i];
+        }
+      }
+      ++stats.rebuildCount;
+      stats.rebuildActions += actionsSinceIdle;
+      actionsSinceIdle = 0;
+    }
+    failedSinceIdle = false;
+    changedSources.clear();
+
+    if (history != nullptr) {
+      updateCriticalPaths();
+      history->save();
+    }
+    if (graph != nullptr) {
+      updateGraph();
+      graph->save();
+    }
+    if (hashCache != nullptr) {
+      hashCache->save();
+    }
+#ifdef __GLIBC__
+    if (ranActions) {
+      // Resets free many small objects at once, which glibc otherwise keeps, leaving the
+      // process at its high-water mark for as long as it keeps watching.
+      malloc_trim(0);
+    }
+#endif
+    if (trace != nullptr) {
+      trace->flush();
+    }
+    if (explainer != nullptr) {
+      explainCosts();
+      explainer->write();
+      ++explainGeneration;
+    }
+
     bool hasFailures = dumpErrors();
     if (activityObserver != nullptr) activityObserver->idle(hasFailures);
+    checkBuildWaits(true, hasFailures);
+  } else {
+    checkBuildWaits(false, false);
+  }
+}
+
+void Driver::queueInstall(File* file, File* installDir, const std::string& name) {
+  Installer::Request request;
+  request.source = file->getOnDisk(File::READ)->path();
+  request.target = installDir->relative(name)->getOnDisk(File::WRITE)->path();
+  queuedInstalls.push_back(std::move(request));
+}
+
+void Driver::createParentDirectory(File* file) {
+  OwnedPtr<File> dir = file->parent();
+  std::string name = dir->canonicalName();
+  if (createdDirs.count(name) > 0) {
+    return;
+  }
+
+  recursivelyCreateDirectory(dir.get());
+
+  // Its ancestors exist now too.
+  while (createdDirs.insert(name).second) {
+    std::string::size_type slashPos = name.find_last_of('/');
+    if (slashPos == std::string::npos) break;
+    name.erase(slashPos);
+  }
+}
+
+void Driver::checkCreatedDirs() {
+  struct stat stats;
+  if (stat(tmp->getOnDisk(File::READ)->path().c_str(), &stats) < 0) {
+    memset(&stats, 0, sizeof(stats));
+  }
+  if (stats.st_dev != tmpDevice || stats.st_ino != tmpInode || stats.st_ino == 0) {
+    createdDirs.clear();
+    tmpDevice = stats.st_dev;
+    tmpInode = stats.st_ino;
+  }
+}
+
+void Driver::startInstalls() {
+  if (installing || queuedInstalls.empty()) {
+    return;
+  }
+
+  installing = true;
+  installOp = eventManager->when(installer->install(std::move(queuedInstalls)))(
+    [this](Void) {
+      installing = false;
+      installOp.release();
+      startInstalls();
+      // May have been all that kept the build from going idle.
+      startSomeActions();
+    });
+  queuedInstalls.clear();
+}
+
+Driver::BuildWaiter::~BuildWaiter() {}
+
+void Driver::waitForBuild(const std::string& canonicalName, BuildWaiter* waiter) {
+  BuildWait wait;
+  wait.waiter = waiter;
+  if (!canonicalName.empty() && graph != nullptr &&
+      graph->findClosure(canonicalName, &wait.actions)) {
+    wait.canonicalName = canonicalName;
+  } else {
+    wait.actions.clear();
+  }
+  buildWaits.push_back(std::move(wait));
+
+  bool idle = activeActions.empty() && pendingActions.empty() && resourceBlockedActions.empty() &&
+      !installing;
+  checkBuildWaits(idle, idle && dumpErrors());
+}
+
+void Driver::cancelWait(BuildWaiter* waiter) {
+  for (size_t i = 0; i < buildWaits.size(); i++) {
+    if (buildWaits[i].waiter == waiter) {
+      buildWaits.erase(buildWaits.begin() + i);
+      return;
+    }
+  }
+}
+
+bool Driver::isBuildingAny(const std::unordered_set<std::string>& actions) {
+  OwnedPtrList<ActionDriver>* lists[] = {
+    &activeActions, &pendingActions, &resourceBlockedActions, &offGoalActions
+  };
+  for (OwnedPtrList<ActionDriver>* list : lists) {
+    for (OwnedPtrList<ActionDriver>::Iterator iter(*list); iter.next();) {
+      if (actions.count(iter.value()->historyKey()) > 0) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+void Driver::checkBuildWaits(bool idle, bool hasFailures) {
+  if (buildWaits.empty() || batchDepth > 0 || scanning) {
+    return;
+  }
+
+  std::vector<std::pair<BuildWaiter*, bool> > done;
+  for (size_t i = 0; i < buildWaits.size();) {
+    BuildWait& wait = buildWaits[i];
+    if (wait.canonicalName.empty()) {
+      if (!idle) {
+        ++i;
+        continue;
+      }
+      done.push_back(std::make_pair(wait.waiter, hasFailures));
+    } else {
+      if (!idle && isBuildingAny(wait.actions)) {
+        ++i;
+        continue;
+      }
+      bool failed = tagTable.find<TagTable::TAG>(
+          Tag::fromName("canonical:" + wait.canonicalName)) == nullptr;
+      for (OwnedPtrMap<ActionDriver*, ActionDriver>::Iterator iter(completedActionPtrs);
+           iter.next() && !failed;) {
+        failed = iter.key()->state == ActionDriver::FAILED &&
+                 wait.actions.count(iter.key()->historyKey()) > 0;
+      }
+      done.push_back(std::make_pair(wait.waiter, failed));
+    }
+    buildWaits.erase(buildWaits.begin() + i);
+  }
+
+  // Waiters may wait again, so call them once the list is consistent.
+  for (size_t i = 0; i < done.size(); i++) {
+    done[i].first->buildDone(done[i].second);
+  }
+}
+
+double Driver::computePriority(ActionDriver* action) {
+  std::string key = action->historyKey();
+  double priority = history == nullptr ? 0 : history->getCriticalPath(key);
+  if (!focus.empty() &&
+      (focusActions.count(key) > 0 || focus.count(action->srcfile->canonicalName()) > 0)) {
+    priority += FOCUS_PRIORITY;
+  }
+  if (failedActions.count(key) > 0 && !action->blockedOnCache) {
+    priority += FAILED_PRIORITY;
+  } else if (!changedSources.empty() &&
+             changedSources.count(action->srcfile->canonicalName()) > 0) {
+    priority += CHANGED_PRIORITY;
+  }
+  return priority;
+}
+
+void Driver::updatePriority(ActionDriver* action) {
+  if (action->priority > 0) {
+    prioritizedActions.erase(action->priorityPos);
+  }
+
+  action->priority = computePriority(action);
+  if (action->priority > 0) {
+    action->priorityPos = prioritizedActions.insert(std::make_pair(action->priority, action));
+  }
+}
+
+void Driver::queuePendingAction(OwnedPtr<ActionDriver> action, bool atFront) {
+  ActionDriver* ptr = action.get();
+  if (trace != nullptr) {
+    ptr->traceQueuedTime = trace->now();
+  }
+  if (!goal.empty() && goalActions.count(ptr->historyKey()) == 0) {
+    offGoalActions.pushBack(action.release());
+    return;
+  }
+  if (atFront) {
+    pendingActions.pushFront(action.release());
+  } else {
+    pendingActions.pushBack(action.release());
+  }
+
+  updatePriority(ptr);
+
+  if (remoteSlots > 0 && ptr->action->getResources().remotable) {
+    remotablePendingActions.insert(ptr);
+  }
+}
+
+OwnedPtr<Driver::ActionDriver> Driver::dequeuePendingAction() {
+  if (prioritizedActions.empty()) {
+    OwnedPtr<ActionDriver> result = pendingActions.popFront();
+    remotablePendingActions.erase(result.get());
+    return result;
+  } else {
+    std::multimap<double, ActionDriver*>::iterator last = prioritizedActions.end();
+    --last;
+    return releasePendingAction(last->second);
+  }
+}
+
+OwnedPtr<Driver::ActionDriver> Driver::releasePendingAction(ActionDriver* action) {
+  if (action->priority > 0) {
+    prioritizedActions.erase(action->priorityPos);
+    action->priority = 0;
+  }
+  remotablePendingActions.erase(action);
+  return pendingActions.release(action);
+}
+
+void Driver::blockOnResources(OwnedPtr<ActionDriver> action) {
+  ActionDriver* ptr = action.get();
+  ptr->resourceBlockedPos = resourceBlockedByPriority.insert(
+      std::make_pair(-computePriority(ptr), ptr));
+  resourceBlockedActions.pushBack(action.release());
+}
+
+OwnedPtr<Driver::ActionDriver> Driver::releaseResourceBlockedAction(ActionDriver* action) {
+  resourceBlockedByPriority.erase(action->resourceBlockedPos);
+  return resourceBlockedActions.release(action);
+}
+
+void Driver::deletePendingAction(ActionDriver* action) {
+  // Whatever used its old outputs won't be revalidated now.
+  action->discardStaleProvisions();
+
+  if (pendingActions.contains(action)) {
+    releasePendingAction(action);
+  } else if (resourceBlockedActions.contains(action)) {
+    releaseResourceBlockedAction(action);
+  } else {
+    offGoalActions.erase(action);
+  }
+}
+
+bool Driver::hasResourcesFor(ActionDriver* action, bool* remote) {
+  *remote = false;
+  if (activeActions.empty()) {
+    // Always make progress, even if the action exceeds the limits on its own.
+    return true;
+  }
+
+  Action::Resources resources = action->action->getResources();
+  if (activeCpus + resources.cpus <= maxConcurrentActions &&
+      (memoryBudget == 0 || activeMemory + resources.memory <= memoryBudget)) {
+    return true;
+  }
+  if (resources.remotable && activeRemoteCpus + resources.cpus <= remoteSlots) {
+    *remote = true;
+    return true;
+  }
+  return false;
+}
+
+OwnedPtr<Driver::ActionDriver> Driver::releaseActiveAction(ActionDriver* action) {
+  if (action->remote) {
+    activeRemoteCpus -= action->resources.cpus;
+  } else {
+    activeCpus -= action->resources.cpus;
+    activeMemory -= action->resources.memory;
+  }
+  resourcesReleased = true;
+  return activeActions.release(action);
+}
+
+void Driver::updateCriticalPaths() {
+  std::unordered_map<ActionDriver*, double> memo;
+  for (OwnedPtrMap<ActionDriver*, ActionDriver>::Iterator iter(completedActionPtrs); iter.next();) {
+    ActionDriver* action = iter.key();
+    if (action->state != ActionDriver::FAILED) {
+      history->setCriticalPath(action->historyKey(), computeCriticalPath(action, &memo));
+    }
+  }
+}
+
+void Driver::updateGraph() {
+  // Rules come from the actions which provided their factories.
+  std::unordered_map<ActionFactory*, ActionDriver*> factoryCreators;
+  for (OwnedPtrMap<ActionDriver*, ActionDriver>::Iterator iter(completedActionPtrs); iter.next();) {
+    ActionDriver* action = iter.key();
+    for (int i = 0; i < action->providedFactories.size(); i++) {
+      factoryCreators[action->providedFactories.get(i)] = action;
+    }
+  }
+
+  for (OwnedPtrMap<ActionDriver*, ActionDriver>::Iterator iter(completedActionPtrs); iter.next();) {
+    ActionDriver* action = iter.key();
+    if (action->state == ActionDriver::FAILED) {
+      // Keep what the last successful run needed.
+      continue;
+    }
+
+    std::vector<std::string> outputs;
+    for (int i = 0; i < action->provisions.size(); i++) {
+      outputs.push_back(action->provisions.get(i)->canonicalName);
+    }
+
+    std::unordered_set<ActionDriver*> inputActions;
+    for (DependencyTable::SearchIterator<DependencyTable::ACTION>
+         iter2(dependencyTable, action); iter2.next();) {
+      Provision* provision = iter2.cell<DependencyTable::PROVISION>();
+      if (provision != nullptr && provision->creator != nullptr) {
+        inputActions.insert(provision->creator);
+      }
+    }
+    for (ActionTriggersTable::SearchIterator<ActionTriggersTable::ACTION>
+         iter2(actionTriggersTable, action); iter2.next();) {
+      ActionDriver* creator = iter2.cell<ActionTriggersTable::PROVISION>()->creator;
+      if (creator != nullptr) {
+        inputActions.insert(creator);
+      }
+      std::unordered_map<ActionFactory*, ActionDriver*>::iterator factoryCreator =
+          factoryCreators.find(iter2.cell<ActionTriggersTable::FACTORY>());
+      if (factoryCreator != factoryCreators.end()) {
+        inputActions.insert(factoryCreator->second);
+      }
+    }
+    inputActions.erase(action);
+
+    std::vector<std::string> inputs;
+    for (ActionDriver* input : inputActions) {
+      inputs.push_back(input->historyKey());
+    }
+    std::sort(inputs.begin(), inputs.end());
+
+    graph->setEdges(action->historyKey(), std::move(outputs), std::move(inputs));
+  }
+}
+
+bool Driver::goalReached() {
+  return tagTable.find<TagTable::TAG>(Tag::fromName("canonical:" + goal)) != nullptr;
+}
+
+void Driver::abandonGoal() {
+  goal.clear();
+  goalActions.clear();
+  while (!offGoalActions.empty()) {
+    queuePendingAction(offGoalActions.popFront(), false);
+  }
+}
+
+double Driver::computeCriticalPath(ActionDriver* action,
+                                   std::unordered_map<ActionDriver*, double>* memo) {
+  std::pair<std::unordered_map<ActionDriver*, double>::iterator, bool> insertResult =
+      memo->insert(std::make_pair(action, 0.0));
+  if (!insertResult.second) {
+    // Already computed -- or currently being computed, in which case there's a cycle and we
+    // just count zero for the back edge.
+    return insertResult.first->second;
+  }
+
+  double ownDuration = action->duration;
+  if (ownDuration < 0) {
+    // Didn't run this time (e.g. it was replayed from cache).  Use the last known duration.
+    ownDuration = std::max(0.0, history->getDuration(action->historyKey()));
+  }
+
+  // Find the longest chain of actions that consumed this action's outputs.
+  double longestDependent = 0;
+  for (int i = 0; i < action->provisions.size(); i++) {
+    Provision* provision = action->provisions.get(i);
+    for (DependencyTable::SearchIterator<DependencyTable::PROVISION>
+         iter(dependencyTable, provision); iter.next();) {
+      ActionDriver* dependent = iter.cell<DependencyTable::ACTION>();
+      if (dependent != action) {
+        longestDependent = std::max(longestDependent, computeCriticalPath(dependent, memo));
+      }
+    }
+    for (ActionTriggersTable::SearchIterator<ActionTriggersTable::PROVISION>
+         iter(actionTriggersTable, provision); iter.next();) {
+      ActionDriver* dependent = iter.cell<ActionTriggersTable::ACTION>();
+      if (dependent != action) {
+        longestDependent = std::max(longestDependent, computeCriticalPath(dependent, memo));
+      }
+    }
+  }
+
+  double result = ownDuration + longestDependent;
+  (*memo)[action] = result;
+  return result;
+}
+
+bool Driver::retryCacheBlockedActions() {
+  // Actions which were waiting on a cached dependency that never appeared must be run for real,
+  // since their inputs may well have changed in a way that no longer needs that dependency.
+  std::vector<ActionDriver*> actionsToRetry;
+  for (OwnedPtrMap<ActionDriver*, ActionDriver>::Iterator iter(completedActionPtrs); iter.next();) {
+    if (iter.key()->blockedOnCache) {
+      actionsToRetry.push_back(iter.key());
+    }
   }
+
+  for (size_t i = 0; i < actionsToRetry.size(); i++) {
+    actionsToRetry[i]->reset();
+    actionsToRetry[i]->bypassCache = true;
+  }
+
+  return !actionsToRetry.empty();
+}
+
+Driver::Provision* Driver::choosePreferredProvider(const Tag& tag, const std::string& directory) {
+  TagTable::SearchIterator<TagTable::TAG> iter(tagTable, tag);
+
+  if (!iter.next()) {
+    return NULL;
+  }
+
+  Provision* bestMatch = iter.cell<TagTable::PROVISION>();
+  if (!iter.next()) {
+    // Only one provider; no need to consult the memo.
+    return bestMatch;
+  }
+
+  std::unordered_map<std::string, Provision*>& memo = preferredProviders[tag];
+  std::unordered_map<std::string, Provision*>::iterator memoIter = memo.find(directory);
+  if (memoIter != memo.end()) {
+    return memoIter->second;
+  }
+
+  // There are multiple files with this tag.  We must choose which one we like best.
+  int bestMatchCommonPrefix = commonDirectoryPrefixLength(directory, bestMatch->canonicalName);
+
+  do {
+    Provision* candidate = iter.cell<TagTable::PROVISION>();
+    int candidateCommonPrefix = commonDirectoryPrefixLength(directory, candidate->canonicalName);
+    if (candidateCommonPrefix < bestMatchCommonPrefix) {
+      // Prefer provider that is closer in the directory tree.
+      continue;
+    } else if (candidateCommonPrefix == bestMatchCommonPrefix) {
+      if (candidate->depth > bestMatch->depth) {
+        // Prefer provider that is less deeply nested.
+        continue;
+      } else if (candidate->depth == bestMatch->depth) {
+        // Arbitrarily -- but consistently -- choose one.
+        int diff = bestMatch->canonicalName.compare(candidate->canonicalName);
+        if (diff < 0) {
+          // Prefer file that comes first alphabetically.
+          continue;
+        } else if (diff == 0) {
+          // TODO:  Is this really an error?  I think it is for the moment, but someday it
+          //   may not be, if multiple actions are allowed to produce outputs with the same
+          //   canonical names.
+          DEBUG_ERROR << "Two providers have same file name: " << bestMatch->canonicalName;
+          continue;
+        }
+      }
+    }
+
+    // If we get here, the candidate is better than the existing best match.
+    bestMatch = candidate;
+    bestMatchCommonPrefix = candidateCommonPrefix;
+  } while (iter.next());
+
+  memo[directory] = bestMatch;
+  return bestMatch;
+}
+
+void Driver::forgetPreferredProvider(const Tag& tag) {
+  preferredProviders.erase(tag);
+
+  if (modifierTags.count(tag) > 0) {
+    // Modifier files rarely change, so just start over.
+    modifierChains.clear();
+    modifierTags.clear();
+  }
+}
+
+const Driver::ModifierChain& Driver::findModifierChain(
+    File* file, const std::string& name, const std::string& directory) {
+  OwnedPtr<File> dir = file->parent();
+
+  std::string key = directory;
+  key.push_back('\0');
+  key.append(dir->canonicalName());
+  key.push_back('\0');
+  key.append(name);
+
+  std::unordered_map<std::string, ModifierChain>::iterator iter = modifierChains.find(key);
+  if (iter != modifierChains.end()) {
+    return iter->second;
+  }
+
+  ModifierChain& chain = modifierChains[key];
+  for (;;) {
+    Tag tag = Tag::fromName("canonical:" + dir->relative(name)->canonicalName());
+    chain.tags.push_back(tag);
+    chain.providers.push_back(choosePreferredProvider(tag, directory));
+    modifierTags.insert(tag);
+    if (!dir->hasParent()) {
+      break;
+    }
+    dir = dir->parent();
+  }
+
+  std::reverse(chain.tags.begin(), chain.tags.end());
+  std::reverse(chain.providers.begin(), chain.providers.end());
+  return chain;
 }
 
 void Driver::rescanForNewFactory(ActionFactory* factory) {
   // Apply triggers.
   std::vector<Tag> triggerTags;
   factory->enumerateTriggerTags(std::back_inserter(triggerTags));
+  std::vector<std::pair<Provision*, std::vector<Tag> > > inlineTagged;
   for (unsigned int i = 0; i < triggerTags.size(); i++) {
     for (TagTable::SearchIterator<TagTable::TAG> iter(tagTable, triggerTags[i]); iter.next();) {
       Provision* provision = iter.cell<TagTable::PROVISION>();
+      std::vector<Tag> tags;
+      if (factory->tryTagInline(triggerTags[i], provision->file.get(), &tags)) {
+        inlineTagged.push_back(std::make_pair(provision, std::move(tags)));
+        continue;
+      }
       OwnedPtr<Action> action = factory->tryMakeAction(triggerTags[i], provision->file.get());
       if (action != NULL) {
         queueNewAction(factory, action.release(), provision);
       }
     }
   }
+
+  // Can't add to tagTable while iterating over it.
+  for (size_t i = 0; i < inlineTagged.size(); i++) {
+    registerProvider(inlineTagged[i].first, inlineTagged[i].second, nullptr, false);
+  }
 }
 
 void Driver::queueNewAction(ActionFactory* factory, OwnedPtr<Action> action,
                             Provision* provision) {
-  OwnedPtr<Dashboard::Task> task = dashboard->beginTask(
-      action->getVerb(), provision->file->canonicalName(),
-      action->isSilent() ? Dashboard::SILENT : Dashboard::NORMAL);
-
   OwnedPtr<ActionDriver> actionDriver =
-      newOwned<ActionDriver>(this, action.release(), provision->file.get(), provision->contentHash,
-                             task.release());
+      newOwned<ActionDriver>(this, action.release(), provision->file.get(), provision->contentHash);
   actionTriggersTable.add(factory, provision, actionDriver.get());
 
+  for (int i = 0; i < orphanedOutputs.size(); i++) {
+    OrphanedOutputs* orphan = orphanedOutputs.get(i);
+    if (orphan->factory == factory && orphan->trigger->equals(provision->file.get())) {
+      actionDriver->stale = orphan->outputs.release();
+      orphanedOutputs.releaseAndShift(i);
+      break;
+    }
+  }
+
   // Put new action on front of queue because it was probably triggered by another action that
   // just completed, and it's good to run related actions together to improve cache locality.
-  pendingActions.pushFront(actionDriver.release());
+  queuePendingAction(actionDriver.release(), true);
 }
 
-void Driver::getTransitiveDependencies(
-    ActionDriver* action, std::unordered_set<ActionDriver*>* deps) {
-  if (action != nullptr && deps->insert(action).second) {
+Driver::AncestorSet::AncestorSet(Driver* driver, ActionDriver* action) : driver(driver) {
+  visit(action);
+}
+
+bool Driver::AncestorSet::contains(ActionDriver* action) {
+  while (visited.count(action) == 0) {
+    if (unexpanded.empty()) {
+      return false;
+    }
+
+    ActionDriver* next = unexpanded.back();
+    unexpanded.pop_back();
+
     for (ActionTriggersTable::SearchIterator<ActionTriggersTable::ACTION>
-         iter(actionTriggersTable, action); iter.next();) {
-      getTransitiveDependencies(iter.cell<ActionTriggersTable::PROVISION>()->creator, deps);
+         iter(driver->actionTriggersTable, next); iter.next();) {
+      visit(iter.cell<ActionTriggersTable::PROVISION>()->creator);
     }
     for (DependencyTable::SearchIterator<DependencyTable::ACTION>
-         iter(dependencyTable, action); iter.next();) {
+         iter(driver->dependencyTable, next); iter.next();) {
       Provision* provision = iter.cell<DependencyTable::PROVISION>();
       if (provision != nullptr) {
-        getTransitiveDependencies(provision->creator, deps);
+        visit(provision->creator);
       }
     }
   }
+
+  return true;
 }
 
-void Driver::registerProvider(Provision* provision, const std::vector<Tag>& tags,
-                              const std::unordered_set<ActionDriver*>& dependencies) {
-  provision->contentHash = provision->file->contentHash();
+void Driver::AncestorSet::visit(ActionDriver* action) {
+  if (action != nullptr && visited.insert(action).second) {
+    unexpanded.push_back(action);
+  }
+}
 
-  for (std::vector<Tag>::const_iterator iter = tags.begin(); iter != tags.end(); ++iter) {
-    const Tag& tag = *iter;
+void Driver::registerProvider(Provision* provision, const std::vector<Tag>& tags,
+                              AncestorSet* ancestors, bool reused) {
+  BuildTrace::Scope traceScope(trace, "registerProvider");
+  provision->canonicalName = provision->file->canonicalName();
+  provision->depth = fileDepth(provision->canonicalName);
+
+  // Triggers may tag the provision inline, growing the list as we go.
+  std::vector<Tag> allTags = tags;
+  for (size_t i = 0; i < allTags.size(); i++) {
+    Tag tag = allTags[i];
     tagTable.add(tag, provision);
+    forgetPreferredProvider(tag);
 
-    resetDependentActions(tag, dependencies);
+    {
+      ExplainScope explainScope(this, provision, "new provider");
+      resetDependentActions(tag, ancestors);
+    }
 
-    fireTriggers(tag, provision);
+    fireTriggers(tag, provision, reused, &allTags);
   }
 }
 
-void Driver::resetDependentActions(const Tag& tag,
-                                   const std::unordered_set<ActionDriver*>& dependencies) {
+void Driver::resetDependentActions(const Tag& tag, AncestorSet* ancestors) {
   std::unordered_set<Provision*> provisionsToReset;
 
   std::vector<ActionDriver*> actionsToReset;
@@ -716,20 +2121,21 @@ void Driver::resetDependentActions(const Tag& tag,
        iter.next();) {
     ActionDriver* action = iter.cell<DependencyTable::ACTION>();
 
-    // Don't reset an action that contributed to the creation of this tag in the first place, since
-    // that would lead to an infinite loop of rebuilding the same action.
-    if (dependencies.count(action) == 0) {
-      Provision* previousProvider = iter.cell<DependencyTable::PROVISION>();
-
-      if (action->choosePreferredProvider(tag) != previousProvider) {
+    Provision* previousProvider = iter.cell<DependencyTable::PROVISION>();
+    if (action->choosePreferredProvider(tag) != previousProvider) {
+      // Don't reset an action that contributed to the creation of this tag in the first place,
+      // since that would lead to an infinite loop of rebuilding the same action.
+      if (ancestors != nullptr && ancestors->contains(action)) {
+        DEBUG_INFO << "Action's inputs are affected by its outputs.";
+      } else {
         // We can't just call reset() here because it could invalidate our iterator.
         actionsToReset.push_back(action);
       }
-    } else {
-      DEBUG_INFO << "Action's inputs are affected by its outputs.";
     }
   }
 
+  // Most tags have nobody to reset; only trace those that do.
+  BuildTrace::Scope traceScope(actionsToReset.empty() ? nullptr : trace, "resetDependentActions");
   for (size_t i = 0; i < actionsToReset.size(); i++) {
     // Only reset the action if it is still in the dependency table.  If not, it was already
     // reset (and possibly deleted!) elsewhere.
@@ -740,8 +2146,10 @@ void Driver::resetDependentActions(const Tag& tag,
 }
 
 void Driver::resetDependentActions(Provision* provision) {
+  BuildTrace::Scope traceScope(trace, "resetDependentActions");
   // Reset dependents of this provision.
   {
+    ExplainScope explainScope(this, provision, "changed");
     std::vector<ActionDriver*> actionsToReset;
     for (DependencyTable::SearchIterator<DependencyTable::PROVISION>
          iter(dependencyTable, provision); iter.next();) {
@@ -763,6 +2171,7 @@ void Driver::resetDependentActions(Provision* provision) {
 
   // Everything triggered by this provision must be deleted.
   {
+    ExplainScope explainScope(this, provision, "trigger changed");
     std::vector<ActionDriver*> actionsToDelete;
 
     for (ActionTriggersTable::SearchIterator<ActionTriggersTable::PROVISION>
@@ -773,27 +2182,212 @@ void Driver::resetDependentActions(Provision* provision) {
 
     for (size_t j = 0; j < actionsToDelete.size(); j++) {
       actionsToDelete[j]->reset();
+      deletePendingAction(actionsToDelete[j]);
+    }
 
-      // TODO:  Use better data structure for pendingActions.  For now we have to iterate
-      //   through the whole thing to find the action we're deleting.  We iterate from the back
-      //   since it's likely the action was just added there.
-      for (int k = pendingActions.size() - 1; k >= 0; k--) {
-        if (pendingActions.get(k) == actionsToDelete[j]) {
-          pendingActions.releaseAndShift(k);
-          break;
+    actionTriggersTable.erase<ActionTriggersTable::PROVISION>(provision);
+  }
+
+  for (TagTable::SearchIterator<TagTable::PROVISION> iter(tagTable, provision); iter.next();) {
+    forgetPreferredProvider(iter.cell<TagTable::TAG>());
+  }
+  tagTable.erase<TagTable::PROVISION>(provision);
+}
+
+void Driver::explainReset(ActionDriver* action) {
+  if (resetCause.provision == nullptr && resetCause.parent == nullptr) {
+    // Not part of a cascade, e.g. retrying after a cache miss.
+    return;
+  }
+
+  ActionDriver* parent = resetCause.parent;
+  if (parent == nullptr) {
+    parent = resetCause.provision->creator;
+  }
+
+  std::string parentName;
+  std::string root;
+  if (parent == nullptr) {
+    parentName = resetCause.provision->canonicalName;
+    root = parentName;
+  } else {
+    parentName = parent->historyKey();
+    root = parent->cascadeGeneration == explainGeneration ? parent->cascadeRoot : parentName;
+  }
+  action->cascadeRoot = root;
+  action->cascadeGeneration = explainGeneration;
+
+  std::string cause = resetCause.how;
+  if (resetCause.provision != nullptr) {
+    cause += ": " + resetCause.provision->canonicalName;
+  }
+
+  double seconds = action->duration;
+  if (seconds < 0 && history != nullptr) {
+    seconds = history->getDuration(action->historyKey());
+  }
+  explainer->recordReset(root, parentName, action->historyKey(), cause, seconds);
+}
+
+void Driver::explainCosts() {
+  // For each source file, everything that would rebuild if it changed:  its dependents and
+  // triggered actions, then theirs, and so on.
+  for (OwnedPtrMap<File*, Provision, File::HashFunc, File::EqualFunc>::Iterator
+       iter(rootProvisions); iter.next();) {
+    std::unordered_set<ActionDriver*> affected;
+    std::vector<Provision*> unexpanded;
+    unexpanded.push_back(iter.value());
+    double seconds = 0;
+
+    while (!unexpanded.empty()) {
+      Provision* provision = unexpanded.back();
+      unexpanded.pop_back();
+
+      std::vector<ActionDriver*> dependents;
+      for (DependencyTable::SearchIterator<DependencyTable::PROVISION>
+           iter2(dependencyTable, provision); iter2.next();) {
+        dependents.push_back(iter2.cell<DependencyTable::ACTION>());
+      }
+      for (ActionTriggersTable::SearchIterator<ActionTriggersTable::PROVISION>
+           iter2(actionTriggersTable, provision); iter2.next();) {
+        dependents.push_back(iter2.cell<ActionTriggersTable::ACTION>());
+      }
+
+      for (size_t i = 0; i < dependents.size(); i++) {
+        ActionDriver* action = dependents[i];
+        if (!affected.insert(action).second) continue;
+
+        double duration = action->duration;
+        if (duration < 0 && history != nullptr) {
+          duration = history->getDuration(action->historyKey());
+        }
+        seconds += std::max(0.0, duration);
+
+        for (int j = 0; j < action->provisions.size(); j++) {
+          unexpanded.push_back(action->provisions.get(j));
         }
       }
     }
 
-    actionTriggersTable.erase<ActionTriggersTable::PROVISION>(provision);
+    if (!affected.empty()) {
+      explainer->addCost(iter.value()->canonicalName, seconds, affected.size());
+    }
   }
+}
+
+void Driver::discardStaleOutputs(StaleOutputs* outputs) {
+  for (int i = 0; i < outputs->provisions.size(); i++) {
+    resetDependentActions(outputs->provisions.get(i));
+  }
+}
 
+void Driver::orphanTriggeredOutputs(Provision* provision) {
+  std::vector<std::pair<ActionFactory*, ActionDriver*> > triggered;
+  for (ActionTriggersTable::SearchIterator<ActionTriggersTable::PROVISION>
+       iter(actionTriggersTable, provision); iter.next();) {
+    triggered.push_back(std::make_pair(iter.cell<ActionTriggersTable::FACTORY>(),
+                                       iter.cell<ActionTriggersTable::ACTION>()));
+  }
+
+  ExplainScope explainScope(this, provision, "trigger changed");
+  for (size_t i = 0; i < triggered.size(); i++) {
+    ActionDriver* action = triggered[i].second;
+    action->reset();
+    if (action->stale != nullptr) {
+      for (int j = 0; j < action->stale->provisions.size(); j++) {
+        action->stale->provisions.get(j)->creator = nullptr;  // action is about to be deleted
+      }
+      OwnedPtr<OrphanedOutputs> orphan = newOwned<OrphanedOutputs>();
+      orphan->factory = triggered[i].first;
+      orphan->trigger = provision->file->clone();
+      orphan->outputs = action->stale.release();
+      orphanedOutputs.add(orphan.release());
+    }
+  }
+}
+
+void Driver::discardOrphanedOutputs() {
+  // Whatever no replacement adopted.  Detach first, since discarding resets actions.
+  OwnedPtrVector<OrphanedOutputs> orphans;
+  orphanedOutputs.swap(&orphans);
+  for (int i = 0; i < orphans.size(); i++) {
+    discardStaleOutputs(orphans.get(i)->outputs.get());
+  }
+}
+
+void Driver::retireProvision(Provision* provision, std::vector<Tag>* tags) {
+  for (TagTable::SearchIterator<TagTable::PROVISION> iter(tagTable, provision); iter.next();) {
+    tags->push_back(iter.cell<TagTable::TAG>());
+    forgetPreferredProvider(iter.cell<TagTable::TAG>());
+  }
   tagTable.erase<TagTable::PROVISION>(provision);
+
+  // Running dependents may see the file half-rewritten, so restart them.
+  ExplainScope explainScope(this, provision, "being rewritten");
+  {
+    std::vector<ActionDriver*> actionsToReset;
+    for (DependencyTable::SearchIterator<DependencyTable::PROVISION>
+         iter(dependencyTable, provision); iter.next();) {
+      if (iter.cell<DependencyTable::ACTION>()->isRunning) {
+        actionsToReset.push_back(iter.cell<DependencyTable::ACTION>());
+      }
+    }
+    for (size_t i = 0; i < actionsToReset.size(); i++) {
+      if (dependencyTable.find<DependencyTable::ACTION>(actionsToReset[i]) != nullptr) {
+        actionsToReset[i]->reset();
+      }
+    }
+  }
+
+  // Likewise, triggered actions which haven't completed yet must not start on it.  They are
+  // recreated by fireTriggers() if the provision is reused.
+  {
+    std::vector<ActionDriver*> actionsToDelete;
+    for (ActionTriggersTable::SearchIterator<ActionTriggersTable::PROVISION>
+         iter(actionTriggersTable, provision); iter.next();) {
+      ActionDriver* action = iter.cell<ActionTriggersTable::ACTION>();
+      if (action->state == ActionDriver::PENDING || action->isRunning) {
+        actionsToDelete.push_back(action);
+      }
+    }
+    for (size_t i = 0; i < actionsToDelete.size(); i++) {
+      actionsToDelete[i]->reset();
+      actionTriggersTable.erase<ActionTriggersTable::ACTION>(actionsToDelete[i]);
+      deletePendingAction(actionsToDelete[i]);
+    }
+  }
 }
 
-void Driver::fireTriggers(const Tag& tag, Provision* provision) {
+bool Driver::hasTriggeredAction(ActionFactory* factory, Provision* provision) {
+  for (ActionTriggersTable::SearchIterator<ActionTriggersTable::PROVISION>
+       iter(actionTriggersTable, provision); iter.next();) {
+    if (iter.cell<ActionTriggersTable::FACTORY>() == factory) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void Driver::addInlineTags(File* file, std::vector<Tag>* tags) {
+  for (size_t i = 0; i < tags->size(); i++) {
+    Tag tag = (*tags)[i];
+    for (TriggerTable::SearchIterator<TriggerTable::TAG> iter(triggers, tag); iter.next();) {
+      iter.cell<TriggerTable::FACTORY>()->tryTagInline(tag, file, tags);
+    }
+  }
+}
+
+void Driver::fireTriggers(const Tag& tag, Provision* provision, bool reused,
+                          std::vector<Tag>* inlineTags) {
   for (TriggerTable::SearchIterator<TriggerTable::TAG> iter(triggers, tag); iter.next();) {
     ActionFactory* factory = iter.cell<TriggerTable::FACTORY>();
+    if (factory->tryTagInline(tag, provision->file.get(), inlineTags)) {
+      continue;
+    }
+    if (reused && hasTriggeredAction(factory, provision)) {
+      // The triggered action from before the rerun still stands.
+      continue;
+    }
     OwnedPtr<Action> triggeredAction = factory->tryMakeAction(tag, provision->file.get());
     if (triggeredAction != NULL) {
       queueNewAction(factory, triggeredAction.release(), provision);
@@ -801,11 +2395,19 @@ void Driver::fireTriggers(const Tag& tag, Provision* provision) {
   }
 }
 
+void Driver::reportFailure() {
+  if (!failedSinceIdle) {
+    failedSinceIdle = true;
+    stats.firstFailureSeconds = monotonicSeconds() - busySince;
+    if (activityObserver != nullptr) activityObserver->firstFailure();
+  }
+}
+
 bool Driver::dumpErrors() {
   bool hasFailures = false;
   for (OwnedPtrMap<ActionDriver*, ActionDriver>::Iterator iter(completedActionPtrs); iter.next();) {
     if (iter.key()->state == ActionDriver::FAILED) {
-      iter.value()->dashboardTask->setState(Dashboard::FAILED);
+      iter.value()->setDashboardState(Dashboard::FAILED);
       hasFailures = true;
     }
   }
@@ -20,13 +20,23 @@
 #include <unordered_map>
 #include <unordered_set>
 #include <memory>
+#include <map>
 #include <set>
+#include <sys/types.h>
 
 #include "base/OwnedPtr.h"
 #include "os/File.h"
+#include "os/HashCache.h"
 #include "Action.h"
 #include "Tag.h"
 #include "Dashboard.h"
+#include "ActionCache.h"
+#include "ActionHistory.h"
+#include "ActionGraph.h"
+#include "BuildTrace.h"
+#include "ResetExplainer.h"
+#include "FileHasher.h"
+#include "Installer.h"
 #include "base/Table.h"
 
 namespace ekam {
@@ -37,20 +47,138 @@ public:
   public:
     virtual void startingAction() = 0;
     virtual void idle(bool hasFailures) = 0;
+
+    // The first action to fail since the Driver was last idle just did.  It may yet succeed,
+    // e.g. if it was missing a dependency that another action will produce, so this is an early
+    // warning, not the final word given to idle().
+    virtual void firstFailure() {}
   };
 
   Driver(EventManager* eventManager, Dashboard* dashboard, File* tmp,
          File* installDirs[BuildContext::INSTALL_LOCATION_COUNT], int maxConcurrentActions,
-         ActivityObserver* activityObserver = nullptr);
+         ActivityObserver* activityObserver = nullptr, ActionCache* actionCache = nullptr,
+         ActionHistory* history = nullptr);
   ~Driver();
 
+  // Limit the total expected memory usage of concurrently-running actions, as declared by
+  // Action::getResources().  Zero means no limit.
+  void setMemoryBudget(uint64_t bytes);
+
+  // Pass at most this many bytes of each action's output to the dashboard, writing the rest to
+  // a file in tmp.  Zero means no limit.
+  void setLogLimit(uint64_t bytes);
+
+  // Fail actions with the given verb which run for longer than the given number of seconds,
+  // killing their processes.  An empty verb sets the default for verbs without a setting of
+  // their own.  Zero means no limit.
+  void setTimeout(const std::string& verb, double seconds);
+
+  // Like setTimeout(), but limits the CPU time of each process the action starts.
+  void setCpuTimeout(const std::string& verb, double seconds);
+
+  // Besides the local -j limit, run up to this many CPUs' worth of remotable actions (see
+  // Action::Resources::remotable) at once on other machines, by prefixing their commands with
+  // the given space-separated launcher, which must run its arguments on a worker sharing this
+  // directory tree at the same path.  Remote actions don't count against the memory budget.
+  void setRemoteLauncher(int slots, const std::string& launcher);
+
+  // Before running an action whose cached result is out of date, have the kernel read ahead the
+  // inputs it used last time, so that cold-cache runs don't stall on each read in turn.
+  void setPrefetch(bool prefetch);
+
+  // Hash actions' outputs on the hasher's threads rather than the event loop thread.
+  void setFileHasher(FileHasher* hasher);
+
+  // Install outputs on the installer's threads rather than the event loop thread.  The build
+  // isn't considered idle until they are in place.
+  void setInstaller(Installer* installer);
+
+  // Saved along with the history whenever the build goes idle.
+  void setHashCache(HashCache* cache);
+
+  // Record each action's queue time, run time and bookkeeping costs, plus time spent in the
+  // Driver's own phases, to the trace.  Flushed whenever the build goes idle.
+  void setTrace(BuildTrace* trace);
+
+  // Report every reset, and what caused it, to the explainer, along with what each source file
+  // would cost to touch.  Written whenever the build goes idle.
+  void setExplainer(ResetExplainer* explainer);
+
+  // Record which actions each action's inputs came from, saved whenever the build goes idle.
+  void setActionGraph(ActionGraph* graph);
+
+  // Only run the actions which the graph says were needed to produce the file with the given
+  // canonical name last time.  Others are held back, unless the Driver goes idle without having
+  // produced the file (e.g. because the graph is out of date), in which case everything is
+  // built.  Returns false, leaving everything to be built, if the graph doesn't know how the
+  // file is produced.  Requires setActionGraph().
+  bool setGoal(const std::string& canonicalName);
+
+  // Run pending actions triggered by the given source files, and those they needed last time
+  // (if there is an action graph), ahead of all others.  Replaces the previous focus.
+  void setFocus(const std::vector<std::string>& canonicalNames);
+
+  class BuildWaiter {
+  public:
+    virtual ~BuildWaiter();
+
+    virtual void buildDone(bool hasFailures) = 0;
+  };
+
+  // Calls waiter->buildDone() once there are no source changes left to apply and the Driver is
+  // idle -- or, given the canonical name of a file the action graph knows, once no action it
+  // says the file needs is pending or running, in which case only those actions' failures
+  // count.  Call cancelWait() if the waiter goes away first.  May call back immediately.
+  void waitForBuild(const std::string& canonicalName, BuildWaiter* waiter);
+  void cancelWait(BuildWaiter* waiter);
+
+  struct Stats {
+    int pendingActions;  // including those waiting for resources
+    int activeActions;
+    int completedActions;
+    int failedActions;
+    int tagTableSize;
+    int dependencyTableSize;
+
+    // Over the Driver's lifetime.
+    uint64_t actionsStarted;
+    uint64_t actionsReset;
+    uint64_t inputsPrefetched;
+
+    // How many actions each rebuild ran, from the Driver becoming busy until it was next idle.
+    // rebuildBuckets[i] counts rebuilds which ran at most REBUILD_BUCKET_BOUNDS[i] actions.
+    static const int REBUILD_BUCKET_COUNT = 5;
+    static const uint64_t REBUILD_BUCKET_BOUNDS[REBUILD_BUCKET_COUNT];
+    uint64_t rebuildBuckets[REBUILD_BUCKET_COUNT];
+    uint64_t rebuildCount;
+    uint64_t rebuildActions;
+
+    // In the latest rebuild that had a failure, seconds from becoming busy until the first;
+    // negative if there hasn't been one.
+    double firstFailureSeconds;
+  };
+  Stats getStats();
+
   void addActionFactory(ActionFactory* factory);
 
   void addSourceFile(File* file);
+  // Like addSourceFile(File*), when the caller has already hashed the file.
+  void addSourceFile(File* file, const Hash& contentHash);
   void removeSourceFile(File* file);
 
+  // Between beginBatch() and endBatch(), source changes reset dependent actions and queue new
+  // ones, but no actions are started.  Use when many source files change at once, so that
+  // actions aren't started only to be canceled by the next change.  Batches may nest.
+  void beginBatch();
+  void endBatch();
+
+  // While scanning, more source files are known to be on their way, so the Driver doesn't
+  // consider itself idle when it runs out of actions.
+  void setScanning(bool scanning);
+
 private:
   class ActionDriver;
+  struct Provision;
 
   EventManager* eventManager;
   Dashboard* dashboard;
@@ -59,37 +187,156 @@ private:
   File* installDirs[BuildContext::INSTALL_LOCATION_COUNT];
 
   int maxConcurrentActions;
+  uint64_t memoryBudget;
+  uint64_t logLimit;
+  std::unordered_map<std::string, double> timeouts;     // by verb; see setTimeout()
+  std::unordered_map<std::string, double> cpuTimeouts;  // by verb; see setCpuTimeout()
+
+  int remoteSlots;
+  std::string remoteLauncher;
+  bool prefetch;
+
+  // Sum of Action::getResources() over activeActions running locally, and CPUs over those
+  // running remotely.
+  double activeCpus;
+  uint64_t activeMemory;
+  double activeRemoteCpus;
+  int batchDepth;
+  bool scanning;
 
   ActivityObserver* activityObserver;
+  ActionCache* actionCache;  // possibly null
+  ActionHistory* history;  // possibly null
+  HashCache* hashCache;  // possibly null
+  FileHasher* fileHasher;  // possibly null
+  Installer* installer;  // possibly null
+
+  // Directories under tmp known to exist, by canonical name, so that each new output needn't
+  // stat its parent.  Forgotten when the build starts after tmp itself was replaced.
+  std::unordered_set<std::string> createdDirs;
+  dev_t tmpDevice;
+  ino_t tmpInode;
 
-  class TriggerTable : public Table<IndexedColumn<Tag, Tag::HashFunc>,
-                                    IndexedColumn<ActionFactory*> > {
+  // Installs waiting for the batch in flight, if any, to finish.
+  std::vector<Installer::Request> queuedInstalls;
+  bool installing;
+  Promise<void> installOp;
+  BuildTrace* trace;  // possibly null
+  ResetExplainer* explainer;  // possibly null
+  ActionGraph* graph;  // possibly null
+
+  // See setGoal().  Empty if there is no goal, or it was abandoned.
+  std::string goal;
+  std::unordered_set<std::string> goalActions;  // by historyKey()
+
+  // See setFocus().
+  std::unordered_set<std::string> focus;         // canonical names of trigger files
+  std::unordered_set<std::string> focusActions;  // by historyKey()
+
+  // For explainer:  the output whose change is currently resetting actions, and how.  parent, if
+  // non-null, is the action responsible in place of provision's creator.  Set by ExplainScope.
+  struct ResetCause {
+    Provision* provision;
+    const char* how;
+    ActionDriver* parent;
+  };
+  ResetCause resetCause;
+  class ExplainScope;
+
+  // Incremented whenever the build goes idle, so that the next cascade of resets starts afresh.
+  uint64_t explainGeneration;
+
+  // Only the counters are kept up to date; getStats() fills in the rest.
+  Stats stats;
+  uint64_t actionsSinceIdle;
+  double busySince;         // when actionsSinceIdle last became non-zero
+  bool failedSinceIdle;
+
+  // For feedback after a change:  actions which failed last time they ran are started first,
+  // then those triggered by sources changed since the Driver was last idle (not counting the
+  // initial scan).
+  std::unordered_set<std::string> failedActions;  // by historyKey()
+  std::unordered_set<std::string> changedSources;  // canonical names
+
+  // See waitForBuild().
+  struct BuildWait {
+    BuildWaiter* waiter;
+    std::string canonicalName;  // empty if waiting for everything
+    std::unordered_set<std::string> actions;  // by historyKey()
+  };
+  std::vector<BuildWait> buildWaits;
+
+  class TriggerTable : public Table<FlatIndexedColumn<Tag, Tag::HashFunc>,
+                                    FlatIndexedColumn<ActionFactory*> > {
   public:
     static const int TAG = 0;
     static const int FACTORY = 1;
   };
   TriggerTable triggers;
 
-  struct Provision {
+  struct Provision : public Pooled {
     ActionDriver* creator;  // possibly null
     OwnedPtr<File> file;
     Hash contentHash;
+
+    // Cached from file by registerProvider(), since choosePreferredProvider() needs them often.
+    std::string canonicalName;
+    int depth;
   };
 
-  class TagTable : public Table<IndexedColumn<Tag, Tag::HashFunc>, IndexedColumn<Provision*> > {
+  class TagTable : public Table<FlatIndexedColumn<Tag, Tag::HashFunc>,
+                                FlatIndexedColumn<Provision*> > {
   public:
     static const int TAG = 0;
     static const int PROVISION = 1;
   };
   TagTable tagTable;
 
-  OwnedPtrVector<ActionDriver> activeActions;
-  OwnedPtrDeque<ActionDriver> pendingActions;
+  // Memoizes choosePreferredProvider() by tag and then by source directory.  A tag's entry is
+  // discarded whenever its providers in tagTable change.
+  std::unordered_map<Tag, std::unordered_map<std::string, Provision*>, Tag::HashFunc>
+      preferredProviders;
+
+  // Memoizes findModifiers() by source directory, file directory, and modifier name.  Discarded
+  // entirely whenever the providers of any tag in modifierTags change.
+  struct ModifierChain {
+    std::vector<Tag> tags;                // outermost directory first
+    std::vector<Provision*> providers;    // parallel to tags; possibly null
+  };
+  std::unordered_map<std::string, ModifierChain> modifierChains;
+  std::unordered_set<Tag, Tag::HashFunc> modifierTags;
+
+  OwnedPtrList<ActionDriver> activeActions;
+  OwnedPtrList<ActionDriver> pendingActions;
+
+  // Pending actions which were on the critical path in a previous run, indexed by the length of
+  // that path.  These are started before other pending actions, longest first.
+  std::multimap<double, ActionDriver*> prioritizedActions;
+
+  // Actions taken off pendingActions which didn't fit in the remaining resource budget.  These
+  // are started first once resources free up.
+  OwnedPtrList<ActionDriver> resourceBlockedActions;
+
+  // resourceBlockedActions indexed by negated priority, so that they are retried highest priority
+  // first and otherwise in the order they were blocked.
+  std::multimap<double, ActionDriver*> resourceBlockedByPriority;
+
+  // Whether a running action has released resources since we last looked through
+  // resourceBlockedActions for one that fits.
+  bool resourcesReleased;
+
+  // Remotable members of pendingActions, if remoteSlots > 0.  Started remotely, in no particular
+  // order, while local CPUs are all busy.
+  std::unordered_set<ActionDriver*> remotablePendingActions;
+
+  // Actions outside goalActions, queued while there is a goal.  Moved to pendingActions if the
+  // goal is abandoned.
+  OwnedPtrList<ActionDriver> offGoalActions;
   OwnedPtrMap<ActionDriver*, ActionDriver> completedActionPtrs;
 
-  class DependencyTable : public Table<IndexedColumn<Tag, Tag::HashFunc>,
-                                       IndexedColumn<ActionDriver*>,
-                                       IndexedColumn<Provision*> > {
+  class DependencyTable : public Table<FlatIndexedColumn<Tag, Tag::HashFunc>,
+                                       FlatIndexedColumn<ActionDriver*>,
+                                       FlatIndexedColumn<Provision*> > {
   public:
     static const int TAG = 0;
     static const int ACTION = 1;
@@ -97,9 +344,9 @@ private:
   };
   DependencyTable dependencyTable;
 
-  class ActionTriggersTable : public Table<IndexedColumn<ActionFactory*>,
-                                           IndexedColumn<Provision*>,
-                                           IndexedColumn<ActionDriver*> > {
+  class ActionTriggersTable : public Table<FlatIndexedColumn<ActionFactory*>,
+                                           FlatIndexedColumn<Provision*>,
+                                           FlatIndexedColumn<ActionDriver*> > {
   public:
     static const int FACTORY = 0;
     static const int PROVISION = 1;
@@ -110,21 +357,107 @@ private:
   OwnedPtrMap<File*, Provision, File::HashFunc, File::EqualFunc> rootProvisions;
 
   void startSomeActions();
+  void queueInstall(File* file, File* installDir, const std::string& name);
+  void createParentDirectory(File* file);
+  void checkCreatedDirs();
+  void startInstalls();
+
+  double computePriority(ActionDriver* action);
+  void updatePriority(ActionDriver* action);
+  void queuePendingAction(OwnedPtr<ActionDriver> action, bool atFront);
+  OwnedPtr<ActionDriver> dequeuePendingAction();
+  OwnedPtr<ActionDriver> releasePendingAction(ActionDriver* action);
+  void blockOnResources(OwnedPtr<ActionDriver> action);
+  OwnedPtr<ActionDriver> releaseResourceBlockedAction(ActionDriver* action);
+  void deletePendingAction(ActionDriver* action);
+
+  // If the action can start now, returns true and sets *remote to whether it must run on a
+  // remote worker.
+  bool hasResourcesFor(ActionDriver* action, bool* remote);
+  OwnedPtr<ActionDriver> releaseActiveAction(ActionDriver* action);
+
+  void updateCriticalPaths();
+  void updateGraph();
+  bool goalReached();
+  void abandonGoal();
+  double computeCriticalPath(ActionDriver* action,
+                             std::unordered_map<ActionDriver*, double>* memo);
+  bool retryCacheBlockedActions();
 
   void rescanForNewFactory(ActionFactory* factory);
 
+  // Chooses among the providers of the tag the one that an action whose trigger file is in the
+  // given directory (a canonical name prefix ending in '/', or empty) should use.
+  Provision* choosePreferredProvider(const Tag& tag, const std::string& directory);
+
+  // Call whenever the providers of the tag change, to discard memoized lookups.
+  void forgetPreferredProvider(const Tag& tag);
+
+  const ModifierChain& findModifierChain(File* file, const std::string& name,
+                                         const std::string& directory);
+
   void queueNewAction(ActionFactory* factory, OwnedPtr<Action> action,
                       Provision* provision);
 
-  void getTransitiveDependencies(ActionDriver* action, std::unordered_set<ActionDriver*>* deps);
+  // The set of actions on which some action transitively depends.  Membership is computed
+  // lazily:  each query only explores as much of the dependency graph as needed to answer it,
+  // and the explored part is remembered for subsequent queries.  So, registering providers for
+  // tags that nobody has asked for yet costs nothing.
+  class AncestorSet {
+  public:
+    AncestorSet(Driver* driver, ActionDriver* action);
+
+    bool contains(ActionDriver* action);
+
+  private:
+    Driver* driver;
+    std::unordered_set<ActionDriver*> visited;
+    std::vector<ActionDriver*> unexpanded;
 
+    void visit(ActionDriver* action);
+  };
+
+  // ancestors may be null if the provision has no creator.  reused is true if the provision
+  // was registered before its creator last reran, so its triggered actions still exist.
   void registerProvider(Provision* provision, const std::vector<Tag>& tags,
-                        const std::unordered_set<ActionDriver*>& dependencies);
-  void resetDependentActions(const Tag& tag,
-                             const std::unordered_set<ActionDriver*>& dependencies);
+                        AncestorSet* ancestors, bool reused);
+  void resetDependentActions(const Tag& tag, AncestorSet* ancestors);
   void resetDependentActions(Provision* provision);
-  void fireTriggers(const Tag& tag, Provision* provision);
 
+  void explainReset(ActionDriver* action);
+  void explainCosts();
+
+  // Outputs of an action from before it was reset.  They are out of tagTable, but the
+  // completed actions that used them are left alone until the action completes again.
+  struct StaleOutputs {
+    OwnedPtrVector<Provision> provisions;
+    std::vector<std::vector<Tag> > tags;  // Parallels provisions; each sorted.
+  };
+
+  // Stale outputs of actions triggered by a file that is being replaced by a new version,
+  // waiting to be adopted by the action the new version triggers with the same factory.
+  struct OrphanedOutputs {
+    ActionFactory* factory;
+    OwnedPtr<File> trigger;
+    OwnedPtr<StaleOutputs> outputs;
+  };
+  OwnedPtrVector<OrphanedOutputs> orphanedOutputs;
+
+  // Takes a provision out of tagTable (returning its tags) while its creator reruns, restarting
+  // only those users which can't wait to see whether the new output is identical.
+  void retireProvision(Provision* provision, std::vector<Tag>* tags);
+  void discardStaleOutputs(StaleOutputs* outputs);
+  void orphanTriggeredOutputs(Provision* provision);
+  void discardOrphanedOutputs();
+  bool hasTriggeredAction(ActionFactory* factory, Provision* provision);
+  // Appends the tags which registerProvider() would add inline for the given ones.
+  void addInlineTags(File* file, std::vector<Tag>* tags);
+  void fireTriggers(const Tag& tag, Provision* provision, bool reused,
+                    std::vector<Tag>* inlineTags);
+
+  void reportFailure();
+  bool isBuildingAny(const std::unordered_set<std::string>& actions);
+  void checkBuildWaits(bool idle, bool hasFailures);
   bool dumpErrors();
 };
 
@@ -18,9 +18,15 @@
 
 #include <string.h>
 #include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <unistd.h>
 #include <map>
+#include <unordered_set>
 
 #include "os/Subprocess.h"
+#include "os/TextFile.h"
 #include "ActionUtil.h"
 #include "base/Debug.h"
 
@@ -28,29 +34,177 @@ namespace ekam {
 
 namespace {
 
-std::string splitToken(std::string* line) {
-  std::string::size_type pos = line->find_first_of(' ');
-  std::string result;
-  if (pos == std::string::npos) {
-    result = *line;
-    line->clear();
-  } else {
-    result.assign(*line, 0, pos);
-    line->erase(0, pos + 1);
+// Parses e.g. "mem=4G cpu=2".
+bool parseResources(std::string args, Action::Resources* resources) {
+  while (!args.empty()) {
+    std::string token = splitToken(&args);
+    if (token.empty()) continue;
+
+    std::string::size_type eqPos = token.find_first_of('=');
+    if (eqPos == std::string::npos) return false;
+    std::string name(token, 0, eqPos);
+    const char* value = token.c_str() + eqPos + 1;
+
+    char* end;
+    double number = strtod(value, &end);
+    if (end == value || number < 0) return false;
+
+    if (name == "cpu") {
+      if (*end != '\0') return false;
+      resources->cpus = number;
+    } else if (name == "mem") {
+      switch (*end) {
+        case 'k': case 'K': number *= 1ull << 10; ++end; break;
+        case 'm': case 'M': number *= 1ull << 20; ++end; break;
+        case 'g': case 'G': number *= 1ull << 30; ++end; break;
+        default: break;
+      }
+      if (*end != '\0') return false;
+      resources->memory = number;
+    } else {
+      return false;
+    }
   }
-  return result;
+  return true;
 }
 
 }  // namespace
 
 // =======================================================================================
 
+// A running instance of a rule, and our ends of its pipes.
+class PluginProcess {
+public:
+  PluginProcess(File* executable, const std::string& argument, bool sandboxed) {
+    subprocess.addArgument(executable, File::READ);
+    if (!argument.empty()) {
+      subprocess.addArgument(argument);
+    }
+
+    if (sandboxed) {
+      // Ekam always runs from the project root; see ekam.cpp.
+      subprocess.sandbox(std::vector<std::string>(1, "src"));
+    }
+
+    responseStream = subprocess.captureStdin();
+    commandStream = subprocess.captureStdout();
+    logStream = subprocess.captureStderr();
+    lineReader = newOwned<LineReader>(commandStream.get());
+  }
+  ~PluginProcess() {}
+
+  Subprocess subprocess;
+  OwnedPtr<ByteStream> responseStream;
+  OwnedPtr<ByteStream> commandStream;
+  OwnedPtr<ByteStream> logStream;
+  OwnedPtr<LineReader> lineReader;
+};
+
+// A long-lived instance of a rule which declared "worker".  Ekam writes the canonical name of
+// each file to process to the worker's stdin.  The worker then issues commands as a rule
+// normally would, writes a NUL byte to stderr, and finally sends "done <exit-status>".
+class PluginWorker {
+public:
+  PluginWorker(File* executable, bool sandboxed)
+      : executableName(executable->getOnDisk(File::READ)->path()),
+        process(executable, "--ekam-worker", sandboxed), alive(true) {
+    process.subprocess.startDetached();
+  }
+  ~PluginWorker() {}
+
+  const std::string executableName;
+  PluginProcess process;
+
+  // False once the worker has exited or misbehaved.
+  bool alive;
+
+  // Logs the worker's stderr to the context up to the NUL that ends the current request.
+  Promise<void> logUntilDone(EventManager* eventManager, BuildContext* context) {
+    return eventManager->when(
+        process.logStream->readAsync(eventManager, buffer, sizeof(buffer)))(
+      [=](size_t size) -> Promise<void> {
+        if (size == 0) {
+          alive = false;
+          return newFulfilledPromise();
+        }
+
+        const char* end = reinterpret_cast<const char*>(memchr(buffer, '\0', size));
+        if (end == NULL) {
+          context->log(std::string(buffer, size));
+          return logUntilDone(eventManager, context);
+        }
+
+        if (end > buffer) {
+          context->log(std::string(buffer, end - buffer));
+        }
+        if (end + 1 != buffer + size) {
+          // Nothing should follow the NUL until the next request.
+          alive = false;
+        }
+        return newFulfilledPromise();
+      });
+  }
+
+private:
+  char buffer[4096];
+};
+
+// Idle workers, for all rules.
+class PluginWorkerPool {
+public:
+  PluginWorkerPool() {}
+  ~PluginWorkerPool() {}
+
+  OwnedPtr<PluginWorker> acquire(File* executable, bool sandboxed) {
+    std::string name = executable->getOnDisk(File::READ)->path();
+    for (int i = idle.size() - 1; i >= 0; i--) {
+      if (idle.get(i)->executableName == name) {
+        return idle.releaseAndShift(i);
+      }
+    }
+    return newOwned<PluginWorker>(executable, sandboxed);
+  }
+
+  void release(OwnedPtr<PluginWorker> worker) {
+    worker->process.commandStream->releaseWatcher();
+    worker->process.logStream->releaseWatcher();
+    idle.add(worker.release());
+  }
+
+  // Kills idle workers for the given rule, e.g. because it changed.
+  void discard(const std::string& executableName) {
+    OwnedPtrVector<PluginWorker> kept;
+    for (int i = 0; i < idle.size(); i++) {
+      if (idle.get(i)->executableName != executableName) {
+        kept.add(idle.release(i));
+      }
+    }
+    idle.swap(&kept);
+  }
+
+  void clear() { idle.clear(); }
+
+  // Requests read from rules (and the processes they run under intercept.so), across all rules.
+  // The pool is shared by all of them, so it keeps the count.
+  uint64_t roundTrips = 0;
+
+private:
+  OwnedPtrVector<PluginWorker> idle;
+};
+
+// =======================================================================================
+
 class PluginDerivedActionFactory : public ActionFactory {
 public:
   PluginDerivedActionFactory(OwnedPtr<File> executable,
                              std::string&& verb,
                              bool silent,
-                             std::vector<Tag>&& triggers);
+                             bool sandboxed,
+                             bool worker,
+                             const Action::Resources& resources,
+                             std::vector<Tag>&& triggers,
+                             const std::vector<std::string>& environment,
+                             PluginWorkerPool* workerPool);
   ~PluginDerivedActionFactory();
 
   // implements ActionFactory -----------------------------------------------------------
@@ -59,17 +213,26 @@ public:
 
 private:
   OwnedPtr<File> executable;
+  Hash executableHash;  // As of when the rule declared its triggers, plus its environment.
   std::string verb;
   bool silent;
+  bool sandboxed;
+  bool worker;
+  Action::Resources resources;
   std::vector<Tag> triggers;
+  PluginWorkerPool* workerPool;
 };
 
 // =======================================================================================
 
 class PluginDerivedAction : public Action {
 public:
-  PluginDerivedAction(File* executable, const std::string& verb, bool silent, File* file)
-      : executable(executable->clone()), verb(verb), silent(silent) {
+  PluginDerivedAction(File* executable, const Hash& executableHash, const std::string& verb,
+                      bool silent, bool sandboxed, bool worker, const Resources& resources,
+                      File* file, PluginWorkerPool* workerPool)
+      : executable(executable->clone()), executableHash(executableHash), verb(verb),
+        silent(silent), sandboxed(sandboxed), worker(worker), resources(resources),
+        workerPool(workerPool) {
     if (file != NULL) {
       this->file = file->clone();
     }
@@ -79,25 +242,40 @@ public:
   // implements Action -------------------------------------------------------------------
   std::string getVerb() { return verb; }
   bool isSilent() { return silent; }
+  Resources getResources() { return resources; }
+  Hash getIdentity() { return executableHash; }
   Promise<void> start(EventManager* eventManager, BuildContext* context);
 
 private:
   class CommandReader;
 
+  // If freshWorker is true, starts a new worker rather than reusing an idle one.
+  Promise<void> startInWorker(EventManager* eventManager, BuildContext* context,
+                              bool freshWorker = false);
+
   OwnedPtr<File> executable;
+  Hash executableHash;
   std::string verb;
   bool silent;
+  bool sandboxed;
+  bool worker;
+  Resources resources;
   OwnedPtr<File> file;  // nullable
+  PluginWorkerPool* workerPool;
+
+  // Tags looked up by the most recent run, used to build the preload manifest for the next.
+  std::vector<std::string> tagLookups;
 };
 
 class PluginDerivedAction::CommandReader {
 public:
-  CommandReader(BuildContext* context, OwnedPtr<ByteStream> requestStream,
-                OwnedPtr<ByteStream> responseStream, File* executable, File* input)
+  CommandReader(BuildContext* context, PluginProcess* process, File* executable, File* input,
+                bool inSandbox, bool inWorker, PluginWorkerPool* workerPool,
+                std::vector<std::string>* tagLookups)
       : context(context), executable(executable->clone()),
-        requestStream(requestStream.release()),
-        responseStream(responseStream.release()),
-        lineReader(this->requestStream.get()), silent(false) {
+        responseStream(process->responseStream.get()), lineReader(process->lineReader.get()),
+        inSandbox(inSandbox), inWorker(inWorker), workerPool(workerPool), silent(false),
+        sandboxed(false), worker(false), tagLookups(tagLookups) {
     if (input != NULL) {
       this->input = input->clone();
       knownFiles.add(input->canonicalName(), input->clone());
@@ -105,20 +283,57 @@ public:
 
     std::string junk;
     splitExtension(executable->basename(), &verb, &junk);
+
+    previousTagLookups.swap(*tagLookups);
+  }
+  ~CommandReader() {
+    if (!manifestPath.empty()) {
+      unlink(manifestPath.c_str());
+    }
   }
-  ~CommandReader() {}
+
+  // True once a worker has said "done".
+  bool isDone() { return done; }
+
+  // True if a worker exited without responding to the request at all, e.g. because it died
+  // while idle.  Then nothing was done on the action's behalf, so it's safe to retry.
+  bool isWorkerLost() { return workerLost; }
 
   Promise<void> readAll(EventManager* eventManager) {
-    return eventManager->when(lineReader.readLine(eventManager))(
-      [=](OwnedPtr<std::string> line) -> Promise<void> {
-        if (line == nullptr) {
-          eof();
+    // Handle everything already buffered before waiting for more.
+    LineReader::Record record;
+    while (lineReader->next(&record)) {
+      ++workerPool->roundTrips;
+      responded = true;
+      if (record.malformed) {
+        rejectFrame();
+      } else if (record.size > 0 && record.data[0] == '\0') {
+        consumeFrame(record.data, record.size);
+      } else {
+        consume(std::string(record.data, record.size));
+      }
+
+      if (done) {
+        eof();
+        return newFulfilledPromise();
+      }
+    }
+
+    return eventManager->when(lineReader->readMore(eventManager))(
+      [=](bool more) -> Promise<void> {
+        if (!more) {
+          if (inWorker && !responded) {
+            workerLost = true;
+          } else if (inWorker) {
+            context->log("worker exited unexpectedly");
+            context->failed();
+          } else {
+            eof();
+          }
           return newFulfilledPromise();
         }
-
-        consume(*line);
         return readAll(eventManager);
-      }, [=](MaybeException<OwnedPtr<std::string>> error) {
+      }, [=](MaybeException<bool> error) {
         try {
           error.get();
         } catch (const std::exception& e) {
@@ -144,13 +359,45 @@ private:
       verb = args;
     } else if (command == "silent") {
       silent = true;
+    } else if (command == "sandbox") {
+      sandboxed = true;
+    } else if (command == "worker") {
+      worker = true;
+    } else if (command == "done" && inWorker) {
+      done = true;
+      if (args != "0") {
+        context->failed();
+      }
+    } else if (command == "resources") {
+      if (!parseResources(args, &resources)) {
+        context->log("invalid resources: " + args);
+        context->failed();
+      }
     } else if (command == "trigger") {
       triggers.push_back(Tag::fromName(args));
-    } else if (command == "findProvider" || command == "findInput") {
+    } else if (command == "environment") {
+      while (!args.empty()) {
+        environment.push_back(splitToken(&args));
+      }
+    } else if (command == "findProvider") {
+      std::string path = lookUpTag(args);
+      path.push_back('\n');
+      respond(path.data(), path.size());
+    } else if (command == "framing") {
+      if (args == "binary") {
+        lineReader->enableFrames();
+        respond("ok\n", 3);
+      } else {
+        respond("\n", 1);
+      }
+    } else if (command == "preloadManifest") {
+      // The manifest goes in /tmp, which a sandboxed process can't see.
+      std::string path = inSandbox ? std::string() : writeManifest();
+      path.push_back('\n');
+      respond(path.data(), path.size());
+    } else if (command == "findInput") {
       File* provider;
-      if (command == "findProvider") {
-        provider = context->findProvider(Tag::fromName(args));
-      } else if (input != NULL && args == input->canonicalName()) {
+      if (input != NULL && args == input->canonicalName()) {
         provider = input.get();
       } else if (findInCache("newOutput " + args)) {
         // File was originally created by this action.  findInCache() already wrote the path,
@@ -164,37 +411,44 @@ private:
         std::string path = diskRef->path();
         cache.insert(std::make_pair(line, diskRef.get()));
         diskRefs.add(diskRef.release());
-        responseStream->writeAll(path.data(), path.size());
+        respond(path.data(), path.size());
 
         knownFiles.add(path, provider->clone());
       }
-      responseStream->writeAll("\n", 1);
+      respond("\n", 1);
     } else if (command == "findModifiers") {
-      auto dir = input->parent();
-      std::vector<File*> results;
-      for (;;) {
-        File* provider = context->findProvider(Tag::fromName(
-            "canonical:" + dir->relative(args)->canonicalName()));
-        if (provider != NULL) {
-          results.push_back(provider);
-        }
-        if (!dir->hasParent()) {
-          break;
-        }
-        dir = dir->parent();
-      }
-
-      for (auto iter = results.rbegin(); iter != results.rend(); ++iter) {
+      std::vector<File*> results = context->findModifiers(input.get(), args);
+      for (auto iter = results.begin(); iter != results.end(); ++iter) {
         File* provider = *iter;
         OwnedPtr<File::DiskRef> diskRef = provider->getOnDisk(File::READ);
         std::string path = diskRef->path();
         diskRefs.add(diskRef.release());
-        responseStream->writeAll(path.data(), path.size());
+        respond(path.data(), path.size());
         knownFiles.add(path, provider->clone());
-        responseStream->writeAll("\n", 1);
+        respond("\n", 1);
       }
 
-      responseStream->writeAll("\n", 1);
+      respond("\n", 1);
+    } else if (command == "history") {
+      double seconds = context->getHistoricalDuration(
+          args.empty() && input != NULL ? input->canonicalName() : args);
+      if (seconds >= 0) {
+        char buffer[32];
+        snprintf(buffer, sizeof(buffer), "%.3f", seconds);
+        respond(buffer, strlen(buffer));
+      }
+      respond("\n", 1);
+    } else if (command == "duration") {
+      char* end;
+      double seconds = strtod(args.c_str(), &end);
+      if (args.empty() || *end != '\0' || seconds < 0) {
+        context->log("invalid duration: " + args);
+        context->failed();
+      } else {
+        context->recordDuration(seconds);
+      }
+    } else if (command == "nocache") {
+      context->uncacheable();
     } else if (command == "newProvider") {
       // TODO:  Create a new output file and register it as a provider.
       context->log("newProvider not implemented");
@@ -212,8 +466,8 @@ private:
       diskRefs.add(diskRef.release());
       knownFiles.add(path, file.release());
 
-      responseStream->writeAll(path.data(), path.size());
-      responseStream->writeAll("\n", 1);
+      respond(path.data(), path.size());
+      respond("\n", 1);
     } else if (command == "provide") {
       std::string filename = splitToken(&args);
       File* file = knownFiles.get(filename);
@@ -224,6 +478,30 @@ private:
       } else {
         provisions.insert(std::make_pair(file, Tag::fromName(args)));
       }
+    } else if (command == "provideTags") {
+      // Like "provide", but with many tags listed one per line in a file, which is much cheaper
+      // than a command per tag when e.g. an object file defines thousands of symbols.
+      std::string filename = splitToken(&args);
+      File* file = knownFiles.get(filename);
+      File* tagFile = knownFiles.get(args);
+      if (file == NULL || tagFile == NULL) {
+        context->log("File passed to \"provideTags\" not created with \"newOutput\" nor noted as "
+                     "an input: " + (file == NULL ? filename : args) + "\n");
+        context->failed();
+      } else {
+        std::string content = tagFile->readAll();
+        std::string::size_type pos = 0;
+        while (pos < content.size()) {
+          std::string::size_type eol = content.find_first_of('\n', pos);
+          if (eol == std::string::npos) {
+            eol = content.size();
+          }
+          if (eol > pos) {
+            provisions.insert(std::make_pair(file, Tag::fromName(content.substr(pos, eol - pos))));
+          }
+          pos = eol + 1;
+        }
+      }
     } else if (command == "install") {
       std::string filename = splitToken(&args);
       File* file = knownFiles.get(filename);
@@ -284,22 +562,35 @@ private:
       context->provide(currentFile, tags);
     }
 
-    // Also register new triggers.
-    context->addActionType(newOwned<PluginDerivedActionFactory>(
-        executable.release(), std::move(verb), silent, std::move(triggers)));
+    // Also register new triggers.  Most actions don't declare any, in which case there's no
+    // point in registering a factory -- and not doing so keeps the action cacheable.
+    if (!triggers.empty()) {
+      context->addActionType(newOwned<PluginDerivedActionFactory>(
+          executable.release(), std::move(verb), silent, sandboxed, worker, resources,
+          std::move(triggers), environment, workerPool));
+    }
   }
 
 private:
   BuildContext* context;
   OwnedPtr<File> executable;
   OwnedPtr<File> input;  // nullable
-  OwnedPtr<ByteStream> requestStream;
-  OwnedPtr<ByteStream> responseStream;
-  LineReader lineReader;
+  ByteStream* responseStream;
+  LineReader* lineReader;
+  bool inSandbox;
+  bool inWorker;
+  bool done = false;
+  bool responded = false;
+  bool workerLost = false;
+  PluginWorkerPool* workerPool;
 
   std::string verb;
   bool silent;
+  bool sandboxed;
+  bool worker;
+  Action::Resources resources;
   std::vector<Tag> triggers;
+  std::vector<std::string> environment;
 
   OwnedPtrMap<std::string, File> knownFiles;
 
@@ -310,47 +601,235 @@ private:
   typedef std::multimap<File*, Tag> ProvisionMap;
   ProvisionMap provisions;
 
+  std::vector<std::string>* tagLookups;
+  std::vector<std::string> previousTagLookups;
+  std::unordered_set<std::string> seenTags;
+  std::string manifestPath;
+
+  // Handles "findProvider <tag>", returning the path or an empty string if not found.  The tag
+  // goes in the next run's preload manifest.
+  std::string lookUpTag(const std::string& tag) {
+    if (seenTags.insert(tag).second) {
+      tagLookups->push_back(tag);
+    }
+
+    File::DiskRef* diskRef = resolveTag(tag);
+    if (diskRef == NULL) {
+      return std::string();
+    }
+    cache.insert(std::make_pair("findProvider " + tag, diskRef));
+    return diskRef->path();
+  }
+
+  // Finds the file providing a tag, which makes it a dependency of this run.  Returns NULL if
+  // there is none.
+  File::DiskRef* resolveTag(const std::string& tag) {
+    File* provider = context->findProvider(Tag::fromName(tag));
+    if (provider == NULL) {
+      return NULL;
+    }
+
+    OwnedPtr<File::DiskRef> diskRef = provider->getOnDisk(File::READ);
+    File::DiskRef* result = diskRef.get();
+    knownFiles.add(diskRef->path(), provider->clone());
+    diskRefs.add(diskRef.release());
+    return result;
+  }
+
+  // Resolves every tag that the previous run of this action looked up and writes the results
+  // to a file, one "<tag>\t<path>" per line (path empty if not found), which the interceptor
+  // loads at startup so that it can answer those lookups without asking us.  Resolving them
+  // here records them as dependencies of this run, in case the answers are used.  But they
+  // aren't carried forward to the next run's manifest unless something asks for them again;
+  // the interceptor does that at exit for the entries it used.  Otherwise a tag looked up once
+  // would stay a dependency forever.  Returns the file's path, or an empty string if there is
+  // nothing to preload.
+  std::string writeManifest() {
+    if (previousTagLookups.empty() || !manifestPath.empty()) {
+      return manifestPath;
+    }
+
+    std::string content;
+    for (size_t i = 0; i < previousTagLookups.size(); i++) {
+      const std::string& tag = previousTagLookups[i];
+      File::DiskRef* diskRef = resolveTag(tag);
+      std::string path = diskRef == NULL ? std::string() : diskRef->path();
+      if (tag.find_first_of("\t\n") == std::string::npos &&
+          path.find_first_of('\n') == std::string::npos) {
+        content.append(tag);
+        content.push_back('\t');
+        content.append(path);
+        content.push_back('\n');
+      }
+    }
+
+    char name[] = "/tmp/ekam-preload-XXXXXX";
+    int fd = mkstemp(name);
+    if (fd < 0) {
+      DEBUG_ERROR << "mkstemp: " << strerror(errno);
+      return std::string();
+    }
+    manifestPath = name;
+    ByteStream stream(fd, manifestPath);
+    stream.writeAll(content.data(), content.size());
+    return manifestPath;
+  }
+
+  // Collects responses while handling a frame.  Null when responses go directly to the stream.
+  std::string* capturedResponse = nullptr;
+
+  void respond(const void* data, size_t size) {
+    if (capturedResponse == nullptr) {
+      responseStream->writeAll(data, size);
+    } else {
+      capturedResponse->append(reinterpret_cast<const char*>(data), size);
+    }
+  }
+
+  static void appendFrameInt(std::string* output, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+      output->push_back(static_cast<char>((value >> (i * 8)) & 0xff));
+    }
+  }
+
+  // A frame's payload is a sequence of commands, each a 32-bit little-endian length followed by
+  // the text of the command without a trailing newline.  The reply is a single frame whose
+  // payload contains, for each command in order, a length followed by exactly the bytes the
+  // text protocol would have written in response (possibly none).  So a client may send many
+  // lookups with one write and get all the answers with one read.
+  void consumeFrame(const char* frame, size_t size) {
+    const unsigned char* data = reinterpret_cast<const unsigned char*>(frame);
+    size_t pos = LineReader::FRAME_HEADER_SIZE;
+
+    std::string reply(LineReader::FRAME_HEADER_SIZE, '\0');
+    std::string response;
+    capturedResponse = &response;
+
+    while (pos + 4 <= size) {
+      size_t length = data[pos] | (data[pos + 1] << 8) | (data[pos + 2] << 16) |
+                      (static_cast<size_t>(data[pos + 3]) << 24);
+      pos += 4;
+      if (length > size - pos) break;
+
+      response.clear();
+      consume(std::string(frame + pos, length));
+      pos += length;
+
+      appendFrameInt(&reply, response.size());
+      reply.append(response);
+    }
+
+    capturedResponse = nullptr;
+
+    if (pos != size) {
+      context->log("malformed request frame");
+      context->failed();
+    }
+
+    std::string header;
+    appendFrameInt(&header, reply.size() - LineReader::FRAME_HEADER_SIZE);
+    reply.replace(1, 4, header);
+    responseStream->writeAll(reply.data(), reply.size());
+  }
+
+  // Fails the action over a frame that was too big to accept or was cut off.  The client still
+  // gets an empty reply frame so that it doesn't wait forever, if it's still listening.
+  void rejectFrame() {
+    context->log("malformed request frame");
+    context->failed();
+
+    std::string reply(LineReader::FRAME_HEADER_SIZE, '\0');
+    try {
+      responseStream->writeAll(reply.data(), reply.size());
+    } catch (const std::exception& e) {
+      // The client is gone, which is fine.
+    }
+  }
+
   bool findInCache(const std::string& line) {
     CacheMap::const_iterator iter = cache.find(line);
     if (iter == cache.end()) {
       return false;
     } else {
       std::string path = iter->second->path();
-      responseStream->writeAll(path.data(), path.size());
-      responseStream->writeAll("\n", 1);
+      respond(path.data(), path.size());
+      respond("\n", 1);
       return true;
     }
   }
 };
 
 Promise<void> PluginDerivedAction::start(EventManager* eventManager, BuildContext* context) {
-  auto subprocess = newOwned<Subprocess>();
-
-  subprocess->addArgument(executable.get(), File::READ);
-  if (file != NULL) {
-    subprocess->addArgument(file->canonicalName());
+  // A CPU limit covers a process's whole life, so it can't be applied to one request to a
+  // long-lived worker.  Start the rule afresh instead, as if it weren't a worker.
+  if (worker && file != NULL && context->getCpuTimeLimit() <= 0) {
+    return startInWorker(eventManager, context);
   }
 
-  OwnedPtr<ByteStream> responseStream = subprocess->captureStdin();
-  OwnedPtr<ByteStream> commandStream = subprocess->captureStdout();
-  OwnedPtr<ByteStream> logStream = subprocess->captureStderr();
+  auto process = newOwned<PluginProcess>(
+      executable.get(), file == NULL ? std::string() : file->canonicalName(), sandboxed);
+  process->subprocess.setCpuTimeLimit(context->getCpuTimeLimit());
 
-  auto subprocessWaitOp = eventManager->when(subprocess->start(eventManager))(
+  auto subprocessWaitOp = eventManager->when(process->subprocess.start(eventManager))(
     [context](ProcessExitCode exitCode) {
       if (exitCode.wasSignaled() || exitCode.getExitCode() != 0) {
+        if (exitCode.wasSignaled() && exitCode.getSignalNumber() == SIGXCPU) {
+          context->log("killed after exceeding CPU time limit\n");
+        }
         context->failed();
       }
     });
 
   auto commandReader = newOwned<CommandReader>(
-      context, commandStream.release(), responseStream.release(), executable.get(), file.get());
+      context, process.get(), executable.get(), file.get(), sandboxed, false, workerPool,
+      &tagLookups);
   auto commandOp = commandReader->readAll(eventManager);
 
-  OwnedPtr<Logger> logger = newOwned<Logger>(context, logStream.release());
+  OwnedPtr<Logger> logger = newOwned<Logger>(context, process->logStream.release());
   auto logOp = logger->run(eventManager);
 
-  return eventManager->when(subprocessWaitOp, commandOp, logOp, subprocess, commandReader, logger)(
-      [](Void, Void, Void, OwnedPtr<Subprocess>, OwnedPtr<CommandReader>, OwnedPtr<Logger>){});
+  return eventManager->when(subprocessWaitOp, commandOp, logOp, process, commandReader, logger)(
+      [](Void, Void, Void, OwnedPtr<PluginProcess>, OwnedPtr<CommandReader>, OwnedPtr<Logger>){});
+}
+
+Promise<void> PluginDerivedAction::startInWorker(EventManager* eventManager,
+                                                 BuildContext* context, bool freshWorker) {
+  OwnedPtr<PluginWorker> pluginWorker = freshWorker ?
+      newOwned<PluginWorker>(executable.get(), sandboxed) :
+      workerPool->acquire(executable.get(), sandboxed);
+
+  std::string request = file->canonicalName() + "\n";
+  try {
+    pluginWorker->process.responseStream->writeAll(request.data(), request.size());
+  } catch (const std::exception& e) {
+    if (freshWorker) throw;
+    // Probably exited while idle.  Try a fresh one.
+    return startInWorker(eventManager, context, true);
+  }
+
+  auto commandReader = newOwned<CommandReader>(
+      context, &pluginWorker->process, executable.get(), file.get(), sandboxed, true, workerPool,
+      &tagLookups);
+  auto commandOp = commandReader->readAll(eventManager);
+  auto logOp = pluginWorker->logUntilDone(eventManager, context);
+
+  return eventManager->when(commandOp, logOp, pluginWorker, commandReader)(
+      [this, eventManager, context, freshWorker](
+          Void, Void, OwnedPtr<PluginWorker> pluginWorker,
+          OwnedPtr<CommandReader> commandReader) -> Promise<void> {
+        if (pluginWorker->alive && commandReader->isDone()) {
+          workerPool->release(pluginWorker.release());
+        } else if (commandReader->isWorkerLost()) {
+          // The write can succeed even though the worker is on its way out, in which case we
+          // only find out now.
+          if (!freshWorker) {
+            return startInWorker(eventManager, context, true);
+          }
+          context->log("worker exited unexpectedly");
+          context->failed();
+        }
+        return newFulfilledPromise();
+      });
 }
 
 // =======================================================================================
@@ -358,12 +837,35 @@ Promise<void> PluginDerivedAction::start(EventManager* eventManager, BuildContex
 PluginDerivedActionFactory::PluginDerivedActionFactory(OwnedPtr<File> executable,
                                                        std::string&& verb,
                                                        bool silent,
-                                                       std::vector<Tag>&& triggers)
-    : executable(executable.release()), silent(silent) {
+                                                       bool sandboxed,
+                                                       bool worker,
+                                                       const Action::Resources& resources,
+                                                       std::vector<Tag>&& triggers,
+                                                       const std::vector<std::string>& environment,
+                                                       PluginWorkerPool* workerPool)
+    : executable(executable.release()), silent(silent), sandboxed(sandboxed), worker(worker),
+      resources(resources), workerPool(workerPool) {
+  executableHash = this->executable->contentHash();
+  if (!environment.empty()) {
+    // The action cache only covers the variables every build depends on, so fold in the ones
+    // this rule reads.
+    Hash::Builder hasher;
+    hasher.add(executableHash.toString());
+    for (const std::string& name : environment) {
+      const char* value = getenv(name.c_str());
+      hasher.add(name).add(value == nullptr ? std::string(1, '\0') : "=" + std::string(value));
+    }
+    executableHash = hasher.build();
+  }
   this->verb.swap(verb);
   this->triggers.swap(triggers);
 }
-PluginDerivedActionFactory::~PluginDerivedActionFactory() {}
+PluginDerivedActionFactory::~PluginDerivedActionFactory() {
+  if (worker) {
+    // The rule is being replaced or removed.
+    workerPool->discard(executable->getOnDisk(File::READ)->path());
+  }
+}
 
 void PluginDerivedActionFactory::enumerateTriggerTags(
     std::back_insert_iterator<std::vector<Tag> > iter) {
@@ -372,14 +874,23 @@ void PluginDerivedActionFactory::enumerateTriggerTags(
   }
 }
 OwnedPtr<Action> PluginDerivedActionFactory::tryMakeAction(const Tag& id, File* file) {
-  return newOwned<PluginDerivedAction>(executable.get(), verb, silent, file);
+  return newOwned<PluginDerivedAction>(executable.get(), executableHash, verb, silent, sandboxed,
+                                       worker, resources, file, workerPool);
 }
 
 // =======================================================================================
 
-ExecPluginActionFactory::ExecPluginActionFactory() {}
+ExecPluginActionFactory::ExecPluginActionFactory() : workerPool(newOwned<PluginWorkerPool>()) {}
 ExecPluginActionFactory::~ExecPluginActionFactory() {}
 
+void ExecPluginActionFactory::shutDownWorkers() {
+  workerPool->clear();
+}
+
+uint64_t ExecPluginActionFactory::getRoundTripCount() {
+  return workerPool->roundTrips;
+}
+
 // implements ActionFactory --------------------------------------------------------------
 
 void ExecPluginActionFactory::enumerateTriggerTags(
@@ -388,7 +899,10 @@ void ExecPluginActionFactory::enumerateTriggerTags(
 }
 
 OwnedPtr<Action> ExecPluginActionFactory::tryMakeAction(const Tag& id, File* file) {
-  return newOwned<PluginDerivedAction>(file, "learn", false, (File*)NULL);
+  // The rule is the trigger file, so its content is covered by the cache anyway.  What "learn"
+  // makes of it is up to Ekam.
+  return newOwned<PluginDerivedAction>(file, Action::ekamIdentity(), "learn", false, false, false,
+                                       Action::Resources(), (File*)NULL, workerPool.get());
 }
 
 }  // namespace ekam
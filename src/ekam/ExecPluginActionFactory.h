@@ -21,14 +21,25 @@
 
 namespace ekam {
 
+class PluginWorkerPool;
+
 class ExecPluginActionFactory : public ActionFactory {
 public:
   ExecPluginActionFactory();
   ~ExecPluginActionFactory();
 
+  // Kills the idle processes of rules which declared "worker".  Call once the build is done.
+  void shutDownWorkers();
+
+  // Number of requests rules have made of Ekam so far.
+  uint64_t getRoundTripCount();
+
   // implements ActionFactory ------------------------------------------------------------
   void enumerateTriggerTags(std::back_insert_iterator<std::vector<Tag> > iter);
   OwnedPtr<Action> tryMakeAction(const Tag& id, File* file);
+
+private:
+  OwnedPtr<PluginWorkerPool> workerPool;
 };
 
 }  // namespace ekam
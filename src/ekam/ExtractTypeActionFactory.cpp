@@ -0,0 +1,60 @@
+// Ekam Build System
+// Author: Kenton Varda (kenton@sandstorm.io)
+// Copyright (c) 2010-2015 Kenton Varda, Google Inc., and contributors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "ExtractTypeActionFactory.h"
+
+namespace ekam {
+
+ExtractTypeActionFactory::ExtractTypeActionFactory() {}
+ExtractTypeActionFactory::~ExtractTypeActionFactory() {}
+
+void ExtractTypeActionFactory::enumerateTriggerTags(
+    std::back_insert_iterator<std::vector<Tag> > iter) {
+  *iter++ = Tag::DEFAULT_TAG;
+}
+
+OwnedPtr<Action> ExtractTypeActionFactory::tryMakeAction(const Tag& id, File* file) {
+  return nullptr;
+}
+
+bool ExtractTypeActionFactory::tryTagInline(const Tag& id, File* file, std::vector<Tag>* tags) {
+  std::string name = file->canonicalName();
+
+  tags->push_back(Tag::fromName("canonical:" + name));
+
+  while (true) {
+    tags->push_back(Tag::fromFile(name));
+
+    std::string::size_type slashPos = name.find_first_of('/');
+    if (slashPos == std::string::npos) {
+      break;
+    }
+
+    name.erase(0, slashPos + 1);
+  }
+
+  if (file->isDirectory()) {
+    tags->push_back(Tag::fromName("directory:*"));
+  } else {
+    std::string base, ext;
+    splitExtension(name, &base, &ext);
+    if (!ext.empty()) tags->push_back(Tag::fromName("filetype:" + ext));
+  }
+
+  return true;
+}
+
+}  // namespace ekam
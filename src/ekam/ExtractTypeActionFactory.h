@@ -0,0 +1,41 @@
+// Ekam Build System
+// Author: Kenton Varda (kenton@sandstorm.io)
+// Copyright (c) 2010-2015 Kenton Varda, Google Inc., and contributors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef KENTONSCODE_EKAM_EXTRACTTYPEACTIONFACTORY_H_
+#define KENTONSCODE_EKAM_EXTRACTTYPEACTIONFACTORY_H_
+
+#include <vector>
+#include <iterator>
+#include "Action.h"
+
+namespace ekam {
+
+// Tags each file by name and type.  The tags depend only on the path, so they're applied
+// inline rather than by running an action on every file.
+class ExtractTypeActionFactory : public ActionFactory {
+public:
+  ExtractTypeActionFactory();
+  ~ExtractTypeActionFactory();
+
+  // implements ActionFactory ------------------------------------------------------------
+  void enumerateTriggerTags(std::back_insert_iterator<std::vector<Tag> > iter);
+  OwnedPtr<Action> tryMakeAction(const Tag& id, File* file);
+  bool tryTagInline(const Tag& id, File* file, std::vector<Tag>* tags);
+};
+
+}  // namespace ekam
+
+#endif  // KENTONSCODE_EKAM_EXTRACTTYPEACTIONFACTORY_H_
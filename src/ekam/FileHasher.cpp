@@ -0,0 +1,66 @@
+// Ekam Build System
+// Author: Kenton Varda (kenton@sandstorm.io)
+// Copyright (c) 2010-2015 Kenton Varda, Google Inc., and contributors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "FileHasher.h"
+
+#include <string.h>
+
+#include "base/Debug.h"
+
+namespace ekam {
+
+FileHasher::FileHasher(ThreadPool* pool): pool(pool) {}
+FileHasher::~FileHasher() {}
+
+bool FileHasher::Result::isCurrent(File* file) const {
+  struct stat now;
+  if (stats.st_ino == 0 || stat(file->getOnDisk(File::READ)->path().c_str(), &now) < 0) {
+    return false;
+  }
+  return now.st_dev == stats.st_dev && now.st_ino == stats.st_ino &&
+      now.st_size == stats.st_size &&
+      now.st_mtim.tv_sec == stats.st_mtim.tv_sec && now.st_mtim.tv_nsec == stats.st_mtim.tv_nsec &&
+      now.st_ctim.tv_sec == stats.st_ctim.tv_sec && now.st_ctim.tv_nsec == stats.st_ctim.tv_nsec;
+}
+
+Promise<std::vector<FileHasher::Result>> FileHasher::hash(const std::vector<File*>& files) {
+  // Cloned here and destroyed by the pool on this thread; the pool thread only reads them.
+  OwnedPtrVector<File> clones;
+  for (size_t i = 0; i < files.size(); i++) {
+    clones.add(files[i]->clone());
+  }
+
+  return pool->run([clones = std::move(clones)]() {
+    std::vector<Result> results(clones.size());
+    for (int i = 0; i < clones.size(); i++) {
+      File* file = clones.get(i);
+      Result& result = results[i];
+      memset(&result.stats, 0, sizeof(result.stats));
+      try {
+        struct stat stats;
+        if (stat(file->getOnDisk(File::READ)->path().c_str(), &stats) == 0) {
+          result.hash = file->contentHash();
+          result.stats = stats;
+        }
+      } catch (const std::exception& e) {
+        DEBUG_ERROR << "Hashing " << file->canonicalName() << ": " << e.what();
+      }
+    }
+    return results;
+  });
+}
+
+}  // namespace ekam
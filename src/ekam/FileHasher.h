@@ -0,0 +1,57 @@
+// Ekam Build System
+// Author: Kenton Varda (kenton@sandstorm.io)
+// Copyright (c) 2010-2015 Kenton Varda, Google Inc., and contributors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef KENTONSCODE_EKAM_FILEHASHER_H_
+#define KENTONSCODE_EKAM_FILEHASHER_H_
+
+#include <vector>
+#include <sys/stat.h>
+
+#include "base/Hash.h"
+#include "base/Promise.h"
+#include "os/File.h"
+#include "os/ThreadPool.h"
+
+namespace ekam {
+
+// Hashes files on a thread pool, so that big outputs (e.g. linked binaries) don't stall the
+// event loop.  Results are delivered on the event loop thread.
+//
+// The pool must outlive the promises returned by hash().
+class FileHasher {
+public:
+  FileHasher(ThreadPool* pool);
+  ~FileHasher();
+
+  struct Result {
+    Hash hash;
+    struct stat stats;  // Taken before reading; st_ino is zero if the file couldn't be read.
+
+    // Whether the file still looks as it did when it was hashed, i.e. hash is still valid.
+    bool isCurrent(File* file) const;
+  };
+
+  // Hashes each of the files, which are cloned.  The results parallel files.  Destroy the
+  // promise to cancel.
+  Promise<std::vector<Result>> hash(const std::vector<File*>& files);
+
+private:
+  ThreadPool* pool;
+};
+
+}  // namespace ekam
+
+#endif  // KENTONSCODE_EKAM_FILEHASHER_H_
@@ -0,0 +1,151 @@
+// Ekam Build System
+// Author: Kenton Varda (kenton@sandstorm.io)
+// Copyright (c) 2010-2015 Kenton Varda, Google Inc., and contributors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "Installer.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+
+#include "base/Debug.h"
+#include "os/ByteStream.h"
+#include "os/OsHandle.h"
+
+namespace ekam {
+
+Installer::Installer(ThreadPool* pool): pool(pool) {}
+Installer::~Installer() {}
+
+Promise<void> Installer::install(std::vector<Request>&& requests) {
+  return pool->run([this, requests = std::move(requests)]() {
+    for (size_t i = 0; i < requests.size(); i++) {
+      try {
+        installOne(requests[i]);
+      } catch (const std::exception& e) {
+        DEBUG_ERROR << "Installing " << requests[i].target << ": " << e.what();
+      }
+    }
+  });
+}
+
+void Installer::installOne(const Request& request) {
+  struct stat target;
+  if (lstat(request.target.c_str(), &target) == 0) {
+    struct stat source;
+    WRAP_SYSCALL(stat, request.source.c_str(), &source);
+    if (source.st_dev == target.st_dev && source.st_ino == target.st_ino) {
+      // Already linked, e.g. because the action rewrote its output in place.
+      return;
+    }
+    if (S_ISREG(target.st_mode) && target.st_size == source.st_size &&
+        sameContent(request.source, request.target)) {
+      // Rebuilt with the same content.  Leaving it keeps the inode, and everything watching it,
+      // undisturbed.
+      return;
+    }
+    WRAP_SYSCALL(unlink, request.target.c_str());
+  } else {
+    createParent(request.target);
+  }
+
+  try {
+    place(request.source, request.target);
+  } catch (const OsError& e) {
+    if (e.getErrorNumber() != ENOENT) throw;
+    // A directory we made was deleted behind our back.
+    createdDirs.clear();
+    createParent(request.target);
+    place(request.source, request.target);
+  }
+}
+
+void Installer::createParent(const std::string& path) {
+  std::string::size_type slashPos = path.find_last_of('/');
+  if (slashPos == std::string::npos || slashPos == 0) {
+    return;
+  }
+  std::string dir = path.substr(0, slashPos);
+  if (createdDirs.count(dir) > 0) {
+    return;
+  }
+
+  if (mkdir(dir.c_str(), 0777) < 0) {
+    if (errno == ENOENT) {
+      createParent(dir);
+      WRAP_SYSCALL(mkdir, dir.c_str(), 0777);
+    } else if (errno != EEXIST) {
+      throw OsError(dir, "mkdir", errno);
+    }
+  }
+  createdDirs.insert(dir);
+}
+
+void Installer::place(const std::string& source, const std::string& target) {
+  if (link(source.c_str(), target.c_str()) == 0) {
+    return;
+  } else if (errno != EXDEV && errno != EPERM && errno != EMLINK) {
+    throw OsError(target, "link", errno);
+  }
+
+  // Can't hard link here.  A reflink still shares the blocks where the filesystem allows it.
+  ByteStream in(source, O_RDONLY | O_CLOEXEC);
+  struct stat stats;
+  in.stat(&stats);
+  ByteStream out(target, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, stats.st_mode & 07777);
+#ifdef FICLONE
+  if (ioctl(out.getHandle()->get(), FICLONE, in.getHandle()->get()) == 0) {
+    return;
+  }
+#endif
+
+  char buffer[65536];
+  while (true) {
+    size_t size = in.read(buffer, sizeof(buffer));
+    if (size == 0) break;
+    out.writeAll(buffer, size);
+  }
+}
+
+bool Installer::sameContent(const std::string& a, const std::string& b) {
+  ByteStream streamA(a, O_RDONLY | O_CLOEXEC);
+  ByteStream streamB(b, O_RDONLY | O_CLOEXEC);
+
+  char bufferA[65536];
+  char bufferB[65536];
+  while (true) {
+    size_t sizeA = streamA.read(bufferA, sizeof(bufferA));
+    size_t sizeB = 0;
+    while (sizeB < sizeA) {
+      size_t n = streamB.read(bufferB + sizeB, sizeA - sizeB);
+      if (n == 0) return false;
+      sizeB += n;
+    }
+    if (sizeA == 0) {
+      return streamB.read(bufferB, 1) == 0;
+    }
+    if (memcmp(bufferA, bufferB, sizeA) != 0) {
+      return false;
+    }
+  }
+}
+
+}  // namespace ekam
@@ -0,0 +1,65 @@
+// Ekam Build System
+// Author: Kenton Varda (kenton@sandstorm.io)
+// Copyright (c) 2010-2015 Kenton Varda, Google Inc., and contributors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef KENTONSCODE_EKAM_INSTALLER_H_
+#define KENTONSCODE_EKAM_INSTALLER_H_
+
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "base/Promise.h"
+#include "os/ThreadPool.h"
+
+namespace ekam {
+
+// Installs outputs into bin/, lib/, etc. on a thread pool, so that an action which installs
+// thousands of headers doesn't stall the event loop with metadata syscalls.
+//
+// A target which already has the source's content is left alone.  Otherwise it is replaced by
+// a hard link to the source, or, where the two are on different filesystems, a reflink
+// (FICLONE) or failing that a copy.  Parent directories are created once and remembered.
+//
+// The pool must outlive the promises returned by install().
+class Installer {
+public:
+  Installer(ThreadPool* pool);
+  ~Installer();
+
+  struct Request {
+    std::string source;  // disk paths
+    std::string target;
+  };
+
+  // Installs the files in order.  Only one call may be outstanding at a time, so that a later
+  // install of the same target can't finish first.  Failures are logged, not propagated.
+  Promise<void> install(std::vector<Request>&& requests);
+
+private:
+  ThreadPool* pool;
+
+  // Directories known to exist.  Only touched by the pool thread running the current batch.
+  std::unordered_set<std::string> createdDirs;
+
+  void installOne(const Request& request);
+  void createParent(const std::string& path);
+  void place(const std::string& source, const std::string& target);
+  static bool sameContent(const std::string& a, const std::string& b);
+};
+
+}  // namespace ekam
+
+#endif  // KENTONSCODE_EKAM_INSTALLER_H_
@@ -0,0 +1,150 @@
+// Ekam Build System
+// Author: Kenton Varda (kenton@sandstorm.io)
+// Copyright (c) 2010-2015 Kenton Varda, Google Inc., and contributors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "MetricsServer.h"
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include "base/Debug.h"
+
+namespace ekam {
+
+namespace {
+
+void writeMetric(std::string* out, const char* name, const char* type, const char* help,
+                 double value) {
+  char buffer[512];
+  snprintf(buffer, sizeof(buffer), "# HELP %s %s\n# TYPE %s %s\n%s %.17g\n",
+           name, help, name, type, name, value);
+  out->append(buffer);
+}
+
+// Zero if unknown.
+uint64_t residentSetBytes() {
+  FILE* statm = fopen("/proc/self/statm", "r");
+  if (statm == NULL) {
+    return 0;
+  }
+  unsigned long long pages = 0;
+  if (fscanf(statm, "%*u %llu", &pages) != 1) {
+    pages = 0;
+  }
+  fclose(statm);
+  return pages * sysconf(_SC_PAGESIZE);
+}
+
+}  // namespace
+
+class MetricsServer::Connection {
+public:
+  Connection(MetricsServer* server, OwnedPtr<ByteStream> stream)
+      : server(server), stream(stream.release()) {
+    // No need to parse the request; answer once it arrives.
+    readOp = server->eventManager->when(
+        this->stream->readAsync(server->eventManager, buffer, sizeof(buffer)))(
+      [this](size_t) {
+        std::string body = this->server->render();
+        char header[128];
+        snprintf(header, sizeof(header),
+                 "HTTP/1.0 200 OK\r\n"
+                 "Content-Type: text/plain; version=0.0.4\r\n"
+                 "Content-Length: %zu\r\n\r\n", body.size());
+        std::string response = header + body;
+        try {
+          this->stream->writeAll(response.data(), response.size());
+        } catch (const std::exception& e) {
+          DEBUG_INFO << "Writing metrics failed: " << e.what();
+        }
+        close();
+      }, [this](MaybeException<size_t> error) {
+        close();
+      });
+  }
+  ~Connection() {}
+
+private:
+  MetricsServer* server;
+  OwnedPtr<ByteStream> stream;
+  char buffer[4096];
+  Promise<void> readOp;
+
+  void close() {
+    MetricsServer* server = this->server;
+    Connection* self = this;
+    closeOp = server->eventManager->when()(
+      [server, self]() {
+        server->connections.erase(self);
+      });
+  }
+  Promise<void> closeOp;
+};
+
+MetricsServer::Source::~Source() noexcept(false) {}
+
+MetricsServer::MetricsServer(EventManager* eventManager, const std::string& bindAddress,
+                             Source* source)
+    : eventManager(eventManager), source(source), socket(eventManager, bindAddress) {
+  acceptOp = doAccept();
+}
+
+MetricsServer::~MetricsServer() {}
+
+Promise<void> MetricsServer::doAccept() {
+  return eventManager->when(socket.accept())(
+    [this](OwnedPtr<ByteStream> stream) {
+      auto connection = newOwned<Connection>(this, stream.release());
+      auto key = connection.get();  // cannot inline due to undefined evaluation order
+      connections.add(key, connection.release());
+      return doAccept();
+    });
+}
+
+std::string MetricsServer::render() {
+  std::string result;
+  source->writeMetrics(&result);
+  writeGauge(&result, "process_resident_memory_bytes", "Resident memory size in bytes.",
+             residentSetBytes());
+  return result;
+}
+
+void MetricsServer::writeGauge(std::string* out, const char* name, const char* help,
+                               double value) {
+  writeMetric(out, name, "gauge", help, value);
+}
+
+void MetricsServer::writeHistogram(std::string* out, const char* name, const char* help,
+                                   const uint64_t* bounds, const uint64_t* counts,
+                                   int bucketCount, uint64_t total, double sum) {
+  char buffer[512];
+  snprintf(buffer, sizeof(buffer), "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+  out->append(buffer);
+  for (int i = 0; i < bucketCount; i++) {
+    snprintf(buffer, sizeof(buffer), "%s_bucket{le=\"%llu\"} %llu\n", name,
+             (unsigned long long)bounds[i], (unsigned long long)counts[i]);
+    out->append(buffer);
+  }
+  snprintf(buffer, sizeof(buffer), "%s_bucket{le=\"+Inf\"} %llu\n%s_sum %.17g\n%s_count %llu\n",
+           name, (unsigned long long)total, name, sum, name, (unsigned long long)total);
+  out->append(buffer);
+}
+
+void MetricsServer::writeCounter(std::string* out, const char* name, const char* help,
+                                 double value) {
+  writeMetric(out, name, "counter", help, value);
+}
+
+}  // namespace ekam
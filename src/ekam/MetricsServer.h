@@ -0,0 +1,67 @@
+// Ekam Build System
+// Author: Kenton Varda (kenton@sandstorm.io)
+// Copyright (c) 2010-2015 Kenton Varda, Google Inc., and contributors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef KENTONSCODE_EKAM_METRICSSERVER_H_
+#define KENTONSCODE_EKAM_METRICSSERVER_H_
+
+#include <string>
+
+#include "base/OwnedPtr.h"
+#include "os/EventManager.h"
+#include "os/Socket.h"
+
+namespace ekam {
+
+// Serves metrics over HTTP in Prometheus' text exposition format, for watching long-running
+// continuous builds.  Every request gets the current metrics, whatever its path.  Rates, such
+// as actions per second, are left to the scraper to compute from the counters.
+class MetricsServer {
+public:
+  class Source {
+  public:
+    virtual ~Source() noexcept(false);
+
+    // Append metrics to out, using writeGauge(), writeCounter() and writeHistogram().
+    virtual void writeMetrics(std::string* out) = 0;
+  };
+
+  MetricsServer(EventManager* eventManager, const std::string& bindAddress, Source* source);
+  ~MetricsServer();
+
+  static void writeGauge(std::string* out, const char* name, const char* help, double value);
+  static void writeCounter(std::string* out, const char* name, const char* help, double value);
+
+  // counts[i] is the number of observations no greater than bounds[i].
+  static void writeHistogram(std::string* out, const char* name, const char* help,
+                             const uint64_t* bounds, const uint64_t* counts, int bucketCount,
+                             uint64_t total, double sum);
+
+private:
+  class Connection;
+
+  EventManager* eventManager;
+  Source* source;
+  ServerSocket socket;
+  Promise<void> acceptOp;
+  OwnedPtrMap<Connection*, Connection> connections;
+
+  Promise<void> doAccept();
+  std::string render();
+};
+
+}  // namespace ekam
+
+#endif  // KENTONSCODE_EKAM_METRICSSERVER_H_
@@ -22,12 +22,25 @@
 
 namespace ekam {
 
+namespace {
+
+const int TASK_STATE_COUNT = Dashboard::BLOCKED + 1;
+
+bool hasPrefix(const std::string& text, const std::string& prefix) {
+  return text.size() >= prefix.size() && text.compare(0, prefix.size(), prefix) == 0;
+}
+
+}  // namespace
+
 class MuxDashboard::TaskImpl : public Dashboard::Task {
 public:
   TaskImpl(MuxDashboard* mux, const std::string& verb, const std::string& noun, Silence silence);
   ~TaskImpl();
 
-  void attach(Dashboard* dashboard);
+  TaskState getState() { return state; }
+  const std::string& getNoun() { return noun; }
+
+  void attach(Dashboard* dashboard, const Filter& filter);
   void detach(Dashboard* dashboard);
 
   // implements Task ---------------------------------------------------------------------
@@ -46,6 +59,9 @@ private:
   WrappedTasksMap wrappedTasks;
 
   static const size_t OUTPUT_BUFER_LIMIT = 4096 - sizeof("\n...(log truncated)...");
+
+  bool shows(const Filter& filter);
+  void announce(Dashboard* dashboard);
 };
 
 const size_t MuxDashboard::TaskImpl::OUTPUT_BUFER_LIMIT;
@@ -55,16 +71,22 @@ MuxDashboard::TaskImpl::TaskImpl(MuxDashboard* mux, const std::string& verb,
     : mux(mux), state(PENDING), silence(silence), verb(verb), noun(noun) {
   mux->tasks.insert(this);
 
-  for (std::unordered_set<Dashboard*>::iterator iter = mux->wrappedDashboards.begin();
+  for (std::unordered_map<Dashboard*, Filter>::iterator iter = mux->wrappedDashboards.begin();
        iter != mux->wrappedDashboards.end(); ++iter) {
-    wrappedTasks.add(*iter, (*iter)->beginTask(verb, noun, silence));
+    if (shows(iter->second)) {
+      wrappedTasks.add(iter->first, iter->first->beginTask(verb, noun, silence));
+    }
   }
 }
 MuxDashboard::TaskImpl::~TaskImpl() {
   mux->tasks.erase(this);
 }
 
-void MuxDashboard::TaskImpl::attach(Dashboard* dashboard) {
+bool MuxDashboard::TaskImpl::shows(const Filter& filter) {
+  return (!filter.onlyFailures || state == FAILED) && hasPrefix(noun, filter.nounPrefix);
+}
+
+void MuxDashboard::TaskImpl::announce(Dashboard* dashboard) {
   OwnedPtr<Task> wrappedTask = dashboard->beginTask(verb, noun, silence);
   if (!outputText.empty()) {
     wrappedTask->addOutput(outputText);
@@ -78,20 +100,35 @@ void MuxDashboard::TaskImpl::attach(Dashboard* dashboard) {
   }
 }
 
-void MuxDashboard::TaskImpl::detach(Dashboard* dashboard) {
-  if (wrappedTasks.erase(dashboard) == 0) {
-    DEBUG_ERROR << "Tried to detach task from dashboard to which it was not attached.";
+void MuxDashboard::TaskImpl::attach(Dashboard* dashboard, const Filter& filter) {
+  // Finished tasks with nothing to say are left out; see Connector.
+  if (shows(filter) && (state == RUNNING || state == FAILED || !outputText.empty())) {
+    announce(dashboard);
   }
 }
 
+void MuxDashboard::TaskImpl::detach(Dashboard* dashboard) {
+  wrappedTasks.erase(dashboard);
+}
+
 void MuxDashboard::TaskImpl::setState(TaskState state) {
   if (state == PENDING || state == RUNNING) {
     outputText.clear();
   }
 
   this->state = state;
-  for (WrappedTasksMap::Iterator iter(wrappedTasks); iter.next();) {
-    iter.value()->setState(state);
+  for (std::unordered_map<Dashboard*, Filter>::iterator iter = mux->wrappedDashboards.begin();
+       iter != mux->wrappedDashboards.end(); ++iter) {
+    Task* wrappedTask = wrappedTasks.get(iter->first);
+    if (!shows(iter->second)) {
+      if (wrappedTask != NULL) {
+        wrappedTasks.erase(iter->first);
+      }
+    } else if (wrappedTask == NULL) {
+      announce(iter->first);
+    } else {
+      wrappedTask->setState(state);
+    }
   }
 }
 
@@ -105,8 +142,14 @@ void MuxDashboard::TaskImpl::addOutput(const std::string& text) {
     }
   }
 
-  for (WrappedTasksMap::Iterator iter(wrappedTasks); iter.next();) {
-    iter.value()->addOutput(text);
+  for (std::unordered_map<Dashboard*, Filter>::iterator iter = mux->wrappedDashboards.begin();
+       iter != mux->wrappedDashboards.end(); ++iter) {
+    Task* wrappedTask = wrappedTasks.get(iter->first);
+    if (wrappedTask != NULL) {
+      wrappedTask->addOutput(text);
+    } else if (shows(iter->second)) {
+      announce(iter->first);
+    }
   }
 }
 
@@ -120,15 +163,26 @@ OwnedPtr<Dashboard::Task> MuxDashboard::beginTask(const std::string& verb, const
   return newOwned<TaskImpl>(this, verb, noun, silence);
 }
 
-MuxDashboard::Connector::Connector(MuxDashboard* mux, Dashboard* dashboard)
+std::vector<int> MuxDashboard::countTasks(const Filter& filter) {
+  std::vector<int> counts(TASK_STATE_COUNT);
+  for (std::unordered_set<TaskImpl*>::iterator iter = tasks.begin();
+       iter != tasks.end(); ++iter) {
+    if (hasPrefix((*iter)->getNoun(), filter.nounPrefix)) {
+      ++counts[(*iter)->getState()];
+    }
+  }
+  return counts;
+}
+
+MuxDashboard::Connector::Connector(MuxDashboard* mux, Dashboard* dashboard, const Filter& filter)
     : mux(mux), dashboard(dashboard) {
-  if (!mux->wrappedDashboards.insert(dashboard).second) {
+  if (!mux->wrappedDashboards.insert(std::make_pair(dashboard, filter)).second) {
     throw std::invalid_argument("Mux is already attached to this dashboard.");
   }
 
   for (std::unordered_set<TaskImpl*>::iterator iter = mux->tasks.begin();
        iter != mux->tasks.end(); ++iter) {
-    (*iter)->attach(dashboard);
+    (*iter)->attach(dashboard, filter);
   }
 }
 
@@ -17,7 +17,9 @@
 #ifndef KENTONSCODE_EKAM_MUXDASHBOARD_H_
 #define KENTONSCODE_EKAM_MUXDASHBOARD_H_
 
+#include <unordered_map>
 #include <unordered_set>
+#include <vector>
 
 #include "Dashboard.h"
 
@@ -28,9 +30,21 @@ public:
   MuxDashboard();
   ~MuxDashboard();
 
+  // Selects which tasks a connected dashboard sees.
+  struct Filter {
+    Filter() : onlyFailures(false) {}
+
+    // Only show tasks while they are failed.
+    bool onlyFailures;
+    // Only show tasks whose noun starts with this.
+    std::string nounPrefix;
+  };
+
+  // A dashboard that connects while tasks exist is told only about those that are running,
+  // failed, or have output.  It hears about the rest if and when they change.
   class Connector {
   public:
-    Connector(MuxDashboard* mux, Dashboard* dashboard);
+    Connector(MuxDashboard* mux, Dashboard* dashboard, const Filter& filter = Filter());
     ~Connector();
 
   private:
@@ -38,6 +52,9 @@ public:
     Dashboard* dashboard;
   };
 
+  // Number of tasks in each TaskState whose noun matches the filter's nounPrefix.
+  std::vector<int> countTasks(const Filter& filter);
+
   // implements Dashboard ----------------------------------------------------------------
   OwnedPtr<Task> beginTask(const std::string& verb, const std::string& noun, Silence silence);
 
@@ -45,7 +62,7 @@ private:
   class TaskImpl;
 
   std::unordered_set<TaskImpl*> tasks;
-  std::unordered_set<Dashboard*> wrappedDashboards;
+  std::unordered_map<Dashboard*, Filter> wrappedDashboards;
 };
 
 }  // namespace ekam
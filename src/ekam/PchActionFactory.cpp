@@ -0,0 +1,165 @@
+// Ekam Build System
+// Author: Kenton Varda (kenton@sandstorm.io)
+// Copyright (c) 2010-2015 Kenton Varda, Google Inc., and contributors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "PchActionFactory.h"
+
+#include <stdexcept>
+#include <stdlib.h>
+#include <string.h>
+
+#include "base/Debug.h"
+
+namespace ekam {
+
+namespace {
+
+class PchAction : public Action {
+public:
+  PchAction(const std::string& headerName) : headerName(headerName) {}
+  ~PchAction() {}
+
+  // implements Action -------------------------------------------------------------------
+  bool isSilent() { return true; }
+  std::string getVerb() { return "prefix"; }
+
+  Promise<void> start(EventManager* eventManager, BuildContext* context) {
+    // Headers Ekam doesn't provide, such as system headers, aren't worth the trouble.
+    File* header = context->findProvider(Tag::fromName("c++header:" + headerName));
+    if (header != NULL) {
+      OwnedPtr<File> request = context->newOutput(header->canonicalName() + ".ekam-pch");
+      request->writeAll("#include <" + headerName + ">\n");
+    }
+    return newFulfilledPromise();
+  }
+
+private:
+  std::string headerName;
+};
+
+bool isSpace(char c) {
+  return c == ' ' || c == '\t';
+}
+
+bool startsWith(const std::string& str, std::string::size_type pos, const char* prefix) {
+  return str.compare(pos, strlen(prefix), prefix) == 0;
+}
+
+}  // namespace
+
+const Tag PchActionFactory::SOURCE_TYPES[] = {
+  Tag::fromName("filetype:.cpp"),
+  Tag::fromName("filetype:.cc"),
+  Tag::fromName("filetype:.C"),
+  Tag::fromName("filetype:.cxx"),
+  Tag::fromName("filetype:.c++")
+};
+
+PchActionFactory::PchActionFactory() : minUsers(0) {
+  // Off by default:  force-including the header is very nearly, but not quite, harmless.
+  const char* setting = getenv("EKAM_PCH_MIN_USERS");
+  if (setting != NULL) {
+    minUsers = atoi(setting);
+  }
+}
+PchActionFactory::~PchActionFactory() {}
+
+std::string PchActionFactory::findPrefixHeader(const std::string& content) {
+  std::string::size_type pos = 0;
+  while (pos < content.size()) {
+    std::string::size_type eol = content.find_first_of('\n', pos);
+    if (eol == std::string::npos) eol = content.size();
+    std::string::size_type start = pos;
+    pos = eol + 1;
+
+    while (start < eol && isSpace(content[start])) ++start;
+    if (start == eol || content[start] != '#') {
+      // Code and comments don't matter.
+      continue;
+    }
+    ++start;
+    while (start < eol && isSpace(content[start])) ++start;
+
+    if (startsWith(content, start, "include")) {
+      start += strlen("include");
+      while (start < eol && isSpace(content[start])) ++start;
+      if (start < eol && content[start] == '<') {
+        std::string::size_type end = content.find_first_of('>', start);
+        if (end == std::string::npos || end > eol) return std::string();
+        return content.substr(start + 1, end - start - 1);
+      }
+    } else if (!startsWith(content, start, "pragma")) {
+      // Forcing the header to the front could change what this does to it.
+      return std::string();
+    }
+  }
+  return std::string();
+}
+
+void PchActionFactory::enumerateTriggerTags(
+    std::back_insert_iterator<std::vector<Tag> > iter) {
+  if (minUsers <= 0) return;
+  for (unsigned int i = 0; i < (sizeof(SOURCE_TYPES) / sizeof(SOURCE_TYPES[0])); i++) {
+    *iter++ = SOURCE_TYPES[i];
+  }
+}
+
+OwnedPtr<Action> PchActionFactory::tryMakeAction(const Tag& id, File* file) {
+  std::string prefix;
+  try {
+    prefix = findPrefixHeader(file->readAll());
+  } catch (const std::exception& e) {
+    DEBUG_INFO << "Couldn't read " << file->canonicalName() << ": " << e.what();
+  }
+
+  std::string name = file->canonicalName();
+  std::string& previous = prefixes[name];
+  if (previous != prefix) {
+    if (!previous.empty()) {
+      --userCounts[previous];
+      // If this file was the one requesting the precompiled header, its request went away
+      // with its old version, so let the next user make a new one.
+      std::unordered_map<std::string, std::string>::iterator iter = requesters.find(previous);
+      if (iter != requesters.end() && iter->second == name) {
+        requesters.erase(iter);
+      }
+    }
+    previous = prefix;
+    if (!prefix.empty()) {
+      ++userCounts[prefix];
+    }
+  }
+
+  if (prefix.empty()) {
+    return nullptr;
+  }
+
+  std::unordered_map<std::string, std::string>::iterator iter = requesters.find(prefix);
+  if (iter != requesters.end()) {
+    if (iter->second != name) {
+      return nullptr;
+    }
+    // Retriggered by a new version of the requester; replace its action.
+  } else if (userCounts[prefix] >= minUsers) {
+    requesters[prefix] = name;
+  } else {
+    return nullptr;
+  }
+
+  return newOwned<PchAction>(prefix);
+}
+
+}  // namespace ekam
@@ -0,0 +1,62 @@
+// Ekam Build System
+// Author: Kenton Varda (kenton@sandstorm.io)
+// Copyright (c) 2010-2015 Kenton Varda, Google Inc., and contributors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef KENTONSCODE_EKAM_PCHACTIONFACTORY_H_
+#define KENTONSCODE_EKAM_PCHACTIONFACTORY_H_
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <iterator>
+#include "Action.h"
+
+namespace ekam {
+
+// Notices headers which many C++ source files include first -- their "prefix header" -- and,
+// once at least $EKAM_PCH_MIN_USERS files share one, asks for it to be precompiled by writing a
+// "<header>.ekam-pch" file next to it.  pch.ekam-rule builds the precompiled header from that,
+// and compile.ekam-rule force-includes the header into files whose prefix it is.
+class PchActionFactory: public ActionFactory {
+public:
+  PchActionFactory();
+  ~PchActionFactory();
+
+  // Returns the header named by the first "#include <...>" in the given source, or an empty
+  // string if there is none or a macro definition or conditional comes before it.  Must agree
+  // with compile.ekam-rule.
+  static std::string findPrefixHeader(const std::string& content);
+
+  // implements ActionFactory ------------------------------------------------------------
+  void enumerateTriggerTags(std::back_insert_iterator<std::vector<Tag> > iter);
+  OwnedPtr<Action> tryMakeAction(const Tag& id, File* file);
+
+private:
+  int minUsers;
+
+  // Source file canonical name -> its prefix header.
+  std::unordered_map<std::string, std::string> prefixes;
+  // Prefix header -> number of source files in prefixes using it.
+  std::unordered_map<std::string, int> userCounts;
+  // Prefix header -> the source file whose action requests its precompilation.
+  std::unordered_map<std::string, std::string> requesters;
+
+  static const Tag SOURCE_TYPES[];
+};
+
+}  // namespace ekam
+
+#endif  // KENTONSCODE_EKAM_PCHACTIONFACTORY_H_
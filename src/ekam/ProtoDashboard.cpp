@@ -16,18 +16,47 @@
 
 #include "ProtoDashboard.h"
 
+#include <algorithm>
 #include <errno.h>
+#include <fcntl.h>
+#include <string.h>
 #include <unistd.h>
+#include <sys/uio.h>
 #include <capnp/message.h>
 #include <capnp/serialize.h>
 #include <stdlib.h>
 
 #include "dashboard.capnp.h"
+#include "base/Debug.h"
 #include "os/Socket.h"
 #include "MuxDashboard.h"
 
 namespace ekam {
 
+namespace {
+
+const proto::TaskUpdate::State STATE_CODES[] = {
+  proto::TaskUpdate::State::PENDING,
+  proto::TaskUpdate::State::RUNNING,
+  proto::TaskUpdate::State::DONE   ,
+  proto::TaskUpdate::State::PASSED ,
+  proto::TaskUpdate::State::FAILED ,
+  proto::TaskUpdate::State::BLOCKED
+};
+
+// Pending log kept per task while the client isn't keeping up.
+const std::string::size_type MAX_PENDING_LOG = 65536;
+
+// Messages passed to a single writev().
+const int MAX_IOVECS = 64;
+
+uint32_t readLittleEndian32(const unsigned char* bytes) {
+  return uint32_t(bytes[0]) | (uint32_t(bytes[1]) << 8) |
+         (uint32_t(bytes[2]) << 16) | (uint32_t(bytes[3]) << 24);
+}
+
+}  // namespace
+
 class ProtoDashboard::TaskImpl : public Dashboard::Task {
 public:
   TaskImpl(int id, const std::string& verb, const std::string& noun,
@@ -41,70 +70,129 @@ public:
 private:
   int id;
   WriteBuffer* output;
-
-  static const proto::TaskUpdate::State STATE_CODES[];
-};
-
-const proto::TaskUpdate::State ProtoDashboard::TaskImpl::STATE_CODES[] = {
-  proto::TaskUpdate::State::PENDING,
-  proto::TaskUpdate::State::RUNNING,
-  proto::TaskUpdate::State::DONE   ,
-  proto::TaskUpdate::State::PASSED ,
-  proto::TaskUpdate::State::FAILED ,
-  proto::TaskUpdate::State::BLOCKED
 };
 
 ProtoDashboard::TaskImpl::TaskImpl(int id, const std::string& verb, const std::string& noun,
                                    Silence silence, WriteBuffer* output)
     : id(id), output(output) {
-  capnp::MallocMessageBuilder message;
-  proto::TaskUpdate::Builder update = message.getRoot<proto::TaskUpdate>();
-  update.setId(id);
-  update.setState(proto::TaskUpdate::State::PENDING);
-  update.setVerb(verb);
-  update.setNoun(noun);
-  update.setSilent(silence == SILENT);
-  output->write(message.getSegmentsForOutput());
+  output->beginTask(id, verb, noun, silence);
 }
 
 ProtoDashboard::TaskImpl::~TaskImpl() {
-  capnp::MallocMessageBuilder message;
-  proto::TaskUpdate::Builder update = message.getRoot<proto::TaskUpdate>();
-  update.setId(id);
-  update.setState(proto::TaskUpdate::State::DELETED);
-  output->write(message.getSegmentsForOutput());
+  output->endTask(id);
 }
 
 void ProtoDashboard::TaskImpl::setState(TaskState state) {
-  capnp::MallocMessageBuilder message;
-  proto::TaskUpdate::Builder update = message.getRoot<proto::TaskUpdate>();
-  update.setId(id);
-  update.setState(STATE_CODES[state]);
-  output->write(message.getSegmentsForOutput());
+  output->setState(id, state);
 }
 
 void ProtoDashboard::TaskImpl::addOutput(const std::string& text) {
-  capnp::MallocMessageBuilder message;
-  proto::TaskUpdate::Builder update = message.getRoot<proto::TaskUpdate>();
-  update.setId(id);
-  update.setLog(text);
-  output->write(message.getSegmentsForOutput());
+  output->addOutput(id, text);
 }
 
 // =======================================================================================
 
 ProtoDashboard::ProtoDashboard(EventManager* eventManager, OwnedPtr<ByteStream> stream)
-    : idCounter(0),
-      writeBuffer(eventManager, stream.release()) {
+    : eventManager(eventManager), idCounter(0),
+      writeBuffer(eventManager, stream.release()), subscriptionObserver(NULL) {
   capnp::MallocMessageBuilder message;
   proto::Header::Builder header = message.getRoot<proto::Header>();
   char* cwd = get_current_dir_name();
   header.setProjectRoot(cwd);
   free(cwd);
   writeBuffer.write(message.getSegmentsForOutput());
+
+  readSubscriptions();
 }
 ProtoDashboard::~ProtoDashboard() {}
 
+void ProtoDashboard::setSubscriptionObserver(SubscriptionObserver* observer) {
+  subscriptionObserver = observer;
+}
+
+void ProtoDashboard::sendSnapshot(const std::vector<int>& counts) {
+  capnp::MallocMessageBuilder message;
+  proto::TaskUpdate::Builder update = message.getRoot<proto::TaskUpdate>();
+  update.setId(0);
+  proto::Snapshot::Builder snapshot = update.initSnapshot();
+  snapshot.setPending(counts[PENDING]);
+  snapshot.setRunning(counts[RUNNING]);
+  snapshot.setDone(counts[DONE]);
+  snapshot.setPassed(counts[PASSED]);
+  snapshot.setFailed(counts[FAILED]);
+  snapshot.setBlocked(counts[BLOCKED]);
+  writeBuffer.write(message.getSegmentsForOutput());
+}
+
+void ProtoDashboard::readSubscriptions() {
+  readOp = eventManager->when(writeBuffer.onReadable())(
+    [this](Void) {
+      char buffer[4096];
+      size_t size;
+      try {
+        size = writeBuffer.read(buffer, sizeof(buffer));
+      } catch (const OsError& error) {
+        if (error.getErrorNumber() == EAGAIN) {
+          readSubscriptions();
+        }
+        // Otherwise, the write side will notice the disconnect.
+        return;
+      }
+
+      if (size > 0) {
+        input.append(buffer, size);
+        parseSubscriptions();
+        readSubscriptions();
+      }
+    });
+}
+
+void ProtoDashboard::parseSubscriptions() {
+  // Each message is a standard capnp segment table followed by its segments.
+  while (input.size() >= 4) {
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(input.data());
+    std::string::size_type segmentCount = readLittleEndian32(bytes) + 1u;
+    if (segmentCount > 512) {
+      DEBUG_ERROR << "Dashboard client sent garbage; ignoring it from now on.";
+      input.clear();
+      subscriptionObserver = NULL;
+      return;
+    }
+
+    std::string::size_type size = (4 * (segmentCount + 1) + 7) & ~7;
+    if (input.size() < size) return;
+    for (std::string::size_type i = 0; i < segmentCount; i++) {
+      size += sizeof(capnp::word) * readLittleEndian32(bytes + 4 * (i + 1));
+    }
+    if (input.size() < size) return;
+
+    kj::Array<capnp::word> words = kj::heapArray<capnp::word>(size / sizeof(capnp::word));
+    memcpy(words.begin(), input.data(), size);
+    input.erase(0, size);
+
+    try {
+      capnp::FlatArrayMessageReader reader(words);
+      proto::Subscription::Reader subscription = reader.getRoot<proto::Subscription>();
+      std::vector<std::string> focus;
+      for (capnp::Text::Reader name : subscription.getFocus()) {
+        focus.push_back(name);
+      }
+      if (subscriptionObserver != NULL && !subscription.getFocusOnly()) {
+        MuxDashboard::Filter filter;
+        filter.onlyFailures = subscription.getOnlyFailures();
+        filter.nounPrefix = subscription.getNounPrefix();
+        subscriptionObserver->subscribed(filter);
+      }
+      // subscribed() may have replaced the observer.
+      if (subscriptionObserver != NULL) {
+        subscriptionObserver->focused(std::move(focus));
+      }
+    } catch (const std::exception& e) {
+      DEBUG_ERROR << "Bad subscription from dashboard client: " << e.what();
+    }
+  }
+}
+
 OwnedPtr<Dashboard::Task> ProtoDashboard::beginTask(
     const std::string& verb, const std::string& noun, Silence silence) {
   return newOwned<TaskImpl>(++idCounter, verb, noun, silence, &writeBuffer);
@@ -116,7 +204,10 @@ ProtoDashboard::WriteBuffer::WriteBuffer(EventManager* eventManager,
                                          OwnedPtr<ByteStream> stream)
     : eventManager(eventManager), stream(stream.release()),
       ioWatcher(eventManager->watchFd(this->stream->getHandle()->get())),
-      offset(0), disconnectFulfiller(NULL) {}
+      offset(0), waitingForWritable(false), disconnectFulfiller(NULL) {
+  // So that a slow client makes us wait rather than blocking the event loop.
+  WRAP_SYSCALL(fcntl, *this->stream->getHandle(), F_SETFL, O_NONBLOCK);
+}
 ProtoDashboard::WriteBuffer::~WriteBuffer() {}
 
 void ProtoDashboard::WriteBuffer::write(kj::ArrayPtr<const kj::ArrayPtr<const capnp::word>> message) {
@@ -125,31 +216,208 @@ void ProtoDashboard::WriteBuffer::write(kj::ArrayPtr<const kj::ArrayPtr<const ca
     return;
   }
 
-  messages.push(capnp::messageToFlatArray(message));
+  encodePending();
+  messages.push_back(capnp::messageToFlatArray(message));
+
+  if (!waitingForWritable) {
+    ready();
+  }
+}
 
-  ready();
+void ProtoDashboard::WriteBuffer::beginTask(int id, const std::string& verb,
+                                            const std::string& noun, Silence silence) {
+  if (stream == NULL) return;
+
+  PendingUpdate* update = addPending(id);
+  update->isNew = true;
+  update->verb = verb;
+  update->noun = noun;
+  update->silent = silence == SILENT;
+  update->hasState = true;
+  update->state = PENDING;
+}
+
+void ProtoDashboard::WriteBuffer::setState(int id, TaskState state) {
+  if (stream == NULL) return;
+
+  // Only the last state matters to clients.
+  PendingUpdate* update = pendingState(id);
+  update->hasState = true;
+  update->state = state;
+}
+
+void ProtoDashboard::WriteBuffer::addOutput(int id, const std::string& text) {
+  if (stream == NULL) return;
+
+  std::unordered_map<int, PendingUpdate*>::iterator iter = latestPending.find(id);
+  PendingUpdate* update;
+  if (iter == latestPending.end() || iter->second->hasState) {
+    update = addPending(id);
+  } else {
+    update = iter->second;
+  }
+
+  update->log.append(text);
+  if (update->log.size() > MAX_PENDING_LOG) {
+    // The client isn't keeping up.  Drop the oldest lines.
+    std::string::size_type cut = update->log.size() - MAX_PENDING_LOG;
+    std::string::size_type eol = update->log.find_first_of('\n', cut);
+    if (eol != std::string::npos) {
+      cut = eol + 1;
+    }
+    update->log.replace(0, cut, "...(log truncated)...\n");
+  }
+}
+
+void ProtoDashboard::WriteBuffer::endTask(int id) {
+  if (stream == NULL) return;
+
+  // Nothing pending for the task is of interest anymore.  If the client hasn't even heard of
+  // it yet, it needn't hear of it at all.
+  bool announced = true;
+  for (int i = 0; i < pending.size(); i++) {
+    PendingUpdate* update = pending.get(i);
+    if (update->id == id) {
+      update->dropped = true;
+      if (update->isNew) {
+        announced = false;
+      }
+    }
+  }
+  latestPending.erase(id);
+
+  if (announced) {
+    PendingUpdate* update = addPending(id);
+    update->hasState = true;
+    update->deleted = true;
+  }
+}
+
+Promise<void> ProtoDashboard::WriteBuffer::onReadable() {
+  if (stream == NULL) {
+    return newFulfilledPromise();
+  }
+  return ioWatcher->onReadable();
+}
+
+size_t ProtoDashboard::WriteBuffer::read(void* buffer, size_t size) {
+  if (stream == NULL) {
+    return 0;
+  }
+  return stream->read(buffer, size);
+}
+
+ProtoDashboard::WriteBuffer::PendingUpdate* ProtoDashboard::WriteBuffer::addPending(int id) {
+  OwnedPtr<PendingUpdate> update = newOwned<PendingUpdate>();
+  update->id = id;
+  update->isNew = false;
+  update->dropped = false;
+  update->silent = false;
+  update->hasState = false;
+  update->deleted = false;
+  update->state = PENDING;
+
+  PendingUpdate* result = update.get();
+  pending.add(update.release());
+  latestPending[id] = result;
+  scheduleFlush();
+  return result;
+}
+
+ProtoDashboard::WriteBuffer::PendingUpdate* ProtoDashboard::WriteBuffer::pendingState(int id) {
+  std::unordered_map<int, PendingUpdate*>::iterator iter = latestPending.find(id);
+  if (iter == latestPending.end() || !iter->second->log.empty()) {
+    return addPending(id);
+  } else {
+    return iter->second;
+  }
+}
+
+void ProtoDashboard::WriteBuffer::scheduleFlush() {
+  // While waiting for the stream, ready() will pick up pending updates once it drains.
+  if (flushOp == nullptr && !waitingForWritable) {
+    flushOp = eventManager->when()(
+      [this]() {
+        flushOp.release();
+        if (!waitingForWritable) {
+          ready();
+        }
+      });
+  }
+}
+
+void ProtoDashboard::WriteBuffer::encodePending() {
+  for (int i = 0; i < pending.size(); i++) {
+    PendingUpdate* pendingUpdate = pending.get(i);
+    if (pendingUpdate->dropped) continue;
+
+    capnp::MallocMessageBuilder message;
+    proto::TaskUpdate::Builder update = message.getRoot<proto::TaskUpdate>();
+    update.setId(pendingUpdate->id);
+    if (pendingUpdate->deleted) {
+      update.setState(proto::TaskUpdate::State::DELETED);
+    } else if (pendingUpdate->hasState) {
+      update.setState(STATE_CODES[pendingUpdate->state]);
+    }
+    if (pendingUpdate->isNew) {
+      update.setVerb(pendingUpdate->verb);
+      update.setNoun(pendingUpdate->noun);
+      update.setSilent(pendingUpdate->silent);
+    }
+    if (!pendingUpdate->log.empty()) {
+      update.setLog(pendingUpdate->log);
+    }
+    messages.push_back(capnp::messageToFlatArray(message.getSegmentsForOutput()));
+  }
+
+  pending.clear();
+  latestPending.clear();
 }
 
 void ProtoDashboard::WriteBuffer::ready() {
   try {
-    while (!messages.empty()) {
-      const kj::Array<capnp::word>& message = messages.front();
-      while (offset < message.size()) {
-        offset += stream->write(message.asBytes().begin() + offset,
-                                message.asBytes().size() - offset);
+    while (stream != NULL) {
+      if (messages.empty()) {
+        if (pending.empty()) {
+          break;
+        }
+        encodePending();
+        continue;
+      }
+
+      struct iovec iovecs[MAX_IOVECS];
+      int count = 0;
+      std::string::size_type skip = offset;
+      for (std::deque<kj::Array<capnp::word>>::iterator iter = messages.begin();
+           iter != messages.end() && count < MAX_IOVECS; ++iter) {
+        kj::ArrayPtr<kj::byte> bytes = iter->asBytes();
+        iovecs[count].iov_base = bytes.begin() + skip;
+        iovecs[count].iov_len = bytes.size() - skip;
+        skip = 0;
+        ++count;
+      }
+
+      size_t n = offset + stream->writev(iovecs, count);
+      while (!messages.empty() && n >= messages.front().asBytes().size()) {
+        n -= messages.front().asBytes().size();
+        messages.pop_front();
       }
-      offset = 0;
-      messages.pop();
+      offset = n;
     }
   } catch (const OsError& error) {
     if (error.getErrorNumber() == EAGAIN) {
       // Ran out of kernel buffer space.  Wait until writable again.
+      waitingForWritable = true;
       waitWritablePromise = eventManager->when(ioWatcher->onWritable())(
         [this](Void) {
+          waitingForWritable = false;
           ready();
         });
     } else {
       stream.clear();
+      messages.clear();
+      pending.clear();
+      latestPending.clear();
 
       if (disconnectFulfiller != NULL) {
         disconnectFulfiller->disconnected();
@@ -209,6 +477,9 @@ public:
   OwnedPtr<Task> beginTask(const std::string& verb, const std::string& noun, Silence silence) {
     return mux.beginTask(verb, noun, silence);
   }
+  void setFocusListener(FocusListener* listener) {
+    focusListener = listener;
+  }
 
 private:
   EventManager* eventManager;
@@ -217,29 +488,66 @@ private:
   OwnedPtr<MuxDashboard::Connector> baseConnector;
   OwnedPtr<ServerSocket> socket;
   Promise<void> acceptOp;
+  FocusListener* focusListener = nullptr;
 
-  class ConnectedProtoDashboard {
+  class ConnectedProtoDashboard : public ProtoDashboard::SubscriptionObserver {
   public:
     ConnectedProtoDashboard(NetworkAcceptingDashboard* owner, EventManager* eventManager,
                             OwnedPtr<ByteStream> stream)
-        : protoDashboard(eventManager, stream.release()),
+        : owner(owner), protoDashboard(eventManager, stream.release()),
           connector(newOwned<MuxDashboard::Connector>(&owner->mux, &protoDashboard)) {
+      protoDashboard.setSubscriptionObserver(this);
       disconnectPromise = eventManager->when(protoDashboard.onDisconnect())(
         [this, owner](Void) {
           connector.clear();
-          owner->connectedDashboards.erase(this);
+          bool hadFocus = !focus.empty();
+          NetworkAcceptingDashboard* self = owner;  // the lambda is destroyed along with this
+          self->connectedDashboards.erase(this);
+          if (hadFocus) self->updateFocus();
         });
     }
     ~ConnectedProtoDashboard() {}
 
+    // implements SubscriptionObserver -------------------------------------------------
+    void subscribed(const MuxDashboard::Filter& filter) {
+      // Dropping the connector tells the client that all of its tasks are gone.
+      connector.clear();
+      protoDashboard.sendSnapshot(owner->mux.countTasks(filter));
+      connector = newOwned<MuxDashboard::Connector>(&owner->mux, &protoDashboard, filter);
+    }
+    void focused(std::vector<std::string>&& canonicalNames) {
+      if (canonicalNames != focus) {
+        focus = std::move(canonicalNames);
+        owner->updateFocus();
+      }
+    }
+
+    std::vector<std::string> focus;
+
   private:
+    NetworkAcceptingDashboard* owner;
     ProtoDashboard protoDashboard;
     OwnedPtr<MuxDashboard::Connector> connector;
     Promise<void> disconnectPromise;
   };
   OwnedPtrMap<ConnectedProtoDashboard*, ConnectedProtoDashboard> connectedDashboards;
+
+  void updateFocus();
 };
 
+void NetworkAcceptingDashboard::updateFocus() {
+  if (focusListener == nullptr) return;
+
+  std::vector<std::string> focus;
+  for (OwnedPtrMap<ConnectedProtoDashboard*, ConnectedProtoDashboard>::Iterator
+       iter(connectedDashboards); iter.next();) {
+    focus.insert(focus.end(), iter.key()->focus.begin(), iter.key()->focus.end());
+  }
+  std::sort(focus.begin(), focus.end());
+  focus.erase(std::unique(focus.begin(), focus.end()), focus.end());
+  focusListener->setFocus(focus);
+}
+
 void NetworkAcceptingDashboard::accepted(OwnedPtr<ByteStream> stream) {
   auto connectedDashboard = newOwned<ConnectedProtoDashboard>(this, eventManager, stream.release());
   auto key = connectedDashboard.get();  // cannot inline due to undefined evaluation order
@@ -17,11 +17,14 @@
 #ifndef KENTONSCODE_EKAM_PROTODASHBOARD_H_
 #define KENTONSCODE_EKAM_PROTODASHBOARD_H_
 
-#include <queue>
+#include <deque>
 #include <string>
+#include <unordered_map>
+#include <vector>
 #include <capnp/common.h>
 
 #include "Dashboard.h"
+#include "MuxDashboard.h"
 #include "os/ByteStream.h"
 #include "os/EventManager.h"
 
@@ -34,28 +37,74 @@ public:
 
   Promise<void> onDisconnect();
 
+  // Told when the client sends a Subscription.
+  class SubscriptionObserver {
+  public:
+    virtual ~SubscriptionObserver() {}
+    virtual void subscribed(const MuxDashboard::Filter& filter) = 0;
+    // Called after subscribed(), or alone for a focusOnly Subscription.
+    virtual void focused(std::vector<std::string>&& canonicalNames) = 0;
+  };
+  void setSubscriptionObserver(SubscriptionObserver* observer);
+
+  // Sends a snapshot with the given number of tasks in each TaskState.
+  void sendSnapshot(const std::vector<int>& counts);
+
   // implements Dashboard ----------------------------------------------------------------
   OwnedPtr<Task> beginTask(const std::string& verb, const std::string& noun, Silence silence);
 
 private:
   class TaskImpl;
 
+  // Queues task updates and writes them to the stream.  Updates made during one turn of the
+  // event loop are merged per task and sent together.  While the client isn't keeping up,
+  // updates keep merging rather than piling up, and the oldest pending log is dropped.
   class WriteBuffer {
   public:
     WriteBuffer(EventManager* eventManager, OwnedPtr<ByteStream> stream);
     ~WriteBuffer();
 
+    // Writes a message after all pending updates.
     void write(kj::ArrayPtr<const kj::ArrayPtr<const capnp::word>> data);
     Promise<void> onDisconnect();
 
+    // For reading from the client.  read() returns zero once disconnected.
+    Promise<void> onReadable();
+    size_t read(void* buffer, size_t size);
+
+    void beginTask(int id, const std::string& verb, const std::string& noun, Silence silence);
+    void setState(int id, TaskState state);
+    void addOutput(int id, const std::string& text);
+    void endTask(int id);
+
   private:
+    // One TaskUpdate not yet encoded.  Clients don't agree on whether a message's state
+    // applies before or after its log, so an update carries one or the other, never both.
+    struct PendingUpdate {
+      int id;
+      bool isNew;    // Announces the task; verb, noun, and silent are valid.
+      bool dropped;  // Task was deleted before this was sent.
+      std::string verb;
+      std::string noun;
+      bool silent;
+      bool hasState;
+      bool deleted;
+      TaskState state;
+      std::string log;
+    };
+
     EventManager* eventManager;
     OwnedPtr<ByteStream> stream;
     OwnedPtr<EventManager::IoWatcher> ioWatcher;
-    std::queue<kj::Array<capnp::word>> messages;
+    std::deque<kj::Array<capnp::word>> messages;
     std::string::size_type offset;
+    bool waitingForWritable;
     Promise<void> waitWritablePromise;
 
+    OwnedPtrVector<PendingUpdate> pending;
+    std::unordered_map<int, PendingUpdate*> latestPending;
+    Promise<void> flushOp;
+
     class DisconnectFulfiller : public PromiseFulfiller<void> {
     public:
       DisconnectFulfiller(Callback* callback, WriteBuffer* writeBuffer);
@@ -69,11 +118,23 @@ private:
     };
     DisconnectFulfiller* disconnectFulfiller;
 
+    PendingUpdate* addPending(int id);
+    PendingUpdate* pendingState(int id);
+    void scheduleFlush();
+    void encodePending();
     void ready();
   };
 
+  EventManager* eventManager;
   int idCounter;
   WriteBuffer writeBuffer;
+
+  SubscriptionObserver* subscriptionObserver;
+  std::string input;  // Received but not yet parsed.
+  Promise<void> readOp;
+
+  void readSubscriptions();
+  void parseSubscriptions();
 };
 
 }  // namespace ekam
@@ -0,0 +1,140 @@
+// Ekam Build System
+// Author: Kenton Varda (kenton@sandstorm.io)
+// Copyright (c) 2010-2015 Kenton Varda, Google Inc., and contributors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "ResetExplainer.h"
+
+#include <fcntl.h>
+#include <algorithm>
+#include <stdio.h>
+
+#include "base/Debug.h"
+#include "os/ByteStream.h"
+
+namespace ekam {
+
+namespace {
+
+// Only the most expensive files are listed.
+const size_t MAX_COSTS = 50;
+
+}  // namespace
+
+ResetExplainer::ResetExplainer(const std::string& path) : path(path) {}
+ResetExplainer::~ResetExplainer() {}
+
+void ResetExplainer::recordReset(const std::string& root, const std::string& parent,
+                                 const std::string& action, const std::string& cause,
+                                 double seconds) {
+  std::unordered_map<std::string, Cascade>::iterator iter = cascades.find(root);
+  if (iter == cascades.end()) {
+    iter = cascades.insert(std::make_pair(root, Cascade())).first;
+    iter->second.resetCount = 0;
+    iter->second.seconds = 0;
+    Node& rootNode = iter->second.nodes[root];
+    rootNode.seconds = -1;
+    cascadeOrder.push_back(root);
+  }
+  Cascade& cascade = iter->second;
+
+  // An action reset more than once in the same cascade is shown under its first cause, which
+  // also keeps the report a tree.
+  if (action == parent || cascade.nodes.count(action) > 0) {
+    return;
+  }
+
+  Node& parentNode = cascade.nodes[parent];
+  if (parentNode.cause.empty() && parent != root) {
+    // The parent itself wasn't reset, e.g. it is a new action.  Show it under the root.
+    parentNode.cause = "not reset";
+    parentNode.seconds = -1;
+    cascade.nodes[root].children.push_back(parent);
+  }
+  parentNode.children.push_back(action);
+
+  Node& node = cascade.nodes[action];
+  node.cause = cause;
+  node.seconds = seconds;
+
+  ++cascade.resetCount;
+  cascade.seconds += std::max(0.0, seconds);
+}
+
+void ResetExplainer::addCost(const std::string& sourceFile, double seconds, int actions) {
+  Cost cost = { seconds, actions, sourceFile };
+  costs.push_back(cost);
+}
+
+void ResetExplainer::write() {
+  std::string out;
+  char buffer[128];
+
+  std::sort(costs.begin(), costs.end(), [](const Cost& a, const Cost& b) {
+    return a.seconds > b.seconds || (a.seconds == b.seconds && a.actions > b.actions);
+  });
+  out.append("Most expensive files to touch (historical run time of everything that would "
+             "rebuild):\n");
+  for (size_t i = 0; i < costs.size() && i < MAX_COSTS; i++) {
+    snprintf(buffer, sizeof(buffer), "  %10.3fs %7d actions  ", costs[i].seconds,
+             costs[i].actions);
+    out.append(buffer);
+    out.append(costs[i].sourceFile);
+    out.push_back('\n');
+  }
+
+  for (size_t i = 0; i < cascadeOrder.size(); i++) {
+    const Cascade& cascade = cascades[cascadeOrder[i]];
+    snprintf(buffer, sizeof(buffer), ": %d actions reset, %.3fs historical run time\n",
+             cascade.resetCount, cascade.seconds);
+    out.push_back('\n');
+    out.append(cascadeOrder[i]);
+    out.append(buffer);
+    const Node& root = cascade.nodes.find(cascadeOrder[i])->second;
+    for (size_t j = 0; j < root.children.size(); j++) {
+      writeNode(&out, cascade, root.children[j], 1);
+    }
+  }
+
+  try {
+    ByteStream file(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    file.writeAll(out.data(), out.size());
+  } catch (const std::exception& e) {
+    DEBUG_ERROR << "Writing reset explanation failed: " << e.what();
+  }
+
+  cascadeOrder.clear();
+  cascades.clear();
+  costs.clear();
+}
+
+void ResetExplainer::writeNode(std::string* out, const Cascade& cascade,
+                               const std::string& name, int depth) {
+  const Node& node = cascade.nodes.find(name)->second;
+  out->append(depth * 2, ' ');
+  out->append(name);
+  out->append("  (");
+  out->append(node.cause);
+  if (node.seconds >= 0) {
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), ", %.3fs", node.seconds);
+    out->append(buffer);
+  }
+  out->append(")\n");
+  for (size_t i = 0; i < node.children.size(); i++) {
+    writeNode(out, cascade, node.children[i], depth + 1);
+  }
+}
+
+}  // namespace ekam
@@ -0,0 +1,79 @@
+// Ekam Build System
+// Author: Kenton Varda (kenton@sandstorm.io)
+// Copyright (c) 2010-2015 Kenton Varda, Google Inc., and contributors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef KENTONSCODE_EKAM_RESETEXPLAINER_H_
+#define KENTONSCODE_EKAM_RESETEXPLAINER_H_
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace ekam {
+
+// Explains why actions were reset.  The Driver reports every reset along with the action or
+// source file whose output caused it, and the explainer writes out, for each source change, the
+// tree of resets that followed.  It also ranks source files by how much work touching them
+// would redo, to guide cleanup of widely-included headers.
+//
+// The report is rewritten by write(), which the Driver calls whenever the build goes idle.  It
+// covers the resets since the previous write().
+class ResetExplainer {
+public:
+  ResetExplainer(const std::string& path);
+  ~ResetExplainer();
+
+  // An action was reset.  parent is the action (or, for the start of a cascade, the source
+  // file) whose output changed, and root is the source change the cascade started from.  cause
+  // describes how the parent's output affected the action.  seconds is how long the action
+  // last took to run, or negative if unknown.
+  void recordReset(const std::string& root, const std::string& parent, const std::string& action,
+                   const std::string& cause, double seconds);
+
+  // The total run time and count of the actions which would rebuild if the source file changed.
+  // Replaces the costs given before the previous write().
+  void addCost(const std::string& sourceFile, double seconds, int actions);
+
+  void write();
+
+private:
+  std::string path;
+
+  struct Node {
+    std::string cause;
+    double seconds;
+    std::vector<std::string> children;
+  };
+  struct Cascade {
+    std::unordered_map<std::string, Node> nodes;  // by action, or the root source file
+    int resetCount;
+    double seconds;
+  };
+  std::vector<std::string> cascadeOrder;
+  std::unordered_map<std::string, Cascade> cascades;  // by root
+
+  struct Cost {
+    double seconds;
+    int actions;
+    std::string sourceFile;
+  };
+  std::vector<Cost> costs;
+
+  void writeNode(std::string* out, const Cascade& cascade, const std::string& name, int depth);
+};
+
+}  // namespace ekam
+
+#endif  // KENTONSCODE_EKAM_RESETEXPLAINER_H_
@@ -0,0 +1,207 @@
+// Ekam Build System
+// Author: Kenton Varda (kenton@sandstorm.io)
+// Copyright (c) 2010-2015 Kenton Varda, Google Inc., and contributors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "SourceScanner.h"
+
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "base/Debug.h"
+
+namespace ekam {
+
+SourceScanner::SourceScanner(EventManager* eventManager, Driver* driver, int threadCount)
+    : eventManager(eventManager), driver(driver), threadCount(threadCount < 1 ? 1 : threadCount),
+      listener(nullptr), busyThreads(0), finished(false) {}
+
+SourceScanner::~SourceScanner() {
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    queue.clear();
+    workAvailable.notify_all();
+  }
+  for (size_t i = 0; i < threads.size(); i++) {
+    threads[i].join();
+  }
+}
+
+SourceScanner::Listener::~Listener() noexcept(false) {}
+
+void SourceScanner::setListener(Listener* listener) {
+  this->listener = listener;
+}
+
+void SourceScanner::scan(File* root) {
+  wakeFd = newOwned<OsHandle>("eventfd", WRAP_SYSCALL(eventfd, 0, EFD_NONBLOCK | EFD_CLOEXEC));
+  wakeWatcher = eventManager->watchFd(wakeFd->get());
+
+  queue.add(root->clone());
+  driver->setScanning(true);
+  waitForResults();
+
+  for (int i = 0; i < threadCount; i++) {
+    threads.push_back(std::thread([this]() { worker(); }));
+  }
+}
+
+// ---------------------------------------------------------------------------------------
+// Worker threads.
+
+void SourceScanner::worker() {
+  std::unique_lock<std::mutex> lock(mutex);
+
+  while (true) {
+    while (queue.empty() && busyThreads > 0) {
+      workAvailable.wait(lock);
+    }
+
+    if (queue.empty()) {
+      // Nothing left to do and nobody who could produce more.
+      if (!finished) {
+        finished = true;
+        uint64_t one = 1;
+        if (write(wakeFd->get(), &one, sizeof(one)) < 0) {
+          DEBUG_ERROR << "write(eventfd): " << strerror(errno);
+        }
+      }
+      workAvailable.notify_all();
+      return;
+    }
+
+    OwnedPtr<File> file = queue.releaseBack();
+    ++busyThreads;
+    lock.unlock();
+
+    try {
+      process(file.release());
+    } catch (const std::exception& e) {
+      DEBUG_ERROR << "Scanning source tree: " << e.what();
+    }
+
+    lock.lock();
+    --busyThreads;
+  }
+}
+
+void SourceScanner::process(OwnedPtr<File> file) {
+  if (file->isDirectory()) {
+    OwnedPtrVector<File> list;
+    file->list(list.appender());
+
+    std::unique_lock<std::mutex> lock(mutex);
+    for (int i = 0; i < list.size(); i++) {
+      queue.add(list.release(i));
+    }
+    workAvailable.notify_all();
+    lock.unlock();
+
+    Hash hash = file->contentHash();  // of the listing
+    addResult(file.release(), hash);
+  } else {
+    Hash hash = hashFile(file.get());
+    addResult(file.release(), hash);
+  }
+}
+
+Hash SourceScanner::hashFile(File* file) {
+  struct stat stats;
+  if (stat(file->getOnDisk(File::READ)->path().c_str(), &stats) < 0) {
+    return file->contentHash();
+  }
+
+  FileId id = { stats.st_dev, stats.st_ino };
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    std::unordered_map<FileId, Hash, FileId::HashFunc>::iterator iter = hashesById.find(id);
+    if (iter != hashesById.end()) {
+      return iter->second;
+    }
+  }
+
+  Hash hash = file->contentHash();
+
+  std::unique_lock<std::mutex> lock(mutex);
+  hashesById[id] = hash;
+  return hash;
+}
+
+void SourceScanner::addResult(OwnedPtr<File> file, const Hash& contentHash) {
+  OwnedPtr<Result> result = newOwned<Result>();
+  result->file = file.release();
+  result->contentHash = contentHash;
+
+  std::unique_lock<std::mutex> lock(mutex);
+  bool wasEmpty = results.empty();
+  results.add(result.release());
+  if (wasEmpty) {
+    uint64_t one = 1;
+    if (write(wakeFd->get(), &one, sizeof(one)) < 0) {
+      DEBUG_ERROR << "write(eventfd): " << strerror(errno);
+    }
+  }
+}
+
+// ---------------------------------------------------------------------------------------
+// Event loop thread.
+
+void SourceScanner::waitForResults() {
+  wakeOp = eventManager->when(wakeWatcher->onReadable())(
+    [this](Void) {
+      uint64_t count;
+      if (read(wakeFd->get(), &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        DEBUG_ERROR << "read(eventfd): " << strerror(errno);
+      }
+      deliverResults();
+    });
+}
+
+void SourceScanner::deliverResults() {
+  OwnedPtrVector<Result> batch;
+  bool done;
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    batch.swap(&results);
+    done = finished;
+  }
+
+  driver->beginBatch();
+  for (int i = 0; i < batch.size(); i++) {
+    Result* result = batch.get(i);
+    if (listener == nullptr || listener->shouldAdd(result->file.get())) {
+      driver->addSourceFile(result->file.get(), result->contentHash);
+    }
+  }
+  driver->endBatch();
+
+  if (done) {
+    for (size_t i = 0; i < threads.size(); i++) {
+      threads[i].join();
+    }
+    threads.clear();
+    wakeOp.release();
+    wakeWatcher.clear();
+    wakeFd.clear();
+    driver->setScanning(false);
+    if (listener != nullptr) {
+      listener->scanFinished();
+    }
+  } else {
+    waitForResults();
+  }
+}
+
+}  // namespace ekam
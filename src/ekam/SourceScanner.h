@@ -0,0 +1,116 @@
+// Ekam Build System
+// Author: Kenton Varda (kenton@sandstorm.io)
+// Copyright (c) 2010-2015 Kenton Varda, Google Inc., and contributors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef KENTONSCODE_EKAM_SOURCESCANNER_H_
+#define KENTONSCODE_EKAM_SOURCESCANNER_H_
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <sys/types.h>
+
+#include "base/OwnedPtr.h"
+#include "base/Hash.h"
+#include "base/Promise.h"
+#include "os/File.h"
+#include "os/EventManager.h"
+#include "os/OsHandle.h"
+#include "Driver.h"
+
+namespace ekam {
+
+// Walks a source tree and hashes its files on a pool of threads, feeding the results to the
+// Driver on the event loop thread as they become available.  Actions start as soon as their
+// trigger files arrive, while the rest of the tree is still being hashed.
+//
+// Files reached through more than one path (hard links, or symlinks to the same file) are only
+// hashed once.
+class SourceScanner {
+public:
+  SourceScanner(EventManager* eventManager, Driver* driver, int threadCount);
+  ~SourceScanner();
+
+  // Told about results before they go to the Driver, on the event loop thread.
+  class Listener {
+  public:
+    virtual ~Listener() noexcept(false);
+
+    // Return false to drop the result, e.g. because a newer version was already reported.
+    virtual bool shouldAdd(File* file) = 0;
+
+    // The whole tree has been delivered.
+    virtual void scanFinished() = 0;
+  };
+
+  // Call before scan().  listener may be null.
+  void setListener(Listener* listener);
+
+  void scan(File* root);
+
+private:
+  struct Result {
+    OwnedPtr<File> file;
+    Hash contentHash;
+  };
+
+  struct FileId {
+    dev_t device;
+    ino_t inode;
+
+    inline bool operator==(const FileId& other) const {
+      return device == other.device && inode == other.inode;
+    }
+    class HashFunc {
+    public:
+      inline size_t operator()(const FileId& id) const {
+        return id.device * 31 + id.inode;
+      }
+    };
+  };
+
+  EventManager* eventManager;
+  Driver* driver;
+  int threadCount;
+  Listener* listener;  // possibly null
+
+  OwnedPtr<OsHandle> wakeFd;
+  OwnedPtr<EventManager::IoWatcher> wakeWatcher;
+  Promise<void> wakeOp;
+  std::vector<std::thread> threads;
+
+  // Everything below is protected by mutex.
+  std::mutex mutex;
+  std::condition_variable workAvailable;
+  OwnedPtrVector<File> queue;
+  int busyThreads;
+  bool finished;
+  OwnedPtrVector<Result> results;
+  std::unordered_map<FileId, Hash, FileId::HashFunc> hashesById;
+
+  void worker();
+  void process(OwnedPtr<File> file);
+  Hash hashFile(File* file);
+  void addResult(OwnedPtr<File> file, const Hash& contentHash);
+
+  void waitForResults();
+  void deliverResults();
+};
+
+}  // namespace ekam
+
+#endif  // KENTONSCODE_EKAM_SOURCESCANNER_H_
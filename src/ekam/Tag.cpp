@@ -15,6 +15,9 @@
 // limitations under the License.
 
 #include "Tag.h"
+
+#include <unordered_map>
+
 #include "base/Debug.h"
 
 namespace ekam {
@@ -62,8 +65,131 @@ std::string canonicalizePath(const std::string& path) {
   return result;
 }
 
+// Every tag seen so far, numbered in order of appearance.  Tags read back with fromString()
+// arrive as bare hashes; such a tag gets its name once fromName() is called with a name that
+// hashes to it.  To make that possible cheaply, names are only hashed while there are bare
+// hashes to match, or when a hash is asked for.
+class TagInterner {
+public:
+  TagInterner() : bareHashCount(0) {
+    // Number zero is the default-constructed Tag.
+    Entry entry;
+    entry.hashed = true;
+    entry.hash = Hash::NULL_HASH;
+    entries.push_back(entry);
+  }
+
+  uint32_t fromName(const std::string& name) {
+    std::unordered_map<std::string, uint32_t>::iterator iter = byName.find(name);
+    if (iter != byName.end()) {
+      return iter->second;
+    }
+
+    if (bareHashCount > 0) {
+      Hash hash = Hash::of(name);
+      std::unordered_map<Hash, uint32_t, Hash::StlHashFunc>::iterator hashIter = byHash.find(hash);
+      if (hashIter != byHash.end()) {
+        --bareHashCount;
+        byName[name] = hashIter->second;
+        names[hashIter->second - 1] = name;
+        return hashIter->second;
+      }
+      uint32_t id = add(true);
+      entries[id].hash = hash;
+      byHash[hash] = id;
+      byName[name] = id;
+      names.push_back(name);
+      return id;
+    }
+
+    uint32_t id = add(false);
+    unhashed.push_back(id);
+    byName[name] = id;
+    names.push_back(name);
+    return id;
+  }
+
+  uint32_t fromHash(const Hash& hash) {
+    std::unordered_map<Hash, uint32_t, Hash::StlHashFunc>::iterator iter = byHash.find(hash);
+    if (iter == byHash.end()) {
+      hashPending();
+      iter = byHash.find(hash);
+      if (iter != byHash.end()) {
+        return iter->second;
+      }
+      uint32_t id = add(true);
+      entries[id].hash = hash;
+      byHash[hash] = id;
+      names.push_back(std::string());
+      ++bareHashCount;
+      return id;
+    }
+    return iter->second;
+  }
+
+  const Hash& hashOf(uint32_t id) {
+    if (!entries[id].hashed) {
+      hashPending();
+    }
+    return entries[id].hash;
+  }
+
+private:
+  struct Entry {
+    bool hashed;
+    Hash hash;
+  };
+
+  std::vector<Entry> entries;
+  std::vector<std::string> names;  // parallels entries, less the default tag
+  std::unordered_map<std::string, uint32_t> byName;
+  std::unordered_map<Hash, uint32_t, Hash::StlHashFunc> byHash;
+  std::vector<uint32_t> unhashed;
+  int bareHashCount;
+
+  uint32_t add(bool hashed) {
+    Entry entry;
+    entry.hashed = hashed;
+    entries.push_back(entry);
+    return entries.size() - 1;
+  }
+
+  void hashPending() {
+    for (size_t i = 0; i < unhashed.size(); i++) {
+      Entry& entry = entries[unhashed[i]];
+      entry.hash = Hash::of(names[unhashed[i] - 1]);
+      entry.hashed = true;
+      byHash[entry.hash] = unhashed[i];
+    }
+    unhashed.clear();
+  }
+};
+
+TagInterner& interner() {
+  // Constructed on first use, since static Tags elsewhere are initialized with fromName().
+  static TagInterner instance;
+  return instance;
+}
+
 }  // namespace
 
+Tag Tag::fromName(const std::string& name) {
+  return Tag(interner().fromName(name));
+}
+
+std::string Tag::toString() const {
+  return interner().hashOf(id).toString();
+}
+
+bool Tag::fromString(const std::string& text, Tag* output) {
+  Hash hash;
+  if (!Hash::fromString(text, &hash)) {
+    return false;
+  }
+  output->id = interner().fromHash(hash);
+  return true;
+}
+
 const Tag Tag::DEFAULT_TAG = Tag::fromName("file:*");
 
 Tag Tag::fromFile(const std::string& path) {
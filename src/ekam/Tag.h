@@ -28,47 +28,44 @@ namespace ekam {
 
 class File;
 
+// Tags are interned:  each distinct name gets a small number, which is all a Tag holds, so
+// copying, comparing, and hashing them is cheap.  The SHA-256 of the name, which is how tags are
+// written to disk, is computed only when needed.
 class Tag {
 public:
-  Tag() {}
+  Tag() : id(0) {}
 
   // Every file has this tag.
   static const Tag DEFAULT_TAG;
 
-  static inline Tag fromName(const std::string& name) {
-    return Tag(name);
-  }
+  static Tag fromName(const std::string& name);
 
   static Tag fromFile(const std::string& path);
 
-  inline std::string toString() { return hash.toString(); }
+  // The SHA-256 of the name, in hex.
+  std::string toString() const;
 
-  inline bool operator==(const Tag& other) const { return hash == other.hash; }
-  inline bool operator!=(const Tag& other) const { return hash != other.hash; }
-  inline bool operator< (const Tag& other) const { return hash <  other.hash; }
-  inline bool operator> (const Tag& other) const { return hash >  other.hash; }
-  inline bool operator<=(const Tag& other) const { return hash <= other.hash; }
-  inline bool operator>=(const Tag& other) const { return hash >= other.hash; }
+  // Parses the output of toString().  Returns false if the input is malformed.
+  static bool fromString(const std::string& text, Tag* output);
+
+  inline bool operator==(const Tag& other) const { return id == other.id; }
+  inline bool operator!=(const Tag& other) const { return id != other.id; }
+  inline bool operator< (const Tag& other) const { return id <  other.id; }
+  inline bool operator> (const Tag& other) const { return id >  other.id; }
+  inline bool operator<=(const Tag& other) const { return id <= other.id; }
+  inline bool operator>=(const Tag& other) const { return id >= other.id; }
 
   class HashFunc {
   public:
     inline size_t operator()(const Tag& id) const {
-      return inner(id.hash);
+      return id.id;
     }
-
-  private:
-    Hash::StlHashFunc inner;
   };
 
 private:
-  Hash hash;
-
-#ifdef EXTRA_DEBUG
-  std::string name;
-  inline explicit Tag(const std::string& name) : hash(Hash::of(name)), name(name) {}
-#else
-  inline explicit Tag(const std::string& name) : hash(Hash::of(name)) {}
-#endif
+  uint32_t id;
+
+  inline explicit Tag(uint32_t id) : id(id) {}
 };
 
 }  // namespace ekam
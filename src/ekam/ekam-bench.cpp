@@ -0,0 +1,544 @@
+// Ekam Build System
+// Author: Kenton Varda (kenton@sandstorm.io)
+// Copyright (c) 2010-2015 Kenton Varda, Google Inc., and contributors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Measures Ekam's own overhead.  Generates a synthetic source tree, then builds it with the real
+// Driver, twice:  once from scratch, and once after changing a widely-included header.  The
+// "compiler" does no real work -- it only looks up each file's includes and provides its
+// symbols -- so nearly all of the time reported is the Driver's, the event loop's and (with -p)
+// the plugin protocol's.
+//
+// With -S, instead compares the ways Subprocess can start a process, as the parent grows.
+
+#include <ftw.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "base/Clock.h"
+#include "base/Debug.h"
+#include "os/DiskFile.h"
+#include "os/HashCache.h"
+#include "os/OsHandle.h"
+#include "os/ThreadPool.h"
+#include "Action.h"
+#include "BuildTrace.h"
+#include "Driver.h"
+#include "ExecPluginActionFactory.h"
+#include "ExtractTypeActionFactory.h"
+#include "FileHasher.h"
+#include "Installer.h"
+#include "SimpleDashboard.h"
+#include "SourceScanner.h"
+
+namespace ekam {
+namespace {
+
+struct TreeShape {
+  int sourceCount = 1000;
+  int headerCount = 100;
+  int fanOut = 5;       // includes per source file
+  int symbolCount = 10;  // per source file
+  int depth = 3;        // headers form include chains of this length
+};
+
+// Stands in for a compiler:  reads the source and, transitively, its headers, so that the
+// Driver records the same dependencies a real compile would, then provides a tag per symbol.
+class BenchCompileAction : public Action {
+public:
+  BenchCompileAction(File* file) : file(file->clone()) {}
+  ~BenchCompileAction() {}
+
+  // implements Action -------------------------------------------------------------------
+  std::string getVerb() { return "compile"; }
+
+  Promise<void> start(EventManager* eventManager, BuildContext* context) {
+    std::vector<Tag> tags;
+    std::unordered_set<std::string> seen;
+    scan(context, file->readAll(), &seen, &tags);
+
+    std::string name = file->canonicalName();
+    OwnedPtr<File> output = context->newOutput(name.substr(0, name.size() - 4) + ".o");
+    output->writeAll(name);
+    context->provide(output.get(), tags);
+    return newFulfilledPromise();
+  }
+
+private:
+  OwnedPtr<File> file;
+
+  static void scan(BuildContext* context, const std::string& content,
+                   std::unordered_set<std::string>* seen, std::vector<Tag>* tags) {
+    static const char INCLUDE[] = "#include \"";
+    static const char SYMBOL[] = "int ";
+
+    std::string::size_type pos = 0;
+    while (pos < content.size()) {
+      std::string::size_type eol = content.find_first_of('\n', pos);
+      if (eol == std::string::npos) eol = content.size();
+
+      if (content.compare(pos, sizeof(INCLUDE) - 1, INCLUDE) == 0) {
+        std::string::size_type start = pos + sizeof(INCLUDE) - 1;
+        std::string header = content.substr(start, content.find_first_of('"', start) - start);
+        if (seen->insert(header).second) {
+          File* provider = context->findProvider(Tag::fromFile(header));
+          if (provider != nullptr) {
+            // Headers only declare symbols.
+            scan(context, provider->readAll(), seen, nullptr);
+          }
+        }
+      } else if (tags != nullptr && content.compare(pos, sizeof(SYMBOL) - 1, SYMBOL) == 0) {
+        std::string::size_type start = pos + sizeof(SYMBOL) - 1;
+        std::string symbol = content.substr(start, content.find_first_of('(', start) - start);
+        tags->push_back(Tag::fromName("c++symbol:" + symbol));
+      }
+
+      pos = eol + 1;
+    }
+  }
+};
+
+class BenchCompileActionFactory : public ActionFactory {
+public:
+  BenchCompileActionFactory() {}
+  ~BenchCompileActionFactory() {}
+
+  // implements ActionFactory ------------------------------------------------------------
+  void enumerateTriggerTags(std::back_insert_iterator<std::vector<Tag> > iter) {
+    *iter++ = Tag::fromName("filetype:.cpp");
+  }
+  OwnedPtr<Action> tryMakeAction(const Tag& id, File* file) {
+    return newOwned<BenchCompileAction>(file);
+  }
+};
+
+// The same, as a rule, for measuring the cost of running actions as processes.
+const char PLUGIN_RULE[] =
+    "#! /bin/sh\n"
+    "set -eu\n"
+    "if test $# = 0; then\n"
+    "  echo trigger filetype:.cpp\n"
+    "  exit 0\n"
+    "fi\n"
+    "INPUT=$1\n"
+    "echo findInput \"$INPUT\"\n"
+    "read SOURCE\n"
+    "QUEUE=$SOURCE\n"
+    "SEEN=\n"
+    "while test -n \"$QUEUE\"; do\n"
+    "  set -- $QUEUE\n"
+    "  FILE=$1\n"
+    "  shift\n"
+    "  QUEUE=\"$*\"\n"
+    "  for NAME in $(sed -n 's/^#include \"\\(.*\\)\"$/\\1/p' \"$FILE\"); do\n"
+    "    case \" $SEEN \" in\n"
+    "      *\" $NAME \"* ) continue ;;\n"
+    "    esac\n"
+    "    SEEN=\"$SEEN $NAME\"\n"
+    "    echo findProvider file:$NAME\n"
+    "    read HEADER\n"
+    "    if test -n \"$HEADER\"; then QUEUE=\"$QUEUE $HEADER\"; fi\n"
+    "  done\n"
+    "done\n"
+    "echo newOutput \"${INPUT%.cpp}.o\"\n"
+    "read OUTPUT\n"
+    "echo \"$INPUT\" > \"$OUTPUT\"\n"
+    "for SYMBOL in $(sed -n 's/^int \\([a-z0-9_]*\\)(.*/\\1/p' \"$SOURCE\"); do\n"
+    "  echo provide \"$OUTPUT\" c++symbol:$SYMBOL\n"
+    "done\n";
+
+std::string headerName(int index) {
+  return "h/h" + toString(index) + ".h";
+}
+
+// Header i includes header i + 1 unless that starts the next chain, so the last header of each
+// chain is (indirectly) included by everything that includes any header of the chain.
+void generateTree(const TreeShape& shape, File* src) {
+  src->createDirectory();
+  OwnedPtr<File> headerDir = src->relative("h");
+  headerDir->createDirectory();
+
+  for (int i = 0; i < shape.headerCount; i++) {
+    std::string content = "#pragma once\n";
+    if ((i + 1) % shape.depth != 0 && i + 1 < shape.headerCount) {
+      content += "#include \"" + headerName(i + 1) + "\"\n";
+    }
+    content += "int header_" + toString(i) + "();\n";
+    src->relative(headerName(i))->writeAll(content);
+  }
+
+  // A hundred files per directory.
+  for (int i = 0; i < shape.sourceCount; i++) {
+    OwnedPtr<File> dir = src->relative("d" + toString(i / 100));
+    if (i % 100 == 0) {
+      dir->createDirectory();
+    }
+
+    std::string content;
+    for (int j = 0; j < shape.fanOut && shape.headerCount > 0; j++) {
+      content += "#include \"" + headerName((i * 7 + j * 13) % shape.headerCount) + "\"\n";
+    }
+    for (int j = 0; j < shape.symbolCount; j++) {
+      content += "int sym_" + toString(i) + "_" + toString(j) + "() { return " + toString(j) +
+          "; }\n";
+    }
+    dir->relative("f" + toString(i) + ".cpp")->writeAll(content);
+  }
+}
+
+long peakRssKb() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+// Average microseconds to start and reap /bin/true, with posix_spawn() or with fork() and exec().
+double microsPerSpawn(int count, bool useFork) {
+  char* argv[] = { const_cast<char*>("/bin/true"), nullptr };
+  double start = monotonicSeconds();
+  for (int i = 0; i < count; i++) {
+    pid_t pid;
+    if (useFork) {
+      pid = fork();
+      if (pid == 0) {
+        execv(argv[0], argv);
+        _exit(1);
+      }
+    } else if (posix_spawn(&pid, argv[0], nullptr, nullptr, argv, environ) != 0) {
+      pid = -1;
+    }
+    if (pid < 0) {
+      fprintf(stderr, "%s: %s\n", useFork ? "fork" : "posix_spawn", strerror(errno));
+      exit(1);
+    }
+
+    int status;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+  }
+  return (monotonicSeconds() - start) * 1e6 / count;
+}
+
+// Subprocess uses posix_spawn() normally and fork() for sandboxed or CPU-limited actions.
+// fork() copies the parent's page tables, so it slows down as the parent -- which holds the
+// whole dependency graph -- grows.  Measure both at a few sizes.
+void spawnBench() {
+  static const int SIZES_MB[] = { 0, 64, 256, 1024 };
+  static const int COUNT = 200;
+
+  std::vector<char*> blocks;
+  int allocatedMb = 0;
+  printf("%14s %16s %16s\n", "parent RSS", "posix_spawn", "fork+exec");
+  for (size_t i = 0; i < sizeof(SIZES_MB) / sizeof(SIZES_MB[0]); i++) {
+    size_t size = (size_t)(SIZES_MB[i] - allocatedMb) << 20;
+    if (size > 0) {
+      // Touch every page, so that it's actually mapped.
+      char* block = reinterpret_cast<char*>(malloc(size));
+      memset(block, 1, size);
+      blocks.push_back(block);
+      allocatedMb = SIZES_MB[i];
+    }
+
+    double spawnMicros = microsPerSpawn(COUNT, false);
+    double forkMicros = microsPerSpawn(COUNT, true);
+    printf("%11ld MB %13.1f us %13.1f us\n", peakRssKb() / 1024, spawnMicros, forkMicros);
+    fflush(stdout);
+  }
+
+  for (size_t i = 0; i < blocks.size(); i++) {
+    free(blocks[i]);
+  }
+}
+
+class Bench {
+public:
+  Bench(int maxConcurrentActions, bool usePlugin)
+      : src("src", nullptr), tmp("tmp", nullptr), bin("bin", nullptr), lib("lib", nullptr),
+        nodeModules("node_modules", nullptr),
+        devNull(fopen("/dev/null", "w")), dashboard(devNull),
+        eventManager(newPreferredEventManager()),
+        history(tmp.relative(".ekam-history").get()),
+        hashCache(tmp.relative(".ekam-hash-cache").get()),
+        trace(tmp.relative("bench-trace.json")->getOnDisk(File::WRITE)->path()),
+        threadPool(eventManager.get(), maxConcurrentActions),
+        fileHasher(&threadPool), installer(&threadPool),
+        driver(eventManager.get(), &dashboard, &tmp, installDirs(), maxConcurrentActions,
+               nullptr, nullptr, &history),
+        maxConcurrentActions(maxConcurrentActions) {
+    DiskFile::setHashCache(&hashCache);
+    driver.setFileHasher(&fileHasher);
+    driver.setInstaller(&installer);
+    driver.setHashCache(&hashCache);
+    driver.setTrace(&trace);
+
+    driver.addActionFactory(&extractTypeActionFactory);
+    if (!usePlugin) {
+      driver.addActionFactory(&benchCompileActionFactory);
+    }
+    driver.addActionFactory(&execPluginActionFactory);
+  }
+  ~Bench() {
+    execPluginActionFactory.shutDownWorkers();
+    DiskFile::setHashCache(nullptr);
+    fclose(devNull);
+  }
+
+  void coldBuild() {
+    Run run(this, "cold build");
+    SourceScanner scanner(eventManager.get(), &driver, maxConcurrentActions);
+    scanner.scan(&src);
+    eventManager->loop();
+  }
+
+  void changeFile(const std::string& canonicalName) {
+    Run run(this, "rebuild after changing " + canonicalName);
+    OwnedPtr<File> file = src.relative(canonicalName);
+    file->writeAll(file->readAll() + "int changed();\n");
+    driver.addSourceFile(file.get());
+    eventManager->loop();
+  }
+
+  bool hasFailures() {
+    return driver.getStats().failedActions > 0;
+  }
+
+private:
+  DiskFile src;
+  DiskFile tmp;
+  DiskFile bin;
+  DiskFile lib;
+  DiskFile nodeModules;
+  File* installDirArray[BuildContext::INSTALL_LOCATION_COUNT];
+
+  FILE* devNull;
+  SimpleDashboard dashboard;
+  OwnedPtr<RunnableEventManager> eventManager;
+  ActionHistory history;
+  HashCache hashCache;
+  BuildTrace trace;
+
+  // Must outlive the Driver; see ekam.cpp.
+  ExecPluginActionFactory execPluginActionFactory;
+  ThreadPool threadPool;
+  FileHasher fileHasher;
+  Installer installer;
+
+  Driver driver;
+  int maxConcurrentActions;
+
+  ExtractTypeActionFactory extractTypeActionFactory;
+  BenchCompileActionFactory benchCompileActionFactory;
+
+  File** installDirs() {
+    installDirArray[BuildContext::BIN] = &bin;
+    installDirArray[BuildContext::LIB] = &lib;
+    installDirArray[BuildContext::NODE_MODULES] = &nodeModules;
+    return installDirArray;
+  }
+
+  // Reports on one build, from construction to destruction.
+  class Run {
+  public:
+    Run(Bench* bench, const std::string& title)
+        : bench(bench), title(title), before(bench->driver.getStats()),
+          totalsBefore(bench->trace.getTotals()), start(monotonicSeconds()) {}
+    ~Run() {
+      double seconds = monotonicSeconds() - start;
+      Driver::Stats after = bench->driver.getStats();
+
+      printf("%s:\n", title.c_str());
+      printf("  %10.3fs wall time\n", seconds);
+      printf("  %10llu actions run\n",
+             (unsigned long long)(after.actionsStarted - before.actionsStarted));
+      printf("  %10llu actions reset\n",
+             (unsigned long long)(after.actionsReset - before.actionsReset));
+      printf("  %10d failed\n", after.failedActions);
+      printf("  %10ld KB peak RSS\n", peakRssKb());
+
+      const std::map<std::string, BuildTrace::Total>& totals = bench->trace.getTotals();
+      for (auto iter = totals.begin(); iter != totals.end(); ++iter) {
+        BuildTrace::Total total = iter->second;
+        auto old = totalsBefore.find(iter->first);
+        if (old != totalsBefore.end()) {
+          total.micros -= old->second.micros;
+          total.count -= old->second.count;
+        }
+        if (total.count > 0) {
+          printf("  %10.3fs %8llu x %s\n", total.micros / 1e6,
+                 (unsigned long long)total.count, iter->first.c_str());
+        }
+      }
+      fflush(stdout);
+    }
+
+  private:
+    Bench* bench;
+    std::string title;
+    Driver::Stats before;
+    std::map<std::string, BuildTrace::Total> totalsBefore;
+    double start;
+  };
+};
+
+int removeEntry(const char* path, const struct stat* stats, int type, struct FTW* ftw) {
+  return remove(path);
+}
+
+void usage(const char* command, FILE* out) {
+  fprintf(out,
+    "usage: %s [-hkpS] [-n <files>] [-H <headers>] [-f <includes>] [-s <symbols>]\n"
+    "       [-d <depth>] [-j <jobs>]\n"
+    "\n"
+    "Measures Ekam's own overhead by building a generated source tree with a \"compiler\"\n"
+    "that does no real work, then rebuilding after changing a widely-included header.\n"
+    "Reports wall time, actions run, peak RSS, and time spent in each of the Driver's\n"
+    "phases.\n"
+    "\n"
+    "options:\n"
+    "  -n <files>     Number of source files (default 1000).\n"
+    "  -H <headers>   Number of headers (default 100).\n"
+    "  -f <includes>  Headers included directly by each source file (default 5).\n"
+    "  -s <symbols>   Symbols defined by each source file (default 10).\n"
+    "  -d <depth>     Headers form include chains this long (default 3).\n"
+    "  -j <jobs>      Run up to <jobs> actions at once (default 4).\n"
+    "  -p             Compile with a plugin rule, one process per file, rather than\n"
+    "                 in-process.\n"
+    "  -k             Keep the generated tree, and print where it is.\n"
+    "  -S             Instead, time starting a process with posix_spawn() and with\n"
+    "                 fork() and exec(), with the parent at several sizes.\n"
+    "  -h             Display this help text and exit.\n",
+    command);
+}
+
+bool parseCount(const char* text, int* result) {
+  char* endptr;
+  long value = strtol(text, &endptr, 10);
+  if (*endptr != '\0' || value < 0) {
+    return false;
+  }
+  *result = value;
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  const char* command = argv[0];
+  TreeShape shape;
+  int maxConcurrentActions = 4;
+  bool usePlugin = false;
+  bool keep = false;
+  bool spawnOnly = false;
+
+  while (true) {
+    int opt = getopt(argc, argv, "hkpSn:H:f:s:d:j:");
+    if (opt == -1) break;
+
+    int* count = nullptr;
+    switch (opt) {
+      case 'n': count = &shape.sourceCount; break;
+      case 'H': count = &shape.headerCount; break;
+      case 'f': count = &shape.fanOut; break;
+      case 's': count = &shape.symbolCount; break;
+      case 'd': count = &shape.depth; break;
+      case 'j': count = &maxConcurrentActions; break;
+      case 'p':
+        usePlugin = true;
+        break;
+      case 'k':
+        keep = true;
+        break;
+      case 'S':
+        spawnOnly = true;
+        break;
+      case 'h':
+        usage(command, stdout);
+        return 0;
+      default:
+        usage(command, stderr);
+        return 1;
+    }
+    if (count != nullptr && !parseCount(optarg, count)) {
+      fprintf(stderr, "Expected number after -%c.\n", opt);
+      return 1;
+    }
+  }
+  if (optind != argc || shape.depth < 1 || maxConcurrentActions < 1) {
+    usage(command, stderr);
+    return 1;
+  }
+
+  if (spawnOnly) {
+    spawnBench();
+    return 0;
+  }
+
+  char dir[] = "/tmp/ekam-bench-XXXXXX";
+  if (mkdtemp(dir) == nullptr) {
+    fprintf(stderr, "mkdtemp: %s\n", strerror(errno));
+    return 1;
+  }
+  if (chdir(dir) < 0) {
+    fprintf(stderr, "chdir(%s): %s\n", dir, strerror(errno));
+    return 1;
+  }
+
+  int result = 0;
+  {
+    DiskFile src("src", nullptr);
+    double start = monotonicSeconds();
+    generateTree(shape, &src);
+    if (usePlugin) {
+      OwnedPtr<File> rule = src.relative("bench-compile.ekam-rule");
+      rule->writeAll(PLUGIN_RULE, sizeof(PLUGIN_RULE) - 1);
+      chmod(rule->getOnDisk(File::READ)->path().c_str(), 0755);
+    }
+    printf("generated %d files and %d headers in %.3fs\n",
+           shape.sourceCount, shape.headerCount, monotonicSeconds() - start);
+
+    DiskFile tmp("tmp", nullptr);
+    tmp.createDirectory();
+
+    Bench bench(maxConcurrentActions, usePlugin);
+    bench.coldBuild();
+    if (shape.headerCount > 0) {
+      bench.changeFile(headerName(std::min(shape.depth, shape.headerCount) - 1));
+    }
+    result = bench.hasFailures() ? 1 : 0;
+  }
+
+  if (keep) {
+    printf("tree is at %s\n", dir);
+  } else {
+    chdir("/");
+    nftw(dir, &removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+  }
+  return result;
+}
+
+}  // namespace ekam
+
+int main(int argc, char* argv[]) {
+  return ekam::main(argc, argv);
+}
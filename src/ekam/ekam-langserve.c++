@@ -9,6 +9,7 @@
 #include <kj/map.h>
 #include <kj/filesystem.h>
 #include <stdlib.h>
+#include <string.h>
 #include <kj/encoding.h>
 
 namespace ekam {
@@ -205,9 +206,16 @@ public:
     }
   }
 
+  bool changedSincePublished() {
+    // A task that reruns typically removes and re-adds exactly the same diagnostics; the client
+    // needn't hear about that.
+    return fingerprint() != publishedFingerprint;
+  }
+
   void exportDiagnostics(kj::StringPtr uriPrefix,
       lsp::LanguageClient::PublishDiagnosticsParams::Builder builder) {
     builder.setUri(kj::str(uriPrefix, realPath));
+    publishedFingerprint = fingerprint();
 
     size_t count = 0;
     for (auto& diagnostic: diagnostics) {
@@ -243,6 +251,18 @@ public:
 private:
   DirtySet& dirtySet;
   kj::String realPath;
+  uint64_t publishedFingerprint = 0;
+
+  uint64_t fingerprint() {
+    // Independent of order, since the set's order changes as entries are erased.
+    uint64_t result = 0;
+    for (auto& entry: diagnostics) {
+      if (!entry.stale) {
+        result += (uint64_t(entry.hashCode()) << 16) + entry.diagnostic->notes.size() + 1;
+      }
+    }
+    return result;
+  }
 
   struct DiagnosticEntry {
     kj::Own<Diagnostic> diagnostic;
@@ -451,105 +471,107 @@ public:
     }
 
     kj::StringPtr log = update.getLog();
+    if (log.size() == 0) return;
 
-    kj::String ownLog;
-    if (leftoverLog.size() > 0) {
-      ownLog = kj::str(leftoverLog, log);
-      log = ownLog;
-    }
-
+    // Copy the chunk once, after whatever partial line the last one left, and split it into
+    // NUL-terminated lines in place.
+    kj::String buffer = kj::str(leftoverLog, log);
+    char* pos = buffer.begin();
+    char* end = buffer.end();
     for (;;) {
-      kj::StringPtr line;
-      kj::String ownLine;
-      KJ_IF_MAYBE(eol, log.findFirst('\n')) {
-        ownLine = kj::str(log.slice(0, *eol));
-        line = ownLine;
-        log = log.slice(*eol + 1);
-      } else {
-        leftoverLog = kj::str(log);
+      char* eol = reinterpret_cast<char*>(memchr(pos, '\n', end - pos));
+      if (eol == nullptr) {
+        leftoverLog = kj::heapString(pos, end - pos);
         break;
       }
+      *eol = '\0';
+      parseLine(kj::StringPtr(pos, eol - pos), files);
+      pos = eol + 1;
+    }
+  }
 
-      trimLeadingSpace(line);
-      if (line == nullptr) continue;
+private:
+  kj::Vector<Diagnostic*> diagnostics;
+  kj::String leftoverLog;
+  bool addNotesToBack = false;
 
-      static constexpr kj::StringPtr IGNORE_PREFIXES[] = {
-        "In file included from "_kj
-      };
-      bool ignore = false;
-      for (auto prefix: IGNORE_PREFIXES) {
-        if (line.startsWith(prefix)) {
-          ignore = true;
-          break;
-        }
-      }
-      if (ignore) continue;
+  void parseLine(kj::StringPtr line, SourceFileSet& files) {
+    trimLeadingSpace(line);
+    if (line == nullptr) return;
 
-      static constexpr kj::StringPtr STRIP_PREFIXES[] = {
-        // Linker errors start with this.
-        "/usr/bin/ld: "_kj
-      };
-      for (auto prefix: STRIP_PREFIXES) {
-        if (line.startsWith(prefix)) {
-          line = line.slice(prefix.size());
-        }
+    static constexpr kj::StringPtr IGNORE_PREFIXES[] = {
+      "In file included from "_kj
+    };
+    bool ignore = false;
+    for (auto prefix: IGNORE_PREFIXES) {
+      if (line.startsWith(prefix)) {
+        ignore = true;
+        break;
       }
+    }
+    if (ignore) return;
 
-      size_t spaceAt = line.findFirst(' ').orDefault(line.size());
-      if (line[spaceAt - 1] != ':') {
-        // No file:line:column: to parse... skip.
-        continue;
+    static constexpr kj::StringPtr STRIP_PREFIXES[] = {
+      // Linker errors start with this.
+      "/usr/bin/ld: "_kj
+    };
+    for (auto prefix: STRIP_PREFIXES) {
+      if (line.startsWith(prefix)) {
+        line = line.slice(prefix.size());
       }
+    }
 
-      // parse file:line:column:
-      size_t pos = KJ_ASSERT_NONNULL(line.findFirst(':'));
-      auto filename = kj::str(line.slice(0, pos));
-      KJ_IF_MAYBE(file, files.get(filename)) {
-        line = line.slice(pos + 1);
+    size_t spaceAt = line.findFirst(' ').orDefault(line.size());
+    if (line[spaceAt - 1] != ':') {
+      // No file:line:column: to parse... skip.
+      return;
+    }
 
-        kj::Maybe<uint> lineNo = tryConsumeNumberColon(line);
-        kj::Maybe<ColumnRange> columnRange = tryConsumeRangeColon(line);
+    // parse file:line:column:
+    size_t pos = KJ_ASSERT_NONNULL(line.findFirst(':'));
+    // The line points into our own buffer, so terminate the filename in place.
+    const_cast<char*>(line.begin())[pos] = '\0';
+    kj::StringPtr filename(line.begin(), pos);
+    KJ_IF_MAYBE(file, files.get(filename)) {
+      line = line.slice(pos + 1);
 
-        trimLeadingSpace(line);
+      kj::Maybe<uint> lineNo = tryConsumeNumberColon(line);
+      kj::Maybe<ColumnRange> columnRange = tryConsumeRangeColon(line);
 
-        Severity severity = consumeSeverity(line);
+      trimLeadingSpace(line);
 
-        Message message {
-          file,
-          lineNo.orDefault(0),
-          columnRange.map([](ColumnRange c) { return c.start; }).orDefault(0),
-          columnRange.map([](ColumnRange c) { return c.end; }).orDefault(0),
-          kj::str(line)
-        };
+      Severity severity = consumeSeverity(line);
 
-        if (severity == Severity::NOTE) {
-          // Append note to previous diagnostic.
-          if (addNotesToBack) {
-            diagnostics.back()->notes.add(kj::mv(message));
-            diagnostics.back()->message.file->markDirty();
-          }
-        } else {
-          Diagnostic diagnostic {
-            severity, kj::mv(message), {}
-          };
-          diagnostics.add(&file->add(kj::mv(diagnostic)));
-
-          // If the notes aren't empty, then this must be a dupe diagnostic, and we don't want to
-          // add duplicate notes.
-          addNotesToBack = diagnostics.back()->notes.empty();
+      Message message {
+        file,
+        lineNo.orDefault(0),
+        columnRange.map([](ColumnRange c) { return c.start; }).orDefault(0),
+        columnRange.map([](ColumnRange c) { return c.end; }).orDefault(0),
+        kj::str(line)
+      };
+
+      if (severity == Severity::NOTE) {
+        // Append note to previous diagnostic.
+        if (addNotesToBack) {
+          diagnostics.back()->notes.add(kj::mv(message));
+          diagnostics.back()->message.file->markDirty();
         }
       } else {
-        // Doesn't appear to start with a filename. Skip.
-        continue;
+        Diagnostic diagnostic {
+          severity, kj::mv(message), {}
+        };
+        diagnostics.add(&file->add(kj::mv(diagnostic)));
+
+        // If the notes aren't empty, then this must be a dupe diagnostic, and we don't want to
+        // add duplicate notes.
+        addNotesToBack = diagnostics.back()->notes.empty();
       }
+    } else {
+      // Doesn't appear to start with a filename. Skip.
+      return;
     }
   }
 
-private:
-  kj::Vector<Diagnostic*> diagnostics;
-  kj::String leftoverLog;
-  bool addNotesToBack = false;
-
   void clearDiagnostics() {
     for (auto diagnostic: diagnostics) {
       diagnostic->message.file->remove(*diagnostic);
@@ -567,9 +589,11 @@ public:
 
   class Scope {
   public:
-    Scope(LanguageServerImpl& server, SourceFileSet& files, kj::StringPtr uriPrefix)
-        : server(server), files(files), uriPrefix(uriPrefix) {
+    Scope(LanguageServerImpl& server, SourceFileSet& files, kj::StringPtr uriPrefix,
+          kj::AsyncOutputStream& ekamConnection)
+        : server(server), files(files), uriPrefix(uriPrefix), ekamConnection(ekamConnection) {
       server.scope = this;
+      server.sendFocus();
     }
     ~Scope() noexcept(false) {
       server.scope = nullptr;
@@ -579,6 +603,8 @@ public:
     LanguageServerImpl& server;
     SourceFileSet& files;
     kj::StringPtr uriPrefix;
+    kj::AsyncOutputStream& ekamConnection;
+    kj::Promise<void> writeQueue = kj::READY_NOW;
 
     friend class LanguageServerImpl;
   };
@@ -600,17 +626,21 @@ protected:
   }
 
   kj::Promise<void> didOpen(DidOpenContext context) override {
-    // Ignore.
+    addFocus(context.getParams().getTextDocument().getUri());
     return kj::READY_NOW;
   }
   kj::Promise<void> didClose(DidCloseContext context) override {
-    // Ignore.
+    kj::StringPtr uri = context.getParams().getTextDocument().getUri();
+    if (openUris.eraseMatch(uri)) {
+      sendFocus();
+    }
     return kj::READY_NOW;
   }
   kj::Promise<void> didChange(DidChangeContext context) override {
+    auto params = context.getParams();
+    auto uri = params.getTextDocument().getUri();
+    addFocus(uri);
     KJ_IF_MAYBE(s, scope) {
-      auto params = context.getParams();
-      auto uri = params.getTextDocument().getUri();
       if (uri.startsWith(s->uriPrefix)) {
         auto path = kj::decodeUriComponent(uri.slice(s->uriPrefix.size()));
         KJ_IF_MAYBE(file, s->files.findByRealPath(path)) {
@@ -621,7 +651,8 @@ protected:
     return kj::READY_NOW;
   }
   kj::Promise<void> didSave(DidSaveContext context) override {
-    // Ignore for now.
+    addFocus(context.getParams().getTextDocument().getUri());
+    // Otherwise ignore for now.
     // TODO(someday): Start a new location map for this file and interpret future diagnostics
     //   against that map rather than the current one.
     return kj::READY_NOW;
@@ -630,6 +661,52 @@ protected:
 private:
   kj::Own<kj::PromiseFulfiller<void>> initializedFulfiller;
   kj::Maybe<Scope&> scope;
+
+  // Documents open in the editor.  Ekam builds for them first.
+  kj::HashSet<kj::String> openUris;
+
+  void addFocus(kj::StringPtr uri) {
+    if (openUris.find(uri) == nullptr) {
+      openUris.insert(kj::str(uri));
+      sendFocus();
+    }
+  }
+
+  void sendFocus() {
+    KJ_IF_MAYBE(s, scope) {
+      // Ekam wants canonical names, i.e. paths relative to src or tmp.
+      static constexpr kj::StringPtr DIRS[] = {"src/"_kj, "tmp/"_kj};
+      kj::Vector<kj::String> names;
+      for (auto& uri: openUris) {
+        if (!uri.startsWith(s->uriPrefix)) continue;
+        auto path = kj::decodeUriComponent(uri.slice(s->uriPrefix.size()));
+        for (auto dir: DIRS) {
+          if (path.startsWith(dir)) {
+            names.add(kj::str(path.slice(dir.size())));
+            break;
+          }
+        }
+      }
+
+      auto message = kj::heap<capnp::MallocMessageBuilder>();
+      auto subscription = message->initRoot<proto::Subscription>();
+      subscription.setFocusOnly(true);
+      auto focus = subscription.initFocus(names.size());
+      for (auto i: kj::indices(names)) {
+        focus.set(i, names[i]);
+      }
+
+      // Writes must not overlap.
+      auto& connection = s->ekamConnection;
+      auto& messageRef = *message;
+      s->writeQueue = s->writeQueue.then([&connection, &messageRef]() {
+        return capnp::writeMessage(connection, messageRef);
+      }).attach(kj::mv(message)).eagerlyEvaluate([](kj::Exception&& exception) {
+        // The read loop will notice if we're disconnected.
+        KJ_LOG(WARNING, "couldn't send focus to Ekam", exception);
+      });
+    }
+  }
 };
 
 class LanguageServerMain {
@@ -707,8 +784,9 @@ public:
       SourceFileSet files(*projectHome, dirtySet);
       kj::HashMap<uint, kj::Own<Task>> tasks;
 
-      LanguageServerImpl::Scope serverScope(server, files, homeUri);
-      kj::Promise<void> updateLoopTask = updateLoop(dirtySet, client, homeUri);
+      LanguageServerImpl::Scope serverScope(server, files, homeUri, *ekamConnection);
+      kj::Promise<void> updateLoopTask =
+          updateLoop(dirtySet, io.provider->getTimer(), client, homeUri);
 
       for (;;) {
         kj::Own<capnp::MessageReader> message;
@@ -746,7 +824,7 @@ public:
 private:
   kj::ProcessContext& context;
 
-  kj::Promise<void> updateLoop(DirtySet& dirtySet,
+  kj::Promise<void> updateLoop(DirtySet& dirtySet, kj::Timer& timer,
       lsp::LanguageClient::Client client, kj::StringPtr homeUri) {
     KJ_IF_MAYBE(p, dirtySet.whenNonEmpty()) {
       return p->then([]() {
@@ -755,13 +833,18 @@ private:
       }).then([&dirtySet, client, homeUri]() mutable {
         kj::Vector<kj::Promise<void>> promises;
         dirtySet.forEach([&](SourceFile& file) {
+          if (!file.changedSincePublished()) return;
           auto req = client.publishDiagnosticsRequest();
           file.exportDiagnostics(homeUri, req);
           promises.add(req.send().ignoreResult());
         });
         return kj::joinPromises(promises.releaseAsArray());
-      }).then([this, &dirtySet, client, homeUri]() mutable {
-        return updateLoop(dirtySet, kj::mv(client), homeUri);
+      }).then([&timer]() {
+        // Let changes accumulate for a while, so that a burst of errors across many tasks is
+        // published a few times rather than once per log chunk.
+        return timer.afterDelay(100 * kj::MILLISECONDS);
+      }).then([this, &dirtySet, &timer, client, homeUri]() mutable {
+        return updateLoop(dirtySet, timer, kj::mv(client), homeUri);
       });
     } else {
       return kj::READY_NOW;
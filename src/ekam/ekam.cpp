@@ -15,6 +15,7 @@
 // limitations under the License.
 
 #include <string>
+#include <unordered_set>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
@@ -30,115 +31,290 @@
 
 #include "Driver.h"
 #include "base/Debug.h"
+#include "base/Trace.h"
 #include "os/DiskFile.h"
+#include "os/HashCache.h"
 #include "Action.h"
 #include "SimpleDashboard.h"
 #include "ConsoleDashboard.h"
 #include "CppActionFactory.h"
+#include "PchActionFactory.h"
+#include "ExtractTypeActionFactory.h"
 #include "ExecPluginActionFactory.h"
+#include "MetricsServer.h"
+#include "BuildServer.h"
+#include "SourceScanner.h"
+#include "FileHasher.h"
+#include "Installer.h"
 #include "os/OsHandle.h"
+#include "os/ThreadPool.h"
 
 namespace ekam {
 
-class ExtractTypeAction : public Action {
+// Passes on the files that editors connected through the network dashboard have open.
+class DriverFocusListener : public Dashboard::FocusListener {
 public:
-  ExtractTypeAction(File* file) : file(file->clone()) {}
-  ~ExtractTypeAction() {}
+  DriverFocusListener(Driver* driver) : driver(driver) {}
+  ~DriverFocusListener() {}
 
-  // implements Action -------------------------------------------------------------------
-  bool isSilent() { return true; }
-  std::string getVerb() { return "scan"; }
-
-  Promise<void> start(EventManager* eventManager, BuildContext* context) {
-    std::vector<Tag> tags;
-
-    std::string name = file->canonicalName();
-
-    tags.push_back(Tag::fromName("canonical:" + name));
-
-    while (true) {
-      tags.push_back(Tag::fromFile(name));
-
-      std::string::size_type slashPos = name.find_first_of('/');
-      if (slashPos == std::string::npos) {
-        break;
-      }
-
-      name.erase(0, slashPos + 1);
-    }
-
-    if (file->isDirectory()) {
-      tags.push_back(Tag::fromName("directory:*"));
-    } else {
-      std::string base, ext;
-      splitExtension(name, &base, &ext);
-      if (!ext.empty()) tags.push_back(Tag::fromName("filetype:" + ext));
-    }
-
-    context->provide(file.get(), tags);
-
-    return newFulfilledPromise();
+  // implements FocusListener -----------------------------------------------------------
+  void setFocus(const std::vector<std::string>& canonicalNames) {
+    driver->setFocus(canonicalNames);
   }
 
 private:
-  OwnedPtr<File> file;
+  Driver* driver;
 };
 
-class ExtractTypeActionFactory : public ActionFactory {
+class BuildMetrics : public MetricsServer::Source {
 public:
-  ExtractTypeActionFactory() {}
-  ~ExtractTypeActionFactory() {}
-
-  // implements ActionFactory ------------------------------------------------------------
-  void enumerateTriggerTags(std::back_insert_iterator<std::vector<Tag> > iter) {
-    *iter++ = Tag::DEFAULT_TAG;
-  }
-  OwnedPtr<Action> tryMakeAction(const Tag& id, File* file) {
-    return newOwned<ExtractTypeAction>(file);
+  BuildMetrics(Driver* driver, ExecPluginActionFactory* plugins)
+      : driver(driver), plugins(plugins) {}
+  ~BuildMetrics() {}
+
+  // implements Source -------------------------------------------------------------------
+  void writeMetrics(std::string* out) {
+    Driver::Stats stats = driver->getStats();
+    MetricsServer::writeGauge(out, "ekam_pending_actions",
+        "Actions waiting to run, including those waiting for resources.", stats.pendingActions);
+    MetricsServer::writeGauge(out, "ekam_active_actions",
+        "Actions currently running.", stats.activeActions);
+    MetricsServer::writeGauge(out, "ekam_completed_actions",
+        "Actions which have completed and not been reset since.", stats.completedActions);
+    MetricsServer::writeGauge(out, "ekam_failed_actions",
+        "Completed actions which failed.", stats.failedActions);
+    MetricsServer::writeCounter(out, "ekam_actions_started_total",
+        "Actions started.", stats.actionsStarted);
+    MetricsServer::writeCounter(out, "ekam_action_resets_total",
+        "Actions reset because their inputs changed.", stats.actionsReset);
+    MetricsServer::writeCounter(out, "ekam_inputs_prefetched_total",
+        "Files read ahead for actions about to run (see -f).", stats.inputsPrefetched);
+    MetricsServer::writeHistogram(out, "ekam_rebuild_actions",
+        "Actions started by each rebuild, from becoming busy until next idle.",
+        Driver::Stats::REBUILD_BUCKET_BOUNDS, stats.rebuildBuckets,
+        Driver::Stats::REBUILD_BUCKET_COUNT, stats.rebuildCount, stats.rebuildActions);
+    MetricsServer::writeGauge(out, "ekam_first_failure_seconds",
+        "Time from the start of the latest rebuild with a failure until its first failure.",
+        stats.firstFailureSeconds);
+    MetricsServer::writeCounter(out, "ekam_rule_round_trips_total",
+        "Requests made by rules, including those intercepted from their subprocesses.",
+        plugins->getRoundTripCount());
+    MetricsServer::writeGauge(out, "ekam_tag_table_size",
+        "Entries in the Driver's tag table.", stats.tagTableSize);
+    MetricsServer::writeGauge(out, "ekam_dependency_table_size",
+        "Entries in the Driver's dependency table.", stats.dependencyTableSize);
   }
+
+private:
+  Driver* driver;
+  ExecPluginActionFactory* plugins;
 };
 
 void usage(const char* command, FILE* out) {
   fprintf(out,
-    "usage: %s [-hvc] [-j <jobcount>] [-n [<addr>]:<port>] [-l <count>]\n"
+    "usage: %s [-hvcfru] [-j <jobcount>] [-n [<addr>]:<port>] [-l <count>]\n"
+    "          [-m <size>] [-o <size>] [-s <dir>] [-d <millis>]\n"
+    "          [-t [<verb>=]<seconds>] [-T [<verb>=]<seconds>] [-p <file>]\n"
+    "          [-M [<addr>]:<port>] [-x <file>] [-w <jobcount>:<launcher>]\n"
+    "          [-g <file>]\n"
     "\n"
     "Build code with Ekam. See https://github.io/sandstorm-io/ekam for details.\n"
     "\n"
     "options:\n"
     "  -c            Run in continuous mode: when there is nothing left to build,\n"
     "                don't exit, but instead watch the source files for changes\n"
-    "                and rebuild as necessary.\n"
+    "                and rebuild as necessary.  Running ekam again in the same\n"
+    "                directory then waits for the continuous build, printing\n"
+    "                its output, instead of building on its own.\n"
+    "  -d <millis>   In continuous mode, wait until source files have stopped\n"
+    "                changing for <millis> milliseconds (default 50) before\n"
+    "                starting to rebuild.\n"
+    "  -f            Prefetch inputs: before running an action whose inputs\n"
+    "                changed, have the kernel start reading the files it used\n"
+    "                last time, so that builds with a cold disk cache don't\n"
+    "                wait on each read in turn.\n"
+    "  -g <file>     Build only what's needed to produce <file> (a path under\n"
+    "                tmp, e.g. `foo/bar-test`), as learned from previous runs.\n"
+    "                If that doesn't produce it, or there were no previous runs,\n"
+    "                everything is built.\n"
     "  -j <jobcount> Run up to <jobcount> actions in parallel.\n"
+    "  -m <size>     Don't start actions whose declared memory usage would push\n"
+    "                the total over <size> (with optional K, M, or G suffix).\n"
+    "                Rules declare their usage with the `resources` command.\n"
+    "  -M [<addr>]:<port>  Serve metrics for Prometheus over HTTP on the\n"
+    "                given address/port: queue depth, running actions, counts\n"
+    "                of actions started and reset, rebuild sizes, requests\n"
+    "                from rules, table sizes and memory usage.\n"
     "  -n [<addr>]:<port>  Accept network connections on the given address/port\n"
     "                and give real-time build status and logs to anyone who\n"
     "                connects. This enables e.g. `ekam-client` and various IDE\n"
     "                plugins.\n"
+    "  -p <file>     Write a profile of the build to <file>, in Chrome's trace\n"
+    "                format (open with chrome://tracing or ui.perfetto.dev).\n"
+    "                Shows when each action was queued and ran, and how long\n"
+    "                Ekam's own bookkeeping took.\n"
+    "  -r            Rebuild everything.  By default, results of actions from\n"
+    "                previous runs are reused if their inputs haven't changed.\n"
+    "  -s <dir>      Share action results through the given directory, which\n"
+    "                would typically be on a network filesystem mounted by all\n"
+    "                developer and CI machines.  Results are fetched from it\n"
+    "                when they aren't cached locally, and uploaded to it after\n"
+    "                actions complete.\n"
+    "  -t [<verb>=]<seconds>  Fail actions which run longer than <seconds>,\n"
+    "                killing their processes.  With <verb>, applies only to\n"
+    "                actions with that verb, e.g. `-t test=300`.  May be\n"
+    "                repeated.\n"
+    "  -T [<verb>=]<seconds>  Like -t, but limits the CPU time of each process\n"
+    "                an action starts.  Rules which would otherwise stay running\n"
+    "                as workers are started afresh for each action instead, so\n"
+    "                that the limit applies to that action alone.\n"
+    "  -u            Wait for events using io_uring rather than epoll, if the\n"
+    "                kernel supports it.\n"
+    "  -w <jobcount>:<launcher>  When all -j slots are busy, run up to\n"
+    "                <jobcount> more links at once on other machines, by\n"
+    "                prefixing their commands with <launcher> (split at\n"
+    "                spaces), e.g. `-w 32:farm-run --pool=build`.  The\n"
+    "                launcher must run its arguments on a worker which sees\n"
+    "                this directory at the same path.\n"
+    "  -x <file>     Explain rebuilds: whenever the build goes idle, write to\n"
+    "                <file> the tree of actions reset by each source change,\n"
+    "                and what caused each reset, along with the source files\n"
+    "                ranked by the run time of everything that depends on them.\n"
     "  -l <count>    Set max number of log lines to display per action. This is\n"
     "                kept relatively short by default because it makes the build\n"
     "                output noisy, but you may need to increase it if you need\n"
     "                to see more of a particular error log. NOTE: If you just\n"
     "                need a one-off, you can use `ekam-client` rather than\n"
     "                restarting Ekam.\n"
+    "  -o <size>     Keep at most <size> (default 1M) of each action's output\n"
+    "                for display.  The rest is written to a file in tmp, named\n"
+    "                after the action's input and verb.  0 means no limit.\n"
     "  -h            See this help\n"
-    "  -v            Show debug logs.\n",
+    "  -v            Show debug logs.\n"
+    "\n"
+    "On SIGUSR1, Ekam writes its most recent internal trace events (epoll and\n"
+    "inotify activity, processes started and exited) to tmp/.ekam-trace.\n",
     command);
 }
 
+// Parses "[<verb>=]<seconds>".
+bool parseTimeout(const char* text, std::pair<std::string, double>* result) {
+  const char* equals = strchr(text, '=');
+  const char* number = equals == nullptr ? text : equals + 1;
+  char* endptr;
+  double seconds = strtod(number, &endptr);
+  if (endptr == number || *endptr != '\0' || seconds < 0) {
+    return false;
+  }
+  result->first = equals == nullptr ? std::string() : std::string(text, equals);
+  result->second = seconds;
+  return true;
+}
+
+// Parses a byte count with optional K, M, or G suffix.
+bool parseSize(const char* text, uint64_t* result) {
+  char* endptr;
+  double size = strtod(text, &endptr);
+  switch (*endptr) {
+    case 'k': case 'K': size *= 1ull << 10; ++endptr; break;
+    case 'm': case 'M': size *= 1ull << 20; ++endptr; break;
+    case 'g': case 'G': size *= 1ull << 30; ++endptr; break;
+    default: break;
+  }
+  if (endptr == text || *endptr != '\0' || size < 0) {
+    return false;
+  }
+  *result = size;
+  return true;
+}
+
 // =======================================================================================
 // TODO:  Move file-watching code to another module.
 
+// Sits between the watchers and the Driver, collecting source changes into batches.  A batch
+// ends once no further changes have arrived for the quiet period, so that e.g. a branch
+// switch touching thousands of files applies all of its resets before any action starts.
+//
+// While the initial SourceScanner runs, also remembers which files the watchers reported, so
+// that the scanner's possibly older results for them are dropped.
+class SourceChangeBatcher : public SourceScanner::Listener {
+public:
+  SourceChangeBatcher(EventManager* eventManager, Driver* driver, int quietMillis)
+      : eventManager(eventManager), driver(driver), quietMillis(quietMillis), inBatch(false),
+        scanning(true) {}
+
+  void addSourceFile(File* file) {
+    changed(file);
+    driver->addSourceFile(file);
+  }
+
+  void removeSourceFile(File* file) {
+    changed(file);
+    driver->removeSourceFile(file);
+  }
+
+  // implements Listener -----------------------------------------------------------------
+  bool shouldAdd(File* file) {
+    return changedDuringScan.count(file->canonicalName()) == 0;
+  }
+  void scanFinished() {
+    scanning = false;
+    changedDuringScan.clear();
+  }
+
+private:
+  EventManager* eventManager;
+  Driver* driver;
+  int quietMillis;
+  bool inBatch;
+  Promise<void> flushOp;
+
+  bool scanning;
+  std::unordered_set<std::string> changedDuringScan;  // canonical names
+
+  void changed(File* file) {
+    if (scanning) {
+      changedDuringScan.insert(file->canonicalName());
+    }
+    changed();
+  }
+
+  void changed() {
+    if (!inBatch) {
+      inBatch = true;
+      driver->beginBatch();
+    }
+
+    if (quietMillis > 0) {
+      // Replacing the timeout pushes the end of the batch back.
+      flushOp = eventManager->when(eventManager->onTimeout(quietMillis))(
+        [this](Void) { flush(); });
+    } else if (flushOp == nullptr) {
+      // Still coalesce whatever arrives in the same turn of the event loop.
+      flushOp = eventManager->when()([this]() { flush(); });
+    }
+  }
+
+  void flush() {
+    flushOp.release();
+    inBatch = false;
+    driver->endBatch();
+  }
+};
+
 class Watcher {
 public:
-  Watcher(OwnedPtr<File> file, EventManager* eventManager, Driver* driver,
+  Watcher(OwnedPtr<File> file, EventManager* eventManager, SourceChangeBatcher* changes,
           bool isDirectory)
-      : eventManager(eventManager), driver(driver), isDirectory(isDirectory), file(file.release()) {
+      : eventManager(eventManager), changes(changes), isDirectory(isDirectory),
+        file(file.release()) {
     resetWatch();
   }
 
   virtual ~Watcher() {}
 
   EventManager* const eventManager;
-  Driver* const driver;
+  SourceChangeBatcher* const changes;
   const bool isDirectory;
   OwnedPtr<File> file;
 
@@ -172,6 +348,10 @@ public:
     return asyncOp == nullptr;
   }
 
+  bool takeChangedEntries(std::vector<std::string>* names) {
+    return watcher->takeChangedEntries(names);
+  }
+
   virtual void created() = 0;
   virtual void modified() = 0;
   virtual void deleted() = 0;
@@ -185,8 +365,8 @@ private:
 
 class FileWatcher : public Watcher {
 public:
-  FileWatcher(OwnedPtr<File> file, EventManager* eventManager, Driver* driver)
-      : Watcher(file.release(), eventManager, driver, false) {}
+  FileWatcher(OwnedPtr<File> file, EventManager* eventManager, SourceChangeBatcher* changes)
+      : Watcher(file.release(), eventManager, changes, false) {}
   ~FileWatcher() {}
 
   // implements FileChangeCallback -------------------------------------------------------
@@ -197,7 +377,7 @@ public:
   void modified() {
     DEBUG_INFO << "Source file modified: " << file->canonicalName();
 
-    driver->addSourceFile(file.get());
+    changes->addSourceFile(file.get());
   }
   void deleted() {
     if (file->isFile()) {
@@ -215,89 +395,70 @@ public:
     DEBUG_INFO << "Source file deleted: " << file->canonicalName();
 
     clearWatch();
-    driver->removeSourceFile(file.get());
+    changes->removeSourceFile(file.get());
   }
 };
 
 class DirectoryWatcher : public Watcher {
   typedef OwnedPtrMap<File*, Watcher, File::HashFunc, File::EqualFunc> ChildMap;
 public:
-  DirectoryWatcher(OwnedPtr<File> file, EventManager* eventManager, Driver* driver)
-      : Watcher(file.release(), eventManager, driver, true) {}
+  DirectoryWatcher(OwnedPtr<File> file, EventManager* eventManager,
+                   SourceChangeBatcher* changes)
+      : Watcher(file.release(), eventManager, changes, true), listed(false) {}
   ~DirectoryWatcher() {}
 
   // implements FileChangeCallback -------------------------------------------------------
   void created() {
-    driver->addSourceFile(file.get());
+    changes->addSourceFile(file.get());
     modified();
   }
+
+  // Watches everything currently in the directory without reporting it to the Driver, for when
+  // a SourceScanner does that instead.
+  void watchExisting() {
+    relist(true);
+  }
+
   void modified() {
     DEBUG_INFO << "Directory modified: " << file->canonicalName();
 
-    OwnedPtrVector<File> list;
-    try {
-      file->list(list.appender());
-    } catch (OsError& e) {
-      // Probably the directory has been deleted but we weren't yet notified.
-      reallyDeleted();
+    // Usually the event manager can tell us which entries changed, saving a relisting of the
+    // whole directory (and a stat() of every entry) on each change.
+    std::vector<std::string> names;
+    if (!takeChangedEntries(&names) || !listed) {
+      relist(false);
+      changes->addSourceFile(file.get());
       return;
     }
 
-    ChildMap newChildren;
-
-    // Build new child list, copying over child watchers where possible.
-    for (int i = 0; i < list.size(); i++) {
-      OwnedPtr<File> childFile = list.release(i);
+    bool entriesChanged = false;
+    for (size_t i = 0; i < names.size(); i++) {
+      if (names[i].empty() || names[i][0] == '.') {
+        continue;  // File::list() skips hidden files too.
+      }
 
+      OwnedPtr<File> childFile = file->relative(names[i]);
       OwnedPtr<Watcher> child;
-      bool childIsDirectory = childFile->isDirectory();
-
-      // When a file is deleted and replaced with a new one of the same type, we run into a lot
-      // of awkward race conditions.  There are three things that can happen in any order:
-      // 1) Notification of file deletion.
-      // 2) Notification of directory change.
-      // 3) New file is created.
-      //
-      // Here is how we handle each possible ordering:
-      // 1, 2, 3)  File will not show up in directory list, so we won't transfer the watcher or
-      //   create a new one.  It will be destroyed.
-      // 1, 3, 2)  child->isDeleted will be true so we'll create a new watcher to replace it.
-      // 2, 1, 3)  Like 1, 2, 3 except we directly call deleted() on the old child watcher from
-      //   this function (see below).  We actually never receive the file deletion event from
-      //   the EventManager in this case.
-      // 2, 3, 1)  Same as 2, 1, 3.
-      // 3, 1, 2)  File watcher notices new file already exists and simply resumes watching.
-      //   Parent watcher thinks nothing happened.
-      // 3, 2, 1)  Same as 3, 1, 2.
-      //
-      // The last two are different if a file was replaced with a directory or vice versa:
-      // 3, 1, 2)  Child watcher notices replacement is a different type and so does not resume
-      //   watching.  The parent notices child->isDeleted is true and replaces it.
-      // 3, 2, 1)  The parent notices that child->isDirectory does not match the type of the new
-      //   file, and so deletes the child watcher explicitly.
-      if (!children.release(childFile.get(), &child) ||
-          child->isDeleted() || child->isDirectory != childIsDirectory) {
-        if (childIsDirectory) {
-          child = newOwned<DirectoryWatcher>(childFile.release(), eventManager, driver);
-        } else {
-          child = newOwned<FileWatcher>(childFile.release(), eventManager, driver);
+      children.release(childFile.get(), &child);
+
+      if (childFile->exists()) {
+        if (child == nullptr || child->isDeleted()) {
+          entriesChanged = true;
         }
-        child->created();
+        child = watcherFor(childFile.release(), child.release(), false);
+        File* key = child->file.get();  // cannot inline due to undefined evaluation order
+        children.add(key, child.release());
+      } else if (child != nullptr && !child->isDeleted()) {
+        entriesChanged = true;
+        child->reallyDeleted();
       }
-
-      File* key = child->file.get();  // cannot inline due to undefined evaluation order
-      newChildren.add(key, child.release());
     }
 
-    // Make sure remaining children have been notified of deletion before we destroy the objects.
-    for (ChildMap::Iterator iter(children); iter.next();) {
-      if (!iter.value()->isDeleted()) {
-        iter.value()->reallyDeleted();
-      }
+    if (entriesChanged) {
+      // The directory's hash covers its listing, so anything that looked at the listing (like
+      // the rules triggered on directories) reruns.
+      changes->addSourceFile(file.get());
     }
-
-    // Swap in new children.
-    children.swap(&newChildren);
   }
 
   void deleted() {
@@ -305,7 +466,8 @@ public:
       // A new directory was created in place of the old.  Reset the watch.
       DEBUG_INFO << "Directory replaced: " << file->canonicalName();
       resetWatch();
-      modified();
+      relist(false);
+      changes->addSourceFile(file.get());
     } else {
       reallyDeleted();
     }
@@ -316,7 +478,7 @@ public:
     DEBUG_INFO << "Directory deleted: " << file->canonicalName();
 
     clearWatch();
-    driver->removeSourceFile(file.get());
+    changes->removeSourceFile(file.get());
 
     // Delete all children.
     for (ChildMap::Iterator iter(children); iter.next();) {
@@ -328,7 +490,92 @@ public:
   }
 
 private:
+  // If quiet, new children aren't reported; see watchExisting().
+  void relist(bool quiet) {
+    OwnedPtrVector<File> list;
+    try {
+      file->list(list.appender());
+    } catch (OsError& e) {
+      // Probably the directory has been deleted but we weren't yet notified.
+      reallyDeleted();
+      return;
+    }
+
+    ChildMap newChildren;
+
+    // Build new child list, copying over child watchers where possible.
+    for (int i = 0; i < list.size(); i++) {
+      OwnedPtr<File> childFile = list.release(i);
+
+      OwnedPtr<Watcher> child;
+      children.release(childFile.get(), &child);
+      child = watcherFor(childFile.release(), child.release(), quiet);
+
+      File* key = child->file.get();  // cannot inline due to undefined evaluation order
+      newChildren.add(key, child.release());
+    }
+
+    // Make sure remaining children have been notified of deletion before we destroy the objects.
+    for (ChildMap::Iterator iter(children); iter.next();) {
+      if (!iter.value()->isDeleted()) {
+        iter.value()->reallyDeleted();
+      }
+    }
+
+    // Swap in new children.
+    children.swap(&newChildren);
+    listed = true;
+  }
+
+  // Returns the watcher to keep for childFile, which exists:  existing, if it is still watching a
+  // file of the right type, or else a new watcher.
+  OwnedPtr<Watcher> watcherFor(OwnedPtr<File> childFile, OwnedPtr<Watcher> existing,
+                               bool quiet) {
+    bool childIsDirectory = childFile->isDirectory();
+
+    // When a file is deleted and replaced with a new one of the same type, we run into a lot
+    // of awkward race conditions.  There are three things that can happen in any order:
+    // 1) Notification of file deletion.
+    // 2) Notification of directory change.
+    // 3) New file is created.
+    //
+    // Here is how we handle each possible ordering:
+    // 1, 2, 3)  File will not show up in directory list, so we won't transfer the watcher or
+    //   create a new one.  It will be destroyed.
+    // 1, 3, 2)  child->isDeleted will be true so we'll create a new watcher to replace it.
+    // 2, 1, 3)  Like 1, 2, 3 except we directly call deleted() on the old child watcher from
+    //   relist() or modified().  We actually never receive the file deletion event from
+    //   the EventManager in this case.
+    // 2, 3, 1)  Same as 2, 1, 3.
+    // 3, 1, 2)  File watcher notices new file already exists and simply resumes watching.
+    //   Parent watcher thinks nothing happened.
+    // 3, 2, 1)  Same as 3, 1, 2.
+    //
+    // The last two are different if a file was replaced with a directory or vice versa:
+    // 3, 1, 2)  Child watcher notices replacement is a different type and so does not resume
+    //   watching.  The parent notices child->isDeleted is true and replaces it.
+    // 3, 2, 1)  The parent notices that child->isDirectory does not match the type of the new
+    //   file, and so deletes the child watcher explicitly.
+    if (existing == nullptr ||
+        existing->isDeleted() || existing->isDirectory != childIsDirectory) {
+      if (childIsDirectory) {
+        auto directory = newOwned<DirectoryWatcher>(childFile.release(), eventManager, changes);
+        if (quiet) {
+          directory->watchExisting();
+        }
+        existing = directory.release();
+      } else {
+        existing = newOwned<FileWatcher>(childFile.release(), eventManager, changes);
+      }
+      if (!quiet) {
+        existing->created();
+      }
+    }
+    return existing;
+  }
+
   ChildMap children;
+  bool listed;  // False until the first relist(); until then, changed entries aren't enough.
 };
 
 // =======================================================================================
@@ -411,29 +658,7 @@ private:
 
 // =======================================================================================
 
-void scanSourceTree(File* src, Driver* driver) {
-  OwnedPtrVector<File> fileQueue;
-
-  {
-    fileQueue.add(src->clone());
-  }
-
-  while (!fileQueue.empty()) {
-    OwnedPtr<File> current = fileQueue.releaseBack();
-
-    if (current->isDirectory()) {
-      OwnedPtrVector<File> list;
-      current->list(list.appender());
-      for (int i = 0; i < list.size(); i++) {
-        fileQueue.add(list.release(i));
-      }
-    }
-
-    driver->addSourceFile(current.get());
-  }
-}
-
-OwnedPtr<Dashboard> getDashboard(int maxDisplayedLogLines) {
+OwnedPtr<Dashboard> getDashboard(int maxDisplayedLogLines, EventManager* eventManager) {
   if (!isatty(STDOUT_FILENO)) {
     return newOwned<SimpleDashboard>(stdout);
   }
@@ -458,7 +683,7 @@ OwnedPtr<Dashboard> getDashboard(int maxDisplayedLogLines) {
       << "falling back to simple output.";
     return newOwned<SimpleDashboard>(stdout);
   }
-  return newOwned<ConsoleDashboard>(stdout, maxDisplayedLogLines);
+  return newOwned<ConsoleDashboard>(stdout, maxDisplayedLogLines, eventManager);
 }
 
 int main(int argc, char* argv[]) {
@@ -467,11 +692,26 @@ int main(int argc, char* argv[]) {
   int maxDisplayedLogLines = 30;
   const char* command = argv[0];
   int maxConcurrentActions = 1;
+  uint64_t memoryBudget = 0;
+  uint64_t logLimit = 1ull << 20;
   bool continuous = false;
+  int quietMillis = 50;
+  bool useActionCache = true;
+  bool useIoUring = false;
+  bool prefetch = false;
+  std::string sharedCacheDir;
   std::string networkDashboardAddress;
+  std::vector<std::pair<std::string, double>> timeouts;
+  std::vector<std::pair<std::string, double>> cpuTimeouts;
+  std::string tracePath;
+  std::string metricsAddress;
+  std::string explainPath;
+  int remoteSlots = 0;
+  std::string remoteLauncher;
+  std::string goal;
 
   while (true) {
-    int opt = getopt(argc, argv, "chvj:n:l:");
+    int opt = getopt(argc, argv, "chvfruj:m:n:l:o:p:s:d:t:T:M:x:w:g:");
     if (opt == -1) break;
 
     switch (opt) {
@@ -487,12 +727,77 @@ int main(int argc, char* argv[]) {
         }
         break;
       }
+      case 'm':
+        if (!parseSize(optarg, &memoryBudget)) {
+          fprintf(stderr, "Expected size after -m.\n");
+          return 1;
+        }
+        break;
+      case 'o':
+        if (!parseSize(optarg, &logLimit)) {
+          fprintf(stderr, "Expected size after -o.\n");
+          return 1;
+        }
+        break;
+      case 't':
+      case 'T': {
+        std::pair<std::string, double> timeout;
+        if (!parseTimeout(optarg, &timeout)) {
+          fprintf(stderr, "Expected [<verb>=]<seconds> after -%c.\n", opt);
+          return 1;
+        }
+        (opt == 't' ? timeouts : cpuTimeouts).push_back(timeout);
+        break;
+      }
       case 'h':
         usage(command, stdout);
         return 0;
       case 'c':
         continuous = true;
         break;
+      case 'd': {
+        char* endptr;
+        quietMillis = strtoul(optarg, &endptr, 10);
+        if (*endptr != '\0') {
+          fprintf(stderr, "Expected number after -d.\n");
+          return 1;
+        }
+        break;
+      }
+      case 'r':
+        useActionCache = false;
+        break;
+      case 'u':
+        useIoUring = true;
+        break;
+      case 'f':
+        prefetch = true;
+        break;
+      case 's':
+        sharedCacheDir = optarg;
+        break;
+      case 'p':
+        tracePath = optarg;
+        break;
+      case 'M':
+        metricsAddress = optarg;
+        break;
+      case 'x':
+        explainPath = optarg;
+        break;
+      case 'w': {
+        char* endptr;
+        remoteSlots = strtoul(optarg, &endptr, 10);
+        if (endptr == optarg || *endptr != ':' || endptr[1] == '\0') {
+          fprintf(stderr, "Expected <jobcount>:<launcher> after -w.\n");
+          return 1;
+        }
+        remoteLauncher = endptr + 1;
+        break;
+      }
+      case 'g':
+        goal = optarg;
+        break;
       case 'n':
         networkDashboardAddress = optarg;
         break;
@@ -536,6 +841,10 @@ int main(int argc, char* argv[]) {
       fprintf(stderr, "ERROR: Ekam is already running in this directory.\n");
       return 1;
     } else {
+      bool passed;
+      if (BuildServer::request("tmp/.ekam-socket", goal, &passed)) {
+        return passed ? 0 : 1;
+      }
       fprintf(stderr, "Another Ekam is already running in this directory.\n"
                       "Waiting for build to complete...\n");
       locks.waitForOther();
@@ -543,16 +852,92 @@ int main(int argc, char* argv[]) {
     }
   }
 
-  OwnedPtr<RunnableEventManager> eventManager = newPreferredEventManager();
+  Trace::dumpOnSignal(SIGUSR1, "tmp/.ekam-trace");
+
+  OwnedPtr<RunnableEventManager> eventManager = newPreferredEventManager(useIoUring);
 
-  OwnedPtr<Dashboard> dashboard = getDashboard(maxDisplayedLogLines);
+  OwnedPtr<Dashboard> dashboard = getDashboard(maxDisplayedLogLines, eventManager.get());
   if (!networkDashboardAddress.empty()) {
     dashboard = initNetworkDashboard(eventManager.get(), networkDashboardAddress,
                                      dashboard.release());
   }
+  BuildServer* buildServer = nullptr;
+  if (continuous) {
+    auto server = newOwned<BuildServer>(eventManager.get(),
+                                        "tmp/.ekam-socket",
+                                        dashboard.release());
+    buildServer = server.get();
+    dashboard = server.release();
+  }
+
+  OwnedPtr<ArtifactStore> sharedCache;
+  if (!sharedCacheDir.empty()) {
+    sharedCache = newOwned<DirectoryArtifactStore>(sharedCacheDir);
+  }
+
+  OwnedPtr<ActionCache> actionCache;
+  if (useActionCache) {
+    actionCache = newOwned<ActionCache>(tmp.relative(".ekam-action-cache").get(),
+                                        sharedCache.get());
+  }
+
+  OwnedPtr<BuildTrace> trace;
+  if (!tracePath.empty()) {
+    trace = newOwned<BuildTrace>(tracePath);
+  }
+
+  OwnedPtr<ResetExplainer> explainer;
+  if (!explainPath.empty()) {
+    explainer = newOwned<ResetExplainer>(explainPath);
+  }
+
+  ActionHistory history(tmp.relative(".ekam-history").get());
+  ActionGraph graph(tmp.relative(".ekam-graph").get());
+  HashCache hashCache(tmp.relative(".ekam-hash-cache").get());
+  DiskFile::setHashCache(&hashCache);
+
+  // Must outlive the Driver, since the rule factories owned by the Driver's actions return
+  // their workers to it.
+  ExecPluginActionFactory execPluginActionFactory;
+
+  // Likewise, since the Driver's actions may be waiting on it.
+  ThreadPool threadPool(eventManager.get(), maxConcurrentActions);
+  FileHasher fileHasher(&threadPool);
+  Installer installer(&threadPool);
 
   Driver driver(eventManager.get(), dashboard.get(), &tmp, installDirs, maxConcurrentActions,
-                &locks);
+                &locks, actionCache.get(), &history);
+  driver.setMemoryBudget(memoryBudget);
+  driver.setLogLimit(logLimit);
+  driver.setRemoteLauncher(remoteSlots, remoteLauncher);
+  driver.setPrefetch(prefetch);
+  driver.setFileHasher(&fileHasher);
+  driver.setInstaller(&installer);
+  for (size_t i = 0; i < timeouts.size(); i++) {
+    driver.setTimeout(timeouts[i].first, timeouts[i].second);
+  }
+  for (size_t i = 0; i < cpuTimeouts.size(); i++) {
+    driver.setCpuTimeout(cpuTimeouts[i].first, cpuTimeouts[i].second);
+  }
+  driver.setHashCache(&hashCache);
+  driver.setTrace(trace.get());
+  driver.setExplainer(explainer.get());
+  driver.setActionGraph(&graph);
+  if (buildServer != nullptr) {
+    buildServer->setDriver(&driver);
+  }
+  if (!goal.empty() && !driver.setGoal(goal)) {
+    fprintf(stderr, "Don't know what %s needs yet; building everything.\n", goal.c_str());
+  }
+
+  DriverFocusListener focusListener(&driver);
+  dashboard->setFocusListener(&focusListener);
+
+  BuildMetrics buildMetrics(&driver, &execPluginActionFactory);
+  OwnedPtr<MetricsServer> metricsServer;
+  if (!metricsAddress.empty()) {
+    metricsServer = newOwned<MetricsServer>(eventManager.get(), metricsAddress, &buildMetrics);
+  }
 
   ExtractTypeActionFactory extractTypeActionFactcory;
   driver.addActionFactory(&extractTypeActionFactcory);
@@ -560,17 +945,27 @@ int main(int argc, char* argv[]) {
   CppActionFactory cppActionFactory;
   driver.addActionFactory(&cppActionFactory);
 
-  ExecPluginActionFactory execPluginActionFactory;
+  PchActionFactory pchActionFactory;
+  driver.addActionFactory(&pchActionFactory);
+
   driver.addActionFactory(&execPluginActionFactory);
 
+  OwnedPtr<SourceChangeBatcher> changes;
+  OwnedPtr<SourceScanner> scanner;
   OwnedPtr<DirectoryWatcher> rootWatcher;
   if (continuous) {
-    rootWatcher = newOwned<DirectoryWatcher>(src.clone(), eventManager.get(), &driver);
-    rootWatcher->modified();
-  } else {
-    scanSourceTree(&src, &driver);
-  }
+    // Watch first, so that nothing changed while scanning is missed.  The scanner then hashes
+    // the tree on many threads (mostly hitting hashCache, after a restart), where the watchers
+    // would have hashed one file at a time on the event loop.
+    changes = newOwned<SourceChangeBatcher>(eventManager.get(), &driver, quietMillis);
+    rootWatcher = newOwned<DirectoryWatcher>(src.clone(), eventManager.get(), changes.get());
+    rootWatcher->watchExisting();
+  }
+  scanner = newOwned<SourceScanner>(eventManager.get(), &driver, maxConcurrentActions);
+  scanner->setListener(changes.get());
+  scanner->scan(&src);
   eventManager->loop();
+  execPluginActionFactory.shutDownWorkers();
 
   // For debugging purposes, check for zombie processes.
   int zombieCount = 0;
@@ -172,6 +172,7 @@ static FILE* ekam_call_stream;
 static FILE* ekam_return_stream;
 
 static char current_dir[PATH_MAX + 1];
+static size_t current_dir_length = 0;  /* including the trailing '/' */
 
 static pthread_once_t init_once_control = PTHREAD_ONCE_INIT;
 
@@ -214,6 +215,9 @@ static void init_bypass_interceptor() {
   }
 }
 
+static void load_preload_manifest();
+static void load_bypass_dirs();
+
 static void init_streams_once() {
   static bool initialized = false;
   if (__atomic_exchange_n(&initialized, true, __ATOMIC_RELEASE)) {
@@ -250,7 +254,10 @@ static void init_streams_once() {
     abort();
   }
   strcat(current_dir, "/");
+  current_dir_length = strlen(current_dir);
 
+  load_bypass_dirs();
+  load_preload_manifest();
 }
 
 static void init_streams() {
@@ -264,40 +271,206 @@ static void init_streams() {
 
 typedef enum usage {
   READ,
-  WRITE
+  WRITE,
+  TAG_LOOKUP  /* Only used as a cache key, for tags loaded from the preload manifest. */
 } usage_t;
 
 static const char TAG_PROVIDER_PREFIX[] = "/ekam-provider/";
-static const char TMP[] = "/tmp";
-static const char VAR_TMP[] = "/var/tmp";
-static const char TMP_PREFIX[] = "/tmp/";
-static const char VAR_TMP_PREFIX[] = "/var/tmp/";
-static const char PROC_PREFIX[] = "/proc/";
-
-static usage_t last_usage = READ;
-static char last_path[PATH_MAX] = "";
-static char last_result[PATH_MAX] = "";
+
+/* A directory, with its trailing '/'. */
+typedef struct prefix {
+  const char* path;
+  size_t length;
+} prefix_t;
+
+#define PREFIX(path) { path, sizeof(path) - 1 }
+static const prefix_t temporary_dirs[] = {
+  PREFIX("/tmp/"),
+  PREFIX("/var/tmp/"),
+  PREFIX("/proc/"),
+#if defined(__linux__)
+  PREFIX("/run/user/"),  /* systemd's $XDG_RUNTIME_DIR */
+#endif
+};
+#undef PREFIX
+
+/* Parsed from $EKAM_REMAP_BYPASS_DIRS by init_streams_once(), rather than on every call. */
+static prefix_t* bypass_dirs = NULL;
+static size_t bypass_dir_count = 0;
+
+/* Results of previous remappings, so that repeated probes of the same path (e.g. a compiler
+ * searching each include directory for every header) don't each need a round trip to Ekam.  A
+ * chained hash table keyed by (path, usage).  Negative results are cached too, since most
+ * include-path probes fail. */
+
+#define CACHE_BUCKET_COUNT 4096
+#define CACHE_MAX_ENTRIES 65536
+
+typedef struct cache_entry {
+  struct cache_entry* next;
+  usage_t usage;
+  bool found;          /* If false, the file doesn't exist and result is empty. */
+  bool used;           /* For TAG_LOOKUP, whether anything asked for it. */
+  const char* result;  /* Points into the same allocation, after path. */
+  char path[];
+} cache_entry_t;
+
+static cache_entry_t* cache_buckets[CACHE_BUCKET_COUNT];
+static int cache_entry_count = 0;
 pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+static size_t cache_bucket_for(const char* path, usage_t usage) {
+  /* FNV-1a. */
+  size_t hash = 2166136261u;
+  for (; *path != '\0'; ++path) {
+    hash = (hash ^ (unsigned char) *path) * 16777619u;
+  }
+  return (hash ^ usage) % CACHE_BUCKET_COUNT;
+}
+
+/* Must be called with cache_mutex held. */
+static cache_entry_t* cache_find_locked(const char* path, usage_t usage) {
+  cache_entry_t* entry;
+  for (entry = cache_buckets[cache_bucket_for(path, usage)]; entry != NULL; entry = entry->next) {
+    if (entry->usage == usage && strcmp(entry->path, path) == 0) {
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+/* Must be called with cache_mutex held. */
+static void cache_erase_locked(const char* path, usage_t usage) {
+  cache_entry_t** link = &cache_buckets[cache_bucket_for(path, usage)];
+  while (*link != NULL) {
+    cache_entry_t* entry = *link;
+    if (entry->usage == usage && strcmp(entry->path, path) == 0) {
+      *link = entry->next;
+      free(entry);
+      --cache_entry_count;
+      return;
+    }
+    link = &entry->next;
+  }
+}
+
+/* output is NULL if the file was not found. */
 static void cache_result(const char* input, const char* output, usage_t usage) {
+  size_t input_size = strlen(input) + 1;
+  size_t output_size = output == NULL ? 1 : strlen(output) + 1;
+  cache_entry_t* entry;
+
   dynamic_pthread_mutex_lock(&cache_mutex);
-  last_usage = usage;
-  strcpy(last_path, input);
-  strcpy(last_result, output);
+
+  if (usage == WRITE) {
+    /* Once a file has been written, reading it should find the new version. */
+    cache_erase_locked(input, READ);
+  }
+
+  if (cache_entry_count < CACHE_MAX_ENTRIES && cache_find_locked(input, usage) == NULL) {
+    entry = (cache_entry_t*) malloc(sizeof(cache_entry_t) + input_size + output_size);
+    if (entry != NULL) {
+      size_t bucket = cache_bucket_for(input, usage);
+      char* result = entry->path + input_size;
+      memcpy(entry->path, input, input_size);
+      if (output == NULL) {
+        *result = '\0';
+      } else {
+        memcpy(result, output, output_size);
+      }
+      entry->result = result;
+      entry->usage = usage;
+      entry->found = output != NULL;
+      entry->used = false;
+      entry->next = cache_buckets[bucket];
+      cache_buckets[bucket] = entry;
+      ++cache_entry_count;
+    }
+  }
+
   dynamic_pthread_mutex_unlock(&cache_mutex);
 }
 
+/* Returns 1 and fills in buffer if a result is cached, -1 if the file is cached as not found,
+ * or 0 if nothing is cached. */
 static int get_cached_result(const char* pathname, char* buffer, usage_t usage) {
   int result = 0;
+  cache_entry_t* entry;
   dynamic_pthread_mutex_lock(&cache_mutex);
-  if (usage == last_usage && strcmp(pathname, last_path) == 0) {
-    strcpy(buffer, last_result);
-    result = 1;
+  entry = cache_find_locked(pathname, usage);
+  if (entry != NULL) {
+    /* Remembered for report_preload_hits(). */
+    entry->used = true;
+    if (entry->found) {
+      strcpy(buffer, entry->result);
+      result = 1;
+    } else {
+      result = -1;
+    }
   }
   dynamic_pthread_mutex_unlock(&cache_mutex);
   return result;
 }
 
+typedef int real_open_t(const char * pathname, int flags, ...);
+
+/* Loads the manifest named by $EKAM_PRELOAD_MANIFEST, if any, into the cache.  Ekam writes this
+ * before starting the action, listing "<tag>\t<path>" for each tag the previous run of the
+ * action looked up (with an empty path if not found), so that those lookups need no round trip
+ * at all. */
+static void load_preload_manifest() {
+  const char* manifest_path = getenv("EKAM_PRELOAD_MANIFEST");
+  real_open_t* real_open;
+  int fd;
+  char* content = NULL;
+  size_t size = 0;
+  size_t capacity = 0;
+  char* line;
+
+  if (manifest_path == NULL || *manifest_path == '\0') return;
+
+  /* Must not call our own open(), which would recurse into initialization. */
+  real_open = (real_open_t*) dlsym(RTLD_NEXT, "open");
+  if (real_open == NULL) return;
+  fd = real_open(manifest_path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return;
+
+  for (;;) {
+    ssize_t n;
+    if (capacity - size < 4096) {
+      char* new_content;
+      capacity = capacity * 2 + 4096;
+      new_content = (char*) realloc(content, capacity + 1);
+      if (new_content == NULL) break;
+      content = new_content;
+    }
+    n = read(fd, content + size, capacity - size);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;
+    size += n;
+  }
+  close(fd);
+
+  if (content == NULL) return;
+  content[size] = '\0';
+
+  for (line = content; *line != '\0';) {
+    char* eol = strchr(line, '\n');
+    char* tab;
+    if (eol == NULL) break;  /* Truncated. */
+    *eol = '\0';
+
+    tab = strchr(line, '\t');
+    if (tab != NULL && eol - line < PATH_MAX) {
+      *tab = '\0';
+      cache_result(line, tab[1] == '\0' ? NULL : tab + 1, TAG_LOOKUP);
+    }
+    line = eol + 1;
+  }
+
+  free(content);
+}
+
 static void canonicalizePath(char* path) {
   /* Preconditions:
    * - path has already been determined to be relative, perhaps because the pointer actually points
@@ -390,54 +563,73 @@ static bool path_has_prefix(const char* pathname, const char* prefix, size_t pre
   return false;
 }
 
+static void load_bypass_dirs() {
+  const char* list = getenv("EKAM_REMAP_BYPASS_DIRS");
+  const char* pos;
+  size_t capacity = 1;
+
+  if (list == NULL || *list == '\0') return;
+
+  for (pos = list; *pos != '\0'; pos++) {
+    if (*pos == ':') ++capacity;
+  }
+  bypass_dirs = (prefix_t*) malloc(capacity * sizeof(prefix_t));
+  if (bypass_dirs == NULL) return;
+
+  for (pos = list; pos != NULL; ) {
+    const char* separator_location = strchr(pos, ':');
+    size_t length = separator_location ? (size_t) (separator_location - pos) : strlen(pos);
+
+    if (length == 0 || pos[0] != '/') {
+      fprintf(stderr, "Bypass directory '%.*s' isn't an absolute path. Skipping.\n",
+              (int) length, pos);
+    } else if (pos[length - 1] != '/') {
+      fprintf(stderr, "Bypass directory '%.*s' doesn't end in trailing '/'. Skipping.\n",
+              (int) length, pos);
+    } else if (length > 1 && length <= PATH_MAX) {
+      char* path = (char*) malloc(length + 1);
+      if (path != NULL) {
+        memcpy(path, pos, length);
+        path[length] = '\0';
+        bypass_dirs[bypass_dir_count].path = path;
+        bypass_dirs[bypass_dir_count].length = length;
+        ++bypass_dir_count;
+      }
+    }
+
+    pos = separator_location ? separator_location + 1 : NULL;
+  }
+}
+
 static bool bypass_remap(const char *pathname) {
   int debug = EKAM_DEBUG;
+  size_t i;
 
   if (pathname[0] != '/') {
     // Only absolute paths are allowed to bypass the remap.
     return false;
   }
 
-  const char* bypass_dirs = getenv("EKAM_REMAP_BYPASS_DIRS");
-  if (bypass_dirs == NULL) {
-    return false;
-  }
-
-  bool found = false;
-
-  while (bypass_dirs && *bypass_dirs) {
-    char* separator_location = strchr(bypass_dirs, ':');
-    size_t bypass_dir_length;
-    if (separator_location) {
-      bypass_dir_length = separator_location - bypass_dirs;
-    } else {
-      bypass_dir_length = strlen(bypass_dirs);
-    }
-
-    if (bypass_dirs[0] != '/') {
-      fprintf(stderr, "Bypass directory '%s' isn't an absolute path. Skipping.\n", bypass_dirs);
-    } else if (bypass_dirs[bypass_dir_length - 1] != '/') {
-      fprintf(stderr, "Bypass directory '%s' doesn't end in trailing '/'. Skipping.\n", bypass_dirs);
-    } else if (path_has_prefix(pathname, bypass_dirs, bypass_dir_length)) {
+  for (i = 0; i < bypass_dir_count; i++) {
+    if (path_has_prefix(pathname, bypass_dirs[i].path, bypass_dirs[i].length)) {
       if (debug) {
         fprintf(stderr, "Bypass found for %s\n", pathname);
       }
-      found = true;
-      break;
-    }
-
-    if (separator_location) {
-      bypass_dirs = separator_location + 1;
-    } else {
-      bypass_dirs = NULL;
+      return true;
     }
   }
 
-  return found;
+  return false;
 }
 
 static bool is_temporary_dir(const char *pathname) {
-  size_t cwd_len = strlen(current_dir) - 1;
+  size_t cwd_len = current_dir_length - 1;
+  size_t i;
+
+  if (pathname[0] != '/') {
+    return false;
+  }
+
   if (strncmp(pathname, current_dir, cwd_len) == 0
       && (pathname[cwd_len] == '/' || pathname[cwd_len] == '\0')) {
     // Somewhere under our working directory. If our working directory happens
@@ -447,23 +639,11 @@ static bool is_temporary_dir(const char *pathname) {
     return false;
   }
 
-  // TODO(soon): Simplify the logic to use `path_has_prefix`.
-  if (strcmp(pathname, TMP) == 0 ||
-      strcmp(pathname, VAR_TMP) == 0 ||
-      strncmp(pathname, TMP_PREFIX, strlen(TMP_PREFIX)) == 0 ||
-      strncmp(pathname, VAR_TMP_PREFIX, strlen(VAR_TMP_PREFIX)) == 0 ||
-      strncmp(pathname, PROC_PREFIX, strlen(PROC_PREFIX)) == 0) {
-    return true;
-  }
-
-#if defined(__linux__)
-#define SYSTEMD_TMPDIR_PREFIX "/run/user/"
-  if (path_has_prefix(pathname, SYSTEMD_TMPDIR_PREFIX, strlen(SYSTEMD_TMPDIR_PREFIX))) {
-    return true;
+  for (i = 0; i < sizeof(temporary_dirs) / sizeof(temporary_dirs[0]); i++) {
+    if (path_has_prefix(pathname, temporary_dirs[i].path, temporary_dirs[i].length)) {
+      return true;
+    }
   }
-#else
-  (void) pathname;
-#endif
 
   return false;
 }
@@ -471,6 +651,12 @@ static bool is_temporary_dir(const char *pathname) {
 static const char* remap_file(const char* syscall_name, const char* pathname,
                               char* buffer, usage_t usage) {
   char* pos;
+  const char* command;
+  int is_tag;
+  /* Results are cached under the canonical name rather than |pathname|, since the same file can
+   * be spelled many ways.  In-tree paths are prefixed with "./", which neither tags nor absolute
+   * paths can start with. */
+  char cache_key[PATH_MAX + 2];
   int debug = EKAM_DEBUG;
 
   /* Ad-hoc debugging can be accomplished by setting debug = 1 when a particular file pattern
@@ -495,13 +681,6 @@ static const char* remap_file(const char* syscall_name, const char* pathname,
     return NULL;
   }
 
-  if (get_cached_result(pathname, buffer, usage)) {
-    if (debug) fprintf(stderr, "  cached: %s\n", buffer);
-    return buffer;
-  }
-
-  flockfile(ekam_call_stream);
-
   if (strncmp(pathname, TAG_PROVIDER_PREFIX, strlen(TAG_PROVIDER_PREFIX)) == 0) {
     /* A tag reference.  Construct the tag name in |buffer|. */
     strcpy(buffer, pathname + strlen(TAG_PROVIDER_PREFIX));
@@ -513,7 +692,6 @@ static const char* remap_file(const char* syscall_name, const char* pathname,
       if (pos == NULL) {
         /* This appears to be a tag type without a name, so it should look like a directory.
          * We can use the current directory.  TODO:  Return some fake empty directory instead. */
-        funlockfile(ekam_call_stream);
         strcpy(buffer, ".");
         if (debug) fprintf(stderr, "  is directory\n");
         return buffer;
@@ -523,44 +701,46 @@ static const char* remap_file(const char* syscall_name, const char* pathname,
 
       if (strcmp(buffer, "canonical:.") == 0) {
         /* HACK:  Don't try to remap top directory. */
-        funlockfile(ekam_call_stream);
         if (debug) fprintf(stderr, "  current directory\n");
         return "src";
       }
     }
 
-    /* Ask ekam to remap the file name. */
-    fputs(usage == READ ? "findProvider " : "newProvider ", ekam_call_stream);
-    fputs(buffer, ekam_call_stream);
-    fputs("\n", ekam_call_stream);
+    is_tag = 1;
+    strcpy(cache_key, buffer);
+    command = usage == READ ? "findProvider " : "newProvider ";
   } else if (is_temporary_dir(pathname)) {
     /* Temp file or /proc.  Ignore. */
-    funlockfile(ekam_call_stream);
     if (debug) fprintf(stderr, "  temp file: %s\n", pathname);
     return pathname;
   } else if (bypass_remap(pathname)) {
-    funlockfile(ekam_call_stream);
     if (debug) fprintf(stderr, "  bypassed file: %s\n", pathname);
     return pathname;
   } else {
-    if (strncmp(pathname, current_dir, strlen(current_dir)) == 0 &&
-        strncmp(pathname + strlen(current_dir), "deps/", 5) != 0) {
+    if (strncmp(pathname, current_dir, current_dir_length) == 0 &&
+        strncmp(pathname + current_dir_length, "deps/", 5) != 0) {
       /* The app is trying to open files in the current directory by absolute path.  Treat it
        * exactly as if it had used a relative path.  We make a special exception for the directory
        * `deps`, to allow e.g. executing binaries found there without mapping them into the
        * common source tree. */
-      pathname = pathname + strlen(current_dir);
+      pathname = pathname + current_dir_length;
     } else if (pathname[0] == '/' ||
                strncmp(pathname, "deps/", 5) == 0) {
       /* Absolute path or under `deps`.  Note the access but don't remap. */
       if (usage == WRITE) {
         /* Cannot write to absolute paths. */
-        funlockfile(ekam_call_stream);
         errno = EACCES;
         if (debug) fprintf(stderr, "  absolute path, can't write\n");
         return NULL;
       }
 
+      if (get_cached_result(pathname, buffer, usage) == 1) {
+        /* Already noted. */
+        if (debug) fprintf(stderr, "  cached absolute path: %s\n", pathname);
+        return pathname;
+      }
+
+      flockfile(ekam_call_stream);
       fputs("noteInput ", ekam_call_stream);
       fputs(pathname, ekam_call_stream);
       fputs("\n", ekam_call_stream);
@@ -570,6 +750,7 @@ static const char* remap_file(const char* syscall_name, const char* pathname,
         fprintf(stderr, "error: Ekam call stream broken.\n");
         abort();
       }
+      /* Only ever cached as found:  whether the file exists is up to the real syscall. */
       cache_result(pathname, pathname, usage);
       funlockfile(ekam_call_stream);
       if (debug) fprintf(stderr, "  absolute path: %s\n", pathname);
@@ -581,17 +762,52 @@ static const char* remap_file(const char* syscall_name, const char* pathname,
     canonicalizePath(buffer);
     if (strcmp(buffer, ".") == 0) {
       /* HACK:  Don't try to remap current directory. */
-      funlockfile(ekam_call_stream);
       if (debug) fprintf(stderr, "  current directory\n");
       return ".";
-    } else {
-      /* Ask ekam to remap the file name. */
-      fputs(usage == READ ? "findInput " : "newOutput ", ekam_call_stream);
-      fputs(buffer, ekam_call_stream);
-      fputs("\n", ekam_call_stream);
     }
+
+    is_tag = 0;
+    cache_key[0] = '.';
+    cache_key[1] = '/';
+    strcpy(cache_key + 2, buffer);
+    command = usage == READ ? "findInput " : "newOutput ";
+  }
+
+  /* On a miss, get_cached_result() leaves |buffer| alone. */
+  switch (get_cached_result(cache_key, buffer, usage)) {
+    case 1:
+      if (debug) fprintf(stderr, "  cached: %s\n", buffer);
+      return buffer;
+    case -1:
+      if (debug) fprintf(stderr, "  cached: no such file\n");
+      errno = ENOENT;
+      return NULL;
+    default:
+      break;
   }
 
+  if (is_tag && usage == READ) {
+    /* Maybe Ekam already told us the answer. */
+    switch (get_cached_result(cache_key, buffer, TAG_LOOKUP)) {
+      case 1:
+        cache_result(cache_key, buffer, usage);
+        if (debug) fprintf(stderr, "  preloaded: %s\n", buffer);
+        return buffer;
+      case -1:
+        cache_result(cache_key, NULL, usage);
+        if (debug) fprintf(stderr, "  preloaded: no such file\n");
+        errno = ENOENT;
+        return NULL;
+      default:
+        break;
+    }
+  }
+
+  /* Ask ekam to remap the file name. */
+  flockfile(ekam_call_stream);
+  fputs(command, ekam_call_stream);
+  fputs(buffer, ekam_call_stream);
+  fputs("\n", ekam_call_stream);
   fflush(ekam_call_stream);
   if (ferror_unlocked(ekam_call_stream)) {
     funlockfile(ekam_call_stream);
@@ -624,17 +840,126 @@ static const char* remap_file(const char* syscall_name, const char* pathname,
 
   if (*buffer == '\0') {
     /* Not found. */
+    cache_result(cache_key, NULL, usage);
     errno = ENOENT;
     if (debug) fprintf(stderr, "  ekam says no such file\n");
     return NULL;
   }
 
-  cache_result(pathname, buffer, usage);
+  cache_result(cache_key, buffer, usage);
 
   if (debug) fprintf(stderr, "  remapped to: %s\n", buffer);
   return buffer;
 }
 
+/* Largest frame report_preload_hits() sends, so that each is a single atomic pipe write. */
+#define REPORT_FRAME_LIMIT 4096
+
+static void put_frame_int(char* output, size_t value) {
+  int i;
+  for (i = 0; i < 4; i++) {
+    output[i] = (char) ((value >> (i * 8)) & 0xff);
+  }
+}
+
+/* Sends the commands in frame[5..size) as one frame (see "framing" in Ekam's README) and reads
+ * and discards the reply.  Returns false if the streams are broken. */
+static bool send_frame(char* frame, size_t size) {
+  unsigned char header[5];
+  size_t remaining;
+  char discard[256];
+
+  frame[0] = '\0';
+  put_frame_int(frame + 1, size - 5);
+  if (fwrite(frame, 1, size, ekam_call_stream) != size || fflush(ekam_call_stream) != 0) {
+    return false;
+  }
+
+  if (fread(header, 1, 5, ekam_return_stream) != 5 || header[0] != '\0') return false;
+  remaining = header[1] | (header[2] << 8) | (header[3] << 16) | ((size_t) header[4] << 24);
+  while (remaining > 0) {
+    size_t n = remaining < sizeof(discard) ? remaining : sizeof(discard);
+    if (fread(discard, 1, n, ekam_return_stream) != n) return false;
+    remaining -= n;
+  }
+  return true;
+}
+
+/* Before exiting, asks Ekam again for every tag that was answered from the preload manifest, so
+ * that Ekam can tell which entries this run actually used.  All the lookups go in frames of
+ * many commands each, so this costs a round trip per few dozen tags rather than one per tag. */
+static void __attribute__((destructor)) report_preload_hits() {
+  char frame[REPORT_FRAME_LIMIT];
+  size_t size = 5;
+  char reply[8];
+  size_t i;
+  cache_entry_t* entry;
+  char** tags = NULL;
+  size_t tag_count = 0;
+  size_t tag_capacity = 0;
+
+  if (ekam_call_stream == NULL) return;
+
+  /* Copy the tags out first, so as not to hold cache_mutex while talking to Ekam. */
+  dynamic_pthread_mutex_lock(&cache_mutex);
+  for (i = 0; i < CACHE_BUCKET_COUNT; i++) {
+    for (entry = cache_buckets[i]; entry != NULL; entry = entry->next) {
+      if (entry->usage == TAG_LOOKUP && entry->used) {
+        if (tag_count == tag_capacity) {
+          char** new_tags;
+          tag_capacity = tag_capacity * 2 + 64;
+          new_tags = (char**) realloc(tags, tag_capacity * sizeof(char*));
+          if (new_tags == NULL) break;
+          tags = new_tags;
+        }
+        tags[tag_count++] = entry->path;
+      }
+    }
+  }
+  dynamic_pthread_mutex_unlock(&cache_mutex);
+
+  if (tag_count == 0) {
+    free(tags);
+    return;
+  }
+
+  /* Errors are ignored from here on:  the program is exiting anyway, and if it closed the
+   * streams, the worst that happens is that Ekam asks this action's next run about tags it
+   * would have preloaded. */
+  flockfile(ekam_call_stream);
+  flockfile(ekam_return_stream);
+
+  fputs("framing binary\n", ekam_call_stream);
+  if (fflush(ekam_call_stream) != 0 ||
+      fgets(reply, sizeof(reply), ekam_return_stream) == NULL || strcmp(reply, "ok\n") != 0) {
+    goto done;
+  }
+
+  for (i = 0; i < tag_count; i++) {
+    static const char COMMAND[] = "findProvider ";
+    size_t tag_size = strlen(tags[i]);
+    size_t command_size = sizeof(COMMAND) - 1 + tag_size;
+    if (5 + 4 + command_size > sizeof(frame)) continue;  /* Can't be sent; never mind. */
+
+    if (size + 4 + command_size > sizeof(frame)) {
+      if (!send_frame(frame, size)) goto done;
+      size = 5;
+    }
+    put_frame_int(frame + size, command_size);
+    memcpy(frame + size + 4, COMMAND, sizeof(COMMAND) - 1);
+    memcpy(frame + size + 4 + sizeof(COMMAND) - 1, tags[i], tag_size);
+    size += 4 + command_size;
+  }
+  if (size > 5) {
+    send_frame(frame, size);
+  }
+
+done:
+  funlockfile(ekam_return_stream);
+  funlockfile(ekam_call_stream);
+  free(tags);
+}
+
 /****************************************************************************************/
 
 #define WRAP(RETURNTYPE, NAME, PARAMTYPES, PARAMS, USAGE, ERROR_RESULT)     \
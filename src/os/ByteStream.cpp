@@ -56,6 +56,10 @@ size_t ByteStream::write(const void* buffer, size_t size) {
   return WRAP_SYSCALL(write, handle, buffer, size);
 }
 
+size_t ByteStream::writev(const struct iovec* iov, int count) {
+  return WRAP_SYSCALL(writev, handle, iov, count);
+}
+
 void ByteStream::writeAll(const void* buffer, size_t size) {
   const char* cbuffer = reinterpret_cast<const char*>(buffer);
 
@@ -110,6 +114,14 @@ void Pipe::attachWriteEndForExec(int target) {
   closeWriteEnd();
 }
 
+void Pipe::addReadEndToSpawn(posix_spawn_file_actions_t* actions, int target) {
+  posix_spawn_file_actions_adddup2(actions, fds[0], target);
+}
+
+void Pipe::addWriteEndToSpawn(posix_spawn_file_actions_t* actions, int target) {
+  posix_spawn_file_actions_adddup2(actions, fds[1], target);
+}
+
 void Pipe::closeReadEnd() {
   if (fds[0] != -1) {
     if (close(fds[0]) != 0) {
@@ -19,6 +19,8 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <spawn.h>
 #include <stdexcept>
 
 #include "base/OwnedPtr.h"
@@ -41,7 +43,13 @@ public:
 
   size_t read(void* buffer, size_t size);
   Promise<size_t> readAsync(EventManager* eventManager, void* buffer, size_t size);
+
+  // readAsync() keeps watching the stream with the EventManager it was first given.  Call this
+  // between reads to allow the next readAsync() to use a different one.
+  void releaseWatcher() { watcher.clear(); }
+
   size_t write(const void* buffer, size_t size);
+  size_t writev(const struct iovec* iov, int count);
   void writeAll(const void* buffer, size_t size);
   void stat(struct stat* stats);
 
@@ -62,6 +70,11 @@ public:
   void attachReadEndForExec(int target);
   void attachWriteEndForExec(int target);
 
+  // Like attach*ForExec(), but has posix_spawn() do it in the child.  Both ends are close-on-exec,
+  // so destroy the Pipe once the child is spawned.
+  void addReadEndToSpawn(posix_spawn_file_actions_t* actions, int target);
+  void addWriteEndToSpawn(posix_spawn_file_actions_t* actions, int target);
+
 private:
   int fds[2];
 
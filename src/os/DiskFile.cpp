@@ -25,11 +25,14 @@
 #include <dirent.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <algorithm>
 #include <unordered_map>
+#include <vector>
 
 #include "base/Debug.h"
 #include "os/OsHandle.h"
 #include "os/ByteStream.h"
+#include "os/HashCache.h"
 #include "base/Hash.h"
 
 namespace ekam {
@@ -92,14 +95,42 @@ bool statIfExists(const std::string& path, struct stat* output) {
 
 }  // anonymous namespace
 
-DiskFile::DiskFile(const std::string& path, File* parent) : path(path) {
+DiskFile::Node::Node(const std::string& path, const SmartPtr<Node>& parent)
+    : path(path), parent(parent), hash(std::hash<std::string>()(path)) {
+  if (this->parent == NULL) {
+    canonicalName = ".";
+  } else {
+    if (this->parent->canonicalName != ".") {
+      canonicalName = this->parent->canonicalName;
+      canonicalName.push_back('/');
+    }
+    std::string::size_type slashPos = path.find_last_of('/');
+    canonicalName.append(path, slashPos == std::string::npos ? 0 : slashPos + 1,
+                         std::string::npos);
+  }
+}
+
+DiskFile::DiskFile(const std::string& path, File* parent) {
+  SmartPtr<Node> parentNode;
   if (parent != NULL) {
-    this->parentRef = parent->clone();
+    DiskFile* diskParent = dynamic_cast<DiskFile*>(parent);
+    if (diskParent == NULL) {
+      throw std::invalid_argument("Parent of disk file must be a disk file: " + path);
+    }
+    parentNode = diskParent->node;
   }
+  node.allocate(path, parentNode);
 }
 DiskFile::~DiskFile() {}
 
+OwnedPtr<File> DiskFile::withNode(const SmartPtr<Node>& node) {
+  OwnedPtr<DiskFile> result = newOwned<DiskFile>(*this);
+  result->node = node;
+  return result.release();
+}
+
 std::string DiskFile::basename() {
+  const std::string& path = node->path;
   if (path.empty()) {
     return ".";
   }
@@ -113,46 +144,36 @@ std::string DiskFile::basename() {
 }
 
 std::string DiskFile::canonicalName() {
-  if (parentRef == NULL) {
-    return ".";
-  }
-
-  std::string result = parentRef->canonicalName();
-  if (result == ".") {
-    result.clear();
-  } else {
-    result.push_back('/');
-  }
-  result.append(basename());
-
-  return result;
+  return node->canonicalName;
 }
 
 OwnedPtr<File> DiskFile::clone() {
-  return newOwned<DiskFile>(path, parentRef.get());
+  return newOwned<DiskFile>(*this);
 }
 
 bool DiskFile::hasParent() {
-  return parentRef != NULL;
+  return node->parent != NULL;
 }
 
 OwnedPtr<File> DiskFile::parent() {
-  if (parentRef == NULL) {
+  if (node->parent == NULL) {
     throw std::runtime_error("Tried to get parent of top-level directory: " + canonicalName());
   }
-  return parentRef->clone();
+  return withNode(node->parent);
 }
 
 bool DiskFile::equals(File* other) {
   DiskFile* otherDiskFile = dynamic_cast<DiskFile*>(other);
-  return otherDiskFile != NULL && otherDiskFile->path == path;
+  return otherDiskFile != NULL &&
+      (otherDiskFile->node == node ||
+       (otherDiskFile->node->hash == node->hash && otherDiskFile->node->path == node->path));
 }
 
 size_t DiskFile::identityHash() {
-  return std::hash<std::string>()(path);
+  return node->hash;
 }
 
-class DiskFile::DiskRefImpl : public File::DiskRef {
+class DiskFile::DiskRefImpl : public File::DiskRef, public Pooled {
 public:
   DiskRefImpl(const std::string& path) : pathName(path) {}
   ~DiskRefImpl() {}
@@ -165,51 +186,124 @@ private:
 };
 
 OwnedPtr<File::DiskRef> DiskFile::getOnDisk(Usage usage) {
-  return newOwned<DiskRefImpl>(path);
+  return newOwned<DiskRefImpl>(node->path);
 }
 
 bool DiskFile::exists() {
   struct stat stats;
-  return statIfExists(path.c_str(), &stats) && (S_ISREG(stats.st_mode) || S_ISDIR(stats.st_mode));
+  return statIfExists(node->path.c_str(), &stats) &&
+      (S_ISREG(stats.st_mode) || S_ISDIR(stats.st_mode));
 }
 
 bool DiskFile::isFile() {
   struct stat stats;
-  return statIfExists(path.c_str(), &stats) && S_ISREG(stats.st_mode);
+  return statIfExists(node->path.c_str(), &stats) && S_ISREG(stats.st_mode);
 }
 
 bool DiskFile::isDirectory() {
   struct stat stats;
-  return statIfExists(path.c_str(), &stats) && S_ISDIR(stats.st_mode);
+  return statIfExists(node->path.c_str(), &stats) && S_ISDIR(stats.st_mode);
 }
 
 // File only.
+namespace {
+
+HashCache* hashCache = nullptr;
+
+bool sameStat(const struct stat& a, const struct stat& b) {
+  return a.st_size == b.st_size &&
+      a.st_mtim.tv_sec == b.st_mtim.tv_sec && a.st_mtim.tv_nsec == b.st_mtim.tv_nsec &&
+      a.st_ctim.tv_sec == b.st_ctim.tv_sec && a.st_ctim.tv_nsec == b.st_ctim.tv_nsec;
+}
+
+}  // namespace
+
+void DiskFile::setHashCache(HashCache* cache) {
+  hashCache = cache;
+}
+
 Hash DiskFile::contentHash() {
   try {
+    if (hashCache != nullptr) {
+      // Most files are unchanged since they were last hashed, so check before opening them.
+      struct stat stats;
+      Hash result;
+      if (statIfExists(node->path, &stats) && S_ISREG(stats.st_mode) &&
+          hashCache->lookup(stats, &result)) {
+        return result;
+      }
+    }
+
     Hash::Builder hasher;
-    ByteStream fd(path, O_RDONLY);
+    ByteStream fd(node->path, O_RDONLY);
+
+    struct stat stats;
+    bool cacheable = false;
+    if (hashCache != nullptr) {
+      fd.stat(&stats);
+      cacheable = S_ISREG(stats.st_mode);
+      Hash result;
+      if (cacheable && hashCache->lookup(stats, &result)) {
+        return result;
+      }
+    }
 
-    char buffer[8192];
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd.getHandle()->get(), 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    // Big enough that syscall overhead is small next to hashing.  We don't mmap() because the
+    // file may be truncated under us (e.g. by an editor), which would raise SIGBUS.
+    char buffer[65536];
 
     while (true) {
       size_t n = fd.read(buffer, sizeof(buffer));
       if (n == 0) {
-        return hasher.build();
+        Hash result = hasher.build();
+        if (cacheable) {
+          // Don't cache if the file changed while we were reading it.
+          struct stat after;
+          fd.stat(&after);
+          if (sameStat(stats, after)) {
+            hashCache->put(stats, result);
+          }
+        }
+        return result;
       }
 
       hasher.add(buffer, n);
     }
   } catch (const OsError& e) {
-    if (e.getErrorNumber() == ENOENT || e.getErrorNumber() == EACCES ||
-        e.getErrorNumber() == EISDIR) {
+    if (e.getErrorNumber() == EISDIR) {
+      return listingHash();
+    }
+    if (e.getErrorNumber() == ENOENT || e.getErrorNumber() == EACCES) {
       return Hash::NULL_HASH;
     }
     throw;
   }
 }
 
+Hash DiskFile::listingHash() {
+  std::vector<std::string> names;
+  DirectoryReader reader(node->path);
+  std::string filename;
+  while (reader.next(&filename)) {
+    if (!filename.empty() && filename[0] != '.') {  // as list() does
+      names.push_back(filename);
+    }
+  }
+  std::sort(names.begin(), names.end());
+
+  Hash::Builder hasher;
+  for (size_t i = 0; i < names.size(); i++) {
+    hasher.add(names[i] + '\0');
+  }
+  return hasher.build();
+}
+
 std::string DiskFile::readAll() {
-  ByteStream fd(path, O_RDONLY);
+  ByteStream fd(node->path, O_RDONLY);
 
   struct stat stats;
   fd.stat(&stats);
@@ -236,7 +330,7 @@ std::string DiskFile::readAll() {
 }
 
 void DiskFile::writeAll(const std::string& content) {
-  ByteStream fd(path, O_WRONLY | O_TRUNC | O_CREAT);
+  ByteStream fd(node->path, O_WRONLY | O_TRUNC | O_CREAT);
 
   std::string::size_type pos = 0;
   while (pos < content.size()) {
@@ -245,7 +339,7 @@ void DiskFile::writeAll(const std::string& content) {
 }
 
 void DiskFile::writeAll(const void* data, int size) {
-  ByteStream fd(path, O_WRONLY | O_TRUNC | O_CREAT);
+  ByteStream fd(node->path, O_WRONLY | O_TRUNC | O_CREAT);
 
   const char* pos = reinterpret_cast<const char*>(data);
   while (size > 0) {
@@ -258,11 +352,11 @@ void DiskFile::writeAll(const void* data, int size) {
 // Directory only.
 void DiskFile::list(OwnedPtrVector<File>::Appender output) {
   std::string prefix;
-  if (!path.empty()) {
-    prefix = path + "/";
+  if (!node->path.empty()) {
+    prefix = node->path + "/";
   }
 
-  DirectoryReader reader(path);
+  DirectoryReader reader(node->path);
   std::string filename;
   while (reader.next(&filename)) {
     if (filename.empty()) {
@@ -288,10 +382,10 @@ OwnedPtr<File> DiskFile::relative(const std::string& path) {
       return clone();
     } else if (path == "..") {
       return parent();
-    } else if (this->path.empty()) {
+    } else if (node->path.empty()) {
       return newOwned<DiskFile>(path, this);
     } else {
-      return newOwned<DiskFile>(this->path + "/" + path, this);
+      return newOwned<DiskFile>(node->path + "/" + path, this);
     }
 
   } else {
@@ -308,17 +402,17 @@ OwnedPtr<File> DiskFile::relative(const std::string& path) {
       if (first_part == ".") {
         return relative(rest);
       } else if (first_part == "..") {
-        if (parentRef == NULL) {
+        if (node->parent == NULL) {
           throw std::runtime_error(
               "Tried to get parent of top-level directory: " + canonicalName());
         }
-        return parentRef->relative(rest);
+        return withNode(node->parent)->relative(rest);
       } else {
         OwnedPtr<File> temp;
-        if (this->path.empty()) {
+        if (node->path.empty()) {
           temp = newOwned<DiskFile>(first_part, this);
         } else {
-          temp = newOwned<DiskFile>(this->path + "/" + first_part, this);
+          temp = newOwned<DiskFile>(node->path + "/" + first_part, this);
         }
         return temp->relative(rest);
       }
@@ -328,10 +422,10 @@ OwnedPtr<File> DiskFile::relative(const std::string& path) {
 
 void DiskFile::createDirectory() {
   while (true) {
-    if (mkdir(path.c_str(), 0777) == 0) {
+    if (mkdir(node->path.c_str(), 0777) == 0) {
       return;
     } else if (errno != EINTR) {
-      throw OsError(path, "mkdir", errno);
+      throw OsError(node->path, "mkdir", errno);
     }
   }
 }
@@ -339,14 +433,14 @@ void DiskFile::createDirectory() {
 void DiskFile::link(File* target) {
   DiskFile* diskTarget = dynamic_cast<DiskFile*>(target);
   if (diskTarget == NULL) {
-    throw new std::invalid_argument("Cannot link disk file to non-disk file: " + path);
+    throw new std::invalid_argument("Cannot link disk file to non-disk file: " + node->path);
   }
 
-  WRAP_SYSCALL(link, diskTarget->path.c_str(), path.c_str());
+  WRAP_SYSCALL(link, diskTarget->node->path.c_str(), node->path.c_str());
 }
 
 void DiskFile::unlink() {
-  WRAP_SYSCALL(unlink, path.c_str());
+  WRAP_SYSCALL(unlink, node->path.c_str());
 }
 
 }  // namespace ekam
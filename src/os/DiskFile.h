@@ -20,13 +20,23 @@
 #include "File.h"
 #include <string>
 
+#include "base/OwnedPtr.h"
+#include "base/Pooled.h"
+
 namespace ekam {
 
-class DiskFile: public File {
+class HashCache;
+
+class DiskFile: public File, public Pooled {
 public:
+  // parent, if not null, must be a DiskFile.
   DiskFile(const std::string& path, File* parent);
   ~DiskFile();
 
+  // If set, contentHash() consults and fills this cache.  Must outlive all calls to
+  // contentHash().
+  static void setHashCache(HashCache* cache);
+
   // implements File ---------------------------------------------------------------------
   std::string basename();
   std::string canonicalName();
@@ -43,8 +53,11 @@ public:
   bool isFile();
   bool isDirectory();
 
-  // File only.
+  // For a directory, a hash of the names of its entries, so that it changes when entries are
+  // added or removed.
   Hash contentHash();
+
+  // File only.
   std::string readAll();
   void writeAll(const std::string& content);
   void writeAll(const void* data, int size);
@@ -61,8 +74,27 @@ public:
 private:
   class DiskRefImpl;
 
-  std::string path;
-  OwnedPtr<File> parentRef;
+  // Immutable, and shared by clones and children, so that copying a DiskFile -- which the Driver
+  // does for every provision and dependency -- costs a reference count rather than a copy of the
+  // path of every ancestor.
+  //
+  // SourceScanner's threads create children of directories which the event loop may be copying
+  // at the same time; SmartPtr's count is atomic for this.
+  //
+  // The canonical name and hash are computed up front, since the Driver asks for them far more
+  // often than it creates files.  (Not lazily, since nodes may be shared between threads.)
+  struct Node : public Pooled {
+    Node(const std::string& path, const SmartPtr<Node>& parent);
+
+    std::string path;
+    SmartPtr<Node> parent;  // null for a top-level directory
+    std::string canonicalName;
+    size_t hash;  // of path
+  };
+  SmartPtr<Node> node;
+
+  OwnedPtr<File> withNode(const SmartPtr<Node>& node);
+  Hash listingHash();
 };
 
 }  // namespace ekam
@@ -0,0 +1,84 @@
+// Ekam Build System
+// Author: Kenton Varda (kenton@sandstorm.io)
+// Copyright (c) 2010-2015 Kenton Varda, Google Inc., and contributors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "DiskFile.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace ekam {
+namespace {
+
+#define ASSERT(EXPRESSION)                                                    \
+  if (!(EXPRESSION)) {                                                        \
+    fprintf(stderr, "%s:%d: FAILED: %s\n", __FILE__, __LINE__, #EXPRESSION);  \
+    exit(1);                                                                  \
+  }
+
+// As SourceScanner does:  list a directory on several threads while another keeps copying and
+// dropping references to it.  All children share the directory's node, so this only works if
+// its reference count is thread-safe.
+void testConcurrentList(const std::string& dir) {
+  const int FILE_COUNT = 20;
+  for (int i = 0; i < FILE_COUNT; i++) {
+    std::string command = "touch " + dir + "/file" + std::to_string(i);
+    ASSERT(system(command.c_str()) == 0);
+  }
+
+  DiskFile root(dir, nullptr);
+  OwnedPtr<File> subdir = root.clone();
+
+  std::vector<std::thread> threads;
+  std::vector<int> counts(4, 0);
+  for (size_t i = 0; i < counts.size(); i++) {
+    int* count = &counts[i];
+    threads.push_back(std::thread([&subdir, count]() {
+      for (int j = 0; j < 200; j++) {
+        OwnedPtrVector<File> list;
+        subdir->list(list.appender());
+        *count = list.size();
+      }
+    }));
+  }
+
+  for (int j = 0; j < 20000; j++) {
+    OwnedPtr<File> copy = subdir->clone();
+    OwnedPtr<File> child = copy->relative("file0");
+    ASSERT(child->canonicalName() == "file0");
+  }
+
+  for (size_t i = 0; i < threads.size(); i++) {
+    threads[i].join();
+    ASSERT(counts[i] == FILE_COUNT);
+  }
+}
+
+}  // namespace
+}  // namespace ekam
+
+int main(int argc, char* argv[]) {
+  char dirTemplate[] = "/tmp/ekam-disk-file-test.XXXXXX";
+  ASSERT(mkdtemp(dirTemplate) != nullptr);
+  std::string dir = dirTemplate;
+
+  ekam::testConcurrentList(dir);
+
+  std::string command = "rm -rf " + dir;
+  ASSERT(system(command.c_str()) == 0);
+  return 0;
+}
@@ -25,6 +25,7 @@
 #include <sys/epoll.h>
 #include <sys/signalfd.h>
 #include <sys/inotify.h>
+#include <sys/timerfd.h>
 #include <sys/stat.h>
 #include <algorithm>
 #include <stdexcept>
@@ -34,51 +35,15 @@
 #include <signal.h>
 #include <limits.h>
 
+#include "base/Clock.h"
 #include "base/Debug.h"
 #include "base/Table.h"
+#include "base/Trace.h"
 
 namespace ekam {
 
 namespace {
 
-std::string epollEventsToString(uint32_t events) {
-  std::string result;
-  if (events == 0) {
-    result.append(" (none)");
-  }
-  if (events & EPOLLIN) {
-    result.append(" EPOLLIN");
-  }
-  if (events & EPOLLOUT) {
-    result.append(" EPOLLOUT");
-  }
-  if (events & EPOLLRDHUP) {
-    result.append(" EPOLLRDHUP");
-  }
-  if (events & EPOLLPRI) {
-    result.append(" EPOLLPRI");
-  }
-  if (events & EPOLLERR) {
-    result.append(" EPOLLERR");
-  }
-  if (events & EPOLLHUP) {
-    result.append(" EPOLLHUP");
-  }
-  if (events & EPOLLET) {
-    result.append(" EPOLLET");
-  }
-  if (events & EPOLLONESHOT) {
-    result.append(" EPOLLONESHOT");
-  }
-
-  if (events & ~(EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLPRI | EPOLLERR | EPOLLHUP |
-                 EPOLLET | EPOLLONESHOT)) {
-    result.append(" (others)");
-  }
-
-  return result;
-}
-
 // TODO:  Copied from DiskFile.cpp.  Share code somehow?
 bool statIfExists(const std::string& path, struct stat* output) {
   int result;
@@ -102,9 +67,19 @@ bool isDirectory(const std::string& path) {
 
 }  // namespace
 
-EpollEventManager::Epoller::Epoller()
+const int EpollEventManager::Epoller::MAX_EVENTS;
+
+EpollEventManager::Epoller::Epoller(bool useIoUring)
     : epollHandle("epoll", WRAP_SYSCALL(epoll_create1, (int)EPOLL_CLOEXEC)),
-      watchCount(0) {}
+      watchCount(0), nextToken(1), readyCount(0), readyPos(0) {
+  if (useIoUring) {
+    try {
+      ring = newOwned<IoUring>(MAX_EVENTS);
+    } catch (const OsError& e) {
+      DEBUG_WARNING << "io_uring unavailable; falling back to epoll: " << e.what();
+    }
+  }
+}
 
 EpollEventManager::Epoller::~Epoller() {
   if (watchCount > 0) {
@@ -114,19 +89,25 @@ EpollEventManager::Epoller::~Epoller() {
 
 EpollEventManager::Epoller::Watch::Watch(Epoller* epoller, OsHandle* handle,
                                          uint32_t events, IoHandler* handler)
-    : epoller(epoller), events(0), registeredEvents(0), fd(handle->get()), name(handle->getName()),
-      handler(handler) {
+    : epoller(epoller), events(0), registeredEvents(0), armedToken(0), fd(handle->get()),
+      name(handle->getName()), handler(handler) {
   addEvents(events);
 }
 
 EpollEventManager::Epoller::Watch::Watch(Epoller* epoller, int fd,
                                          uint32_t events, IoHandler* handler)
-    : epoller(epoller), events(0), registeredEvents(0), fd(fd), name(toString(fd)),
+    : epoller(epoller), events(0), registeredEvents(0), armedToken(0), fd(fd), name(toString(fd)),
       handler(handler) {
   addEvents(events);
 }
 
 EpollEventManager::Epoller::Watch::~Watch() {
+  for (int i = epoller->readyPos; i < epoller->readyCount; i++) {
+    if (epoller->readyEvents[i].data.ptr == this) {
+      epoller->readyEvents[i].data.ptr = nullptr;
+    }
+  }
+
   removeEvents(events);
 
   if (epoller->watchesNeedingUpdate.erase(this) > 0) {
@@ -135,41 +116,46 @@ EpollEventManager::Epoller::Watch::~Watch() {
 }
 
 void EpollEventManager::Epoller::Watch::addEvents(uint32_t eventsToAdd) {
-  DEBUG_INFO << "Adding events for " << fd << ":" << epollEventsToString(eventsToAdd);
+  TRACE("add events for fd %d: %x", fd, eventsToAdd);
   uint32_t newEvents = events | eventsToAdd;
   if (newEvents == events) {
     return;
   }
 
   events = newEvents;
-  if (events == registeredEvents) {
-    epoller->watchesNeedingUpdate.erase(this);
-  } else {
+  if (needsUpdate()) {
     epoller->watchesNeedingUpdate.insert(this);
+  } else {
+    epoller->watchesNeedingUpdate.erase(this);
   }
 }
 
 void EpollEventManager::Epoller::Watch::removeEvents(uint32_t eventsToRemove) {
-  DEBUG_INFO << "Removing events for " << fd << ":" << epollEventsToString(eventsToRemove);
+  TRACE("remove events for fd %d: %x", fd, eventsToRemove);
   uint32_t newEvents = events & ~eventsToRemove;
   if (newEvents == events) {
     return;
   }
 
   events = newEvents;
-  if (events == registeredEvents) {
-    epoller->watchesNeedingUpdate.erase(this);
-  } else {
+  if (needsUpdate()) {
     epoller->watchesNeedingUpdate.insert(this);
+  } else {
+    epoller->watchesNeedingUpdate.erase(this);
   }
 }
 
+bool EpollEventManager::Epoller::Watch::needsUpdate() {
+  return events != registeredEvents ||
+      (epoller->ring != nullptr && events != 0 && armedToken == 0);
+}
+
 void EpollEventManager::Epoller::Watch::updateRegistration() {
-  if (registeredEvents == events) {
+  if (!needsUpdate()) {
     DEBUG_ERROR << "Watch does not need updating.";
     return;
   }
-  DEBUG_INFO << "Updating event registrations for " << fd << ":" << epollEventsToString(events);
+  TRACE("update registration for fd %d: %x", fd, events);
 
   int op = EPOLL_CTL_MOD;
   if (registeredEvents == 0) {
@@ -181,6 +167,20 @@ void EpollEventManager::Epoller::Watch::updateRegistration() {
   }
   registeredEvents = events;
 
+  if (epoller->ring != nullptr) {
+    if (armedToken != 0) {
+      epoller->ring->pollRemove(armedToken);
+      epoller->watchesByToken.erase(armedToken);
+      armedToken = 0;
+    }
+    if (events != 0) {
+      armedToken = epoller->nextToken++;
+      epoller->watchesByToken[armedToken] = this;
+      epoller->ring->pollAdd(fd, events, armedToken);
+    }
+    return;
+  }
+
   struct epoll_event event;
   event.events = registeredEvents;
   event.data.ptr = this;
@@ -188,6 +188,25 @@ void EpollEventManager::Epoller::Watch::updateRegistration() {
 }
 
 bool EpollEventManager::Epoller::handleEvent() {
+  while (readyPos < readyCount) {
+    const struct epoll_event& event = readyEvents[readyPos++];
+    Watch* watch = reinterpret_cast<Watch*>(event.data.ptr);
+    if (watch == nullptr || watch->events == 0) {
+      // Watch was destroyed or lost interest since epoll_wait() returned.
+      continue;
+    }
+
+    // Drop events the watch no longer wants; we haven't told epoll yet.
+    uint32_t events = event.events & (watch->events | EPOLLERR | EPOLLHUP);
+    if (events == 0) {
+      continue;
+    }
+
+    TRACE("epoll event: %s: %x", watch->name, events);
+    watch->handler->handle(events);
+    return true;
+  }
+
   // Run pending updates.
   for (Watch* watch : watchesNeedingUpdate) {
     watch->updateRegistration();
@@ -199,21 +218,45 @@ bool EpollEventManager::Epoller::handleEvent() {
     return false;
   }
 
-  DEBUG_INFO << "Waiting for " << watchCount << " events...";
-  struct epoll_event event;
-  int result = WRAP_SYSCALL(epoll_wait, epollHandle, &event, 1, -1);
-  if (result == 0) {
-    throw std::logic_error("epoll_wait() returned zero despite infinite timeout.");
-  } else if (result > 1) {
-    throw std::logic_error("epoll_wait() returned more than one event when only one requested.");
+  TRACE("waiting for %d watches", watchCount);
+  if (ring != nullptr) {
+    waitForCompletions();
+  } else {
+    int result = WRAP_SYSCALL(epoll_wait, epollHandle, &readyEvents[0], MAX_EVENTS, -1);
+    if (result == 0) {
+      throw std::logic_error("epoll_wait() returned zero despite infinite timeout.");
+    }
+    readyCount = result;
   }
+  readyPos = 0;
 
-  Watch* watch = reinterpret_cast<Watch*>(event.data.ptr);
-  DEBUG_INFO << "epoll event: " << watch->name << ":" << epollEventsToString(event.events);
+  // The events will be handled by subsequent calls.
+  return true;
+}
 
-  watch->handler->handle(event.events);
+void EpollEventManager::Epoller::waitForCompletions() {
+  IoUring::Completion completions[MAX_EVENTS];
+  int count = ring->submitAndWait(completions, MAX_EVENTS);
+
+  readyCount = 0;
+  for (int i = 0; i < count; i++) {
+    std::unordered_map<uint64_t, Watch*>::iterator iter =
+        watchesByToken.find(completions[i].userData);
+    if (iter == watchesByToken.end()) {
+      // Poll was removed; this is its cancellation or a race with it.
+      continue;
+    }
+    Watch* watch = iter->second;
+    watchesByToken.erase(iter);
+    watch->armedToken = 0;
+    if (watch->needsUpdate()) {
+      watchesNeedingUpdate.insert(watch);
+    }
 
-  return true;
+    struct epoll_event& event = readyEvents[readyCount++];
+    event.events = completions[i].result < 0 ? EPOLLERR : completions[i].result;
+    event.data.ptr = watch;
+  }
 }
 
 // =============================================================================
@@ -243,7 +286,7 @@ EpollEventManager::SignalHandler::~SignalHandler() {
 }
 
 void EpollEventManager::SignalHandler::handle(uint32_t events) {
-  DEBUG_INFO << "Received signal on signalfd.";
+  TRACE("signalfd readable");
 
   struct signalfd_siginfo signalEvent;
   if (signalStream.read(&signalEvent, sizeof(signalEvent)) != sizeof(signalEvent)) {
@@ -270,7 +313,7 @@ void EpollEventManager::SignalHandler::maybeStopExpecting() {
 
 // =======================================================================================
 
-class EpollEventManager::AsyncCallbackHandler : public PendingRunnable {
+class EpollEventManager::AsyncCallbackHandler : public PendingRunnable, public Pooled {
 public:
   AsyncCallbackHandler(EpollEventManager* eventManager, OwnedPtr<Runnable> runnable)
       : eventManager(eventManager), called(false), runnable(runnable.release()) {
@@ -325,7 +368,7 @@ public:
   }
 
   void handle(int waitStatus) {
-    DEBUG_INFO << "Process " << pid << " exited with status: " << waitStatus;
+    TRACE("process %d exited with status %d", pid, waitStatus);
 
     signalHandler->processExitHandlerMap.erase(pid);
     signalHandler->maybeStopExpecting();
@@ -378,7 +421,7 @@ void EpollEventManager::SignalHandler::handleProcessExit() {
       // onProcessExit() was called or not, but we should warn if we encounter a process for
       // which onProcessExit() was never called so that the code can be fixed.
       DEBUG_ERROR << "Got SIGCHLD for PID we weren't waiting for: " << pid;
-      return;
+      continue;
     }
 
     iter->second->handle(waitStatus);
@@ -420,7 +463,7 @@ public:
   }
 
   Promise<void> onWritable() {
-    if (readFulfiller != nullptr) {
+    if (writeFulfiller != nullptr) {
       throw std::logic_error("Already waiting for writability on this fd.");
     }
     return newPromise<Fulfiller>(&watch, EPOLLOUT, &writeFulfiller);
@@ -505,21 +548,21 @@ public:
     wd = WRAP_SYSCALL(inotify_add_watch, *inotifyHandler->inotifyStream.getHandle(), path.c_str(),
                       IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_DELETE_SELF |
                       IN_MODIFY | IN_MOVE_SELF | IN_MOVED_FROM | IN_MOVED_TO);
-    DEBUG_INFO << "inotify_add_watch(" << path << ") [" << wd << "]";
+    TRACE("inotify_add_watch(%s) [%d]", path, wd);
     inotifyHandler->watchMap[wd] = this;
     inotifyHandler->watchByNameMap[path] = this;
     inotifyHandler->watch.addEvents(EPOLLIN);
   }
 
   ~WatchedDirectory() {
-    DEBUG_INFO << "~WatchedDirectory(): " << path;
+    TRACE("~WatchedDirectory(): %s", path);
 
     if (callbackTable.size() > 0) {
       DEBUG_ERROR << "Deleting WatchedDirectory before all FileWatcherImpls were removed.";
     }
 
     if (wd >= 0) {
-      DEBUG_INFO << "inotify_rm_watch(" << path << ") [" << wd << "]";
+      TRACE("inotify_rm_watch(%s) [%d]", path, wd);
 
       if (WRAP_SYSCALL(inotify_rm_watch, *inotifyHandler->inotifyStream.getHandle(), wd) < 0) {
         DEBUG_ERROR << "inotify_rm_watch(" << path << "): " << strerror(errno);
@@ -530,12 +573,12 @@ public:
   }
 
   void addWatch(const std::string& basename, FileWatcherImpl* op) {
-    DEBUG_INFO << "Watch directory " << path << " now covering: " << basename;
+    TRACE("watch directory %s now covering: %s", path, basename);
     callbackTable.add(basename, op);
   }
 
   void removeWatch(FileWatcherImpl* op) {
-    DEBUG_INFO << "Watch directory " << path << " no longer covering: " << basenameForOp(op);
+    TRACE("watch directory %s no longer covering: %s", path, basenameForOp(op));
     if (callbackTable.erase<CallbackTable::WATCH_OP>(op) == 0) {
       DEBUG_ERROR << "Trying to remove watch that was never added.";
     }
@@ -552,6 +595,10 @@ public:
 
   void handle(struct inotify_event* event);
 
+  // Events were lost (the inotify queue overflowed), so tell every watcher that its file may
+  // have changed, and directory watchers that they must relist.
+  void eventsLost();
+
 private:
   InotifyHandler* inotifyHandler;
   int wd;
@@ -632,6 +679,17 @@ public:
     maybeFulfill();
   }
 
+  void flagEntryChanged(const std::string& name) {
+    changedEntries.push_back(name);
+    flagAsModified();
+  }
+
+  void flagEntriesLost() {
+    entriesLost = true;
+    changedEntries.clear();
+    flagAsModified();
+  }
+
   // implements FileWatcher --------------------------------------------------------------
   Promise<FileChangeType> onChange() {
     if (fulfiller != nullptr) {
@@ -642,6 +700,16 @@ public:
     return result;
   }
 
+  bool takeChangedEntries(std::vector<std::string>* names) {
+    if (entriesLost) {
+      entriesLost = false;
+      return false;
+    }
+    names->swap(changedEntries);
+    changedEntries.clear();
+    return true;
+  }
+
 private:
   class Fulfiller: public PromiseFulfiller<FileChangeType> {
   public:
@@ -681,6 +749,10 @@ private:
   bool deleted;
   Fulfiller* fulfiller;
 
+  // For a directory:  see takeChangedEntries().
+  std::vector<std::string> changedEntries;
+  bool entriesLost = false;
+
   void maybeFulfill() {
     if (fulfiller != nullptr) {
       if (deleted) {
@@ -707,16 +779,7 @@ void EpollEventManager::InotifyHandler::WatchedDirectory::handle(struct inotify_
     basename = event->name;
   }
 
-  DEBUG_INFO << "inotify event on: " << path << "\n  basename: " << basename << "\n  flags:"
-             << ((event->mask & IN_ATTRIB     ) ? " IN_ATTRIB"      : "")
-             << ((event->mask & IN_CLOSE_WRITE) ? " IN_CLOSE_WRITE" : "")
-             << ((event->mask & IN_CREATE     ) ? " IN_CREATE"      : "")
-             << ((event->mask & IN_DELETE     ) ? " IN_DELETE"      : "")
-             << ((event->mask & IN_DELETE_SELF) ? " IN_DELETE_SELF" : "")
-             << ((event->mask & IN_MODIFY     ) ? " IN_MODIFY"      : "")
-             << ((event->mask & IN_MOVE_SELF  ) ? " IN_MOVE_SELF"   : "")
-             << ((event->mask & IN_MOVED_FROM ) ? " IN_MOVED_FROM"  : "")
-             << ((event->mask & IN_MOVED_TO   ) ? " IN_MOVED_TO"    : "");
+  TRACE("inotify event on %s: basename %s, mask %x", path, basename, event->mask);
 
   // Some events implicitly remove the watch descriptor (because the watched directory no longer
   // exists).  Such descriptors are now invalid and may be reused the next time
@@ -731,7 +794,7 @@ void EpollEventManager::InotifyHandler::WatchedDirectory::handle(struct inotify_
   // to inotify_add_watch() typically reuses it).  This appears to be a bug in Linux (observed
   // in 2.6.35-22-generic).  Will file a bug report if I get time to write a demo program.
   if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
-    DEBUG_INFO << "Watch descriptor implicitly removed: " << event->wd;
+    TRACE("watch descriptor implicitly removed: %d", event->wd);
     invalidate();
   }
 
@@ -746,12 +809,23 @@ void EpollEventManager::InotifyHandler::WatchedDirectory::handle(struct inotify_
   }
 
   // If this event is indicating creation or deletion of a file in the directory, then call the
-  // directory's modified() callback as well.
+  // directory's modified() callback as well, saying which entry changed.
   if (!basename.empty() &&
       (event->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO))) {
     for (CallbackTable::SearchIterator<CallbackTable::BASENAME> iter(callbackTable, "");
          iter.next();) {
       FileWatcherImpl* op = iter.cell<CallbackTable::WATCH_OP>();
+      op->flagEntryChanged(basename);
+    }
+  }
+}
+
+void EpollEventManager::InotifyHandler::WatchedDirectory::eventsLost() {
+  for (CallbackTable::RowIterator iter(callbackTable); iter.next();) {
+    FileWatcherImpl* op = iter.cell<CallbackTable::WATCH_OP>();
+    if (iter.cell<CallbackTable::BASENAME>().empty()) {
+      op->flagEntriesLost();
+    } else {
       op->flagAsModified();
     }
   }
@@ -797,17 +871,15 @@ void EpollEventManager::InotifyHandler::handle(uint32_t epollEvents) {
 
     pos += sizeof(struct inotify_event) + event->len;
 
-    DEBUG_INFO << "inotify " << event->wd << ":"
-               << ((event->mask & IN_ATTRIB     ) ? " IN_ATTRIB"      : "")
-               << ((event->mask & IN_CLOSE_WRITE) ? " IN_CLOSE_WRITE" : "")
-               << ((event->mask & IN_CREATE     ) ? " IN_CREATE"      : "")
-               << ((event->mask & IN_DELETE     ) ? " IN_DELETE"      : "")
-               << ((event->mask & IN_DELETE_SELF) ? " IN_DELETE_SELF" : "")
-               << ((event->mask & IN_MODIFY     ) ? " IN_MODIFY"      : "")
-               << ((event->mask & IN_MOVE_SELF  ) ? " IN_MOVE_SELF"   : "")
-               << ((event->mask & IN_MOVED_FROM ) ? " IN_MOVED_FROM"  : "")
-               << ((event->mask & IN_MOVED_TO   ) ? " IN_MOVED_TO"    : "")
-               << ((event->mask & IN_IGNORED    ) ? " IN_IGNORED"     : "");
+    TRACE("inotify %d: mask %x", event->wd, event->mask);
+
+    if (event->mask & IN_Q_OVERFLOW) {
+      DEBUG_ERROR << "inotify queue overflowed; rescanning all watched directories.";
+      for (WatchMap::iterator iter = watchMap.begin(); iter != watchMap.end(); ++iter) {
+        iter->second->eventsLost();
+      }
+      continue;
+    }
 
     WatchMap::iterator iter = watchMap.find(event->wd);
     if (iter == watchMap.end()) {
@@ -831,8 +903,210 @@ OwnedPtr<EventManager::FileWatcher> EpollEventManager::watchFile(const std::stri
 
 // =======================================================================================
 
-EpollEventManager::EpollEventManager()
-  : signalHandler(&epoller), inotifyHandler(&epoller) {}
+class EpollEventManager::TimerHandler::TimeoutFulfiller : public PromiseFulfiller<void> {
+public:
+  TimeoutFulfiller(Callback* callback, TimerHandler* timerHandler, uint64_t milliseconds)
+      : callback(callback), timerHandler(timerHandler), deadline(now() + milliseconds),
+        level(-1), slot(0), prev(nullptr), next(nullptr) {
+    timerHandler->addTimer(this);
+  }
+  ~TimeoutFulfiller() {
+    if (level >= 0) {
+      timerHandler->removeTimer(this);
+    }
+  }
+
+  void fire() {
+    timerHandler->removeTimer(this);
+    callback->fulfill();
+  }
+
+private:
+  friend class TimerHandler;
+
+  Callback* callback;
+  TimerHandler* timerHandler;
+  uint64_t deadline;
+
+  // Position in the wheel; level is -1 when not linked.
+  int level;
+  int slot;
+  TimeoutFulfiller* prev;
+  TimeoutFulfiller* next;
+};
+
+EpollEventManager::TimerHandler::TimerHandler(Epoller* epoller)
+    : timerStream(WRAP_SYSCALL(timerfd_create, CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC),
+                  "timerfd"),
+      watch(epoller, timerStream.getHandle(), 0, this),
+      currentTick(now()), armedTick(UINT64_MAX), timerCount(0), handling(false) {
+  memset(slots, 0, sizeof(slots));
+  memset(occupied, 0, sizeof(occupied));
+}
+
+EpollEventManager::TimerHandler::~TimerHandler() {
+  if (timerCount > 0) {
+    DEBUG_ERROR << "TimerHandler destroyed with timers outstanding.";
+  }
+}
+
+uint64_t EpollEventManager::TimerHandler::now() {
+  return monotonicMillis();
+}
+
+Promise<void> EpollEventManager::TimerHandler::onTimeout(uint64_t milliseconds) {
+  return newPromise<TimeoutFulfiller>(this, milliseconds);
+}
+
+void EpollEventManager::TimerHandler::addTimer(TimeoutFulfiller* timer) {
+  if (timerCount++ == 0) {
+    // Nothing could have fired while idle, so just catch up.
+    currentTick = now();
+    watch.addEvents(EPOLLIN);
+  }
+  timer->deadline = std::max(timer->deadline, currentTick + 1);
+  link(timer);
+  rearm();
+}
+
+void EpollEventManager::TimerHandler::removeTimer(TimeoutFulfiller* timer) {
+  unlink(timer);
+  if (--timerCount == 0) {
+    watch.removeEvents(EPOLLIN);
+  }
+  rearm();
+}
+
+void EpollEventManager::TimerHandler::link(TimeoutFulfiller* timer) {
+  int level = 0;
+  while (level < LEVELS - 1 &&
+         (timer->deadline >> (LEVEL_BITS * (level + 1))) !=
+         (currentTick >> (LEVEL_BITS * (level + 1)))) {
+    ++level;
+  }
+
+  uint64_t index = timer->deadline >> (LEVEL_BITS * level);
+  if (level == LEVELS - 1) {
+    // Beyond the range of the wheel, park it in the farthest slot; it gets re-linked when that
+    // slot comes up.
+    index = std::min(index, (currentTick >> (LEVEL_BITS * level)) + SLOTS - 1);
+  }
+  int slot = index & (SLOTS - 1);
+
+  timer->level = level;
+  timer->slot = slot;
+  timer->prev = nullptr;
+  timer->next = slots[level][slot];
+  if (timer->next != nullptr) {
+    timer->next->prev = timer;
+  }
+  slots[level][slot] = timer;
+  occupied[level] |= uint64_t(1) << slot;
+}
+
+void EpollEventManager::TimerHandler::unlink(TimeoutFulfiller* timer) {
+  if (timer->prev == nullptr) {
+    slots[timer->level][timer->slot] = timer->next;
+    if (timer->next == nullptr) {
+      occupied[timer->level] &= ~(uint64_t(1) << timer->slot);
+    }
+  } else {
+    timer->prev->next = timer->next;
+  }
+  if (timer->next != nullptr) {
+    timer->next->prev = timer->prev;
+  }
+  timer->level = -1;
+  timer->prev = nullptr;
+  timer->next = nullptr;
+}
+
+uint64_t EpollEventManager::TimerHandler::nextTick() {
+  uint64_t result = UINT64_MAX;
+  for (int level = 0; level < LEVELS; level++) {
+    if (occupied[level] == 0) continue;
+
+    // Find the first non-empty slot after the current one, wrapping around.
+    uint64_t current = currentTick >> (LEVEL_BITS * level);
+    int start = (current + 1) & (SLOTS - 1);
+    uint64_t rotated = start == 0 ? occupied[level] :
+        (occupied[level] >> start) | (occupied[level] << (SLOTS - start));
+    uint64_t tick = (current + 1 + __builtin_ctzll(rotated)) << (LEVEL_BITS * level);
+    result = std::min(result, tick);
+  }
+  return result;
+}
+
+void EpollEventManager::TimerHandler::advance(uint64_t tick) {
+  while (true) {
+    uint64_t next = nextTick();
+    if (next > tick) break;
+    currentTick = next;
+
+    // Cascade from the top so that timers can fall through several levels at once.
+    for (int level = LEVELS - 1; level > 0; level--) {
+      if ((currentTick & ((uint64_t(1) << (LEVEL_BITS * level)) - 1)) != 0) continue;
+      TimeoutFulfiller** head = &slots[level][(currentTick >> (LEVEL_BITS * level)) & (SLOTS - 1)];
+      while (*head != nullptr) {
+        TimeoutFulfiller* timer = *head;
+        unlink(timer);
+        link(timer);
+      }
+    }
+
+    // Fire whatever is due.  fire() unlinks the timer, and fulfilling may add or cancel others.
+    TimeoutFulfiller** head = &slots[0][currentTick & (SLOTS - 1)];
+    while (*head != nullptr) {
+      (*head)->fire();
+    }
+  }
+  currentTick = std::max(currentTick, tick);
+}
+
+void EpollEventManager::TimerHandler::rearm() {
+  if (handling) return;
+
+  uint64_t next = nextTick();
+  if (next == armedTick) return;
+  armedTick = next;
+
+  struct itimerspec spec;
+  memset(&spec, 0, sizeof(spec));
+  if (next != UINT64_MAX) {
+    spec.it_value.tv_sec = next / 1000;
+    spec.it_value.tv_nsec = (next % 1000) * 1000000L;
+  }
+  WRAP_SYSCALL(timerfd_settime, *timerStream.getHandle(), TFD_TIMER_ABSTIME, &spec, nullptr);
+}
+
+void EpollEventManager::TimerHandler::handle(uint32_t events) {
+  uint64_t expirations;
+  if (read(timerStream.getHandle()->get(), &expirations, sizeof(expirations)) < 0 &&
+      errno != EAGAIN) {
+    DEBUG_ERROR << "read(timerfd): " << strerror(errno);
+  }
+
+  handling = true;
+  try {
+    advance(now());
+  } catch (...) {
+    handling = false;
+    rearm();
+    throw;
+  }
+  handling = false;
+  rearm();
+}
+
+Promise<void> EpollEventManager::onTimeout(uint64_t milliseconds) {
+  return timerHandler.onTimeout(milliseconds);
+}
+
+// =======================================================================================
+
+EpollEventManager::EpollEventManager(bool useIoUring)
+  : epoller(useIoUring), signalHandler(&epoller), inotifyHandler(&epoller),
+    timerHandler(&epoller) {}
 EpollEventManager::~EpollEventManager() {}
 
 void EpollEventManager::loop() {
@@ -854,8 +1128,8 @@ bool EpollEventManager::handleEvent() {
 
 // =======================================================================================
 
-OwnedPtr<RunnableEventManager> newPreferredEventManager() {
-  return newOwned<EpollEventManager>();
+OwnedPtr<RunnableEventManager> newPreferredEventManager(bool preferIoUring) {
+  return newOwned<EpollEventManager>(preferIoUring);
 }
 
 }  // namespace ekam
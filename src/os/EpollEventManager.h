@@ -18,6 +18,7 @@
 #define KENTONSCODE_OS_EPOLLEVENTMANAGER_H_
 
 #include <sys/types.h>
+#include <sys/epoll.h>
 #include <stdint.h>
 #include <signal.h>
 #include <deque>
@@ -29,6 +30,7 @@
 #include "base/OwnedPtr.h"
 #include "OsHandle.h"
 #include "ByteStream.h"
+#include "IoUring.h"
 
 typedef struct pollfd PollFd;
 
@@ -36,9 +38,14 @@ namespace ekam {
 
 class EpollEventManager : public RunnableEventManager {
 public:
-  EpollEventManager();
+  // If useIoUring is true, waits for events using io_uring rather than epoll_wait(), falling
+  // back to epoll if the kernel doesn't support it.
+  EpollEventManager(bool useIoUring = false);
   ~EpollEventManager();
 
+  // Whether events are actually being waited for with io_uring.
+  bool isUsingIoUring() { return epoller.isUsingIoUring(); }
+
   // implements RunnableEventManager -----------------------------------------------------
   void loop();
 
@@ -49,6 +56,7 @@ public:
   Promise<ProcessExitCode> onProcessExit(pid_t pid);
   OwnedPtr<IoWatcher> watchFd(int fd);
   OwnedPtr<FileWatcher> watchFile(const std::string& filename);
+  Promise<void> onTimeout(uint64_t milliseconds);
 
 private:
   class AsyncCallbackHandler;
@@ -63,10 +71,11 @@ private:
 
   class Epoller {
   public:
-    Epoller();
+    Epoller(bool useIoUring);
     ~Epoller();
 
     bool handleEvent();
+    bool isUsingIoUring() { return ring.get() != nullptr; }
 
     class Watch {
     public:
@@ -84,10 +93,12 @@ private:
       Epoller* epoller;
       uint32_t events;
       uint32_t registeredEvents;
+      uint64_t armedToken;  // io_uring only:  user data of our outstanding poll, or zero.
       int fd;
       std::string name;
       IoHandler* handler;
 
+      bool needsUpdate();
       void updateRegistration();
     };
 
@@ -95,7 +106,26 @@ private:
     OsHandle epollHandle;
     int watchCount;
 
+    // If non-null, we wait on this rather than epollHandle.  io_uring polls are one-shot, so each
+    // Watch is re-armed after every completion.  Completions are matched to Watches by token, so
+    // that those of removed polls are recognized as stale.
+    OwnedPtr<IoUring> ring;
+    uint64_t nextToken;
+    std::unordered_map<uint64_t, Watch*> watchesByToken;
+
     std::unordered_set<Watch*> watchesNeedingUpdate;
+
+    // Events returned by the last epoll_wait() which haven't been handled yet.  We handle one
+    // per call to handleEvent() so that async callbacks still run in between, but only call
+    // epoll_wait() again once all are done.  Entries for Watches destroyed in the meantime are
+    // nulled out.
+    static const int MAX_EVENTS = 64;
+    struct epoll_event readyEvents[MAX_EVENTS];
+    int readyCount;
+    int readyPos;
+
+    // Fills readyEvents from io_uring completions.
+    void waitForCompletions();
   };
 
   class SignalHandler : public IoHandler {
@@ -143,9 +173,55 @@ private:
     WatchByNameMap watchByNameMap;
   };
 
+  class TimerHandler : public IoHandler {
+  public:
+    TimerHandler(Epoller* epoller);
+    ~TimerHandler();
+
+    Promise<void> onTimeout(uint64_t milliseconds);
+
+    // implements IoHandler --------------------------------------------------------------
+    void handle(uint32_t events);
+
+  private:
+    class TimeoutFulfiller;
+
+    // All timers share one timerfd, organized as a hierarchical timer wheel with millisecond
+    // ticks.  Level N has SLOTS slots each spanning SLOTS^N ticks.  A timer sits at the lowest
+    // level at which its deadline and the current tick fall in the same parent slot, and moves
+    // down ("cascades") when its slot comes up.  Adding or cancelling a timer is O(1), and the
+    // timerfd is only reprogrammed when the earliest non-empty slot changes.
+    static const int LEVEL_BITS = 6;
+    static const int SLOTS = 1 << LEVEL_BITS;
+    static const int LEVELS = 5;  // 2^30 ms, about 12 days.  Longer timers just cascade again.
+
+    ByteStream timerStream;
+    Epoller::Watch watch;
+    uint64_t currentTick;  // Milliseconds on CLOCK_MONOTONIC; everything up to here has fired.
+    uint64_t armedTick;    // What the timerfd is set to, or UINT64_MAX if disarmed.
+    int timerCount;
+    bool handling;
+
+    TimeoutFulfiller* slots[LEVELS][SLOTS];
+    uint64_t occupied[LEVELS];  // Bit N is set if slots[level][N] is non-empty.
+
+    static uint64_t now();
+
+    void addTimer(TimeoutFulfiller* timer);
+    void removeTimer(TimeoutFulfiller* timer);
+    void link(TimeoutFulfiller* timer);
+    void unlink(TimeoutFulfiller* timer);
+
+    // The next tick at which some slot needs to be expired or cascaded.
+    uint64_t nextTick();
+    void advance(uint64_t tick);
+    void rearm();
+  };
+
   Epoller epoller;
   SignalHandler signalHandler;
   InotifyHandler inotifyHandler;
+  TimerHandler timerHandler;
 
   std::deque<AsyncCallbackHandler*> asyncCallbacks;
 
@@ -0,0 +1,267 @@
+// Ekam Build System
+// Author: Kenton Varda (kenton@sandstorm.io)
+// Copyright (c) 2010-2015 Kenton Varda, Google Inc., and contributors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "EpollEventManager.h"
+#include "base/Clock.h"
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+#include <algorithm>
+#include <vector>
+
+namespace ekam {
+namespace {
+
+#define ASSERT(EXPRESSION)                                                    \
+  if (!(EXPRESSION)) {                                                        \
+    fprintf(stderr, "%s:%d: FAILED: %s\n", __FILE__, __LINE__, #EXPRESSION);  \
+    exit(1);                                                                  \
+  }
+
+// Waits for a pipe to become readable, then writable, through the given event manager.
+void checkPipeEvents(EpollEventManager* eventManager) {
+  int fds[2];
+  ASSERT(pipe(fds) == 0);
+
+  OwnedPtr<EventManager::IoWatcher> reader = eventManager->watchFd(fds[0]);
+  OwnedPtr<EventManager::IoWatcher> writer = eventManager->watchFd(fds[1]);
+
+  int readableCount = 0;
+  Promise<void> readable = eventManager->when(reader->onReadable())(
+    [&](Void) {
+      ++readableCount;
+    });
+
+  // loop() returns once nothing is being waited for, i.e. after both have fired.
+  int writableCount = 0;
+  Promise<void> writable = eventManager->when(writer->onWritable())(
+    [&](Void) {
+      ++writableCount;
+      ASSERT(write(fds[1], "x", 1) == 1);
+    });
+  eventManager->loop();
+  ASSERT(writableCount == 1);
+  ASSERT(readableCount == 1);
+
+  char c;
+  ASSERT(read(fds[0], &c, 1) == 1 && c == 'x');
+
+  // Watches can be re-armed after firing.
+  readable = eventManager->when(reader->onReadable())(
+    [&](Void) {
+      ++readableCount;
+    });
+  ASSERT(write(fds[1], "y", 1) == 1);
+  eventManager->loop();
+  ASSERT(readableCount == 2);
+
+  reader.clear();
+  writer.clear();
+  close(fds[0]);
+  close(fds[1]);
+}
+
+void testEpoll() {
+  EpollEventManager eventManager(false);
+  ASSERT(!eventManager.isUsingIoUring());
+  checkPipeEvents(&eventManager);
+}
+
+void testIoUring() {
+  EpollEventManager eventManager(true);
+  if (!eventManager.isUsingIoUring()) {
+    fprintf(stderr, "io_uring not available here; only testing the fallback.\n");
+    return;
+  }
+  checkPipeEvents(&eventManager);
+}
+
+// Makes io_uring_setup() fail with ENOSYS in this process, as on a kernel without io_uring.
+void disableIoUring() {
+  struct sock_filter filter[] = {
+    BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, nr)),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, __NR_io_uring_setup, 0, 1),
+    BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ERRNO | ENOSYS),
+    BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW),
+  };
+  struct sock_fprog program = { sizeof(filter) / sizeof(filter[0]), filter };
+  ASSERT(prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) == 0);
+  ASSERT(prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &program) == 0);
+}
+
+void testIoUringFallback() {
+  // Seccomp filters can't be removed, so do this in a child process.
+  pid_t pid = fork();
+  ASSERT(pid >= 0);
+  if (pid == 0) {
+    disableIoUring();
+    EpollEventManager eventManager(true);
+    ASSERT(!eventManager.isUsingIoUring());
+    checkPipeEvents(&eventManager);
+    _exit(0);
+  }
+
+  int status;
+  ASSERT(waitpid(pid, &status, 0) == pid);
+  ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+// ---------------------------------------------------------------------------------------
+// Timers.  The wheel runs on the real monotonic clock, so these line their timers up against
+// its slot boundaries by waiting for the right moment.
+
+// Waits until the clock reads `before` milliseconds short of a multiple of `period`, and
+// returns that reading.
+uint64_t waitUntilBefore(uint64_t period, uint64_t before) {
+  uint64_t now = monotonicMillis();
+  uint64_t target = (now / period + 1) * period - before;
+  if (target < now + 2) {
+    target += period;
+  }
+  usleep((target - now - 2) * 1000);
+  while ((now = monotonicMillis()) < target) {}
+  return now;
+}
+
+// Sets up timers with the given timeouts, runs the loop until they have all fired, and checks
+// that none fired early and that they fired in order.  Returns the milliseconds it took.
+uint64_t runTimers(EpollEventManager* eventManager, uint64_t start,
+                   const std::vector<uint64_t>& timeouts) {
+  std::vector<uint64_t> fired;
+  std::vector<Promise<void>> promises;
+  for (size_t i = 0; i < timeouts.size(); i++) {
+    uint64_t timeout = timeouts[i];
+    promises.push_back(eventManager->when(eventManager->onTimeout(timeout))(
+      [&fired, start, timeout](Void) {
+        ASSERT(monotonicMillis() >= start + timeout);
+        fired.push_back(timeout);
+      }));
+  }
+
+  eventManager->loop();
+  ASSERT(fired.size() == timeouts.size());
+  ASSERT(std::is_sorted(fired.begin(), fired.end()));
+  return monotonicMillis() - start;
+}
+
+void testTimerWraparound() {
+  // Spans a few revolutions of the lowest level, so its slots are reused.
+  EpollEventManager eventManager;
+  std::vector<uint64_t> timeouts;
+  for (uint64_t timeout = 1; timeout < 300; timeout += 7) {
+    timeouts.push_back(timeout);
+  }
+  uint64_t start = monotonicMillis();
+  runTimers(&eventManager, start, timeouts);
+}
+
+void testTimerSlotBoundary() {
+  // Deadlines exactly on a level 1 slot boundary, and either side of one.  A timer lands at the
+  // level above until its slot comes up, then must fire on the tick it cascades.
+  EpollEventManager eventManager;
+  uint64_t start = waitUntilBefore(64, 3);
+  std::vector<uint64_t> timeouts = { 2, 3, 4, 67 };
+  runTimers(&eventManager, start, timeouts);
+}
+
+void testTimerCascade() {
+  // Just before a level 2 boundary (4096ms), timers due after it start at level 2.  At the
+  // boundary they cascade:  straight to level 0 if due within 64ms, else to level 1 and then
+  // to level 0 later.
+  EpollEventManager eventManager;
+  uint64_t start = waitUntilBefore(4096, 10);
+  std::vector<uint64_t> timeouts = { 5, 10, 40, 150, 300 };
+  uint64_t elapsed = runTimers(&eventManager, start, timeouts);
+  ASSERT(elapsed < 1000);
+}
+
+void testTimerCancel() {
+  EpollEventManager eventManager;
+  uint64_t start = monotonicMillis();
+  int firedCount = 0;
+  bool cancelledFired = false;
+
+  // Two timers in the same slot; cancelling one must leave the other.
+  Promise<void> first = eventManager.when(eventManager.onTimeout(20))(
+    [&firedCount](Void) {
+      ++firedCount;
+    });
+  Promise<void> cancelled = eventManager.when(eventManager.onTimeout(20))(
+    [&cancelledFired](Void) {
+      cancelledFired = true;
+    });
+  cancelled.release();
+
+  // A long timer, cancelled while the loop is running.  loop() only returns early if it was
+  // removed from the wheel.
+  Promise<void> pending = eventManager.when(eventManager.onTimeout(5000))(
+    [&cancelledFired](Void) {
+      cancelledFired = true;
+    });
+  Promise<void> canceller = eventManager.when(eventManager.onTimeout(30))(
+    [&firedCount, &pending](Void) {
+      ++firedCount;
+      pending.release();
+    });
+
+  eventManager.loop();
+  ASSERT(firedCount == 2);
+  ASSERT(!cancelledFired);
+  ASSERT(monotonicMillis() - start < 1000);
+}
+
+void testZeroTimeout() {
+  EpollEventManager eventManager;
+  uint64_t start = monotonicMillis();
+  int firedCount = 0;
+
+  // Fires on the next tick, including when added while timers are firing.
+  Promise<void> inner;
+  Promise<void> outer = eventManager.when(eventManager.onTimeout(0))(
+    [&eventManager, &firedCount, &inner](Void) {
+      ++firedCount;
+      inner = eventManager.when(eventManager.onTimeout(0))(
+        [&firedCount](Void) {
+          ++firedCount;
+        });
+    });
+
+  eventManager.loop();
+  ASSERT(firedCount == 2);
+  ASSERT(monotonicMillis() - start < 100);
+}
+
+}  // namespace
+}  // namespace ekam
+
+int main(int argc, char* argv[]) {
+  ekam::testEpoll();
+  ekam::testIoUring();
+  ekam::testIoUringFallback();
+  ekam::testTimerWraparound();
+  ekam::testTimerSlotBoundary();
+  ekam::testTimerCascade();
+  ekam::testTimerCancel();
+  ekam::testZeroTimeout();
+  return 0;
+}
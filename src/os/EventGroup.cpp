@@ -17,12 +17,13 @@
 #include "EventGroup.h"
 
 #include "base/Debug.h"
+#include "base/Pooled.h"
 
 namespace ekam {
 
 EventGroup::ExceptionHandler::~ExceptionHandler() noexcept(false) {}
 
-class EventGroup::PendingEvent {
+class EventGroup::PendingEvent : public Pooled {
 public:
   PendingEvent(EventGroup* group): group(group) {
     ++group->eventCount;
@@ -48,7 +49,7 @@ private:
     group->exceptionHandler->threwUnknownException();            \
   }
 
-class EventGroup::RunnableWrapper : public Runnable {
+class EventGroup::RunnableWrapper : public Runnable, public Pooled {
 public:
   RunnableWrapper(EventGroup* group, OwnedPtr<Runnable> wrapped)
       : group(group), pendingEvent(group), wrapped(wrapped.release()) {}
@@ -132,6 +133,10 @@ public:
       });
   }
 
+  bool takeChangedEntries(std::vector<std::string>* names) {
+    return inner->takeChangedEntries(names);
+  }
+
 private:
   EventGroup* group;
   OwnedPtr<FileWatcher> inner;
@@ -141,6 +146,14 @@ OwnedPtr<EventManager::FileWatcher> EventGroup::watchFile(const std::string& fil
   return newOwned<FileWatcherWrapper>(this, inner->watchFile(filename));
 }
 
+Promise<void> EventGroup::onTimeout(uint64_t milliseconds) {
+  Promise<void> innerPromise = inner->onTimeout(milliseconds);
+  return when(innerPromise, newPendingEvent())(
+    [](Void, OwnedPtr<PendingEvent>) {
+      // Let PendingEvent die.
+    });
+}
+
 OwnedPtr<EventGroup::PendingEvent> EventGroup::newPendingEvent() {
   return newOwned<PendingEvent>(this);
 }
@@ -54,6 +54,7 @@ public:
   Promise<ProcessExitCode> onProcessExit(pid_t pid);
   OwnedPtr<IoWatcher> watchFd(int fd);
   OwnedPtr<FileWatcher> watchFile(const std::string& filename);
+  Promise<void> onTimeout(uint64_t milliseconds);
 
 private:
   class PendingEvent;
@@ -25,6 +25,10 @@ namespace ekam {
 EventManager::~EventManager() noexcept(false) {}
 EventManager::IoWatcher::~IoWatcher() noexcept(false) {}
 EventManager::FileWatcher::~FileWatcher() {}
+
+bool EventManager::FileWatcher::takeChangedEntries(std::vector<std::string>* names) {
+  return false;
+}
 RunnableEventManager::~RunnableEventManager() noexcept(false) {}
 
 void ProcessExitCode::throwError() {
@@ -18,8 +18,10 @@
 #define KENTONSCODE_OS_EVENTMANAGER_H_
 
 #include <stddef.h>
+#include <stdint.h>
 #include <sys/types.h>
 #include <string>
+#include <vector>
 #include "base/OwnedPtr.h"
 #include "base/Promise.h"
 
@@ -89,10 +91,20 @@ public:
     virtual ~FileWatcher();
 
     virtual Promise<FileChangeType> onChange() = 0;
+
+    // For a watched directory:  moves into *names the names of entries created, deleted, or
+    // renamed since the last call, so that the caller needn't relist the directory on each
+    // MODIFIED.  Returns false if that isn't known, e.g. because events were lost, in which case
+    // the caller must relist.  The default implementation always returns false.
+    virtual bool takeChangedEntries(std::vector<std::string>* names);
   };
 
   // Watch a file (on disk) for changes or deletion.
   virtual OwnedPtr<FileWatcher> watchFile(const std::string& filename) = 0;
+
+  // Fulfills the promise once the given number of milliseconds have passed.  Destroy the promise
+  // to cancel.  Cheap enough to set one per action.
+  virtual Promise<void> onTimeout(uint64_t milliseconds) = 0;
 };
 
 class RunnableEventManager : public EventManager {
@@ -102,7 +114,9 @@ public:
   virtual void loop() = 0;
 };
 
-OwnedPtr<RunnableEventManager> newPreferredEventManager();
+// If preferIoUring is true and the platform supports it, the event manager waits for events
+// using io_uring.
+OwnedPtr<RunnableEventManager> newPreferredEventManager(bool preferIoUring = false);
 
 }  // namespace ekam
 
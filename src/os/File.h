@@ -70,8 +70,11 @@ public:
   virtual bool isFile() = 0;
   virtual bool isDirectory() = 0;
 
-  // File only.
+  // For a directory, a hash of the names of its entries, so that it changes when entries are
+  // added or removed.
   virtual Hash contentHash() = 0;
+
+  // File only.
   virtual std::string readAll() = 0;
   virtual void writeAll(const std::string& content) = 0;
   virtual void writeAll(const void* data, int size) = 0;
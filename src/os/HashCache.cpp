@@ -0,0 +1,136 @@
+// Ekam Build System
+// Author: Kenton Varda (kenton@sandstorm.io)
+// Copyright (c) 2010-2015 Kenton Varda, Google Inc., and contributors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "HashCache.h"
+
+#include <stdio.h>
+#include <time.h>
+#include <string>
+
+#include "TextFile.h"
+
+namespace ekam {
+
+// File format is one line per file:
+//
+//   <device> <inode> <size> <mtime ns> <ctime ns> <hash>
+
+namespace {
+
+// Files changed more recently than this may still change without their timestamps moving.
+const int64_t RACY_NS = 2000000000ll;
+
+int64_t toNanos(const struct timespec& time) {
+  return time.tv_sec * 1000000000ll + time.tv_nsec;
+}
+
+}  // namespace
+
+HashCache::HashCache(File* file) : file(file->clone()), dirty(false) {
+  forEachLineOf(this->file.get(), [this](const std::string& line) {
+    unsigned long long device, inode, size;
+    long long mtimeNs, ctimeNs;
+    char hashText[65];
+    Entry entry;
+    if (sscanf(line.c_str(), "%llu %llu %llu %lld %lld %64s",
+               &device, &inode, &size, &mtimeNs, &ctimeNs, hashText) != 6 ||
+        !Hash::fromString(hashText, &entry.hash)) {
+      return;
+    }
+
+    FileId id = { (dev_t)device, (ino_t)inode };
+    entry.size = size;
+    entry.mtimeNs = mtimeNs;
+    entry.ctimeNs = ctimeNs;
+    entry.used = false;
+    entries[id] = entry;
+  });
+}
+
+HashCache::~HashCache() {}
+
+bool HashCache::lookup(const struct stat& stats, Hash* output) {
+  FileId id = { stats.st_dev, stats.st_ino };
+
+  std::unique_lock<std::mutex> lock(mutex);
+  std::unordered_map<FileId, Entry, FileId::HashFunc>::iterator iter = entries.find(id);
+  if (iter == entries.end()) {
+    return false;
+  }
+
+  Entry& entry = iter->second;
+  if (entry.size != (uint64_t)stats.st_size ||
+      entry.mtimeNs != toNanos(stats.st_mtim) ||
+      entry.ctimeNs != toNanos(stats.st_ctim)) {
+    entries.erase(iter);
+    dirty = true;
+    return false;
+  }
+
+  if (!entry.used) {
+    entry.used = true;
+    dirty = true;
+  }
+  *output = entry.hash;
+  return true;
+}
+
+void HashCache::put(const struct stat& stats, const Hash& hash) {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  int64_t nowNs = toNanos(now);
+  if (nowNs - toNanos(stats.st_mtim) < RACY_NS || nowNs - toNanos(stats.st_ctim) < RACY_NS) {
+    return;
+  }
+
+  FileId id = { stats.st_dev, stats.st_ino };
+  Entry entry;
+  entry.size = stats.st_size;
+  entry.mtimeNs = toNanos(stats.st_mtim);
+  entry.ctimeNs = toNanos(stats.st_ctim);
+  entry.hash = hash;
+  entry.used = true;
+
+  std::unique_lock<std::mutex> lock(mutex);
+  entries[id] = entry;
+  dirty = true;
+}
+
+void HashCache::save() {
+  std::string content;
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (!dirty) return;
+
+    char buffer[128];
+    for (std::unordered_map<FileId, Entry, FileId::HashFunc>::iterator iter = entries.begin();
+         iter != entries.end(); ++iter) {
+      if (!iter->second.used) continue;
+      snprintf(buffer, sizeof(buffer), "%llu %llu %llu %lld %lld ",
+               (unsigned long long)iter->first.device, (unsigned long long)iter->first.inode,
+               (unsigned long long)iter->second.size,
+               (long long)iter->second.mtimeNs, (long long)iter->second.ctimeNs);
+      content.append(buffer);
+      content.append(iter->second.hash.toString());
+      content.push_back('\n');
+    }
+    dirty = false;
+  }
+
+  writeBestEffort(file.get(), content, "hash cache");
+}
+
+}  // namespace ekam
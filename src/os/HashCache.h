@@ -0,0 +1,87 @@
+// Ekam Build System
+// Author: Kenton Varda (kenton@sandstorm.io)
+// Copyright (c) 2010-2015 Kenton Varda, Google Inc., and contributors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef KENTONSCODE_OS_HASHCACHE_H_
+#define KENTONSCODE_OS_HASHCACHE_H_
+
+#include <mutex>
+#include <unordered_map>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdint.h>
+
+#include "base/OwnedPtr.h"
+#include "base/Hash.h"
+#include "File.h"
+
+namespace ekam {
+
+// Remembers content hashes of disk files by inode, so that files whose stat() is unchanged
+// needn't be read again -- in particular, across Ekam runs.  An entry is valid only while the
+// file's size, mtime and ctime are exactly as recorded.
+//
+// To avoid trusting a timestamp that a later write in the same clock tick could leave
+// unchanged, files changed within the last couple seconds are not cached.
+//
+// Thread-safe.
+class HashCache {
+public:
+  HashCache(File* file);
+  ~HashCache();
+
+  // Returns false if there is no valid entry.
+  bool lookup(const struct stat& stats, Hash* output);
+
+  // `stats` must have been taken before reading the content.
+  void put(const struct stat& stats, const Hash& hash);
+
+  // Write to disk, if anything changed.  Only entries looked up or added since loading are
+  // kept, so that deleted files drop out.
+  void save();
+
+private:
+  struct FileId {
+    dev_t device;
+    ino_t inode;
+
+    inline bool operator==(const FileId& other) const {
+      return device == other.device && inode == other.inode;
+    }
+    class HashFunc {
+    public:
+      inline size_t operator()(const FileId& id) const {
+        return id.device * 31 + id.inode;
+      }
+    };
+  };
+
+  struct Entry {
+    uint64_t size;
+    int64_t mtimeNs;
+    int64_t ctimeNs;
+    Hash hash;
+    bool used;
+  };
+
+  OwnedPtr<File> file;
+  std::mutex mutex;
+  std::unordered_map<FileId, Entry, FileId::HashFunc> entries;
+  bool dirty;
+};
+
+}  // namespace ekam
+
+#endif  // KENTONSCODE_OS_HASHCACHE_H_
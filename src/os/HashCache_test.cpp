@@ -0,0 +1,163 @@
+// Ekam Build System
+// Author: Kenton Varda (kenton@sandstorm.io)
+// Copyright (c) 2010-2015 Kenton Varda, Google Inc., and contributors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "HashCache.h"
+#include "DiskFile.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+
+namespace ekam {
+namespace {
+
+#define ASSERT(EXPRESSION)                                                    \
+  if (!(EXPRESSION)) {                                                        \
+    fprintf(stderr, "%s:%d: FAILED: %s\n", __FILE__, __LINE__, #EXPRESSION);  \
+    exit(1);                                                                  \
+  }
+
+// Stats of a file last changed the given number of seconds ago.
+struct stat statsFromSecondsAgo(ino_t inode, off_t size, time_t secondsAgo) {
+  struct stat stats;
+  memset(&stats, 0, sizeof(stats));
+  stats.st_dev = 1;
+  stats.st_ino = inode;
+  stats.st_mode = S_IFREG | 0644;
+  stats.st_size = size;
+  clock_gettime(CLOCK_REALTIME, &stats.st_mtim);
+  stats.st_mtim.tv_sec -= secondsAgo;
+  stats.st_ctim = stats.st_mtim;
+  return stats;
+}
+
+void writeFile(const std::string& path, const std::string& content) {
+  FILE* file = fopen(path.c_str(), "w");
+  ASSERT(file != nullptr);
+  ASSERT(fwrite(content.data(), 1, content.size(), file) == content.size());
+  ASSERT(fclose(file) == 0);
+}
+
+void testStatReuse(const std::string& dir) {
+  DiskFile cacheFile(dir + "/hash-cache", nullptr);
+  Hash hash = Hash::of("content");
+  struct stat stats = statsFromSecondsAgo(100, 7, 60);
+
+  {
+    HashCache cache(&cacheFile);
+    Hash result;
+    ASSERT(!cache.lookup(stats, &result));
+    cache.put(stats, hash);
+    ASSERT(cache.lookup(stats, &result));
+    ASSERT(result == hash);
+
+    // Any change to the size or timestamps invalidates the entry.
+    struct stat changed = stats;
+    changed.st_size = 8;
+    ASSERT(!cache.lookup(changed, &result));
+    ASSERT(!cache.lookup(stats, &result));
+
+    cache.put(stats, hash);
+    changed = stats;
+    ++changed.st_mtim.tv_nsec;
+    ASSERT(!cache.lookup(changed, &result));
+
+    cache.put(stats, hash);
+    changed = stats;
+    ++changed.st_ctim.tv_nsec;
+    ASSERT(!cache.lookup(changed, &result));
+
+    cache.put(stats, hash);
+    cache.save();
+  }
+
+  struct stat other = statsFromSecondsAgo(101, 7, 60);
+  {
+    // Entries survive a reload.
+    HashCache cache(&cacheFile);
+    Hash result;
+    ASSERT(cache.lookup(stats, &result));
+    ASSERT(result == hash);
+    cache.put(other, hash);
+    cache.save();
+  }
+
+  {
+    // Entries which aren't used between loading and saving are dropped, as for deleted files.
+    HashCache cache(&cacheFile);
+    Hash result;
+    ASSERT(cache.lookup(stats, &result));
+    cache.save();
+  }
+
+  {
+    HashCache cache(&cacheFile);
+    Hash result;
+    ASSERT(cache.lookup(stats, &result));
+    ASSERT(!cache.lookup(other, &result));
+  }
+}
+
+void testRacyWrite(const std::string& dir) {
+  DiskFile cacheFile(dir + "/racy-cache", nullptr);
+  HashCache cache(&cacheFile);
+
+  // A file changed within the last two seconds isn't cached, since a second write in the same
+  // timestamp tick could leave its stats unchanged.
+  struct stat recent = statsFromSecondsAgo(200, 7, 1);
+  cache.put(recent, Hash::of("first"));
+  Hash result;
+  ASSERT(!cache.lookup(recent, &result));
+
+  // End to end:  a file rewritten right after being hashed is hashed again, even if the rewrite
+  // doesn't change its size or mtime.
+  std::string path = dir + "/file";
+  DiskFile::setHashCache(&cache);
+  DiskFile file(path, nullptr);
+
+  writeFile(path, "aaaa");
+  struct stat before;
+  ASSERT(stat(path.c_str(), &before) == 0);
+  ASSERT(file.contentHash() == Hash::of("aaaa"));
+
+  writeFile(path, "bbbb");
+  struct timespec times[2] = { before.st_atim, before.st_mtim };
+  ASSERT(utimensat(AT_FDCWD, path.c_str(), times, 0) == 0);
+  ASSERT(file.contentHash() == Hash::of("bbbb"));
+
+  // Its stats, as a coarse-grained filesystem clock could have left them, aren't cached either.
+  ASSERT(!cache.lookup(before, &result));
+
+  DiskFile::setHashCache(nullptr);
+}
+
+}  // namespace
+}  // namespace ekam
+
+int main(int argc, char* argv[]) {
+  char dirTemplate[] = "/tmp/ekam-hash-cache-test.XXXXXX";
+  ASSERT(mkdtemp(dirTemplate) != nullptr);
+  std::string dir = dirTemplate;
+
+  ekam::testStatReuse(dir);
+  ekam::testRacyWrite(dir);
+
+  std::string command = "rm -rf " + dir;
+  ASSERT(system(command.c_str()) == 0);
+  return 0;
+}
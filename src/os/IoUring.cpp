@@ -0,0 +1,157 @@
+// Ekam Build System
+// Author: Kenton Varda (kenton@sandstorm.io)
+// Copyright (c) 2010-2015 Kenton Varda, Google Inc., and contributors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "IoUring.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+
+#include "OsHandle.h"
+
+namespace ekam {
+
+namespace {
+
+// Only used in pollRemove() requests, whose completions we don't report.
+const uint64_t REMOVE_USER_DATA = 0;
+
+}  // namespace
+
+IoUring::IoUring(unsigned entries) : pending(0) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  ringFd = syscall(__NR_io_uring_setup, entries, &params);
+  if (ringFd < 0) {
+    throw OsError("io_uring_setup", errno);
+  }
+
+  sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  bool singleMmap = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (singleMmap) {
+    sqRingSize = cqRingSize = sqRingSize > cqRingSize ? sqRingSize : cqRingSize;
+  }
+  sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+
+  sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                ringFd, IORING_OFF_SQ_RING);
+  cqRing = singleMmap ? sqRing :
+      mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+           ringFd, IORING_OFF_CQ_RING);
+  void* sqesPtr = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ringFd, IORING_OFF_SQES);
+  if (sqRing == MAP_FAILED || cqRing == MAP_FAILED || sqesPtr == MAP_FAILED) {
+    int error = errno;
+    if (sqRing != MAP_FAILED) munmap(sqRing, sqRingSize);
+    if (!singleMmap && cqRing != MAP_FAILED) munmap(cqRing, cqRingSize);
+    if (sqesPtr != MAP_FAILED) munmap(sqesPtr, sqesSize);
+    close(ringFd);
+    throw OsError("mmap(io_uring)", error);
+  }
+  sqes = reinterpret_cast<struct io_uring_sqe*>(sqesPtr);
+
+  char* sq = reinterpret_cast<char*>(sqRing);
+  sqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+  sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+  sqMask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+  sqEntries = params.sq_entries;
+  sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+
+  char* cq = reinterpret_cast<char*>(cqRing);
+  cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+  cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+  cqMask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+  cqes = reinterpret_cast<struct io_uring_cqe*>(cq + params.cq_off.cqes);
+}
+
+IoUring::~IoUring() {
+  munmap(sqes, sqesSize);
+  if (cqRing != sqRing) munmap(cqRing, cqRingSize);
+  munmap(sqRing, sqRingSize);
+  close(ringFd);
+}
+
+int IoUring::enter(unsigned toSubmit, unsigned minComplete, unsigned flags) {
+  long result;
+  do {
+    result = syscall(__NR_io_uring_enter, ringFd, toSubmit, minComplete, flags, nullptr, 0);
+  } while (result < 0 && errno == EINTR);
+  if (result < 0) {
+    throw OsError("io_uring_enter", errno);
+  }
+  return result;
+}
+
+struct io_uring_sqe* IoUring::nextSqe() {
+  unsigned tail = *sqTail;
+  if (tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries) {
+    // Submission queue full.  Hand what we have to the kernel.
+    pending -= enter(pending, 0, 0);
+  }
+
+  unsigned index = tail & sqMask;
+  struct io_uring_sqe* sqe = &sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqArray[index] = index;
+  __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+  ++pending;
+  return sqe;
+}
+
+void IoUring::pollAdd(int fd, uint32_t pollEvents, uint64_t userData) {
+  struct io_uring_sqe* sqe = nextSqe();
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  sqe->poll32_events = pollEvents;
+  sqe->user_data = userData;
+}
+
+void IoUring::pollRemove(uint64_t userData) {
+  struct io_uring_sqe* sqe = nextSqe();
+  sqe->opcode = IORING_OP_POLL_REMOVE;
+  sqe->fd = -1;
+  sqe->addr = userData;
+  sqe->user_data = REMOVE_USER_DATA;
+}
+
+int IoUring::submitAndWait(Completion* output, int max) {
+  int count = 0;
+  while (count == 0) {
+    unsigned head = *cqHead;
+    if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+      pending -= enter(pending, 1, IORING_ENTER_GETEVENTS);
+    }
+
+    unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+    for (; head != tail && count < max; ++head) {
+      const struct io_uring_cqe& cqe = cqes[head & cqMask];
+      if (cqe.user_data != REMOVE_USER_DATA) {
+        output[count].userData = cqe.user_data;
+        output[count].result = cqe.res;
+        ++count;
+      }
+    }
+    __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+  }
+
+  return count;
+}
+
+}  // namespace ekam
@@ -0,0 +1,81 @@
+// Ekam Build System
+// Author: Kenton Varda (kenton@sandstorm.io)
+// Copyright (c) 2010-2015 Kenton Varda, Google Inc., and contributors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef KENTONSCODE_OS_IOURING_H_
+#define KENTONSCODE_OS_IOURING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+namespace ekam {
+
+// Minimal wrapper around a Linux io_uring, using the raw system calls so that we don't depend
+// on liburing.  Only supports what Epoller needs:  one-shot polls.
+class IoUring {
+public:
+  // Throws OsError if io_uring is not available.
+  IoUring(unsigned entries);
+  ~IoUring();
+
+  // Queue a one-shot poll of fd for the given poll(2) events.  Its completion will carry the
+  // given userData, which must be non-zero.
+  void pollAdd(int fd, uint32_t pollEvents, uint64_t userData);
+
+  // Queue cancellation of the poll that was added with the given userData.  The canceled poll
+  // may still complete, with -ECANCELED.
+  void pollRemove(uint64_t userData);
+
+  struct Completion {
+    uint64_t userData;
+    int result;  // For polls, the poll(2) events that occurred, or -errno.
+  };
+
+  // Submits everything queued, waits for at least one completion, and returns up to `max` of
+  // them.  Completions of pollRemove() requests themselves are not returned.
+  int submitAndWait(Completion* output, int max);
+
+private:
+  int ringFd;
+
+  void* sqRing;
+  size_t sqRingSize;
+  void* cqRing;
+  size_t cqRingSize;
+  io_uring_sqe* sqes;
+  size_t sqesSize;
+
+  unsigned* sqHead;
+  unsigned* sqTail;
+  unsigned sqMask;
+  unsigned sqEntries;
+  unsigned* sqArray;
+  unsigned* cqHead;
+  unsigned* cqTail;
+  unsigned cqMask;
+  io_uring_cqe* cqes;
+
+  unsigned pending;  // Queued but not yet submitted.
+
+  io_uring_sqe* nextSqe();
+  int enter(unsigned toSubmit, unsigned minComplete, unsigned flags);
+};
+
+}  // namespace ekam
+
+#endif  // KENTONSCODE_OS_IOURING_H_
@@ -18,12 +18,14 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 #include "base/Debug.h"
 
@@ -84,23 +86,58 @@ bool parseIpAddr(std::string text, struct sockaddr_in* addr) {
   return true;
 }
 
+const char UNIX_PREFIX[] = "unix:";
+
+bool isUnixAddr(const std::string& text) {
+  return text.compare(0, sizeof(UNIX_PREFIX) - 1, UNIX_PREFIX) == 0;
+}
+
+bool parseUnixAddr(const std::string& text, struct sockaddr_un* addr) {
+  std::string path(text, sizeof(UNIX_PREFIX) - 1);
+  if (path.empty() || path.size() >= sizeof(addr->sun_path)) return false;
+  addr->sun_family = AF_UNIX;
+  memcpy(addr->sun_path, path.data(), path.size());
+  return true;
+}
+
+// Fills in *addr, which must be big enough for either kind, and returns its size, or zero if
+// the address is invalid.
+socklen_t parseAddr(const std::string& text, struct sockaddr_storage* addr) {
+  memset(addr, 0, sizeof(*addr));
+  if (isUnixAddr(text)) {
+    return parseUnixAddr(text, reinterpret_cast<struct sockaddr_un*>(addr)) ?
+        sizeof(struct sockaddr_un) : 0;
+  } else {
+    return parseIpAddr(text, reinterpret_cast<struct sockaddr_in*>(addr)) ?
+        sizeof(struct sockaddr_in) : 0;
+  }
+}
+
 }  // namespace
 
 ServerSocket::ServerSocket(EventManager* eventManager, const std::string& bindAddress, int backlog)
     : eventManager(eventManager),
-      handle(bindAddress, WRAP_SYSCALL(socket, AF_INET, SOCK_STREAM, 0)),
+      handle(bindAddress, WRAP_SYSCALL(socket, isUnixAddr(bindAddress) ? AF_UNIX : AF_INET,
+                                       SOCK_STREAM, 0)),
       watcher(eventManager->watchFd(handle.get())) {
   WRAP_SYSCALL(fcntl, handle, F_SETFL, O_NONBLOCK);
 
-  int optval = 1;
-  WRAP_SYSCALL(setsockopt, handle,  SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
-
-  struct sockaddr_in addr;
-  if (!parseIpAddr(bindAddress, &addr)) {
+  struct sockaddr_storage addr;
+  socklen_t addrSize = parseAddr(bindAddress, &addr);
+  if (addrSize == 0) {
     throw std::invalid_argument("Invalid bind address: " + bindAddress);
   }
 
-  WRAP_SYSCALL(bind, handle, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr));
+  if (isUnixAddr(bindAddress)) {
+    // Left behind by a previous server that didn't exit cleanly, presumably.  Whoever binds
+    // must ensure no other server is using the path.
+    unlink(reinterpret_cast<struct sockaddr_un*>(&addr)->sun_path);
+  } else {
+    int optval = 1;
+    WRAP_SYSCALL(setsockopt, handle,  SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+  }
+
+  WRAP_SYSCALL(bind, handle, reinterpret_cast<struct sockaddr*>(&addr), addrSize);
   WRAP_SYSCALL(listen, handle, (backlog == 0) ? SOMAXCONN : backlog);
 }
 
@@ -132,5 +169,19 @@ Promise<OwnedPtr<ByteStream>> ServerSocket::accept() {
     });
 }
 
+OwnedPtr<ByteStream> connectSocket(const std::string& address) {
+  struct sockaddr_storage addr;
+  socklen_t addrSize = parseAddr(address, &addr);
+  if (addrSize == 0) {
+    throw std::invalid_argument("Invalid address: " + address);
+  }
+
+  OwnedPtr<ByteStream> result = newOwned<ByteStream>(
+      WRAP_SYSCALL(socket, addr.ss_family, SOCK_STREAM, 0), address);
+  WRAP_SYSCALL(connect, *result->getHandle(), reinterpret_cast<struct sockaddr*>(&addr),
+               addrSize);
+  return result;
+}
+
 
 }  // namespace ekam
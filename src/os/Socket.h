@@ -24,6 +24,7 @@
 
 namespace ekam {
 
+// Addresses are "[<addr>]:<port>" for TCP, or "unix:<path>" for a unix domain socket.
 class ServerSocket {
 public:
   ServerSocket(EventManager* eventManager, const std::string& bindAddress, int backlog = 0);
@@ -39,6 +40,9 @@ private:
   OwnedPtr<EventManager::IoWatcher> watcher;
 };
 
+// Connects to a ServerSocket's address, blocking until connected.
+OwnedPtr<ByteStream> connectSocket(const std::string& address);
+
 }  // namespace ekam
 
 #endif  // KENTONSCODE_OS_SOCKET_H_
@@ -18,6 +18,9 @@
 
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
+#include <spawn.h>
+#include <math.h>
 #include <signal.h>
 #include <unistd.h>
 #include <errno.h>
@@ -25,16 +28,183 @@
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef __linux__
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mount.h>
+#include <sys/prctl.h>
+#include <sys/statfs.h>
+#include <sys/statvfs.h>
+#endif
+
 #include "OsHandle.h"
 #include "base/Debug.h"
+#include "base/Trace.h"
+
+extern char** environ;
 
 namespace ekam {
 
-Subprocess::Subprocess() : doPathLookup(false), pid(-1) {}
+namespace {
+
+// Writes "<prefix>: errno <error>" to stderr.  Used in the child between fork() and exec(), so
+// sticks to async-signal-safe calls:  another thread may have held the malloc or stdio lock at the
+// time of the fork, and we'd deadlock on it.
+void writeError(const char* prefix, int error) {
+  char buffer[256];
+  size_t size = strlen(prefix);
+  if (size > sizeof(buffer) - 32) size = sizeof(buffer) - 32;
+  memcpy(buffer, prefix, size);
+  memcpy(buffer + size, ": errno ", 8);
+  size += 8;
+
+  char digits[16];
+  char* pos = digits + sizeof(digits);
+  unsigned value = error < 0 ? -error : error;
+  do {
+    *--pos = '0' + value % 10;
+    value /= 10;
+  } while (value > 0);
+  size_t count = digits + sizeof(digits) - pos;
+  memcpy(buffer + size, pos, count);
+  size += count;
+  buffer[size++] = '\n';
+
+  while (write(STDERR_FILENO, buffer, size) < 0 && errno == EINTR) {}
+}
+
+#ifdef __linux__
+
+// Everything enterSandbox() needs, computed before fork() for the same reason.
+struct SandboxSetup {
+  int namespaces;
+  std::string uidMap;
+  std::string gidMap;
+  std::vector<std::string> readOnlyPaths;
+  std::vector<std::string> errorPrefixes;  // parallel to readOnlyPaths
+};
+
+void prepareSandbox(const std::vector<std::string>& readOnlyPaths, SandboxSetup* setup) {
+  setup->namespaces = CLONE_NEWNS | CLONE_NEWPID;
+  if (geteuid() != 0) {
+    setup->namespaces |= CLONE_NEWUSER;
+  }
+  std::string uid = toString((int)getuid());
+  std::string gid = toString((int)getgid());
+  setup->uidMap = uid + " " + uid + " 1";
+  setup->gidMap = gid + " " + gid + " 1";
+  setup->readOnlyPaths = readOnlyPaths;
+  for (size_t i = 0; i < readOnlyPaths.size(); i++) {
+    setup->errorPrefixes.push_back("sandbox: " + readOnlyPaths[i]);
+  }
+}
+
+bool writeProcFile(const char* path, const char* content, size_t size) {
+  int fd = open(path, O_WRONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  bool result = write(fd, content, size) == (ssize_t)size;
+  close(fd);
+  return result;
+}
+
+// Bind-mounts path onto itself read-only.  Flags like nosuid which the existing mount has must
+// be kept, or the kernel refuses the remount inside a user namespace.  Uses statfs() rather than
+// statvfs(), which may read /proc/mounts with stdio.
+bool makeReadOnly(const std::string& path) {
+  struct statfs stats;
+  if (statfs(path.c_str(), &stats) < 0 ||
+      mount(path.c_str(), path.c_str(), NULL, MS_BIND | MS_REC, NULL) < 0) {
+    return false;
+  }
+
+  unsigned long flags = MS_BIND | MS_REMOUNT | MS_RDONLY;
+  if (stats.f_flags & ST_NOSUID) flags |= MS_NOSUID;
+  if (stats.f_flags & ST_NODEV) flags |= MS_NODEV;
+  if (stats.f_flags & ST_NOEXEC) flags |= MS_NOEXEC;
+  if (stats.f_flags & ST_NOATIME) flags |= MS_NOATIME;
+  if (stats.f_flags & ST_NODIRATIME) flags |= MS_NODIRATIME;
+  if (stats.f_flags & ST_RELATIME) flags |= MS_RELATIME;
+  return mount(NULL, path.c_str(), NULL, flags, NULL) == 0;
+}
+
+// Called in the child between fork() and exec().  Returns in the process which should go on to
+// exec, or exits on failure.
+void enterSandbox(const SandboxSetup& setup) {
+  if (unshare(setup.namespaces) < 0) {
+    // Probably a kernel without (unprivileged) namespaces.
+    writeError("ekam: can't create sandbox, running unsandboxed", errno);
+    return;
+  }
+
+  if (setup.namespaces & CLONE_NEWUSER) {
+    if (!writeProcFile("/proc/self/setgroups", "deny", 4) ||
+        !writeProcFile("/proc/self/uid_map", setup.uidMap.data(), setup.uidMap.size()) ||
+        !writeProcFile("/proc/self/gid_map", setup.gidMap.data(), setup.gidMap.size())) {
+      writeError("sandbox: id map", errno);
+      _exit(1);
+    }
+  }
+
+  // Don't let our mounts propagate back out.
+  if (mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL) < 0 ||
+      mount("tmpfs", "/tmp", "tmpfs", MS_NOSUID | MS_NODEV, "mode=1777") < 0) {
+    writeError("sandbox: mount", errno);
+    _exit(1);
+  }
+  for (size_t i = 0; i < setup.readOnlyPaths.size(); i++) {
+    if (!makeReadOnly(setup.readOnlyPaths[i])) {
+      writeError(setup.errorPrefixes[i].c_str(), errno);
+      _exit(1);
+    }
+  }
+
+  // The new PID namespace applies to our children, so fork once more.  The grandchild is the
+  // namespace's init; when it exits, the kernel kills everything else inside.
+  pid_t child = fork();
+  if (child < 0) {
+    writeError("sandbox: fork", errno);
+    _exit(1);
+  } else if (child > 0) {
+    // Wait and pass on the exit status.  The process group is still ours, so kill(-pid) from
+    // the parent reaches the grandchild too.
+    int status;
+    while (waitpid(child, &status, 0) < 0) {
+      if (errno != EINTR) {
+        _exit(1);
+      }
+    }
+    if (WIFSIGNALED(status)) {
+      signal(WTERMSIG(status), SIG_DFL);
+      kill(getpid(), WTERMSIG(status));
+    }
+    _exit(WEXITSTATUS(status));
+  }
+
+  // Don't outlive the waiting parent.  (It can't have exited already, since it waits for us,
+  // and if it was killed along with the process group then so were we.)
+  prctl(PR_SET_PDEATHSIG, SIGKILL);
+}
+
+#endif  // __linux__
+
+std::string commandLine(const std::vector<std::string>& args) {
+  std::string result;
+  for (unsigned int i = 0; i < args.size(); i++) {
+    if (i > 0) result.push_back(' ');
+    result.append(args[i]);
+  }
+  return result;
+}
+
+}  // namespace
+
+Subprocess::Subprocess() : doPathLookup(false), sandboxed(false), cpuTimeLimit(0), pid(-1) {}
 
 Subprocess::~Subprocess() {
   if (pid >= 0) {
-    DEBUG_INFO << "Killing pid: " << pid;
+    TRACE("killing pid %d", pid);
     // Kill entire progress group.
     kill(-pid, SIGKILL);
     int dummy;
@@ -88,27 +258,121 @@ OwnedPtr<ByteStream> Subprocess::captureStdoutAndStderr() {
   return stdoutAndStderrPipe->releaseReadEnd();
 }
 
+void Subprocess::sandbox(const std::vector<std::string>& readOnlyPaths) {
+  sandboxed = true;
+  this->readOnlyPaths = readOnlyPaths;
+}
+
+void Subprocess::setCpuTimeLimit(double seconds) {
+  cpuTimeLimit = seconds > 0 ? static_cast<uint64_t>(ceil(seconds)) : 0;
+}
+
 Promise<ProcessExitCode> Subprocess::start(EventManager* eventManager) {
-  pid = fork();
+  startDetached();
 
-  if (pid < 0) {
-    throw OsError("", "fork", errno);
-  } else if (pid == 0) {
-    // In child.
+  return eventManager->when(eventManager->onProcessExit(pid))(
+    [this](ProcessExitCode exitCode) -> ProcessExitCode {
+      pid = -1;
+      return exitCode;
+    });
+}
 
-    std::vector<char*> argv;
-    std::string command;
+void Subprocess::startDetached() {
+  std::vector<char*> argv;
+  for (unsigned int i = 0; i < args.size(); i++) {
+    argv.push_back(const_cast<char*>(args[i].c_str()));
+  }
+  argv.push_back(NULL);
 
-    for (unsigned int i = 0; i < args.size(); i++) {
-      argv.push_back(strdup(args[i].c_str()));
+  // Only joined if it'll be printed.
+  DEBUG_INFO << "exec: " << commandLine(args);
 
-      if (i > 0) command.push_back(' ');
-      command.append(args[i]);
-    }
+  // With a large build loaded, fork() spends a long time copying our page tables, only for the
+  // child to exec right away.  posix_spawn() avoids that (glibc uses vfork semantics), but the
+  // sandbox and the CPU limit have to be set up in the child.
+  if (sandboxed || cpuTimeLimit > 0) {
+    forkAndExec(argv);
+  } else {
+    spawn(argv);
+  }
+  TRACE("started pid %d: %s", pid, args.empty() ? executableName : args[0]);
 
-    argv.push_back(NULL);
+  if (stdoutPipe != NULL) {
+    stdoutPipe.clear();
+  }
+  if (stdinPipe != NULL) {
+    stdinPipe.clear();
+  }
+  if (stderrPipe != NULL) {
+    stderrPipe.clear();
+  }
+  if (stdoutAndStderrPipe != NULL) {
+    stdoutAndStderrPipe.clear();
+  }
+
+  // Set the child's process group ID. The child also does this to itself (see below), but we
+  // need to do it in the parent as well to prevent a race condition in which we end up killing
+  // the child before it manages to call setpgid(). If that happens, then the child will keep
+  // going and the parent process will end up blockend on waitpid(). But the child process will
+  // almost certainly make an RPC to the parent process and wait for a reply, leading to
+  // deadlock.
+  setpgid(pid, 0);
+}
 
-    DEBUG_INFO << "exec: " << command;
+void Subprocess::spawn(const std::vector<char*>& argv) {
+  posix_spawn_file_actions_t actions;
+  posix_spawnattr_t attributes;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawnattr_init(&attributes);
+
+  if (stdinPipe != NULL) {
+    stdinPipe->addReadEndToSpawn(&actions, STDIN_FILENO);
+  }
+  if (stdoutPipe != NULL) {
+    stdoutPipe->addWriteEndToSpawn(&actions, STDOUT_FILENO);
+  }
+  if (stderrPipe != NULL) {
+    stderrPipe->addWriteEndToSpawn(&actions, STDERR_FILENO);
+  }
+  if (stdoutAndStderrPipe != NULL) {
+    stdoutAndStderrPipe->addWriteEndToSpawn(&actions, STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, STDOUT_FILENO, STDERR_FILENO);
+  }
+
+  // Start a new process group, as forkAndExec() does.
+  posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETPGROUP);
+  posix_spawnattr_setpgroup(&attributes, 0);
+
+  int error;
+  if (doPathLookup) {
+    error = posix_spawnp(&pid, executableName.c_str(), &actions, &attributes, &argv[0], environ);
+  } else {
+    error = posix_spawn(&pid, executableName.c_str(), &actions, &attributes, &argv[0], environ);
+  }
+
+  posix_spawnattr_destroy(&attributes);
+  posix_spawn_file_actions_destroy(&actions);
+
+  if (error != 0) {
+    pid = -1;
+    throw OsError(executableName, "posix_spawn", error);
+  }
+}
+
+void Subprocess::forkAndExec(const std::vector<char*>& argv) {
+#ifdef __linux__
+  SandboxSetup sandboxSetup;
+  if (sandboxed) {
+    prepareSandbox(readOnlyPaths, &sandboxSetup);
+  }
+#endif
+
+  pid = fork();
+
+  if (pid < 0) {
+    throw OsError("", "fork", errno);
+  } else if (pid == 0) {
+    // In child.
 
     if (stdinPipe != NULL) {
       stdinPipe->attachReadEndForExec(STDIN_FILENO);
@@ -132,41 +396,30 @@ Promise<ProcessExitCode> Subprocess::start(EventManager* eventManager) {
     //   children, bleh.
     setpgid(0, 0);
 
+    if (cpuTimeLimit > 0) {
+      // SIGKILL follows a second later, in case SIGXCPU is caught.
+      struct rlimit limit;
+      limit.rlim_cur = cpuTimeLimit;
+      limit.rlim_max = cpuTimeLimit + 1;
+      if (setrlimit(RLIMIT_CPU, &limit) < 0) {
+        writeError("setrlimit(RLIMIT_CPU)", errno);
+      }
+    }
+
+#ifdef __linux__
+    if (sandboxed) {
+      enterSandbox(sandboxSetup);
+    }
+#endif
+
     if (doPathLookup) {
       execvp(executableName.c_str(), &argv[0]);
     } else {
       execv(executableName.c_str(), &argv[0]);
     }
 
-    perror("exec");
-    exit(1);
-  } else {
-    if (stdoutPipe != NULL) {
-      stdoutPipe.clear();
-    }
-    if (stdinPipe != NULL) {
-      stdinPipe.clear();
-    }
-    if (stderrPipe != NULL) {
-      stderrPipe.clear();
-    }
-    if (stdoutAndStderrPipe != NULL) {
-      stdoutAndStderrPipe.clear();
-    }
-
-    // Set the child's process group ID. The child also does this to itself (see above), but we
-    // need to do it in the parent as well to prevent a race condition in which we end up killing
-    // the child before it manages to call setpgid(). If that happens, then the child will keep
-    // going and the parent process will end up blockend on waitpid(). But the child process will
-    // almost certainly make an RPC to the parent process and wait for a reply, leading to
-    // deadlock.
-    setpgid(pid, 0);
-
-    return eventManager->when(eventManager->onProcessExit(pid))(
-      [this](ProcessExitCode exitCode) -> ProcessExitCode {
-        pid = -1;
-        return exitCode;
-      });
+    writeError("exec", errno);
+    _exit(1);
   }
 }
 
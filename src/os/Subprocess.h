@@ -40,8 +40,23 @@ public:
   OwnedPtr<ByteStream> captureStderr();
   OwnedPtr<ByteStream> captureStdoutAndStderr();
 
+  // Run the process in its own mount and PID namespaces (plus a user namespace, if not root),
+  // with a private tmpfs on /tmp and the given directories made read-only.  Anything the process
+  // leaves running is killed when it exits.  Linux only; elsewhere, or if the kernel doesn't
+  // allow unprivileged namespaces, the process runs unsandboxed.
+  void sandbox(const std::vector<std::string>& readOnlyPaths);
+
+  // Kill the process (with SIGXCPU) once it has used the given number of seconds of CPU time.
+  // Each process it starts gets the same allowance.  Zero means no limit.
+  void setCpuTimeLimit(double seconds);
+
   Promise<ProcessExitCode> start(EventManager* eventManager);
 
+  // Like start(), but doesn't wait for the process to exit.  It is still killed and reaped when
+  // the Subprocess is destroyed.  For long-lived processes which shouldn't keep the event loop
+  // running.
+  void startDetached();
+
 private:
   class CallbackWrapper;
 
@@ -56,7 +71,15 @@ private:
   OwnedPtr<Pipe> stderrPipe;
   OwnedPtr<Pipe> stdoutAndStderrPipe;
 
+  bool sandboxed;
+  std::vector<std::string> readOnlyPaths;
+
+  uint64_t cpuTimeLimit;  // whole seconds, or zero
+
   pid_t pid;
+
+  void spawn(const std::vector<char*>& argv);
+  void forkAndExec(const std::vector<char*>& argv);
 };
 
 }  // namespace ekam
@@ -0,0 +1,47 @@
+// Ekam Build System
+// Author: Kenton Varda (kenton@sandstorm.io)
+// Copyright (c) 2010-2015 Kenton Varda, Google Inc., and contributors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "TextFile.h"
+
+#include <stdexcept>
+
+#include "base/Debug.h"
+
+namespace ekam {
+
+std::string splitToken(std::string* line) {
+  std::string::size_type pos = line->find_first_of(' ');
+  std::string result;
+  if (pos == std::string::npos) {
+    result.swap(*line);
+  } else {
+    result.assign(*line, 0, pos);
+    line->erase(0, pos + 1);
+  }
+  return result;
+}
+
+bool writeBestEffort(File* file, const std::string& content, const char* description) {
+  try {
+    file->writeAll(content);
+    return true;
+  } catch (const std::exception& e) {
+    DEBUG_ERROR << "Writing " << description << " failed: " << e.what();
+    return false;
+  }
+}
+
+}  // namespace ekam
@@ -0,0 +1,67 @@
+// Ekam Build System
+// Author: Kenton Varda (kenton@sandstorm.io)
+// Copyright (c) 2010-2015 Kenton Varda, Google Inc., and contributors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef KENTONSCODE_OS_TEXTFILE_H_
+#define KENTONSCODE_OS_TEXTFILE_H_
+
+#include <string>
+
+#include "File.h"
+
+namespace ekam {
+
+// Helpers for the line-oriented text that Ekam parses:  plugin commands, and the files under
+// tmp/ in which it remembers things between runs.  Losing one of those files only costs a slower
+// build, so they are read and written on a best-effort basis.
+
+// Removes the first space-separated token from *line and returns it.  If there is no space, the
+// whole line is the token.
+std::string splitToken(std::string* line);
+
+// Calls func(line) for each newline-terminated line of content, without the newline.  func may
+// modify the line it is given.  A final line with no newline -- left by a write that was cut
+// short -- is ignored.
+template <typename Func>
+void forEachLine(const std::string& content, Func&& func) {
+  std::string line;
+  std::string::size_type pos = 0;
+  while (pos < content.size()) {
+    std::string::size_type eol = content.find_first_of('\n', pos);
+    if (eol == std::string::npos) {
+      break;
+    }
+
+    line.assign(content, pos, eol - pos);
+    pos = eol + 1;
+    func(line);
+  }
+}
+
+// Like forEachLine(), on the file's content.  Does nothing if the file doesn't exist.
+template <typename Func>
+void forEachLineOf(File* file, Func&& func) {
+  if (file->exists()) {
+    forEachLine(file->readAll(), func);
+  }
+}
+
+// Replaces the file's content.  On failure, logs an error mentioning what the file holds (e.g.
+// "action history") and returns false.
+bool writeBestEffort(File* file, const std::string& content, const char* description);
+
+}  // namespace ekam
+
+#endif  // KENTONSCODE_OS_TEXTFILE_H_
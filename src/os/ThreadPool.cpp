@@ -0,0 +1,266 @@
+// Ekam Build System
+// Author: Kenton Varda (kenton@sandstorm.io)
+// Copyright (c) 2010-2015 Kenton Varda, Google Inc., and contributors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "ThreadPool.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "base/Debug.h"
+
+namespace ekam {
+
+namespace {
+
+// The pool and deque index of the current thread, if it is a pool thread.
+thread_local ThreadPool* currentPool = nullptr;
+thread_local int currentIndex = -1;
+
+}  // namespace
+
+ThreadPool::Job::~Job() {}
+
+void ThreadPool::Task::run() {
+  compute();
+  pool->finished(this);
+}
+
+void ThreadPool::Task::discard() {
+  // Owned by `tasks`.
+}
+
+// Shared by the deque it is queued on and the LaterHandle returned by runLater(), either of
+// which may let go first, on any thread.
+class ThreadPool::LaterJob : public Job {
+public:
+  LaterJob(OwnedPtr<Runnable> runnable)
+      : runnable(runnable.release()), state(QUEUED), refs(2) {}
+
+  void run() {
+    int expected = QUEUED;
+    if (state.compare_exchange_strong(expected, STARTED)) {
+      runnable->run();
+    }
+    unref();
+  }
+
+  void discard() {
+    unref();
+  }
+
+  void cancel() {
+    int expected = QUEUED;
+    state.compare_exchange_strong(expected, CANCELED);
+    unref();
+  }
+
+private:
+  enum { QUEUED, STARTED, CANCELED };
+
+  OwnedPtr<Runnable> runnable;
+  std::atomic<int> state;
+  std::atomic<int> refs;
+
+  void unref() {
+    if (--refs == 0) {
+      delete this;
+    }
+  }
+};
+
+class ThreadPool::LaterHandle : public PendingRunnable {
+public:
+  LaterHandle(LaterJob* job): job(job) {}
+  ~LaterHandle() {
+    job->cancel();
+  }
+
+private:
+  LaterJob* job;
+};
+
+ThreadPool::ThreadPool(EventManager* eventManager, int threadCount)
+    : eventManager(eventManager), nextWorker(0), queuedJobs(0), shuttingDown(false) {
+  wakeFd = newOwned<OsHandle>("eventfd", WRAP_SYSCALL(eventfd, 0, EFD_NONBLOCK | EFD_CLOEXEC));
+  wakeWatcher = eventManager->watchFd(wakeFd->get());
+
+  if (threadCount < 1) threadCount = 1;
+  for (int i = 0; i < threadCount; i++) {
+    workers.add(newOwned<Worker>());
+  }
+  for (int i = 0; i < threadCount; i++) {
+    threads.push_back(std::thread([this, i]() { worker(i); }));
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::unique_lock<std::mutex> lock(idleMutex);
+    shuttingDown = true;
+    workAvailable.notify_all();
+  }
+  for (size_t i = 0; i < threads.size(); i++) {
+    threads[i].join();
+  }
+
+  // Whatever is still queued never runs.  Tasks are owned by `tasks` and deleted with it.
+  for (int i = 0; i < workers.size(); i++) {
+    std::deque<Job*>& jobs = workers.get(i)->jobs;
+    for (size_t j = 0; j < jobs.size(); j++) {
+      jobs[j]->discard();
+    }
+  }
+}
+
+void ThreadPool::submit(OwnedPtr<Task> task) {
+  if (tasks.empty()) {
+    // Only wait on the eventfd while there's work outstanding, so that the event loop can exit
+    // when the build is done.
+    waitForResults();
+  }
+
+  Task* ptr = task.get();
+  ptr->pool = this;
+  tasks.add(ptr, task.release());
+  push(ptr);
+}
+
+OwnedPtr<PendingRunnable> ThreadPool::runLater(OwnedPtr<Runnable> runnable) {
+  LaterJob* job = new LaterJob(runnable.release());
+  push(job);
+  return newOwned<LaterHandle>(job);
+}
+
+void ThreadPool::push(Job* job) {
+  bool fromPool = currentPool == this;
+  int index = fromPool ? currentIndex : nextWorker++ % workers.size();
+
+  // Counted first, so that the count never goes negative.
+  ++queuedJobs;
+  {
+    // The owner takes from the back, so its own work goes there, to be done next.  Work from
+    // outside goes on the front, so that it is still done in the order it was submitted.
+    Worker* worker = workers.get(index);
+    std::unique_lock<std::mutex> lock(worker->mutex);
+    if (fromPool) {
+      worker->jobs.push_back(job);
+    } else {
+      worker->jobs.push_front(job);
+    }
+  }
+
+  // Taking the lock means that a thread about to wait has either seen queuedJobs or is waiting.
+  std::unique_lock<std::mutex> lock(idleMutex);
+  workAvailable.notify_one();
+}
+
+// ---------------------------------------------------------------------------------------
+// Worker threads.
+
+ThreadPool::Job* ThreadPool::take(int index) {
+  {
+    // Our own newest work first, since its data is most likely still in cache.
+    Worker* worker = workers.get(index);
+    std::unique_lock<std::mutex> lock(worker->mutex);
+    if (!worker->jobs.empty()) {
+      Job* job = worker->jobs.back();
+      worker->jobs.pop_back();
+      --queuedJobs;
+      return job;
+    }
+  }
+
+  // Steal from the other end of someone else's deque, away from what its owner is working on.
+  for (int i = 1; i < workers.size(); i++) {
+    Worker* victim = workers.get((index + i) % workers.size());
+    std::unique_lock<std::mutex> lock(victim->mutex);
+    if (!victim->jobs.empty()) {
+      Job* job = victim->jobs.front();
+      victim->jobs.pop_front();
+      --queuedJobs;
+      return job;
+    }
+  }
+
+  return nullptr;
+}
+
+void ThreadPool::worker(int index) {
+  currentPool = this;
+  currentIndex = index;
+
+  while (!shuttingDown) {
+    Job* job = take(index);
+    if (job != nullptr) {
+      job->run();
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock(idleMutex);
+    while (queuedJobs == 0 && !shuttingDown) {
+      workAvailable.wait(lock);
+    }
+  }
+}
+
+void ThreadPool::finished(Task* task) {
+  std::unique_lock<std::mutex> lock(finishedMutex);
+  bool wasEmpty = finishedTasks.empty();
+  finishedTasks.push_back(task);
+  if (wasEmpty) {
+    uint64_t one = 1;
+    if (write(wakeFd->get(), &one, sizeof(one)) < 0) {
+      DEBUG_ERROR << "write(eventfd): " << strerror(errno);
+    }
+  }
+}
+
+// ---------------------------------------------------------------------------------------
+// Event loop thread.
+
+void ThreadPool::waitForResults() {
+  wakeOp = eventManager->when(wakeWatcher->onReadable())(
+    [this](Void) {
+      uint64_t count;
+      if (read(wakeFd->get(), &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        DEBUG_ERROR << "read(eventfd): " << strerror(errno);
+      }
+      wakeOp.release();
+      deliverResults();
+      if (!tasks.empty()) {
+        waitForResults();
+      }
+    });
+}
+
+void ThreadPool::deliverResults() {
+  std::vector<Task*> batch;
+  {
+    std::unique_lock<std::mutex> lock(finishedMutex);
+    batch.swap(finishedTasks);
+  }
+
+  for (size_t i = 0; i < batch.size(); i++) {
+    OwnedPtr<Task> task;
+    if (tasks.release(batch[i], &task)) {
+      task->deliver();
+    }
+  }
+}
+
+}  // namespace ekam
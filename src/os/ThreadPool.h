@@ -0,0 +1,243 @@
+// Ekam Build System
+// Author: Kenton Varda (kenton@sandstorm.io)
+// Copyright (c) 2010-2015 Kenton Varda, Google Inc., and contributors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef KENTONSCODE_OS_THREADPOOL_H_
+#define KENTONSCODE_OS_THREADPOOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "base/OwnedPtr.h"
+#include "base/Promise.h"
+#include "EventManager.h"
+#include "OsHandle.h"
+
+namespace ekam {
+
+// Runs functions on a pool of threads.  Each thread has its own deque of work:  it takes from the
+// back of its own, and when that is empty, steals from the front of the others'.  Work submitted
+// from one of the pool's threads goes on the back of that thread's deque, so a task that fans
+// out keeps its pieces local unless other threads are idle.  Work submitted from elsewhere is
+// dealt out to the threads in turn, onto the front, so each thread does it in submission order.
+//
+// There are two ways in.  run() delivers a function's result as a promise on the event loop
+// thread, which is what the build uses for hashing and installing.  Everything but the function
+// itself happens on the event loop thread, including destroying the function, so that it may own
+// objects (such as Files) which must only be touched by one thread at a time.
+//
+// The pool is also an Executor:  runLater() queues a Runnable from any thread, and promise
+// continuations can be posted with when().  Promise states are not thread-safe, though, and a
+// continuation can start on another thread as soon as it is posted, while the poster still holds
+// the promise when() returned.  So for now, when() is only safe from the thread of a one-thread
+// pool; elsewhere, use runLater() directly.  To get a result back to the event loop, use run().
+class ThreadPool : public Executor {
+public:
+  ThreadPool(EventManager* eventManager, int threadCount);
+  ~ThreadPool();
+
+  // Calls func() on one of the pool's threads and fulfills the promise with its result, or
+  // exception.  Call on the event loop thread.  The result type must be default-constructible.
+  // Destroying the promise discards the result, though func() still runs.  The pool must
+  // outlive the promise.
+  template <typename Func>
+  Promise<typename std::result_of<Func()>::type> run(Func&& func);
+
+  // implements Executor -----------------------------------------------------------------
+  // May be called from any thread.  Destroying the returned PendingRunnable keeps the runnable
+  // from starting, but doesn't wait for it if it already has.  Runnables still queued when the
+  // pool is destroyed never run.
+  OwnedPtr<PendingRunnable> runLater(OwnedPtr<Runnable> runnable);
+
+private:
+  // Something queued on a deque.
+  class Job {
+  public:
+    virtual ~Job();
+
+    // Called on a pool thread.
+    virtual void run() = 0;
+    // Called instead of run() if the pool is destroyed first.
+    virtual void discard() = 0;
+  };
+
+  class Task : public Job {
+  public:
+    ThreadPool* pool;
+
+    // Called on a pool thread.
+    virtual void compute() = 0;
+    // Called on the event loop thread, after compute().
+    virtual void deliver() = 0;
+
+    void run();
+    void discard();
+  };
+
+  template <typename T, typename Func> class TaskImpl;
+  template <typename T> class Fulfiller;
+  class LaterJob;
+  class LaterHandle;
+
+  struct Worker {
+    std::mutex mutex;
+    std::deque<Job*> jobs;  // protected by mutex
+  };
+
+  EventManager* eventManager;
+
+  OwnedPtr<OsHandle> wakeFd;
+  OwnedPtr<EventManager::IoWatcher> wakeWatcher;
+  Promise<void> wakeOp;
+  std::vector<std::thread> threads;
+  OwnedPtrVector<Worker> workers;
+  std::atomic<unsigned int> nextWorker;  // where work from outside the pool goes next
+  std::atomic<int> queuedJobs;           // in all deques together
+  std::atomic<bool> shuttingDown;
+
+  // Tasks which have been submitted and not yet delivered.  Only touched on the event loop
+  // thread.
+  OwnedPtrMap<Task*, Task> tasks;
+
+  // Idle threads wait on workAvailable.
+  std::mutex idleMutex;
+  std::condition_variable workAvailable;
+
+  // Protected by finishedMutex.
+  std::mutex finishedMutex;
+  std::vector<Task*> finishedTasks;
+
+  void submit(OwnedPtr<Task> task);
+  void push(Job* job);
+  Job* take(int index);
+  void worker(int index);
+  void finished(Task* task);
+  void waitForResults();
+  void deliverResults();
+};
+
+template <typename T>
+class ThreadPool::Fulfiller : public PromiseFulfiller<T> {
+public:
+  typedef typename PromiseFulfiller<T>::Callback Callback;
+
+  Fulfiller(Callback* callback, Fulfiller** ptr): callback(callback), ptr(ptr) {
+    *ptr = this;
+  }
+  ~Fulfiller() {
+    if (ptr != nullptr) {
+      *ptr = nullptr;
+    }
+  }
+
+  Callback* release() {
+    *ptr = nullptr;
+    ptr = nullptr;
+    return callback;
+  }
+
+private:
+  Callback* callback;
+  Fulfiller** ptr;
+};
+
+template <typename T, typename Func>
+class ThreadPool::TaskImpl : public Task {
+public:
+  TaskImpl(Func&& func): func(std::move(func)) {}
+
+  Fulfiller<T>* fulfiller = nullptr;
+
+  void compute() {
+    try {
+      result = func();
+    } catch (...) {
+      exception = std::current_exception();
+    }
+  }
+
+  void deliver() {
+    if (fulfiller == nullptr) return;
+    typename Fulfiller<T>::Callback* callback = fulfiller->release();
+    if (exception) {
+      try {
+        std::rethrow_exception(exception);
+      } catch (...) {
+        callback->propagateCurrentException();
+      }
+    } else {
+      callback->fulfill(std::move(result));
+    }
+  }
+
+private:
+  Func func;
+  T result;
+  std::exception_ptr exception;
+};
+
+template <typename Func>
+class ThreadPool::TaskImpl<void, Func> : public Task {
+public:
+  TaskImpl(Func&& func): func(std::move(func)) {}
+
+  Fulfiller<void>* fulfiller = nullptr;
+
+  void compute() {
+    try {
+      func();
+    } catch (...) {
+      exception = std::current_exception();
+    }
+  }
+
+  void deliver() {
+    if (fulfiller == nullptr) return;
+    typename Fulfiller<void>::Callback* callback = fulfiller->release();
+    if (exception) {
+      try {
+        std::rethrow_exception(exception);
+      } catch (...) {
+        callback->propagateCurrentException();
+      }
+    } else {
+      callback->fulfill();
+    }
+  }
+
+private:
+  Func func;
+  std::exception_ptr exception;
+};
+
+template <typename Func>
+Promise<typename std::result_of<Func()>::type> ThreadPool::run(Func&& func) {
+  typedef typename std::result_of<Func()>::type T;
+  OwnedPtr<TaskImpl<T, Func>> task = newOwned<TaskImpl<T, Func>>(std::move(func));
+  Promise<T> result = newPromise<Fulfiller<T>>(&task->fulfiller);
+  submit(task.release());
+  return result;
+}
+
+}  // namespace ekam
+
+#endif  // KENTONSCODE_OS_THREADPOOL_H_
@@ -0,0 +1,251 @@
+// Ekam Build System
+// Author: Kenton Varda (kenton@sandstorm.io)
+// Copyright (c) 2010-2015 Kenton Varda, Google Inc., and contributors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "ThreadPool.h"
+#include "EpollEventManager.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <atomic>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace ekam {
+namespace {
+
+#define ASSERT(EXPRESSION)                                                    \
+  if (!(EXPRESSION)) {                                                        \
+    fprintf(stderr, "%s:%d: FAILED: %s\n", __FILE__, __LINE__, #EXPRESSION);  \
+    exit(1);                                                                  \
+  }
+
+void testResults() {
+  EpollEventManager eventManager;
+  ThreadPool pool(&eventManager, 4);
+
+  std::thread::id loopThread = std::this_thread::get_id();
+  std::vector<int> results(100, -1);
+  std::vector<Promise<void>> promises;
+  for (int i = 0; i < 100; i++) {
+    promises.push_back(eventManager.when(pool.run([i]() { return i * i; }))(
+      [&results, i, loopThread](int result) {
+        // Delivered on the event loop thread.
+        ASSERT(std::this_thread::get_id() == loopThread);
+        results[i] = result;
+      }));
+  }
+
+  // The pool only keeps the loop running while results are outstanding.
+  eventManager.loop();
+  for (int i = 0; i < 100; i++) {
+    ASSERT(results[i] == i * i);
+  }
+}
+
+void testException() {
+  EpollEventManager eventManager;
+  ThreadPool pool(&eventManager, 2);
+
+  std::string message;
+  Promise<void> promise = eventManager.when(pool.run([]() -> int {
+    throw std::runtime_error("boom");
+  }))(
+    [](int result) {
+      ASSERT(false);
+    }, [&message](MaybeException<int> error) {
+      try {
+        error.get();
+      } catch (const std::exception& e) {
+        message = e.what();
+      }
+    });
+
+  eventManager.loop();
+  ASSERT(message == "boom");
+}
+
+void testCancel() {
+  EpollEventManager eventManager;
+  ThreadPool pool(&eventManager, 2);
+
+  // Destroying the promise discards the result, but the function still runs.
+  std::atomic<bool> ran(false);
+  {
+    Promise<void> promise = pool.run([&ran]() { ran = true; });
+  }
+
+  eventManager.loop();
+  ASSERT(ran);
+}
+
+void testShutdownWithQueuedWork() {
+  EpollEventManager eventManager;
+  std::atomic<bool> started(false);
+  std::atomic<bool> release(false);
+  std::atomic<int> queuedRan(0);
+
+  // Let the blocking task finish only once the destructor is (very likely) waiting for it.
+  std::thread releaser([&release]() {
+    usleep(100000);
+    release = true;
+  });
+
+  {
+    ThreadPool pool(&eventManager, 1);
+    std::vector<Promise<void>> promises;
+    promises.push_back(pool.run([&started, &release]() {
+      started = true;
+      while (!release) {
+        usleep(1000);
+      }
+    }));
+    for (int i = 0; i < 10; i++) {
+      promises.push_back(pool.run([&queuedRan]() { ++queuedRan; }));
+    }
+
+    while (!started) {
+      usleep(1000);
+    }
+    promises.clear();
+    // The destructor waits for the running task, and drops the rest unrun.
+  }
+
+  releaser.join();
+  ASSERT(queuedRan == 0);
+}
+
+// Waits for counter to reach expected, failing if it takes too long.
+void waitFor(const std::atomic<int>& counter, int expected) {
+  for (int i = 0; i < 10000 && counter != expected; i++) {
+    usleep(1000);
+  }
+  ASSERT(counter == expected);
+}
+
+void testRunLater() {
+  EpollEventManager eventManager;
+  ThreadPool pool(&eventManager, 4);
+
+  std::thread::id loopThread = std::this_thread::get_id();
+  std::atomic<int> ran(0);
+  std::atomic<int> onLoopThread(0);
+  std::vector<OwnedPtr<PendingRunnable>> pending;
+  for (int i = 0; i < 100; i++) {
+    pending.push_back(pool.runLater(newLambdaRunnable([&ran, &onLoopThread, loopThread]() {
+      if (std::this_thread::get_id() == loopThread) ++onLoopThread;
+      ++ran;
+    })));
+  }
+
+  waitFor(ran, 100);
+  ASSERT(onLoopThread == 0);
+}
+
+void testStealing() {
+  EpollEventManager eventManager;
+  ThreadPool pool(&eventManager, 4);
+
+  // One job fans out into many slow ones, which all go on its own thread's deque.  The other
+  // threads only get any by stealing.
+  std::mutex mutex;
+  std::set<std::thread::id> threadsUsed;
+  std::atomic<int> ran(0);
+  std::vector<OwnedPtr<PendingRunnable>> children;
+  std::atomic<int> submitted(0);
+
+  OwnedPtr<PendingRunnable> parent = pool.runLater(newLambdaRunnable([&]() {
+    for (int i = 0; i < 40; i++) {
+      children.push_back(pool.runLater(newLambdaRunnable([&]() {
+        usleep(5000);
+        std::unique_lock<std::mutex> lock(mutex);
+        threadsUsed.insert(std::this_thread::get_id());
+        ++ran;
+      })));
+    }
+    submitted = 1;
+  }));
+
+  waitFor(submitted, 1);
+  waitFor(ran, 40);
+  std::unique_lock<std::mutex> lock(mutex);
+  ASSERT(threadsUsed.size() > 1);
+}
+
+void testRunLaterCancel() {
+  EpollEventManager eventManager;
+  ThreadPool pool(&eventManager, 1);
+
+  // Keep the only thread busy while the second job is canceled.
+  std::atomic<bool> release(false);
+  std::atomic<int> ran(0);
+  OwnedPtr<PendingRunnable> blocker = pool.runLater(newLambdaRunnable([&]() {
+    while (!release) {
+      usleep(1000);
+    }
+    ++ran;
+  }));
+  OwnedPtr<PendingRunnable> canceled = pool.runLater(newLambdaRunnable([&]() { ran += 100; }));
+  canceled.clear();
+  OwnedPtr<PendingRunnable> after = pool.runLater(newLambdaRunnable([&]() { ++ran; }));
+
+  release = true;
+  waitFor(ran, 2);
+  usleep(10000);
+  ASSERT(ran == 2);
+}
+
+void testWhen() {
+  EpollEventManager eventManager;
+  std::thread::id loopThread = std::this_thread::get_id();
+  std::atomic<int> result(0);
+  std::atomic<bool> onPool(false);
+
+  // Destroyed after the pool, which waits for the continuation.
+  Promise<void> promise;
+  {
+    // With one thread, the continuation can't start until the job posting it has finished with
+    // the promise.
+    ThreadPool pool(&eventManager, 1);
+    OwnedPtr<PendingRunnable> job = pool.runLater(newLambdaRunnable([&]() {
+      promise = pool.when(newFulfilledPromise(21))(
+        [&result, &onPool, loopThread](int value) {
+          onPool = std::this_thread::get_id() != loopThread;
+          result = value * 2;
+        });
+    }));
+    waitFor(result, 42);
+  }
+  ASSERT(onPool);
+}
+
+}  // namespace
+}  // namespace ekam
+
+int main(int argc, char* argv[]) {
+  ekam::testResults();
+  ekam::testException();
+  ekam::testCancel();
+  ekam::testShutdownWithQueuedWork();
+  ekam::testRunLater();
+  ekam::testStealing();
+  ekam::testRunLaterCancel();
+  ekam::testWhen();
+  return 0;
+}